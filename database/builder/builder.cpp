@@ -39,6 +39,9 @@
 
 unsigned version = 1;
 
+/* Maximum number of children of a packed R-tree node (version 2 and up) */
+const unsigned int rtreeFanout = 16;
+
 const double Inf = std::numeric_limits<float>::infinity();
 
 std::unordered_map<std::string, std::string> alpha2ToName;
@@ -487,6 +490,178 @@ std::vector<PolygonData*> polygons_;
 std::vector<MetaData> metadata_;
 std::vector<std::string> fieldNames_;
 
+void encodeFixed32(std::vector<uint8_t>& output, uint32_t value)
+{
+    output.push_back(value & 0xFF);
+    output.push_back((value >> 8) & 0xFF);
+    output.push_back((value >> 16) & 0xFF);
+    output.push_back((value >> 24) & 0xFF);
+}
+
+/* Version 3 metadata: a record count, one offset per field for every record and the zero terminated strings */
+void encodeMetadataV3(std::vector<uint8_t>& output)
+{
+    std::unordered_map<std::string, uint32_t> stringOffsets;
+    std::vector<uint8_t> strings;
+    uint32_t tableSize = 4 + 4 * metadata_.size() * fieldNames_.size();
+
+    encodeFixed32(output, metadata_.size());
+    for(MetaData& metadata: metadata_) {
+        if(metadata.data_.size() != fieldNames_.size()) {
+            std::cout << "Metadata record has the wrong number of fields\n";
+            exit(1);
+        }
+
+        metadata.fileIndex_ = output.size();
+        for(std::string& str: metadata.data_) {
+            if(str.find('\0') != std::string::npos) {
+                std::cout << "Metadata string contains a zero byte\n";
+                exit(1);
+            }
+
+            if(!stringOffsets.count(str)) {
+                stringOffsets[str] = tableSize + strings.size();
+                strings.insert(std::end(strings), std::begin(str), std::end(str));
+                strings.push_back(0);
+            }
+            encodeFixed32(output, stringOffsets[str]);
+        }
+    }
+
+    output.insert(std::end(output), std::begin(strings), std::end(strings));
+}
+
+struct BoundingBox {
+    int64_t minLat, minLon, maxLat, maxLon;
+
+    void encodeBinary(std::vector<uint8_t>& output) const
+    {
+        encodeFixed32(output, minLat);
+        encodeFixed32(output, minLon);
+        encodeFixed32(output, maxLat);
+        encodeFixed32(output, maxLon);
+    }
+};
+
+struct RTreeNode {
+    BoundingBox box;
+    uint32_t first;
+    uint32_t count;
+};
+
+/* Sort-Tile-Recursive packing: order the boxes such that every rtreeFanout consecutive boxes are close together */
+std::vector<size_t> packSortTileRecursive(const std::vector<BoundingBox>& boxes)
+{
+    std::vector<size_t> order(boxes.size());
+    for(size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+
+    size_t numNodes = (boxes.size() + rtreeFanout - 1) / rtreeFanout;
+    size_t numSlices = ceil(sqrt(numNodes));
+    size_t sliceSize = std::max<size_t>(numSlices, 1) * rtreeFanout;
+
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return boxes[a].minLon + boxes[a].maxLon < boxes[b].minLon + boxes[b].maxLon;
+    });
+
+    for(size_t start = 0; start < order.size(); start += sliceSize) {
+        auto end = order.begin() + std::min(start + sliceSize, order.size());
+        std::sort(order.begin() + start, end, [&](size_t a, size_t b) {
+            return boxes[a].minLat + boxes[a].maxLat < boxes[b].minLat + boxes[b].maxLat;
+        });
+    }
+
+    return order;
+}
+
+std::vector<RTreeNode> groupRTreeNodes(const std::vector<BoundingBox>& boxes, uint32_t flags)
+{
+    std::vector<RTreeNode> nodes;
+    for(size_t i = 0; i < boxes.size() || nodes.empty(); i += rtreeFanout) {
+        RTreeNode node;
+        node.box = {INT64_MAX, INT64_MAX, INT64_MIN, INT64_MIN};
+        node.first = i | flags;
+        node.count = std::min<size_t>(rtreeFanout, boxes.size() - std::min(i, boxes.size()));
+        for(size_t j = i; j < i + node.count; j++) {
+            node.box.minLat = std::min(node.box.minLat, boxes[j].minLat);
+            node.box.minLon = std::min(node.box.minLon, boxes[j].minLon);
+            node.box.maxLat = std::max(node.box.maxLat, boxes[j].maxLat);
+            node.box.maxLon = std::max(node.box.maxLon, boxes[j].maxLon);
+        }
+        nodes.push_back(node);
+    }
+    return nodes;
+}
+
+void encodeRTree(std::vector<uint8_t>& output)
+{
+    const uint32_t leafFlag = 0x80000000;
+
+    /* Leaf entries */
+    std::vector<BoundingBox> boxes;
+    for(PolygonData* polygon: polygons_) {
+        boxes.push_back({polygon->boundingMin.lat_, polygon->boundingMin.lon_, polygon->boundingMax.lat_, polygon->boundingMax.lon_});
+    }
+
+    std::vector<size_t> entryOrder = packSortTileRecursive(boxes);
+    std::vector<BoundingBox> sortedBoxes;
+    for(size_t index: entryOrder) {
+        sortedBoxes.push_back(boxes[index]);
+    }
+
+    /* Build the levels bottom up, before grouping a level it is reordered so siblings are close */
+    std::vector<std::vector<RTreeNode>> levels;
+    levels.push_back(groupRTreeNodes(sortedBoxes, leafFlag));
+    while(levels.back().size() > 1) {
+        std::vector<RTreeNode>& level = levels.back();
+        std::vector<BoundingBox> levelBoxes;
+        for(RTreeNode& node: level) {
+            levelBoxes.push_back(node.box);
+        }
+
+        std::vector<size_t> order = packSortTileRecursive(levelBoxes);
+        std::vector<RTreeNode> sortedLevel;
+        std::vector<BoundingBox> sortedLevelBoxes;
+        for(size_t index: order) {
+            sortedLevel.push_back(level[index]);
+            sortedLevelBoxes.push_back(levelBoxes[index]);
+        }
+        level = sortedLevel;
+
+        levels.push_back(groupRTreeNodes(sortedLevelBoxes, 0));
+    }
+
+    /* Store the root first, children always come after their parent */
+    std::reverse(levels.begin(), levels.end());
+    size_t numNodes = 0;
+    for(size_t i = 0; i < levels.size(); i++) {
+        numNodes += levels[i].size();
+    }
+
+    encodeFixed32(output, numNodes);
+    encodeFixed32(output, polygons_.size());
+
+    size_t levelStart = 0;
+    for(size_t i = 0; i < levels.size(); i++) {
+        size_t childStart = levelStart + levels[i].size();
+        for(RTreeNode& node: levels[i]) {
+            node.box.encodeBinary(output);
+            encodeFixed32(output, (node.first & leafFlag) ? node.first : node.first + childStart);
+            encodeFixed32(output, node.count);
+        }
+        levelStart = childStart;
+    }
+
+    for(size_t index: entryOrder) {
+        PolygonData* polygon = polygons_[index];
+        boxes[index].encodeBinary(output);
+        encodeFixed32(output, index);
+        encodeFixed32(output, metadata_.at(polygon->metadataId_).fileIndex_);
+        encodeFixed32(output, polygon->fileIndex_);
+    }
+}
+
 
 unsigned int decodeVariableLength(uint8_t* buffer, int64_t* result, bool handleNeg = true)
 {
@@ -659,7 +834,7 @@ int main(int argc, char ** argv )
     unsigned int precision = strtol(argv[4], NULL, 10);
     std::string notice = argv[5];
     version = strtol(argv[6], NULL, 10);
-    if(version > 1){
+    if(version > 3){
         std::cout << "Unknown version\n";
         return 1;
     }
@@ -767,9 +942,13 @@ int main(int argc, char ** argv )
 
     /* Encode metadata */
     std::vector<uint8_t> outputMeta;
-    for(MetaData& metadata: metadata_) {
-        metadata.fileIndex_ = outputMeta.size();
-        metadata.encodeBinaryData(outputMeta);
+    if(version >= 3) {
+        encodeMetadataV3(outputMeta);
+    } else {
+        for(MetaData& metadata: metadata_) {
+            metadata.fileIndex_ = outputMeta.size();
+            metadata.encodeBinaryData(outputMeta);
+        }
     }
     std::cout << "Encoded metadata into "<<outputMeta.size()<<" bytes.\n";
 
@@ -789,6 +968,13 @@ int main(int argc, char ** argv )
     }
     std::cout << "Encoded bounding box section into "<<outputBBox.size()<<" bytes.\n";
 
+    /* Encode packed R-tree */
+    std::vector<uint8_t> outputRTree;
+    if(version >= 2) {
+        encodeRTree(outputRTree);
+        std::cout << "Encoded R-tree section into "<<outputRTree.size()<<" bytes.\n";
+    }
+
     /* Encode header */
     std::vector<uint8_t> outputHeader;
     outputHeader.push_back('P');
@@ -805,13 +991,29 @@ int main(int argc, char ** argv )
     encodeVariableLength(outputHeader, outputBBox.size(), false);
     encodeVariableLength(outputHeader, outputMeta.size(), false);
     encodeVariableLength(outputHeader, outputData.size(), false);
+    if(version >= 2) {
+        encodeVariableLength(outputHeader, outputRTree.size(), false);
+    }
     std::cout << "Encoded header into "<<outputHeader.size()<<" bytes.\n";
 
+    /* From version 3 the metadata section starts at a 4 byte aligned offset */
+    size_t bboxEnd = outputHeader.size() + outputBBox.size();
+    std::vector<uint8_t> outputMetaPadding(version >= 3 ? (4 - bboxEnd % 4) % 4 : 0, 0);
+
+    /* The R-tree starts at a 4 byte aligned offset */
+    size_t dataEnd = bboxEnd + outputMetaPadding.size() + outputMeta.size() + outputData.size();
+    std::vector<uint8_t> outputPadding((4 - dataEnd % 4) % 4, 0);
+
     FILE* outputFile = fopen(outPath.c_str(), "wb");
     fwrite(outputHeader.data(), 1, outputHeader.size(), outputFile);
     fwrite(outputBBox.data(), 1, outputBBox.size(), outputFile);
+    fwrite(outputMetaPadding.data(), 1, outputMetaPadding.size(), outputFile);
     fwrite(outputMeta.data(), 1, outputMeta.size(), outputFile);
     fwrite(outputData.data(), 1, outputData.size(), outputFile);
+    if(version >= 2) {
+        fwrite(outputPadding.data(), 1, outputPadding.size(), outputFile);
+        fwrite(outputRTree.data(), 1, outputRTree.size(), outputFile);
+    }
     fclose(outputFile);
 
 }
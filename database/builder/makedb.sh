@@ -7,6 +7,8 @@ g++ builder.cpp --std=c++11 -o builder -lshp
 rm -rf out naturalearth timezone db.zip
 mkdir -p out
 mkdir -p out_v1
+mkdir -p out_v2
+mkdir -p out_v3
 mkdir -p naturalearth
 mkdir -p timezone
 
@@ -24,6 +26,10 @@ echo C "naturalearth/ne_10m_admin_0_countries_lakes ./out/country16.bin 16 \"Mad
 echo C "naturalearth/ne_10m_admin_0_countries_lakes ./out/country21.bin 21 \"Made with Natural Earth, placed in the Public Domain.\" 0";
 echo C "naturalearth/ne_10m_admin_0_countries_lakes ./out_v1/country16.bin 16 \"Made with Natural Earth, placed in the Public Domain.\" 1";
 echo C "naturalearth/ne_10m_admin_0_countries_lakes ./out_v1/country21.bin 21 \"Made with Natural Earth, placed in the Public Domain.\" 1";
+echo C "naturalearth/ne_10m_admin_0_countries_lakes ./out_v2/country16.bin 16 \"Made with Natural Earth, placed in the Public Domain.\" 2";
+echo C "naturalearth/ne_10m_admin_0_countries_lakes ./out_v2/country21.bin 21 \"Made with Natural Earth, placed in the Public Domain.\" 2";
+echo C "naturalearth/ne_10m_admin_0_countries_lakes ./out_v3/country16.bin 16 \"Made with Natural Earth, placed in the Public Domain.\" 3";
+echo C "naturalearth/ne_10m_admin_0_countries_lakes ./out_v3/country21.bin 21 \"Made with Natural Earth, placed in the Public Domain.\" 3";
 ) | xargs -n6 -P4 ./builder
 
 cd timezone
@@ -34,11 +40,15 @@ cd ..
 echo "T timezone/combined-shapefile-with-oceans ./out/timezone16.bin 16 \"Contains data from Natural Earth, placed in the Public Domain. Contains information from https://github.com/evansiroky/timezone-boundary-builder, which is made available here under the Open Database License \(ODbL\).\" 0";
 echo "T timezone/combined-shapefile-with-oceans ./out/timezone21.bin 21 \"Contains data from Natural Earth, placed in the Public Domain. Contains information from https://github.com/evansiroky/timezone-boundary-builder, which is made available here under the Open Database License \(ODbL\).\" 0";
 echo "T timezone/combined-shapefile-with-oceans ./out_v1/timezone16.bin 16 \"Contains data from Natural Earth, placed in the Public Domain. Contains information from https://github.com/evansiroky/timezone-boundary-builder, which is made available here under the Open Database License \(ODbL\).\" 1";
+echo "T timezone/combined-shapefile-with-oceans ./out_v2/timezone16.bin 16 \"Contains data from Natural Earth, placed in the Public Domain. Contains information from https://github.com/evansiroky/timezone-boundary-builder, which is made available here under the Open Database License \(ODbL\).\" 2";
 echo "T timezone/combined-shapefile-with-oceans ./out_v1/timezone21.bin 21 \"Contains data from Natural Earth, placed in the Public Domain. Contains information from https://github.com/evansiroky/timezone-boundary-builder, which is made available here under the Open Database License \(ODbL\).\" 1";
+echo "T timezone/combined-shapefile-with-oceans ./out_v2/timezone21.bin 21 \"Contains data from Natural Earth, placed in the Public Domain. Contains information from https://github.com/evansiroky/timezone-boundary-builder, which is made available here under the Open Database License \(ODbL\).\" 2";
+echo "T timezone/combined-shapefile-with-oceans ./out_v3/timezone16.bin 16 \"Contains data from Natural Earth, placed in the Public Domain. Contains information from https://github.com/evansiroky/timezone-boundary-builder, which is made available here under the Open Database License \(ODbL\).\" 3";
+echo "T timezone/combined-shapefile-with-oceans ./out_v3/timezone21.bin 21 \"Contains data from Natural Earth, placed in the Public Domain. Contains information from https://github.com/evansiroky/timezone-boundary-builder, which is made available here under the Open Database License \(ODbL\).\" 3";
 ) | xargs -n 6 -P4 ./builder
 
 exit
 
 rm -rf timezone naturalearth
 
-zip db.zip out/* out_v1/*
+zip db.zip out/* out_v1/* out_v2/* out_v3/*
@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
 #if defined(_MSC_VER) || defined(__MINGW32__)
 #include <windows.h>
 #elif defined(__APPLE__) || defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)
@@ -39,6 +40,16 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define ZD_SIMD_X86
+#define ZD_SIMD_AVX2_DISPATCH
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define ZD_SIMD_X86
+#include <emmintrin.h>
 #endif
 
 #include "zonedetect.h"
@@ -55,7 +66,277 @@ enum ZDInternalError {
 #endif
     ZD_E_DB_MUNMAP,
     ZD_E_DB_CLOSE,
-    ZD_E_PARSE_HEADER
+    ZD_E_PARSE_HEADER,
+    ZD_E_BUILD_INDEX,
+    ZD_E_VALIDATE
+};
+
+#define ZD_GRID_DEFAULT_LAT_CELLS 180
+#define ZD_GRID_DEFAULT_LON_CELLS 360
+
+/*
+ * Cells closer than this to the bounding box of an edge are never classified. The edge tests are exact and
+ * only report a border for points inside that box, so one unit is a safety margin and not a tolerance.
+ */
+#define ZD_GRID_BORDER_MARGIN 1
+
+/* Special values of ZDGrid.cellZone, all other values are the polygon id of the only zone */
+#define ZD_CELL_MIXED UINT32_MAX
+#define ZD_CELL_EMPTY (UINT32_MAX - 1)
+
+/*
+ * Packed R-tree section (version 2 and up), starts at the first 4 byte aligned offset after the data section.
+ * All fields are little endian 32 bit integers:
+ *   numNodes, numEntries
+ *   node[numNodes]: minLat, minLon, maxLat, maxLon, first, count
+ *   entry[numEntries]: minLat, minLon, maxLat, maxLon, polygonId, metadataIndex, polygonIndex
+ * Node 0 is the root and children always come after their parent. If first has ZD_RTREE_LEAF set,
+ * the children are entries, otherwise they are nodes.
+ */
+#define ZD_RTREE_HEADER_SIZE 8
+#define ZD_RTREE_NODE_SIZE   24
+#define ZD_RTREE_ENTRY_SIZE  28
+#define ZD_RTREE_LEAF        UINT32_C(0x80000000)
+#define ZD_RTREE_MAX_STACK   256
+
+/*
+ * Largest absolute coordinate, of vertices and of lookup points, for which the products of coordinate
+ * differences in ZDWindingEdge and ZDEdgeDistanceSqr fit in 64 bits
+ */
+#define ZD_COORDINATE_MAX (INT32_C(5) << 27)
+
+#define ZD_CACHE_LINE_SIZE 64
+/* The polygon table is padded to a multiple of this, so SIMD loops never need a scalar tail */
+#define ZD_TABLE_PADDING   16
+
+/*
+ * Decoded bounding box section, index i belongs to polygon id i. Each array starts on a cache line
+ * and the padding entries have empty boxes.
+ */
+struct ZDPolygonTable {
+    uint32_t count;
+    uint32_t paddedCount;
+    uint8_t sorted;
+    uint8_t simdLevel;
+
+    int32_t *minLat, *minLon, *maxLat, *maxLon;
+    uint32_t *metadataIndex;
+    uint32_t *polygonIndex;
+
+    void *memory;
+};
+
+#define ZD_SLAB_DEFAULT_MIN_VERTICES 1024
+/* Target number of edges per latitude slab */
+#define ZD_SLAB_EDGES                8
+/* Maximum average number of slabs an edge may be stored in */
+#define ZD_SLAB_MAX_COPIES           4
+
+/* Polygon decoded at open, optionally with its edges bucketed into latitude slabs */
+struct ZDDecodedPolygon {
+    uint32_t polygonIndex;
+    uint32_t numPoints;
+    /* The last point equals the first one, edge i connects point i - 1 and point i */
+    int32_t *lat, *lon;
+
+    int32_t minLat, maxLat;
+    uint32_t numSlabs;
+    uint32_t *slabStart;
+    uint32_t *slabEdges;
+};
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+typedef CRITICAL_SECTION ZDMutex;
+typedef HANDLE ZDThread;
+#define ZD_THREADS
+#elif defined(__APPLE__) || defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)
+typedef pthread_mutex_t ZDMutex;
+typedef pthread_t ZDThread;
+#define ZD_THREADS
+#else
+typedef int ZDMutex;
+#endif
+
+#define ZD_CACHE_DEFAULT_MAX_MEMORY (8u << 20)
+#define ZD_CACHE_MIN_BUCKETS        64
+#define ZD_RESULT_CACHE_DEFAULT_ENTRIES 65536
+#define ZD_RESULT_CACHE_DEFAULT_SHARDS  16
+#define ZD_RESULT_CACHE_MAX_SHARDS      4096
+#define ZD_RESULT_CACHE_MAX_HITS        4
+/* Queries must stay this far inside the safezone of an entry to reuse it, this covers the rounding of the distances */
+#define ZD_RESULT_CACHE_MARGIN          4
+
+struct ZDCacheEntry {
+    struct ZDDecodedPolygon polygon;
+    size_t size;
+    uint32_t refCount;
+    uint8_t cached;
+
+    struct ZDCacheEntry *hashNext;
+    /* lruPrev points towards the most recently used entry */
+    struct ZDCacheEntry *lruPrev, *lruNext;
+};
+
+/* LRU cache of decoded polygons, keyed on polygonIndex */
+struct ZDPolygonCache {
+    ZDMutex mutex;
+
+    size_t maxMemory;
+    size_t memory;
+    uint32_t numEntries;
+    uint32_t numBuckets;
+    struct ZDCacheEntry **buckets;
+    struct ZDCacheEntry *lruHead, *lruTail;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+struct ZDResultEntry {
+    int32_t lat, lon;
+    uint32_t cell;
+    uint32_t numHits;
+    /* Squared safezone, and the squared distance within which other points of the cell may reuse the entry */
+    uint64_t distanceSqr;
+    uint64_t reuseSqr;
+    ZoneDetectHit hits[ZD_RESULT_CACHE_MAX_HITS];
+
+    struct ZDResultEntry *hashNext;
+    /* lruPrev points towards the most recently used entry */
+    struct ZDResultEntry *lruPrev, *lruNext;
+};
+
+/* Independently locked part of the result cache, the grid cell of a point selects its shard */
+struct ZDResultShard {
+    ZDMutex mutex;
+
+    uint32_t numEntries;
+    uint32_t maxEntries;
+    uint32_t numBuckets;
+    struct ZDResultEntry *entries;
+    struct ZDResultEntry **buckets;
+    struct ZDResultEntry *lruHead, *lruTail;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+    /* Keep the locks of different shards on different cache lines */
+    uint8_t padding[ZD_CACHE_LINE_SIZE];
+};
+
+struct ZDResultCache {
+    uint32_t numShards;
+    struct ZDResultShard *shards;
+    size_t memory;
+};
+
+enum ZDSimdLevel {
+    ZD_SIMD_NONE,
+    ZD_SIMD_SSE2,
+    ZD_SIMD_AVX2
+};
+
+/* Metadata records decoded at open, in metaId order */
+struct ZDMetadataTable {
+    uint32_t count;
+    uint32_t *metaIds;
+    /* numFields zero terminated strings per record */
+    ZoneDetectString *fields;
+    char *strings;
+};
+
+struct ZDHitList {
+    ZoneDetectHit *hits;
+    size_t numHits;
+    size_t capacity;
+    /* Set once hits was allocated by ZDHitListAdd */
+    ZoneDetectHit *heap;
+    /* Never allocate, only count the hits that do not fit */
+    uint8_t fixed;
+};
+
+/* Points per sorted block of ZDLookupBatch, bounds its temporary memory */
+#define ZD_BATCH_CHUNK (1u << 18)
+/* Points per sorted block when using threads, each worker handles about one block per round */
+#define ZD_BATCH_THREAD_CHUNK (1u << 16)
+/* Points per unit of work that can be stolen by another thread */
+#define ZD_BATCH_UNIT 256
+/* Points per block of a polygon major batch, the points of a block share each polygon they test */
+#define ZD_BATCH_POLYGON_POINTS 4096
+#define ZD_BATCH_MAX_THREADS 256
+
+struct ZDBatchUnit {
+    uint32_t start;
+    uint32_t end;
+};
+
+/* The owner takes units from the tail, other workers steal from the head */
+struct ZDBatchDeque {
+    ZDMutex mutex;
+    struct ZDBatchUnit *units;
+    uint32_t head, tail;
+};
+
+/* One round of a threaded batch, covering numPoints points from offset base */
+struct ZDBatchJob {
+    const ZoneDetect *library;
+    const float *lat, *lon;
+    ZoneDetectBatchResult *results;
+    struct ZDBatchPoint *points;
+    int sort;
+    uint32_t flags;
+
+    size_t base;
+    uint32_t numPoints;
+    uint32_t chunkSize;
+
+    /* Protects nextChunk and nextWorker */
+    ZDMutex mutex;
+    uint32_t nextChunk;
+    uint32_t nextWorker;
+    uint32_t numWorkers;
+    struct ZDBatchDeque *deques;
+};
+
+struct ZDBatchPoint {
+    uint32_t key;
+    uint32_t index;
+    int32_t latFixedPoint;
+    int32_t lonFixedPoint;
+};
+
+struct ZDCandidate {
+    uint32_t polygonId;
+    uint32_t metadataIndex;
+    uint32_t polygonIndex;
+    uint64_t boxArea;
+};
+
+/* Candidate of a polygon major batch, sorted by polygon */
+struct ZDBatchTest {
+    uint32_t polygonIndex;
+    uint32_t candidate;
+    uint32_t point;
+};
+
+/* State of the points that test the same polygon, kept per field so it can be processed four at a time */
+struct ZDBatchGroup {
+    int32_t *lat, *lon;
+    int32_t *quadrant, *winding;
+    /* -1 once the result is known */
+    int32_t *done;
+    ZDLookupResult *result;
+};
+
+struct ZDGrid {
+    uint32_t latCells, lonCells;
+    /* Polygons of cell i are cellPolygons[cellStart[i]] up to cellPolygons[cellStart[i + 1]] */
+    uint32_t *cellStart;
+    uint32_t *cellPolygons;
+    /* Optional, the result shared by all points of the cell or ZD_CELL_MIXED */
+    uint32_t *cellZone;
 };
 
 struct ZoneDetectOpaque {
@@ -78,13 +359,39 @@ struct ZoneDetectOpaque {
     uint8_t version;
     uint8_t precision;
     uint8_t numFields;
+    /* Passed ZD_OPEN_VALIDATE, the bounding boxes and polygon data are decoded without bounds checks */
+    uint8_t trusted;
 
     char *notice;
     char **fieldNames;
 
     uint32_t bboxOffset;
+    /* Differs from metadataOffset by the alignment padding of version 3 */
+    uint32_t bboxEnd;
     uint32_t metadataOffset;
     uint32_t dataOffset;
+
+    /* Version 3: number of metadata records and offset of their strings in the section */
+    uint32_t metadataRecords;
+    uint32_t metadataStrings;
+
+    uint32_t rtreeOffset;
+    uint32_t rtreeNumNodes;
+    uint32_t rtreeNumEntries;
+
+    struct ZDPolygonTable table;
+    struct ZDGrid grid;
+
+    /* Sorted on polygonIndex */
+    uint32_t numDecodedPolygons;
+    struct ZDDecodedPolygon *decodedPolygons;
+
+    struct ZDPolygonCache *cache;
+    struct ZDResultCache *resultCache;
+    struct ZDMetadataTable metadata;
+
+    double indexBuildTime;
+    uint8_t simdLevel;
 };
 
 static void (*zdErrorHandler)(int, int);
@@ -95,8 +402,15 @@ static void zdError(enum ZDInternalError errZD, int errNative)
 
 static int32_t ZDFloatToFixedPoint(float input, float scale, unsigned int precision)
 {
-    const float inputScaled = input / scale;
-    return (int32_t)(inputScaled * (float)(1 << (precision - 1)));
+    const float inputScaled = input / scale * (float)(1 << (precision - 1));
+
+    /* Points far outside the globe, and NaN, are clamped to keep the edge arithmetic within 64 bits */
+    if(!(inputScaled > -(float)ZD_COORDINATE_MAX)) {
+        return -ZD_COORDINATE_MAX;
+    } else if(inputScaled > (float)ZD_COORDINATE_MAX) {
+        return ZD_COORDINATE_MAX;
+    }
+    return (int32_t)inputScaled;
 }
 
 static float ZDFixedPointToFloat(int32_t input, float scale, unsigned int precision)
@@ -128,8 +442,9 @@ static unsigned int ZDDecodeVariableLengthUnsigned(const ZoneDetect *library, ui
                 break;
             }
 
+            /* Longer values do not fit in 64 bits */
             i++;
-            if(buffer + i > bufferEnd) {
+            if(buffer + i > bufferEnd || shift >= 64) {
                 return 0;
             }
         }
@@ -198,64 +513,220 @@ static int64_t ZDDecodeUnsignedToSigned(uint64_t value)
     return (value & 1) ? -(int64_t)(value / 2) : (int64_t)(value / 2);
 }
 
-static unsigned int ZDDecodeVariableLengthSigned(const ZoneDetect *library, uint32_t *index, int32_t *result)
+/*
+ * Decoders for the bounding boxes and polygon data. ZD_OPEN_VALIDATE checked that these never leave the
+ * mapping on a trusted database, the checks and the exception handling are skipped for it.
+ */
+static inline unsigned int ZDDecodeUnsigned(const ZoneDetect *library, uint32_t *index, uint64_t *result)
+{
+    if(library->trusted) {
+        const uint8_t *const buffer = library->mapping + *index;
+        uint64_t value = buffer[0] & UINT8_C(0x7F);
+        unsigned int i = 1;
+        while(buffer[i - 1] & UINT8_C(0x80)) {
+            value |= (((uint64_t)buffer[i]) & UINT8_C(0x7F)) << (7u * i);
+            i++;
+        }
+        *result = value;
+        *index += i;
+        return i;
+    }
+
+    return ZDDecodeVariableLengthUnsigned(library, index, result);
+}
+
+static inline unsigned int ZDDecodeUnsignedReverse(const ZoneDetect *library, uint32_t *index, uint64_t *result)
+{
+    if(library->trusted) {
+        uint32_t i = *index - 1;
+        while(library->mapping[i] & UINT8_C(0x80)) {
+            i--;
+        }
+        *index = i;
+
+        uint32_t i2 = i + 1;
+        return ZDDecodeUnsigned(library, &i2, result);
+    }
+
+    return ZDDecodeVariableLengthUnsignedReverse(library, index, result);
+}
+
+static inline unsigned int ZDDecodeSigned(const ZoneDetect *library, uint32_t *index, int32_t *result)
 {
     uint64_t value = 0;
-    const unsigned int retVal = ZDDecodeVariableLengthUnsigned(library, index, &value);
+    const unsigned int retVal = ZDDecodeUnsigned(library, index, &value);
     *result = (int32_t)ZDDecodeUnsignedToSigned(value);
     return retVal;
 }
 
-static char *ZDParseString(const ZoneDetect *library, uint32_t *index)
+static uint32_t ZDReadUInt32(const ZoneDetect *library, uint32_t index)
+{
+    const uint8_t *const buffer = library->mapping + index;
+    return (uint32_t)buffer[0] | ((uint32_t)buffer[1] << 8) | ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+/* A record of the bounding box section, the indexes are relative to the metadata and data sections */
+struct ZDBBoxEntry {
+    int32_t minLat, minLon, maxLat, maxLon;
+    uint32_t metadataIndex;
+    uint32_t polygonIndex;
+};
+
+/*
+ * Decode the record at *bboxIndex and add its deltas to the indexes of entry, which start at zero.
+ * Returns 0 at the end of the section and for a record that does not fit in it.
+ */
+static int ZDDecodeBBoxEntry(const ZoneDetect *library, uint32_t *bboxIndex, struct ZDBBoxEntry *entry)
+{
+    int32_t metadataIndexDelta;
+    uint64_t polygonIndexDelta;
+
+    if(*bboxIndex >= library->bboxEnd) return 0;
+    if(!ZDDecodeSigned(library, bboxIndex, &entry->minLat)) return 0;
+    if(!ZDDecodeSigned(library, bboxIndex, &entry->minLon)) return 0;
+    if(!ZDDecodeSigned(library, bboxIndex, &entry->maxLat)) return 0;
+    if(!ZDDecodeSigned(library, bboxIndex, &entry->maxLon)) return 0;
+    if(!ZDDecodeSigned(library, bboxIndex, &metadataIndexDelta)) return 0;
+    if(!ZDDecodeUnsigned(library, bboxIndex, &polygonIndexDelta)) return 0;
+    if(*bboxIndex > library->bboxEnd) return 0;
+
+    entry->metadataIndex += (uint32_t)metadataIndexDelta;
+    entry->polygonIndex += (uint32_t)polygonIndexDelta;
+    return 1;
+}
+
+/* Find the characters of the string at index, which may refer to an earlier copy of the string */
+static int ZDLocateString(const ZoneDetect *library, uint32_t *index, uint32_t *offset, uint32_t *length)
 {
     uint64_t strLength;
     if(!ZDDecodeVariableLengthUnsigned(library, index, &strLength)) {
-        return NULL;
+        return -1;
     }
 
     uint32_t strOffset = *index;
-    unsigned int remoteStr = 0;
     if(strLength >= 256) {
         strOffset = library->metadataOffset + (uint32_t)strLength - 256;
-        remoteStr = 1;
 
         if(!ZDDecodeVariableLengthUnsigned(library, &strOffset, &strLength)) {
-            return NULL;
+            return -1;
         }
 
         if(strLength > 256) {
-            return NULL;
+            return -1;
         }
+    } else {
+        *index += (uint32_t)strLength;
     }
 
-    char *const str = malloc((size_t)(strLength + 1));
+    *offset = strOffset;
+    *length = (uint32_t)strLength;
+    return 0;
+}
 
-    if(str) {
+/* Copy a located string to str, which must have room for the terminating zero */
+static int ZDCopyString(const ZoneDetect *library, uint32_t offset, uint32_t length, char *str)
+{
 #if defined(_MSC_VER)
-        __try {
+    __try {
 #endif
-            size_t i;
-            for(i = 0; i < strLength; i++) {
-                str[i] = (char)(library->mapping[strOffset + i] ^ UINT8_C(0x80));
-            }
-#if defined(_MSC_VER)
-        } __except(GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR
-                   ? EXCEPTION_EXECUTE_HANDLER
-                   : EXCEPTION_CONTINUE_SEARCH) { /* file mapping SEH exception occurred */
-            zdError(ZD_E_DB_MAP_EXCEPTION, (int)GetLastError());
-            return 0;
+        uint32_t i;
+        for(i = 0; i < length; i++) {
+            str[i] = (char)(library->mapping[offset + i] ^ UINT8_C(0x80));
         }
+#if defined(_MSC_VER)
+    } __except(GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR
+               ? EXCEPTION_EXECUTE_HANDLER
+               : EXCEPTION_CONTINUE_SEARCH) { /* file mapping SEH exception occurred */
+        zdError(ZD_E_DB_MAP_EXCEPTION, (int)GetLastError());
+        return -1;
+    }
 #endif
-        str[strLength] = 0;
+    str[length] = 0;
+
+    return 0;
+}
+
+static char *ZDParseString(const ZoneDetect *library, uint32_t *index)
+{
+    uint32_t strOffset, strLength;
+    if(ZDLocateString(library, index, &strOffset, &strLength)) {
+        return NULL;
     }
 
-    if(!remoteStr) {
-        *index += (uint32_t)strLength;
+    char *const str = malloc((size_t)strLength + 1);
+
+    if(str && ZDCopyString(library, strOffset, strLength, str)) {
+        free(str);
+        return NULL;
+    }
+
+    return str;
+}
+
+/* Find a field of a version 3 metadata record, the string can be used straight from the mapping */
+static const char *ZDLocateField(const ZoneDetect *library, uint32_t metaId, unsigned int field, uint32_t *length)
+{
+    const uint32_t recordSize = (uint32_t)library->numFields * 4;
+    if(metaId < 4 || metaId >= library->metadataStrings || (metaId - 4) % recordSize || field >= library->numFields) {
+        return NULL;
+    }
+
+    const uint32_t offset = ZDReadUInt32(library, library->metadataOffset + metaId + field * 4);
+    if(offset < library->metadataStrings || offset >= library->dataOffset - library->metadataOffset) {
+        return NULL;
+    }
+
+    const char *const str = (const char *)library->mapping + library->metadataOffset + offset;
+    *length = (uint32_t)strlen(str);
+    return str;
+}
+
+/* Allocate a copy of a metadata field, index walks the record in versions before 3 */
+static char *ZDParseField(const ZoneDetect *library, uint32_t metaId, unsigned int field, uint32_t *index)
+{
+    if(library->version < 3) {
+        return ZDParseString(library, index);
+    }
+
+    uint32_t length;
+    const char *const data = ZDLocateField(library, metaId, field, &length);
+    if(!data) {
+        return NULL;
     }
 
+    char *const str = malloc((size_t)length + 1);
+    if(str) {
+        memcpy(str, data, (size_t)length + 1);
+    }
     return str;
 }
 
+/*
+ * Version 3 metadata is a record count followed by the records, which have one offset per field. The
+ * offsets point at zero terminated strings after the records, the metaId is the offset of the record.
+ */
+static int ZDParseMetadataTable(ZoneDetect *library)
+{
+    const uint32_t size = library->dataOffset - library->metadataOffset;
+    if(size < 4) {
+        return -1;
+    }
+
+    library->metadataRecords = ZDReadUInt32(library, library->metadataOffset);
+    const uint64_t recordsEnd = 4 + (uint64_t)library->metadataRecords * library->numFields * 4;
+    if(recordsEnd > size) {
+        return -1;
+    }
+
+    /* A terminated last string makes every string in the section terminated */
+    if(recordsEnd < size && library->mapping[library->dataOffset - 1]) {
+        return -1;
+    }
+
+    library->metadataStrings = (uint32_t)recordsEnd;
+    return 0;
+}
+
 static int ZDParseHeader(ZoneDetect *library)
 {
     if(library->length < 7) {
@@ -282,7 +753,12 @@ static int ZDParseHeader(ZoneDetect *library)
     }
 #endif
 
-    if(library->version >= 2) {
+    if(library->version >= 4) {
+        return -1;
+    }
+
+    /* The edge arithmetic in ZDWindingEdge needs coordinates of at most 31 bits */
+    if(!library->precision || library->precision > 30) {
         return -1;
     }
 
@@ -303,31 +779,92 @@ static int ZDParseHeader(ZoneDetect *library)
         return -1;
     }
 
-    uint64_t tmp;
+    uint64_t bboxSize, metadataSize, tmp;
     /* Read section sizes */
-    /* By memset: library->bboxOffset = 0 */
-
+    if(!ZDDecodeVariableLengthUnsigned(library, &index, &bboxSize)) return -1;
+    if(!ZDDecodeVariableLengthUnsigned(library, &index, &metadataSize)) return -1;
     if(!ZDDecodeVariableLengthUnsigned(library, &index, &tmp)) return -1;
-    library->metadataOffset = (uint32_t)tmp + library->bboxOffset;
 
-    if(!ZDDecodeVariableLengthUnsigned(library, &index, &tmp))return -1;
-    library->dataOffset = (uint32_t)tmp + library->metadataOffset;
+    uint64_t rtreeSize = 0;
+    if(library->version >= 2) {
+        if(!ZDDecodeVariableLengthUnsigned(library, &index, &rtreeSize)) return -1;
+    }
 
-    if(!ZDDecodeVariableLengthUnsigned(library, &index, &tmp)) return -1;
+    /* The sections follow the header, from version 3 the metadata is aligned to 4 bytes */
+    uint64_t metadataOffset = index + bboxSize;
+    if(library->version >= 3) {
+        metadataOffset = (metadataOffset + 3) & ~(uint64_t)3;
+    }
+    if(metadataOffset + metadataSize + tmp > (uint64_t)library->length) {
+        return -2;
+    }
+
+    library->bboxOffset = index;
+    library->bboxEnd = (uint32_t)(index + bboxSize);
+    library->metadataOffset = (uint32_t)metadataOffset;
+    library->dataOffset = (uint32_t)(metadataOffset + metadataSize);
+
+    if(library->version >= 3 && ZDParseMetadataTable(library)) {
+        return -2;
+    }
+
+    if(library->version < 2) {
+        /* Verify file length */
+        if(tmp + library->dataOffset != (uint32_t)library->length) {
+            return -2;
+        }
+        return 0;
+    }
+
+    /* Verify file length, the R-tree is aligned to 4 bytes */
+    const uint64_t rtreeOffset = (tmp + library->dataOffset + 3) & ~(uint64_t)3;
+    if(rtreeOffset + rtreeSize != (uint64_t)library->length || rtreeSize < ZD_RTREE_HEADER_SIZE) {
+        return -2;
+    }
 
-    /* Add header size to everything */
-    library->bboxOffset += index;
-    library->metadataOffset += index;
-    library->dataOffset += index;
+#if defined(_MSC_VER)
+    __try {
+#endif
+        library->rtreeOffset = (uint32_t)rtreeOffset;
+        library->rtreeNumNodes = ZDReadUInt32(library, library->rtreeOffset);
+        library->rtreeNumEntries = ZDReadUInt32(library, library->rtreeOffset + 4);
+#if defined(_MSC_VER)
+    } __except(GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR
+               ? EXCEPTION_EXECUTE_HANDLER
+               : EXCEPTION_CONTINUE_SEARCH) { /* file mapping SEH exception occurred */
+        zdError(ZD_E_DB_MAP_EXCEPTION, (int)GetLastError());
+        return -1;
+    }
+#endif
 
-    /* Verify file length */
-    if(tmp + library->dataOffset != (uint32_t)library->length) {
+    if(!library->rtreeNumNodes ||
+            ZD_RTREE_HEADER_SIZE + (uint64_t)library->rtreeNumNodes * ZD_RTREE_NODE_SIZE + (uint64_t)library->rtreeNumEntries * ZD_RTREE_ENTRY_SIZE != rtreeSize) {
         return -2;
     }
 
     return 0;
 }
 
+/* Squared distance from the point to the box in the units of distanceSqrMin, zero if the box contains it */
+static uint64_t ZDBoxDistanceSqr(int32_t latFixedPoint, int32_t lonFixedPoint, int32_t minLat, int32_t minLon, int32_t maxLat, int32_t maxLon)
+{
+    int64_t diffLat = 0, diffLon = 0;
+
+    if(latFixedPoint < minLat) {
+        diffLat = (int64_t)minLat - latFixedPoint;
+    } else if(latFixedPoint > maxLat) {
+        diffLat = (int64_t)latFixedPoint - maxLat;
+    }
+    if(lonFixedPoint < minLon) {
+        diffLon = (int64_t)minLon - lonFixedPoint;
+    } else if(lonFixedPoint > maxLon) {
+        diffLon = (int64_t)lonFixedPoint - maxLon;
+    }
+
+    /* Note: lon has half scale */
+    return (uint64_t)(diffLat * diffLat) + (uint64_t)(diffLon * diffLon) * 4;
+}
+
 static int ZDPointInBox(int32_t xl, int32_t x, int32_t xr, int32_t yl, int32_t y, int32_t yr)
 {
     if((xl <= x && x <= xr) || (xr <= x && x <= xl)) {
@@ -390,27 +927,27 @@ readNewPoint:
     }
 
     if(reader->first && reader->library->version == 0) {
-        if(!ZDDecodeVariableLengthUnsigned(reader->library, &reader->polygonIndex, &reader->numVertices)) return -1;
+        if(!ZDDecodeUnsigned(reader->library, &reader->polygonIndex, &reader->numVertices)) return -1;
         if(!reader->numVertices) return -1;
     }
 
     uint8_t referenceDone = 0;
 
-    if(reader->library->version == 1) {
+    if(reader->library->version >= 1) {
         uint64_t point = 0;
 
         if(!reader->referenceDirection) {
-            if(!ZDDecodeVariableLengthUnsigned(reader->library, &reader->polygonIndex, &point)) return -1;
+            if(!ZDDecodeUnsigned(reader->library, &reader->polygonIndex, &point)) return -1;
         } else {
             if(reader->referenceDirection > 0) {
                 /* Read reference forward */
-                if(!ZDDecodeVariableLengthUnsigned(reader->library, &reader->referenceStart, &point)) return -1;
+                if(!ZDDecodeUnsigned(reader->library, &reader->referenceStart, &point)) return -1;
                 if(reader->referenceStart >= reader->referenceEnd) {
                     referenceDone = 1;
                 }
             } else if(reader->referenceDirection < 0) {
                 /* Read reference backwards */
-                if(!ZDDecodeVariableLengthUnsignedReverse(reader->library, &reader->referenceStart, &point)) return -1;
+                if(!ZDDecodeUnsignedReverse(reader->library, &reader->referenceStart, &point)) return -1;
                 if(reader->referenceStart <= reader->referenceEnd) {
                     referenceDone = 1;
                 }
@@ -424,18 +961,18 @@ readNewPoint:
             }
 
             uint64_t value;
-            if(!ZDDecodeVariableLengthUnsigned(reader->library, &reader->polygonIndex, &value)) return -1;
+            if(!ZDDecodeUnsigned(reader->library, &reader->polygonIndex, &value)) return -1;
 
             if(value == 0) {
                 reader->done = 2;
             } else if(value == 1) {
                 int32_t diff;
                 int64_t start;
-                if(!ZDDecodeVariableLengthUnsigned(reader->library, &reader->polygonIndex, (uint64_t*)&start)) return -1;
-                if(!ZDDecodeVariableLengthSigned(reader->library, &reader->polygonIndex, &diff)) return -1;
+                if(!ZDDecodeUnsigned(reader->library, &reader->polygonIndex, (uint64_t*)&start)) return -1;
+                if(!ZDDecodeSigned(reader->library, &reader->polygonIndex, &diff)) return -1;
 
                 reader->referenceStart = reader->library->dataOffset+(uint32_t)start;
-                reader->referenceEnd = reader->library->dataOffset+(uint32_t)(start + diff);
+                reader->referenceEnd = reader->library->dataOffset+(uint32_t)start+(uint32_t)diff;
                 reader->referenceDirection = diff;
                 if(diff < 0) {
                     reader->referenceStart--;
@@ -452,14 +989,16 @@ readNewPoint:
         }
     }
 
-    if(reader->library->version == 0) {
-        if(!ZDDecodeVariableLengthSigned(reader->library, &reader->polygonIndex, &diffLat)) return -1;
-        if(!ZDDecodeVariableLengthSigned(reader->library, &reader->polygonIndex, &diffLon)) return -1;
+    /* Once all vertices are read only the closing point is left, which is not encoded */
+    if(reader->library->version == 0 && !reader->done) {
+        if(!ZDDecodeSigned(reader->library, &reader->polygonIndex, &diffLat)) return -1;
+        if(!ZDDecodeSigned(reader->library, &reader->polygonIndex, &diffLon)) return -1;
     }
 
     if(!reader->done) {
-        reader->pointLat += diffLat;
-        reader->pointLon += diffLon;
+        /* Wraps around on corrupt data, ZD_OPEN_VALIDATE rejects points outside the coordinate range */
+        reader->pointLat = (int32_t)((uint32_t)reader->pointLat + (uint32_t)diffLat);
+        reader->pointLon = (int32_t)((uint32_t)reader->pointLon + (uint32_t)diffLon);
         if(reader->first) {
             reader->firstLat = reader->pointLat;
             reader->firstLon = reader->pointLon;
@@ -473,7 +1012,7 @@ readNewPoint:
 
     reader->first = 0;
 
-    if(reader->library->version == 0) {
+    if(reader->library->version == 0 && reader->done < 2) {
         reader->numVertices--;
         if(!reader->numVertices) {
             reader->done = 1;
@@ -500,33 +1039,30 @@ readNewPoint:
 
 static int ZDFindPolygon(const ZoneDetect *library, uint32_t wantedId, uint32_t* metadataIndexPtr, uint32_t* polygonIndexPtr)
 {
+    if(library->table.memory) {
+        if(wantedId >= library->table.count) {
+            return 0;
+        }
+        if(metadataIndexPtr) {
+            *metadataIndexPtr = library->metadataOffset + library->table.metadataIndex[wantedId];
+        }
+        if(polygonIndexPtr) {
+            *polygonIndexPtr = library->table.polygonIndex[wantedId];
+        }
+        return 1;
+    }
+
     uint32_t polygonId = 0;
     uint32_t bboxIndex = library->bboxOffset;
+    struct ZDBBoxEntry entry = {0};
 
-    uint32_t metadataIndex = 0, polygonIndex = 0;
-
-    while(bboxIndex < library->metadataOffset) {
-        uint64_t polygonIndexDelta;
-        int32_t metadataIndexDelta;
-        int32_t tmp;
-        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &tmp)) break;
-        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &tmp)) break;
-        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &tmp)) break;
-        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &tmp)) break;
-        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &metadataIndexDelta)) break;
-        if(!ZDDecodeVariableLengthUnsigned(library, &bboxIndex, &polygonIndexDelta)) break;
-
-        metadataIndex += (uint32_t)metadataIndexDelta;
-        polygonIndex += (uint32_t)polygonIndexDelta;
-
+    while(ZDDecodeBBoxEntry(library, &bboxIndex, &entry)) {
         if(polygonId == wantedId) {
             if(metadataIndexPtr) {
-                metadataIndex += library->metadataOffset;
-                *metadataIndexPtr = metadataIndex;
+                *metadataIndexPtr = library->metadataOffset + entry.metadataIndex;
             }
             if(polygonIndexPtr) {
-                polygonIndex += library->dataOffset;
-                *polygonIndexPtr = polygonIndex;
+                *polygonIndexPtr = library->dataOffset + entry.polygonIndex;
             }
             return 1;
         }
@@ -635,442 +1171,6190 @@ fail:
     return NULL;
 }
 
-static ZDLookupResult ZDPointInPolygon(const ZoneDetect *library, uint32_t polygonIndex, int32_t latFixedPoint, int32_t lonFixedPoint, uint64_t *distanceSqrMin)
+static int ZDQuadrant(int32_t pointLat, int32_t pointLon, int32_t latFixedPoint, int32_t lonFixedPoint)
 {
-    int32_t pointLat, pointLon, prevLat = 0, prevLon = 0;
-    int prevQuadrant = 0, winding = 0;
+    if(pointLat >= latFixedPoint) {
+        if(pointLon >= lonFixedPoint) {
+            return 0;
+        } else {
+            return 1;
+        }
+    } else {
+        if(pointLon >= lonFixedPoint) {
+            return 3;
+        } else {
+            return 2;
+        }
+    }
+}
 
-    uint8_t first = 1;
+/*
+ * Lower *distanceSqrMin to the squared distance from the point to the edge from prev to point, if that is
+ * smaller. The closest point lies within the box of the edge, so edges whose box is not closer than the
+ * current minimum are skipped. The closest point is found in the metric of the distance, in which lon has
+ * half scale. All coordinates are at most ZD_COORDINATE_MAX in absolute value, which ZD_OPEN_VALIDATE checks
+ * for the database and ZDFloatToFixedPoint ensures for the point. Differences are then below 2^30.33, so dot
+ * and lengthSqr, at most 5 times the square of that, stay below 2^63.
+ */
+static void ZDEdgeDistanceSqr(int32_t latFixedPoint, int32_t lonFixedPoint, int32_t prevLat, int32_t prevLon, int32_t pointLat, int32_t pointLon, uint64_t *distanceSqrMin)
+{
+    const int32_t minLat = (prevLat < pointLat) ? prevLat : pointLat;
+    const int32_t maxLat = (prevLat < pointLat) ? pointLat : prevLat;
+    const int32_t minLon = (prevLon < pointLon) ? prevLon : pointLon;
+    const int32_t maxLon = (prevLon < pointLon) ? pointLon : prevLon;
+    if(ZDBoxDistanceSqr(latFixedPoint, lonFixedPoint, minLat, minLon, maxLat, maxLon) >= *distanceSqrMin) {
+        return;
+    }
 
-    struct Reader reader;
-    ZDReaderInit(&reader, library, polygonIndex);
+    const int64_t edgeLat = (int64_t)pointLat - prevLat;
+    const int64_t edgeLon = (int64_t)pointLon - prevLon;
+    const int64_t targetLat = (int64_t)latFixedPoint - prevLat;
+    const int64_t targetLon = (int64_t)lonFixedPoint - prevLon;
+    /* Project in the same metric as the distance, lon has half scale */
+    const int64_t dot = targetLat * edgeLat + targetLon * edgeLon * 4;
+    const int64_t lengthSqr = edgeLat * edgeLat + edgeLon * edgeLon * 4;
+
+    int64_t diffLat, diffLon;
+    if(dot >= 0 && dot <= lengthSqr && lengthSqr > 0) {
+        /* Project onto the segment, the fraction dot / lengthSqr is kept with 31 bits */
+        int64_t numerator = dot, denominator = lengthSqr;
+        while(denominator >= (INT64_C(1) << 31)) {
+            numerator >>= 1;
+            denominator >>= 1;
+        }
+        const int64_t fraction = (numerator << 31) / denominator;
 
-    while(1) {
-        int result = ZDReaderGetPoint(&reader, &pointLat, &pointLon);
-        if(result < 0) {
-            return ZD_LOOKUP_PARSE_ERROR;
-        } else if(result == 0) {
-            break;
+        diffLat = fraction * edgeLat / (INT64_C(1) << 31) - targetLat;
+        diffLon = fraction * edgeLon / (INT64_C(1) << 31) - targetLon;
+    } else {
+        /*
+         * Calculate squared distance to vertices
+         * It is enough to check the current point since the polygon is closed.
+         */
+        diffLat = (int64_t)(pointLat - latFixedPoint);
+        diffLon = (int64_t)(pointLon - lonFixedPoint);
+    }
+
+    /* Note: lon has half scale */
+    uint64_t distanceSqr = (uint64_t)(diffLat * diffLat) + (uint64_t)(diffLon * diffLon) * 4;
+    if(distanceSqr < *distanceSqrMin) *distanceSqrMin = distanceSqr;
+}
+
+/*
+ * Process the edge from prev to point. Returns a border result, or ZD_LOOKUP_IGNORE after adding the
+ * change of the winding number (counted in quadrants) to *winding. All arithmetic is done on 64 bit
+ * integers, this is exact for coordinates of at most ZD_COORDINATE_MAX.
+ */
+static ZDLookupResult ZDWindingEdge(int32_t latFixedPoint, int32_t lonFixedPoint, int32_t prevLat, int32_t prevLon, int prevQuadrant, int32_t pointLat, int32_t pointLon, int quadrant, int *winding, uint64_t *distanceSqrMin)
+{
+    int windingNeedCompare = 0, lineIsStraight = 0;
+
+    /* Calculate winding number */
+    if(quadrant == prevQuadrant) {
+        /* Do nothing */
+    } else if(quadrant == (prevQuadrant + 1) % 4) {
+        (*winding) ++;
+    } else if((quadrant + 1) % 4 == prevQuadrant) {
+        (*winding) --;
+    } else {
+        windingNeedCompare = 1;
+    }
+
+    /* Avoid horizontal and vertical lines */
+    if((pointLon == prevLon || pointLat == prevLat)) {
+        lineIsStraight = 1;
+    }
+
+    if(lineIsStraight && (windingNeedCompare || ZDPointInBox(pointLat, latFixedPoint, prevLat, pointLon, lonFixedPoint, prevLon))) {
+        if(distanceSqrMin) *distanceSqrMin = 0;
+        return ZD_LOOKUP_ON_BORDER_SEGMENT;
+    }
+
+    if(!windingNeedCompare && !distanceSqrMin) {
+        return ZD_LOOKUP_IGNORE;
+    }
+
+    const int64_t edgeLat = (int64_t)pointLat - prevLat;
+    const int64_t edgeLon = (int64_t)pointLon - prevLon;
+    const int64_t targetLat = (int64_t)latFixedPoint - prevLat;
+    const int64_t targetLon = (int64_t)lonFixedPoint - prevLon;
+
+    /* Jumped two quadrants. */
+    if(windingNeedCompare) {
+        /*
+         * The edge crosses the latitude of the target cross / edgeLat to the east of it. It is on the
+         * border if that is at most one unit.
+         */
+        const int64_t cross = targetLat * edgeLon - targetLon * edgeLat;
+        const int64_t edgeLatAbs = (edgeLat < 0) ? -edgeLat : edgeLat;
+        if(cross >= -edgeLatAbs && cross <= edgeLatAbs) {
+            if(distanceSqrMin) *distanceSqrMin = 0;
+            return ZD_LOOKUP_ON_BORDER_SEGMENT;
         }
 
-        /* Check if point is ON the border */
-        if(pointLat == latFixedPoint && pointLon == lonFixedPoint) {
+        /* Ok, it's not. In which direction did we go round the target? */
+        const int sign = ((cross < 0) == (edgeLat > 0)) ? 2 : -2;
+        if(quadrant == 2 || quadrant == 3) {
+            *winding += sign;
+        } else {
+            *winding -= sign;
+        }
+    }
+
+    /* Calculate closest point on the segment (if needed) */
+    if(distanceSqrMin) {
+        ZDEdgeDistanceSqr(latFixedPoint, lonFixedPoint, prevLat, prevLon, pointLat, pointLon, distanceSqrMin);
+    }
+
+    return ZD_LOOKUP_IGNORE;
+}
+
+static ZDLookupResult ZDWindingToResult(int winding, uint64_t *distanceSqrMin)
+{
+    if(winding == -4) {
+        return ZD_LOOKUP_IN_ZONE;
+    } else if(winding == 4) {
+        return ZD_LOOKUP_IN_EXCLUDED_ZONE;
+    } else if(winding == 0) {
+        return ZD_LOOKUP_NOT_IN_ZONE;
+    }
+
+    /* Should not happen */
+    if(distanceSqrMin) *distanceSqrMin = 0;
+    return ZD_LOOKUP_ON_BORDER_SEGMENT;
+}
+
+static uint32_t ZDSlabIndexRange(int32_t minLat, int32_t maxLat, uint32_t numSlabs, int32_t latFixedPoint);
+
+static uint32_t ZDSlabIndex(const struct ZDDecodedPolygon *polygon, int32_t latFixedPoint)
+{
+    return ZDSlabIndexRange(polygon->minLat, polygon->maxLat, polygon->numSlabs, latFixedPoint);
+}
+
+/* Process edges start up to end in order, like ZDPointInPolygon */
+static ZDLookupResult ZDWindingEdges(const struct ZDDecodedPolygon *polygon, int32_t latFixedPoint, int32_t lonFixedPoint, uint32_t start, uint32_t end, int *winding, uint64_t *distanceSqrMin)
+{
+    const int32_t *const lat = polygon->lat;
+    const int32_t *const lon = polygon->lon;
+    uint32_t i;
+
+    int prevQuadrant = ZDQuadrant(lat[start - 1], lon[start - 1], latFixedPoint, lonFixedPoint);
+    for(i = start; i < end; i++) {
+        if(lat[i] == latFixedPoint && lon[i] == lonFixedPoint) {
             if(distanceSqrMin) *distanceSqrMin = 0;
             return ZD_LOOKUP_ON_BORDER_VERTEX;
         }
 
-        /* Find quadrant */
-        int quadrant;
-        if(pointLat >= latFixedPoint) {
-            if(pointLon >= lonFixedPoint) {
-                quadrant = 0;
-            } else {
-                quadrant = 1;
+        const int quadrant = ZDQuadrant(lat[i], lon[i], latFixedPoint, lonFixedPoint);
+        const ZDLookupResult edgeResult = ZDWindingEdge(latFixedPoint, lonFixedPoint, lat[i - 1], lon[i - 1], prevQuadrant, lat[i], lon[i], quadrant, winding, distanceSqrMin);
+        if(edgeResult != ZD_LOOKUP_IGNORE) {
+            return edgeResult;
+        }
+        prevQuadrant = quadrant;
+    }
+
+    return ZD_LOOKUP_IGNORE;
+}
+
+/*
+ * The vector kernels compute the quadrant of both ends of several edges at once. Edges that move one
+ * quadrant only change the winding number. Edges that jump two quadrants or whose bounding box contains
+ * the point (this includes every edge that touches it) are rare, the whole group is then handed to
+ * ZDWindingEdges so results and their order are exactly those of the scalar code.
+ */
+#if defined(ZD_SIMD_AVX2_DISPATCH)
+__attribute__((target("avx2")))
+static __m256i ZDQuadrantAVX2(__m256i pointLat, __m256i pointLon, __m256i lat, __m256i lon)
+{
+    const __m256i south = _mm256_cmpgt_epi32(lat, pointLat);
+    const __m256i west = _mm256_cmpgt_epi32(lon, pointLon);
+    return _mm256_add_epi32(_mm256_and_si256(south, _mm256_set1_epi32(2)), _mm256_and_si256(_mm256_xor_si256(south, west), _mm256_set1_epi32(1)));
+}
+
+__attribute__((target("avx2")))
+static __m256i ZDOutsideAVX2(__m256i point, __m256i prev, __m256i value)
+{
+    return _mm256_or_si256(_mm256_and_si256(_mm256_cmpgt_epi32(point, value), _mm256_cmpgt_epi32(prev, value)),
+                           _mm256_and_si256(_mm256_cmpgt_epi32(value, point), _mm256_cmpgt_epi32(value, prev)));
+}
+
+__attribute__((target("avx2")))
+static ZDLookupResult ZDWindingKernelAVX2(const struct ZDDecodedPolygon *polygon, int32_t latFixedPoint, int32_t lonFixedPoint, int *winding)
+{
+    const __m256i lat = _mm256_set1_epi32(latFixedPoint);
+    const __m256i lon = _mm256_set1_epi32(lonFixedPoint);
+    const __m256i one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2), three = _mm256_set1_epi32(3);
+    __m256i sum = _mm256_setzero_si256();
+    uint32_t i;
+
+    for(i = 1; i + 8 <= polygon->numPoints; i += 8) {
+        const __m256i pointLat = _mm256_loadu_si256((const __m256i *)(const void *)(polygon->lat + i));
+        const __m256i pointLon = _mm256_loadu_si256((const __m256i *)(const void *)(polygon->lon + i));
+        const __m256i prevLat = _mm256_loadu_si256((const __m256i *)(const void *)(polygon->lat + i - 1));
+        const __m256i prevLon = _mm256_loadu_si256((const __m256i *)(const void *)(polygon->lon + i - 1));
+
+        const __m256i delta = _mm256_and_si256(_mm256_sub_epi32(ZDQuadrantAVX2(pointLat, pointLon, lat, lon), ZDQuadrantAVX2(prevLat, prevLon, lat, lon)), three);
+        const __m256i outside = _mm256_or_si256(ZDOutsideAVX2(pointLat, prevLat, lat), ZDOutsideAVX2(pointLon, prevLon, lon));
+        const __m256i special = _mm256_or_si256(_mm256_cmpeq_epi32(delta, two), _mm256_xor_si256(outside, _mm256_set1_epi32(-1)));
+
+        if(_mm256_movemask_ps(_mm256_castsi256_ps(special))) {
+            const ZDLookupResult result = ZDWindingEdges(polygon, latFixedPoint, lonFixedPoint, i, i + 8, winding, NULL);
+            if(result != ZD_LOOKUP_IGNORE) {
+                return result;
             }
         } else {
-            if(pointLon >= lonFixedPoint) {
-                quadrant = 3;
-            } else {
-                quadrant = 2;
-            }
+            sum = _mm256_add_epi32(sum, _mm256_and_si256(_mm256_cmpeq_epi32(delta, one), one));
+            sum = _mm256_sub_epi32(sum, _mm256_and_si256(_mm256_cmpeq_epi32(delta, three), one));
         }
+    }
 
-        if(!first) {
-            int windingNeedCompare = 0, lineIsStraight = 0;
-            float a = 0, b = 0;
-
-            /* Calculate winding number */
-            if(quadrant == prevQuadrant) {
-                /* Do nothing */
-            } else if(quadrant == (prevQuadrant + 1) % 4) {
-                winding ++;
-            } else if((quadrant + 1) % 4 == prevQuadrant) {
-                winding --;
-            } else {
-                windingNeedCompare = 1;
-            }
+    int32_t lanes[8];
+    unsigned int lane;
+    _mm256_storeu_si256((__m256i *)(void *)lanes, sum);
+    for(lane = 0; lane < 8; lane++) {
+        *winding += lanes[lane];
+    }
 
-            /* Avoid horizontal and vertical lines */
-            if((pointLon == prevLon || pointLat == prevLat)) {
-                lineIsStraight = 1;
-            }
+    return ZDWindingEdges(polygon, latFixedPoint, lonFixedPoint, i, polygon->numPoints, winding, NULL);
+}
+#endif
 
-            /* Calculate the parameters of y=ax+b if needed */
-            if(!lineIsStraight && (distanceSqrMin || windingNeedCompare)) {
-                a = ((float)pointLat - (float)prevLat) / ((float)pointLon - (float)prevLon);
-                b = (float)pointLat - a * (float)pointLon;
-            }
+#if defined(ZD_SIMD_X86)
+static __m128i ZDQuadrantSSE2(__m128i pointLat, __m128i pointLon, __m128i lat, __m128i lon)
+{
+    const __m128i south = _mm_cmplt_epi32(pointLat, lat);
+    const __m128i west = _mm_cmplt_epi32(pointLon, lon);
+    return _mm_add_epi32(_mm_and_si128(south, _mm_set1_epi32(2)), _mm_and_si128(_mm_xor_si128(south, west), _mm_set1_epi32(1)));
+}
+
+static __m128i ZDOutsideSSE2(__m128i point, __m128i prev, __m128i value)
+{
+    return _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi32(point, value), _mm_cmpgt_epi32(prev, value)),
+                        _mm_and_si128(_mm_cmplt_epi32(point, value), _mm_cmplt_epi32(prev, value)));
+}
 
-            int onStraight = ZDPointInBox(pointLat, latFixedPoint, prevLat, pointLon, lonFixedPoint, prevLon);
-            if(lineIsStraight && (onStraight || windingNeedCompare)) {
-                if(distanceSqrMin) *distanceSqrMin = 0;
-                return ZD_LOOKUP_ON_BORDER_SEGMENT;
+static ZDLookupResult ZDWindingKernelSSE2(const struct ZDDecodedPolygon *polygon, int32_t latFixedPoint, int32_t lonFixedPoint, int *winding)
+{
+    const __m128i lat = _mm_set1_epi32(latFixedPoint);
+    const __m128i lon = _mm_set1_epi32(lonFixedPoint);
+    const __m128i one = _mm_set1_epi32(1), two = _mm_set1_epi32(2), three = _mm_set1_epi32(3);
+    __m128i sum = _mm_setzero_si128();
+    uint32_t i;
+
+    for(i = 1; i + 4 <= polygon->numPoints; i += 4) {
+        const __m128i pointLat = _mm_loadu_si128((const __m128i *)(const void *)(polygon->lat + i));
+        const __m128i pointLon = _mm_loadu_si128((const __m128i *)(const void *)(polygon->lon + i));
+        const __m128i prevLat = _mm_loadu_si128((const __m128i *)(const void *)(polygon->lat + i - 1));
+        const __m128i prevLon = _mm_loadu_si128((const __m128i *)(const void *)(polygon->lon + i - 1));
+
+        const __m128i delta = _mm_and_si128(_mm_sub_epi32(ZDQuadrantSSE2(pointLat, pointLon, lat, lon), ZDQuadrantSSE2(prevLat, prevLon, lat, lon)), three);
+        const __m128i outside = _mm_or_si128(ZDOutsideSSE2(pointLat, prevLat, lat), ZDOutsideSSE2(pointLon, prevLon, lon));
+        const __m128i special = _mm_or_si128(_mm_cmpeq_epi32(delta, two), _mm_xor_si128(outside, _mm_set1_epi32(-1)));
+
+        if(_mm_movemask_ps(_mm_castsi128_ps(special))) {
+            const ZDLookupResult result = ZDWindingEdges(polygon, latFixedPoint, lonFixedPoint, i, i + 4, winding, NULL);
+            if(result != ZD_LOOKUP_IGNORE) {
+                return result;
             }
+        } else {
+            sum = _mm_add_epi32(sum, _mm_and_si128(_mm_cmpeq_epi32(delta, one), one));
+            sum = _mm_sub_epi32(sum, _mm_and_si128(_mm_cmpeq_epi32(delta, three), one));
+        }
+    }
 
-            /* Jumped two quadrants. */
-            if(windingNeedCompare) {
-                /* Check if the target is on the border */
-                const int32_t intersectLon = (int32_t)(((float)latFixedPoint - b) / a);
-                if(intersectLon >= lonFixedPoint-1 && intersectLon <= lonFixedPoint+1) {
-                    if(distanceSqrMin) *distanceSqrMin = 0;
-                    return ZD_LOOKUP_ON_BORDER_SEGMENT;
-                }
+    int32_t lanes[4];
+    unsigned int lane;
+    _mm_storeu_si128((__m128i *)(void *)lanes, sum);
+    for(lane = 0; lane < 4; lane++) {
+        *winding += lanes[lane];
+    }
 
-                /* Ok, it's not. In which direction did we go round the target? */
-                const int sign = (intersectLon < lonFixedPoint) ? 2 : -2;
-                if(quadrant == 2 || quadrant == 3) {
-                    winding += sign;
-                } else {
-                    winding -= sign;
-                }
-            }
+    return ZDWindingEdges(polygon, latFixedPoint, lonFixedPoint, i, polygon->numPoints, winding, NULL);
+}
+#endif
 
-            /* Calculate closest point on line (if needed) */
-            if(distanceSqrMin) {
-                float closestLon, closestLat;
-                if(!lineIsStraight) {
-                    closestLon = ((float)lonFixedPoint + a * (float)latFixedPoint - a * b) / (a * a + 1);
-                    closestLat = (a * ((float)lonFixedPoint + a * (float)latFixedPoint) + b) / (a * a + 1);
-                } else {
-                    if(pointLon == prevLon) {
-                        closestLon = (float)pointLon;
-                        closestLat = (float)latFixedPoint;
-                    } else {
-                        closestLon = (float)lonFixedPoint;
-                        closestLat = (float)pointLat;
-                    }
-                }
+static ZDLookupResult ZDWindingKernel(const ZoneDetect *library, const struct ZDDecodedPolygon *polygon, int32_t latFixedPoint, int32_t lonFixedPoint, int *winding)
+{
+#if defined(ZD_SIMD_AVX2_DISPATCH)
+    if(library->simdLevel == ZD_SIMD_AVX2) {
+        return ZDWindingKernelAVX2(polygon, latFixedPoint, lonFixedPoint, winding);
+    }
+#endif
+
+#if defined(ZD_SIMD_X86)
+    if(library->simdLevel == ZD_SIMD_SSE2) {
+        return ZDWindingKernelSSE2(polygon, latFixedPoint, lonFixedPoint, winding);
+    }
+#else
+    (void)library;
+#endif
 
-                const int closestInBox = ZDPointInBox(pointLon, (int32_t)closestLon, prevLon, pointLat, (int32_t)closestLat, prevLat);
+    return ZDWindingEdges(polygon, latFixedPoint, lonFixedPoint, 1, polygon->numPoints, winding, NULL);
+}
 
-                int64_t diffLat, diffLon;
-                if(closestInBox) {
-                    /* Calculate squared distance to segment. */
-                    diffLat = (int64_t)(closestLat - (float)latFixedPoint);
-                    diffLon = (int64_t)(closestLon - (float)lonFixedPoint);
-                } else {
-                    /*
-                     * Calculate squared distance to vertices
-                     * It is enough to check the current point since the polygon is closed.
-                     */
-                    diffLat = (int64_t)(pointLat - latFixedPoint);
-                    diffLon = (int64_t)(pointLon - lonFixedPoint);
-                }
+/* Smallest latitude in the slab */
+static int32_t ZDSlabMinLat(const struct ZDDecodedPolygon *polygon, uint32_t slab)
+{
+    const int64_t range = (int64_t)polygon->maxLat - polygon->minLat + 1;
+    return (int32_t)(polygon->minLat + ((int64_t)slab * range + polygon->numSlabs - 1) / polygon->numSlabs);
+}
 
-                /* Note: lon has half scale */
-                uint64_t distanceSqr = (uint64_t)(diffLat * diffLat) + (uint64_t)(diffLon * diffLon) * 4;
-                if(distanceSqr < *distanceSqrMin) *distanceSqrMin = distanceSqr;
-            }
+/*
+ * Distance to the edges of a polygon whose latitude span contains the point. Slabs are visited outwards
+ * from the one of the point, stopping when their latitude alone is further away than the minimum.
+ */
+static void ZDSlabDistanceSqr(const struct ZDDecodedPolygon *polygon, int32_t latFixedPoint, int32_t lonFixedPoint, uint32_t slab, uint64_t *distanceSqrMin)
+{
+    const int32_t *const lat = polygon->lat;
+    const int32_t *const lon = polygon->lon;
+    uint32_t s, j;
+
+    for(s = slab; s < polygon->numSlabs; s++) {
+        if(s > slab) {
+            const int64_t diffLat = (int64_t)ZDSlabMinLat(polygon, s) - latFixedPoint;
+            if((uint64_t)(diffLat * diffLat) >= *distanceSqrMin) break;
         }
+        for(j = polygon->slabStart[s]; j < polygon->slabStart[s + 1]; j++) {
+            const uint32_t i = polygon->slabEdges[j];
+            ZDEdgeDistanceSqr(latFixedPoint, lonFixedPoint, lat[i - 1], lon[i - 1], lat[i], lon[i], distanceSqrMin);
+        }
+    }
 
-        prevQuadrant = quadrant;
-        prevLat = pointLat;
-        prevLon = pointLon;
-        first = 0;
-    };
+    for(s = slab; s-- > 0;) {
+        const int64_t diffLat = (int64_t)latFixedPoint - (ZDSlabMinLat(polygon, s + 1) - 1);
+        if((uint64_t)(diffLat * diffLat) >= *distanceSqrMin) break;
+        for(j = polygon->slabStart[s]; j < polygon->slabStart[s + 1]; j++) {
+            const uint32_t i = polygon->slabEdges[j];
+            ZDEdgeDistanceSqr(latFixedPoint, lonFixedPoint, lat[i - 1], lon[i - 1], lat[i], lon[i], distanceSqrMin);
+        }
+    }
+}
 
-    if(winding == -4) {
-        return ZD_LOOKUP_IN_ZONE;
-    } else if(winding == 4) {
-        return ZD_LOOKUP_IN_EXCLUDED_ZONE;
-    } else if(winding == 0) {
+static ZDLookupResult ZDPointInDecodedPolygon(const ZoneDetect *library, const struct ZDDecodedPolygon *polygon, int32_t latFixedPoint, int32_t lonFixedPoint, uint64_t *distanceSqrMin)
+{
+    const int32_t *const lat = polygon->lat;
+    const int32_t *const lon = polygon->lon;
+    int winding = 0;
+    uint32_t i;
+
+    if(!polygon->numPoints) {
         return ZD_LOOKUP_NOT_IN_ZONE;
     }
 
-    /* Should not happen */
-    if(distanceSqrMin) *distanceSqrMin = 0;
-    return ZD_LOOKUP_ON_BORDER_SEGMENT;
+    /* Check if point is ON the border */
+    if(lat[0] == latFixedPoint && lon[0] == lonFixedPoint) {
+        if(distanceSqrMin) *distanceSqrMin = 0;
+        return ZD_LOOKUP_ON_BORDER_VERTEX;
+    }
+
+    if(!polygon->numSlabs || (distanceSqrMin && (latFixedPoint < polygon->minLat || latFixedPoint > polygon->maxLat))) {
+        /* Visit every edge, the vector kernels do not compute distances */
+        const ZDLookupResult edgeResult = distanceSqrMin ? ZDWindingEdges(polygon, latFixedPoint, lonFixedPoint, 1, polygon->numPoints, &winding, distanceSqrMin)
+                                          : ZDWindingKernel(library, polygon, latFixedPoint, lonFixedPoint, &winding);
+        if(edgeResult != ZD_LOOKUP_IGNORE) {
+            return edgeResult;
+        }
+        return ZDWindingToResult(winding, distanceSqrMin);
+    }
+
+    if(latFixedPoint < polygon->minLat || latFixedPoint > polygon->maxLat) {
+        return ZD_LOOKUP_NOT_IN_ZONE;
+    }
+
+    /*
+     * Only edges whose latitude span contains the point can cross the horizontal line through it or touch
+     * the point. The winding number is the number of crossings on the right side (quadrant 0 and 3) of the
+     * point, going up counts +1 and going down -1. This is four times less than the quadrant count but
+     * gives the same result, as the quadrant count of a closed polygon is always a multiple of four.
+     */
+    const uint32_t slab = ZDSlabIndex(polygon, latFixedPoint);
+    uint32_t j;
+    for(j = polygon->slabStart[slab]; j < polygon->slabStart[slab + 1]; j++) {
+        i = polygon->slabEdges[j];
+        const int32_t prevLat = lat[i - 1], pointLat = lat[i];
+
+        if((prevLat < latFixedPoint && pointLat < latFixedPoint) || (prevLat > latFixedPoint && pointLat > latFixedPoint)) {
+            continue;
+        }
+
+        if(pointLat == latFixedPoint && lon[i] == lonFixedPoint) {
+            if(distanceSqrMin) *distanceSqrMin = 0;
+            return ZD_LOOKUP_ON_BORDER_VERTEX;
+        }
+
+        const int prevQuadrant = ZDQuadrant(prevLat, lon[i - 1], latFixedPoint, lonFixedPoint);
+        const int quadrant = ZDQuadrant(pointLat, lon[i], latFixedPoint, lonFixedPoint);
+        int delta = 0;
+        const ZDLookupResult edgeResult = ZDWindingEdge(latFixedPoint, lonFixedPoint, prevLat, lon[i - 1], prevQuadrant, pointLat, lon[i], quadrant, &delta, NULL);
+        if(edgeResult != ZD_LOOKUP_IGNORE) {
+            if(distanceSqrMin) *distanceSqrMin = 0;
+            return edgeResult;
+        }
+
+        /* A positive quadrant change going up and a negative one going down pass the right side */
+        if(quadrant <= 1 && prevQuadrant >= 2) {
+            winding += (delta > 0) ? 4 : 0;
+        } else if(quadrant >= 2 && prevQuadrant <= 1) {
+            winding -= (delta < 0) ? 4 : 0;
+        }
+    }
+
+    const ZDLookupResult result = ZDWindingToResult(winding, distanceSqrMin);
+    if(distanceSqrMin && *distanceSqrMin) {
+        ZDSlabDistanceSqr(polygon, latFixedPoint, lonFixedPoint, slab, distanceSqrMin);
+    }
+    return result;
 }
 
-void ZDCloseDatabase(ZoneDetect *library)
+static const struct ZDDecodedPolygon *ZDFindDecodedPolygon(const ZoneDetect *library, uint32_t polygonIndex)
 {
-    if(library) {
-        if(library->fieldNames) {
-            size_t i;
-            for(i = 0; i < (size_t)library->numFields; i++) {
-                if(library->fieldNames[i]) {
-                    free(library->fieldNames[i]);
-                }
-            }
-            free(library->fieldNames);
-        }
-        if(library->notice) {
-            free(library->notice);
+    uint32_t low = 0, high = library->numDecodedPolygons;
+
+    while(low < high) {
+        const uint32_t middle = low + (high - low) / 2;
+        const uint32_t middleIndex = library->decodedPolygons[middle].polygonIndex;
+        if(middleIndex == polygonIndex) {
+            return &library->decodedPolygons[middle];
+        } else if(middleIndex < polygonIndex) {
+            low = middle + 1;
+        } else {
+            high = middle;
         }
+    }
 
-        if(library->closeType == 0) {
+    return NULL;
+}
+
+static int ZDMutexInit(ZDMutex *mutex)
+{
 #if defined(_MSC_VER) || defined(__MINGW32__)
-            if(library->mapping && !UnmapViewOfFile(library->mapping)) zdError(ZD_E_DB_MUNMAP_MSVIEW, (int)GetLastError());
-            if(library->fdMap && !CloseHandle(library->fdMap))         zdError(ZD_E_DB_MUNMAP, (int)GetLastError());
-            if(library->fd && !CloseHandle(library->fd))               zdError(ZD_E_DB_CLOSE, (int)GetLastError());
+    InitializeCriticalSection(mutex);
+    return 0;
 #elif defined(__APPLE__) || defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)
-            if(library->mapping && munmap(library->mapping, (size_t)(library->length))) zdError(ZD_E_DB_MUNMAP, 0);
-            if(library->fd >= 0 && close(library->fd))                                  zdError(ZD_E_DB_CLOSE, 0);
+    return pthread_mutex_init(mutex, NULL);
+#else
+    (void)mutex;
+    return 0;
 #endif
-        }
+}
 
-        free(library);
+static void ZDMutexDestroy(ZDMutex *mutex)
+{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    DeleteCriticalSection(mutex);
+#elif defined(__APPLE__) || defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)
+    pthread_mutex_destroy(mutex);
+#else
+    (void)mutex;
+#endif
+}
+
+static void ZDMutexLock(ZDMutex *mutex)
+{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    EnterCriticalSection(mutex);
+#elif defined(__APPLE__) || defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)
+    pthread_mutex_lock(mutex);
+#else
+    (void)mutex;
+#endif
+}
+
+static void ZDMutexUnlock(ZDMutex *mutex)
+{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    LeaveCriticalSection(mutex);
+#elif defined(__APPLE__) || defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)
+    pthread_mutex_unlock(mutex);
+#else
+    (void)mutex;
+#endif
+}
+
+/* Sequentially consistent atomics for the lock-free readers of ZoneDetectOverlay */
+static uint64_t ZDAtomicLoad(const volatile uint64_t *value)
+{
+#if defined(_MSC_VER)
+    return (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(uintptr_t)value, 0, 0);
+#elif defined(__GNUC__)
+    return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+#else
+    return *value;
+#endif
+}
+
+static void ZDAtomicStore(volatile uint64_t *value, uint64_t newValue)
+{
+#if defined(_MSC_VER)
+    InterlockedExchange64((volatile LONG64 *)value, (LONG64)newValue);
+#elif defined(__GNUC__)
+    __atomic_store_n(value, newValue, __ATOMIC_SEQ_CST);
+#else
+    *value = newValue;
+#endif
+}
+
+/* Returns the value before the increment */
+static uint64_t ZDAtomicIncrement(volatile uint64_t *value)
+{
+#if defined(_MSC_VER)
+    return (uint64_t)InterlockedIncrement64((volatile LONG64 *)value) - 1;
+#elif defined(__GNUC__)
+    return __atomic_fetch_add(value, 1, __ATOMIC_SEQ_CST);
+#else
+    return (*value)++;
+#endif
+}
+
+static void ZDAtomicDecrement(volatile uint64_t *value)
+{
+#if defined(_MSC_VER)
+    InterlockedDecrement64((volatile LONG64 *)value);
+#elif defined(__GNUC__)
+    __atomic_fetch_sub(value, 1, __ATOMIC_SEQ_CST);
+#else
+    (*value)--;
+#endif
+}
+
+static int ZDAtomicCompareExchange(volatile uint64_t *value, uint64_t expected, uint64_t newValue)
+{
+#if defined(_MSC_VER)
+    return (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)value, (LONG64)newValue, (LONG64)expected) == expected;
+#elif defined(__GNUC__)
+    return __atomic_compare_exchange_n(value, &expected, newValue, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#else
+    if(*value != expected) {
+        return 0;
+    }
+    *value = newValue;
+    return 1;
+#endif
+}
+
+static void *ZDAtomicLoadPointer(void *volatile *pointer)
+{
+#if defined(_MSC_VER)
+    return InterlockedCompareExchangePointer(pointer, NULL, NULL);
+#elif defined(__GNUC__)
+    return __atomic_load_n(pointer, __ATOMIC_SEQ_CST);
+#else
+    return *pointer;
+#endif
+}
+
+static void *ZDAtomicExchangePointer(void *volatile *pointer, void *newPointer)
+{
+#if defined(_MSC_VER)
+    return InterlockedExchangePointer(pointer, newPointer);
+#elif defined(__GNUC__)
+    return __atomic_exchange_n(pointer, newPointer, __ATOMIC_SEQ_CST);
+#else
+    void *const oldPointer = *pointer;
+    *pointer = newPointer;
+    return oldPointer;
+#endif
+}
+
+static uint32_t ZDCacheBucket(const struct ZDPolygonCache *cache, uint32_t polygonIndex)
+{
+    return (polygonIndex * 2654435761u) & (cache->numBuckets - 1);
+}
+
+static struct ZDCacheEntry *ZDCacheFind(const struct ZDPolygonCache *cache, uint32_t polygonIndex)
+{
+    struct ZDCacheEntry *entry = cache->buckets[ZDCacheBucket(cache, polygonIndex)];
+    while(entry && entry->polygon.polygonIndex != polygonIndex) {
+        entry = entry->hashNext;
     }
+    return entry;
+}
+
+static void ZDCacheLruUnlink(struct ZDPolygonCache *cache, struct ZDCacheEntry *entry)
+{
+    if(entry->lruPrev) entry->lruPrev->lruNext = entry->lruNext;
+    else cache->lruHead = entry->lruNext;
+    if(entry->lruNext) entry->lruNext->lruPrev = entry->lruPrev;
+    else cache->lruTail = entry->lruPrev;
+}
+
+static void ZDCacheLruPushFront(struct ZDPolygonCache *cache, struct ZDCacheEntry *entry)
+{
+    entry->lruPrev = NULL;
+    entry->lruNext = cache->lruHead;
+    if(cache->lruHead) cache->lruHead->lruPrev = entry;
+    else cache->lruTail = entry;
+    cache->lruHead = entry;
+}
+
+static void ZDCacheRemove(struct ZDPolygonCache *cache, struct ZDCacheEntry *entry)
+{
+    struct ZDCacheEntry **link = &cache->buckets[ZDCacheBucket(cache, entry->polygon.polygonIndex)];
+    while(*link != entry) {
+        link = &(*link)->hashNext;
+    }
+    *link = entry->hashNext;
+
+    ZDCacheLruUnlink(cache, entry);
+    cache->memory -= entry->size;
+    cache->numEntries--;
+}
+
+static void ZDCacheGrow(struct ZDPolygonCache *cache)
+{
+    const uint32_t numBuckets = cache->numBuckets * 2;
+    struct ZDCacheEntry **const buckets = calloc(numBuckets, sizeof *buckets);
+    if(!buckets) {
+        /* Longer chains, but still correct */
+        return;
+    }
+
+    struct ZDCacheEntry *entry;
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->numBuckets = numBuckets;
+    for(entry = cache->lruHead; entry; entry = entry->lruNext) {
+        const uint32_t bucket = ZDCacheBucket(cache, entry->polygon.polygonIndex);
+        entry->hashNext = buckets[bucket];
+        buckets[bucket] = entry;
+    }
+}
+
+static struct ZDCacheEntry *ZDCacheDecode(const ZoneDetect *library, uint32_t polygonIndex)
+{
+    size_t length = 0;
+    int32_t *const list = ZDPolygonToListInternal(library, polygonIndex, &length);
+    if(!list) {
+        return NULL;
+    }
+
+    const uint32_t numPoints = (uint32_t)(length / 2);
+    const size_t size = sizeof(struct ZDCacheEntry) + 2 * (size_t)numPoints * sizeof(int32_t);
+    struct ZDCacheEntry *const entry = malloc(size);
+    if(!entry) {
+        free(list);
+        return NULL;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    entry->size = size;
+    entry->refCount = 1;
+    entry->polygon.polygonIndex = polygonIndex;
+    entry->polygon.numPoints = numPoints;
+    entry->polygon.lat = (int32_t *)(entry + 1);
+    entry->polygon.lon = entry->polygon.lat + numPoints;
+
+    uint32_t i;
+    for(i = 0; i < numPoints; i++) {
+        entry->polygon.lat[i] = list[2 * i];
+        entry->polygon.lon[i] = list[2 * i + 1];
+    }
+    free(list);
+
+    return entry;
+}
+
+/*
+ * Returns the decoded polygon with a reference held, which must be dropped with ZDCacheRelease.
+ * Decoding happens without holding the lock, so two threads may decode the same polygon, the
+ * second one then drops its copy.
+ */
+static struct ZDCacheEntry *ZDCacheAcquire(const ZoneDetect *library, uint32_t polygonIndex)
+{
+    struct ZDPolygonCache *const cache = library->cache;
+    struct ZDCacheEntry *entry;
+
+    ZDMutexLock(&cache->mutex);
+    entry = ZDCacheFind(cache, polygonIndex);
+    if(entry) {
+        entry->refCount++;
+        ZDCacheLruUnlink(cache, entry);
+        ZDCacheLruPushFront(cache, entry);
+        cache->hits++;
+        ZDMutexUnlock(&cache->mutex);
+        return entry;
+    }
+    cache->misses++;
+    ZDMutexUnlock(&cache->mutex);
+
+    struct ZDCacheEntry *const decoded = ZDCacheDecode(library, polygonIndex);
+    if(!decoded) {
+        return NULL;
+    }
+
+    ZDMutexLock(&cache->mutex);
+    entry = ZDCacheFind(cache, polygonIndex);
+    if(entry) {
+        entry->refCount++;
+        ZDMutexUnlock(&cache->mutex);
+        free(decoded);
+        return entry;
+    }
+
+    /* Evict the least recently used entries that are not in use */
+    struct ZDCacheEntry *victim = cache->lruTail;
+    while(victim && cache->memory + decoded->size > cache->maxMemory) {
+        struct ZDCacheEntry *const prev = victim->lruPrev;
+        if(!victim->refCount) {
+            ZDCacheRemove(cache, victim);
+            free(victim);
+            cache->evictions++;
+        }
+        victim = prev;
+    }
+
+    /* If it does not fit, the caller gets a private copy that is freed on release */
+    if(cache->memory + decoded->size <= cache->maxMemory) {
+        if(cache->numEntries >= cache->numBuckets) {
+            ZDCacheGrow(cache);
+        }
+
+        const uint32_t bucket = ZDCacheBucket(cache, polygonIndex);
+        decoded->cached = 1;
+        decoded->hashNext = cache->buckets[bucket];
+        cache->buckets[bucket] = decoded;
+        ZDCacheLruPushFront(cache, decoded);
+        cache->memory += decoded->size;
+        cache->numEntries++;
+    }
+    ZDMutexUnlock(&cache->mutex);
+
+    return decoded;
+}
+
+static void ZDCacheRelease(const ZoneDetect *library, struct ZDCacheEntry *entry)
+{
+    if(!entry->cached) {
+        free(entry);
+        return;
+    }
+
+    ZDMutexLock(&library->cache->mutex);
+    entry->refCount--;
+    ZDMutexUnlock(&library->cache->mutex);
+}
+
+static int ZDCreateCache(ZoneDetect *library, const ZoneDetectOptions *options)
+{
+    struct ZDPolygonCache *const cache = calloc(1, sizeof *cache);
+    if(!cache) {
+        return -1;
+    }
+
+    cache->maxMemory = options->cacheMaxMemory ? options->cacheMaxMemory : ZD_CACHE_DEFAULT_MAX_MEMORY;
+    cache->numBuckets = ZD_CACHE_MIN_BUCKETS;
+    cache->buckets = calloc(cache->numBuckets, sizeof *cache->buckets);
+    if(!cache->buckets) {
+        free(cache);
+        return -1;
+    }
+
+    if(ZDMutexInit(&cache->mutex)) {
+        free(cache->buckets);
+        free(cache);
+        return -1;
+    }
+
+    library->cache = cache;
+    return 0;
+}
+
+static void ZDFreeCache(struct ZDPolygonCache *cache)
+{
+    struct ZDCacheEntry *entry = cache->lruHead;
+    while(entry) {
+        struct ZDCacheEntry *const next = entry->lruNext;
+        free(entry);
+        entry = next;
+    }
+
+    ZDMutexDestroy(&cache->mutex);
+    free(cache->buckets);
+    free(cache);
+}
+
+int ZDGetCacheStats(const ZoneDetect *library, ZoneDetectCacheStats *stats)
+{
+    struct ZDPolygonCache *const cache = library->cache;
+    if(!cache) {
+        return -1;
+    }
+
+    ZDMutexLock(&cache->mutex);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->memory = cache->memory;
+    stats->numEntries = cache->numEntries;
+    ZDMutexUnlock(&cache->mutex);
+
+    return 0;
+}
+
+static ZDLookupResult ZDPointInPolygon(const ZoneDetect *library, uint32_t polygonIndex, int32_t latFixedPoint, int32_t lonFixedPoint, uint64_t *distanceSqrMin)
+{
+    int32_t pointLat, pointLon, prevLat = 0, prevLon = 0;
+    int prevQuadrant = 0, winding = 0;
+
+    uint8_t first = 1;
+
+    if(library->numDecodedPolygons) {
+        const struct ZDDecodedPolygon *const polygon = ZDFindDecodedPolygon(library, polygonIndex);
+        if(polygon) {
+            return ZDPointInDecodedPolygon(library, polygon, latFixedPoint, lonFixedPoint, distanceSqrMin);
+        }
+    }
+
+    if(library->cache) {
+        struct ZDCacheEntry *const entry = ZDCacheAcquire(library, polygonIndex);
+        if(entry) {
+            const ZDLookupResult result = ZDPointInDecodedPolygon(library, &entry->polygon, latFixedPoint, lonFixedPoint, distanceSqrMin);
+            ZDCacheRelease(library, entry);
+            return result;
+        }
+        /* Fall through, the reader reports the parse error */
+    }
+
+    struct Reader reader;
+    ZDReaderInit(&reader, library, polygonIndex);
+
+    while(1) {
+        int result = ZDReaderGetPoint(&reader, &pointLat, &pointLon);
+        if(result < 0) {
+            return ZD_LOOKUP_PARSE_ERROR;
+        } else if(result == 0) {
+            break;
+        }
+
+        /* Check if point is ON the border */
+        if(pointLat == latFixedPoint && pointLon == lonFixedPoint) {
+            if(distanceSqrMin) *distanceSqrMin = 0;
+            return ZD_LOOKUP_ON_BORDER_VERTEX;
+        }
+
+        const int quadrant = ZDQuadrant(pointLat, pointLon, latFixedPoint, lonFixedPoint);
+
+        if(!first) {
+            const ZDLookupResult edgeResult = ZDWindingEdge(latFixedPoint, lonFixedPoint, prevLat, prevLon, prevQuadrant, pointLat, pointLon, quadrant, &winding, distanceSqrMin);
+            if(edgeResult != ZD_LOOKUP_IGNORE) {
+                return edgeResult;
+            }
+        }
+
+        prevQuadrant = quadrant;
+        prevLat = pointLat;
+        prevLon = pointLon;
+        first = 0;
+    };
+
+    return ZDWindingToResult(winding, distanceSqrMin);
+}
+
+static uint32_t ZDSlabIndexRange(int32_t minLat, int32_t maxLat, uint32_t numSlabs, int32_t latFixedPoint)
+{
+    return (uint32_t)(((int64_t)latFixedPoint - minLat) * numSlabs / ((int64_t)maxLat - minLat + 1));
+}
+
+static int ZDBuildSlabs(struct ZDDecodedPolygon *polygon)
+{
+    const uint32_t numEdges = polygon->numPoints - 1;
+    uint32_t numSlabs = numEdges / ZD_SLAB_EDGES;
+    uint32_t i;
+
+    polygon->minLat = INT32_MAX;
+    polygon->maxLat = INT32_MIN;
+    for(i = 0; i < polygon->numPoints; i++) {
+        if(polygon->lat[i] < polygon->minLat) polygon->minLat = polygon->lat[i];
+        if(polygon->lat[i] > polygon->maxLat) polygon->maxLat = polygon->lat[i];
+    }
+
+    if((int64_t)numSlabs > (int64_t)polygon->maxLat - polygon->minLat + 1) {
+        numSlabs = (uint32_t)((int64_t)polygon->maxLat - polygon->minLat + 1);
+    }
+
+    /* Long edges are stored in every slab they cross, use fewer slabs if that costs too much memory */
+    uint64_t numEntries = 0;
+    while(numSlabs > 1) {
+        numEntries = 0;
+        for(i = 1; i < polygon->numPoints; i++) {
+            const int32_t low = polygon->lat[i - 1] < polygon->lat[i] ? polygon->lat[i - 1] : polygon->lat[i];
+            const int32_t high = polygon->lat[i - 1] < polygon->lat[i] ? polygon->lat[i] : polygon->lat[i - 1];
+            numEntries += ZDSlabIndexRange(polygon->minLat, polygon->maxLat, numSlabs, high) - ZDSlabIndexRange(polygon->minLat, polygon->maxLat, numSlabs, low) + 1;
+        }
+        if(numEntries <= (uint64_t)ZD_SLAB_MAX_COPIES * numEdges) {
+            break;
+        }
+        numSlabs /= 2;
+    }
+
+    if(numSlabs <= 1) {
+        /* Not worth it, the full scan will be used */
+        return 0;
+    }
+
+    polygon->slabStart = calloc((size_t)numSlabs + 1, sizeof *polygon->slabStart);
+    polygon->slabEdges = malloc((size_t)numEntries * sizeof *polygon->slabEdges);
+    if(!polygon->slabStart || !polygon->slabEdges) {
+        return -1;
+    }
+    polygon->numSlabs = numSlabs;
+
+    /* Same approach as the grid: count, prefix sum, fill in edge order and shift back */
+    uint32_t slab;
+    for(i = 1; i < polygon->numPoints; i++) {
+        const int32_t low = polygon->lat[i - 1] < polygon->lat[i] ? polygon->lat[i - 1] : polygon->lat[i];
+        const int32_t high = polygon->lat[i - 1] < polygon->lat[i] ? polygon->lat[i] : polygon->lat[i - 1];
+        const uint32_t slabEnd = ZDSlabIndex(polygon, high);
+        for(slab = ZDSlabIndex(polygon, low); slab <= slabEnd; slab++) {
+            polygon->slabStart[slab + 1]++;
+        }
+    }
+    for(slab = 0; slab < numSlabs; slab++) {
+        polygon->slabStart[slab + 1] += polygon->slabStart[slab];
+    }
+    for(i = 1; i < polygon->numPoints; i++) {
+        const int32_t low = polygon->lat[i - 1] < polygon->lat[i] ? polygon->lat[i - 1] : polygon->lat[i];
+        const int32_t high = polygon->lat[i - 1] < polygon->lat[i] ? polygon->lat[i] : polygon->lat[i - 1];
+        const uint32_t slabEnd = ZDSlabIndex(polygon, high);
+        for(slab = ZDSlabIndex(polygon, low); slab <= slabEnd; slab++) {
+            polygon->slabEdges[polygon->slabStart[slab]++] = i;
+        }
+    }
+    for(slab = numSlabs; slab > 0; slab--) {
+        polygon->slabStart[slab] = polygon->slabStart[slab - 1];
+    }
+    polygon->slabStart[0] = 0;
+
+    return 0;
+}
+
+static int ZDCompareDecodedPolygons(const void *a, const void *b)
+{
+    const uint32_t indexA = ((const struct ZDDecodedPolygon *)a)->polygonIndex;
+    const uint32_t indexB = ((const struct ZDDecodedPolygon *)b)->polygonIndex;
+    return (indexA > indexB) - (indexA < indexB);
+}
+
+/*
+ * Decode all polygons with at least minVertices points. Polygons with at least slabMinVertices points
+ * also get a slab index.
+ */
+static int ZDDecodePolygons(ZoneDetect *library, uint32_t minVertices, uint32_t slabMinVertices)
+{
+    const struct ZDPolygonTable *const table = &library->table;
+    uint32_t capacity = 0;
+    uint32_t i;
+
+    for(i = 0; i < table->count; i++) {
+        size_t length = 0;
+        int32_t *const list = ZDPolygonToListInternal(library, table->polygonIndex[i], &length);
+        if(!list) {
+            /* This polygon will give a parse error during lookups */
+            continue;
+        }
+
+        if(length / 2 < (size_t)minVertices) {
+            free(list);
+            continue;
+        }
+
+        if(library->numDecodedPolygons >= capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            struct ZDDecodedPolygon *const newPolygons = realloc(library->decodedPolygons, capacity * sizeof *newPolygons);
+            if(!newPolygons) {
+                free(list);
+                return -1;
+            }
+            library->decodedPolygons = newPolygons;
+        }
+
+        struct ZDDecodedPolygon *const polygon = &library->decodedPolygons[library->numDecodedPolygons];
+        memset(polygon, 0, sizeof(*polygon));
+        library->numDecodedPolygons++;
+
+        polygon->polygonIndex = table->polygonIndex[i];
+        polygon->numPoints = (uint32_t)(length / 2);
+        polygon->lat = malloc(2 * polygon->numPoints * sizeof *polygon->lat);
+        if(!polygon->lat) {
+            free(list);
+            return -1;
+        }
+        polygon->lon = polygon->lat + polygon->numPoints;
+
+        uint32_t j;
+        for(j = 0; j < polygon->numPoints; j++) {
+            polygon->lat[j] = list[2 * j];
+            polygon->lon[j] = list[2 * j + 1];
+        }
+        free(list);
+
+        if(polygon->numPoints >= slabMinVertices && ZDBuildSlabs(polygon)) {
+            return -1;
+        }
+    }
+
+    if(library->numDecodedPolygons) {
+        qsort(library->decodedPolygons, library->numDecodedPolygons, sizeof *library->decodedPolygons, ZDCompareDecodedPolygons);
+    }
+
+    return 0;
+}
+
+static uint32_t ZDDecodePolygonTableEntries(const ZoneDetect *library, struct ZDPolygonTable *table)
+{
+    uint32_t bboxIndex = library->bboxOffset;
+    struct ZDBBoxEntry entry = {0};
+    uint32_t count = 0;
+
+    while(ZDDecodeBBoxEntry(library, &bboxIndex, &entry)) {
+        if(table) {
+            table->minLat[count] = entry.minLat;
+            table->minLon[count] = entry.minLon;
+            table->maxLat[count] = entry.maxLat;
+            table->maxLon[count] = entry.maxLon;
+            table->metadataIndex[count] = entry.metadataIndex;
+            table->polygonIndex[count] = library->dataOffset + entry.polygonIndex;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+static int ZDDecodePolygonTable(ZoneDetect *library)
+{
+    struct ZDPolygonTable *const table = &library->table;
+
+    if(table->memory) {
+        return 0;
+    }
+
+    /* The first pass only counts the entries */
+    table->count = ZDDecodePolygonTableEntries(library, NULL);
+    table->paddedCount = (table->count + ZD_TABLE_PADDING - 1) / ZD_TABLE_PADDING * ZD_TABLE_PADDING;
+
+    const size_t arraySize = ((size_t)table->paddedCount * sizeof(uint32_t) + ZD_CACHE_LINE_SIZE - 1) / ZD_CACHE_LINE_SIZE * ZD_CACHE_LINE_SIZE;
+    table->memory = malloc(6 * arraySize + ZD_CACHE_LINE_SIZE);
+    if(!table->memory) {
+        return -1;
+    }
+
+    uint8_t *const aligned = (uint8_t *)(((uintptr_t)table->memory + ZD_CACHE_LINE_SIZE - 1) & ~(uintptr_t)(ZD_CACHE_LINE_SIZE - 1));
+    table->minLat = (int32_t *)(void *)(aligned);
+    table->minLon = (int32_t *)(void *)(aligned + arraySize);
+    table->maxLat = (int32_t *)(void *)(aligned + 2 * arraySize);
+    table->maxLon = (int32_t *)(void *)(aligned + 3 * arraySize);
+    table->metadataIndex = (uint32_t *)(void *)(aligned + 4 * arraySize);
+    table->polygonIndex = (uint32_t *)(void *)(aligned + 5 * arraySize);
+
+    ZDDecodePolygonTableEntries(library, table);
+
+    uint32_t i;
+    for(i = table->count; i < table->paddedCount; i++) {
+        table->minLat[i] = table->minLon[i] = INT32_MAX;
+        table->maxLat[i] = table->maxLon[i] = INT32_MIN;
+        table->metadataIndex[i] = table->polygonIndex[i] = 0;
+    }
+
+    table->sorted = 1;
+    for(i = 1; i < table->count; i++) {
+        if(table->minLat[i] < table->minLat[i - 1]) {
+            table->sorted = 0;
+        }
+    }
+
+    table->simdLevel = library->simdLevel;
+
+    return 0;
+}
+
+/* Number of leading table entries that the linear scan visits: it stops at the first box with minLat above the point */
+static uint32_t ZDPolygonTableEnd(const struct ZDPolygonTable *table, int32_t latFixedPoint)
+{
+    uint32_t low = 0, high = table->count;
+
+    if(!table->sorted) {
+        while(low < high && table->minLat[low] <= latFixedPoint) {
+            low++;
+        }
+        return low;
+    }
+
+    while(low < high) {
+        const uint32_t middle = low + (high - low) / 2;
+        if(table->minLat[middle] <= latFixedPoint) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+#if defined(ZD_SIMD_AVX2_DISPATCH)
+__attribute__((target("avx2")))
+static uint32_t ZDPolygonTableFilterAVX2(const struct ZDPolygonTable *table, int32_t latFixedPoint, int32_t lonFixedPoint, uint32_t start, uint32_t end, uint32_t *candidates)
+{
+    const __m256i lat = _mm256_set1_epi32(latFixedPoint);
+    const __m256i lon = _mm256_set1_epi32(lonFixedPoint);
+    uint32_t numCandidates = 0;
+    uint32_t i;
+
+    for(i = start; i < end; i += 8) {
+        const __m256i outside = _mm256_or_si256(
+                                    _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_load_si256((const __m256i *)(const void *)(table->minLat + i)), lat),
+                                            _mm256_cmpgt_epi32(lat, _mm256_load_si256((const __m256i *)(const void *)(table->maxLat + i)))),
+                                    _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_load_si256((const __m256i *)(const void *)(table->minLon + i)), lon),
+                                            _mm256_cmpgt_epi32(lon, _mm256_load_si256((const __m256i *)(const void *)(table->maxLon + i)))));
+        unsigned int mask = ~(unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & 0xFFu;
+        while(mask) {
+            const unsigned int bit = (unsigned int)__builtin_ctz(mask);
+            candidates[numCandidates++] = i + bit;
+            mask &= mask - 1;
+        }
+    }
+
+    return numCandidates;
+}
+#endif
+
+/*
+ * Store the ids of the polygons in [start, end) whose bounding box contains the point.
+ * start must be a multiple of ZD_TABLE_PADDING, the padding entries never match.
+ */
+static uint32_t ZDPolygonTableFilter(const struct ZDPolygonTable *table, int32_t latFixedPoint, int32_t lonFixedPoint, uint32_t start, uint32_t end, uint32_t *candidates)
+{
+    uint32_t numCandidates = 0;
+    uint32_t i;
+
+    end = (end + ZD_TABLE_PADDING - 1) / ZD_TABLE_PADDING * ZD_TABLE_PADDING;
+
+#if defined(ZD_SIMD_AVX2_DISPATCH)
+    if(table->simdLevel == ZD_SIMD_AVX2) {
+        return ZDPolygonTableFilterAVX2(table, latFixedPoint, lonFixedPoint, start, end, candidates);
+    }
+#endif
+
+#if defined(ZD_SIMD_X86)
+    if(table->simdLevel == ZD_SIMD_SSE2) {
+        const __m128i lat = _mm_set1_epi32(latFixedPoint);
+        const __m128i lon = _mm_set1_epi32(lonFixedPoint);
+
+        for(i = start; i < end; i += 4) {
+            const __m128i outside = _mm_or_si128(
+                                        _mm_or_si128(_mm_cmpgt_epi32(_mm_load_si128((const __m128i *)(const void *)(table->minLat + i)), lat),
+                                                _mm_cmpgt_epi32(lat, _mm_load_si128((const __m128i *)(const void *)(table->maxLat + i)))),
+                                        _mm_or_si128(_mm_cmpgt_epi32(_mm_load_si128((const __m128i *)(const void *)(table->minLon + i)), lon),
+                                                _mm_cmpgt_epi32(lon, _mm_load_si128((const __m128i *)(const void *)(table->maxLon + i)))));
+            const unsigned int mask = ~(unsigned int)_mm_movemask_ps(_mm_castsi128_ps(outside)) & 0xFu;
+            unsigned int bit;
+            for(bit = 0; bit < 4; bit++) {
+                if(mask & (1u << bit)) {
+                    candidates[numCandidates++] = i + bit;
+                }
+            }
+        }
+        return numCandidates;
+    }
+#endif
+
+    for(i = start; i < end; i++) {
+        if(latFixedPoint >= table->minLat[i] && latFixedPoint <= table->maxLat[i] &&
+                lonFixedPoint >= table->minLon[i] && lonFixedPoint <= table->maxLon[i]) {
+            candidates[numCandidates++] = i;
+        }
+    }
+
+    return numCandidates;
+}
+
+static uint32_t ZDGridCoordinate(int32_t value, uint32_t cells, unsigned int precision)
+{
+    /* Both lat and lon are scaled to [-2^(precision-1), 2^(precision-1)] */
+    int64_t cell = (((int64_t)value + ((int64_t)1 << (precision - 1))) * (int64_t)cells) >> precision;
+    if(cell < 0) {
+        cell = 0;
+    } else if(cell >= (int64_t)cells) {
+        cell = (int64_t)cells - 1;
+    }
+    return (uint32_t)cell;
+}
+
+static uint32_t ZDGridCell(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint)
+{
+    const uint32_t latCell = ZDGridCoordinate(latFixedPoint, library->grid.latCells, library->precision);
+    const uint32_t lonCell = ZDGridCoordinate(lonFixedPoint, library->grid.lonCells, library->precision);
+    return latCell * library->grid.lonCells + lonCell;
+}
+
+static int ZDGridContains(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint)
+{
+    const int64_t limit = (int64_t)1 << (library->precision - 1);
+    return latFixedPoint >= -limit && latFixedPoint <= limit && lonFixedPoint >= -limit && lonFixedPoint <= limit;
+}
+
+static int32_t ZDGridCellCenter(uint32_t cell, uint32_t cells, unsigned int precision)
+{
+    return (int32_t)((((2 * (int64_t)cell + 1) << precision) / (2 * (int64_t)cells)) - ((int64_t)1 << (precision - 1)));
+}
+
+/* Smallest coordinate that ZDGridCoordinate maps to the cell */
+static int64_t ZDGridCellMin(uint32_t cell, uint32_t cells, unsigned int precision)
+{
+    return ((((int64_t)cell << precision) + cells - 1) / cells) - ((int64_t)1 << (precision - 1));
+}
+
+/*
+ * Squared distance from the point to the sides of its cell. No edge passes through a classified cell,
+ * so for those it is a lower bound of the distance to the border.
+ */
+static uint64_t ZDGridCellDistanceSqr(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint)
+{
+    const uint32_t latCell = ZDGridCoordinate(latFixedPoint, library->grid.latCells, library->precision);
+    const uint32_t lonCell = ZDGridCoordinate(lonFixedPoint, library->grid.lonCells, library->precision);
+    const int64_t latLow = latFixedPoint - ZDGridCellMin(latCell, library->grid.latCells, library->precision) + 1;
+    const int64_t latHigh = ZDGridCellMin(latCell + 1, library->grid.latCells, library->precision) - latFixedPoint;
+    const int64_t lonLow = lonFixedPoint - ZDGridCellMin(lonCell, library->grid.lonCells, library->precision) + 1;
+    const int64_t lonHigh = ZDGridCellMin(lonCell + 1, library->grid.lonCells, library->precision) - lonFixedPoint;
+    const int64_t diffLat = (latLow < latHigh) ? latLow : latHigh;
+    const int64_t diffLon = (lonLow < lonHigh) ? lonLow : lonHigh;
+
+    /* Note: lon has half scale */
+    const uint64_t latDistanceSqr = (uint64_t)(diffLat * diffLat);
+    const uint64_t lonDistanceSqr = (uint64_t)(diffLon * diffLon) * 4;
+    return (latDistanceSqr < lonDistanceSqr) ? latDistanceSqr : lonDistanceSqr;
+}
+
+static uint32_t ZDResultHash(uint32_t cell)
+{
+    return cell * 2654435761u;
+}
+
+static struct ZDResultShard *ZDResultShardOf(const struct ZDResultCache *cache, uint32_t cell)
+{
+    return &cache->shards[(ZDResultHash(cell) >> 20) & (cache->numShards - 1)];
+}
+
+static struct ZDResultEntry **ZDResultBucket(struct ZDResultShard *shard, uint32_t cell)
+{
+    return &shard->buckets[ZDResultHash(cell) & (shard->numBuckets - 1)];
+}
+
+static void ZDResultLruUnlink(struct ZDResultShard *shard, struct ZDResultEntry *entry)
+{
+    if(entry->lruPrev) entry->lruPrev->lruNext = entry->lruNext;
+    else shard->lruHead = entry->lruNext;
+    if(entry->lruNext) entry->lruNext->lruPrev = entry->lruPrev;
+    else shard->lruTail = entry->lruPrev;
+}
+
+static void ZDResultLruPushFront(struct ZDResultShard *shard, struct ZDResultEntry *entry)
+{
+    entry->lruPrev = NULL;
+    entry->lruNext = shard->lruHead;
+    if(shard->lruHead) shard->lruHead->lruPrev = entry;
+    else shard->lruTail = entry;
+    shard->lruHead = entry;
+}
+
+/*
+ * Squared distance within which points get the same result, with a grid only for points of the same cell.
+ * Besides the safezone, this is limited by the bounding boxes that do not contain the point, as the
+ * safezone does not include the borders of those polygons. Without a grid or decoded table it is 0.
+ */
+static uint64_t ZDResultReuseSqr(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, uint64_t distanceSqr)
+{
+    const struct ZDPolygonTable *const table = &library->table;
+    uint32_t i;
+
+    if(library->grid.cellStart) {
+        if(!ZDGridContains(library, latFixedPoint, lonFixedPoint)) {
+            return 0;
+        }
+
+        const uint32_t cell = ZDGridCell(library, latFixedPoint, lonFixedPoint);
+        for(i = library->grid.cellStart[cell]; i < library->grid.cellStart[cell + 1]; i++) {
+            const uint32_t polygonId = library->grid.cellPolygons[i];
+            const uint64_t boxDistanceSqr = ZDBoxDistanceSqr(latFixedPoint, lonFixedPoint, table->minLat[polygonId], table->minLon[polygonId], table->maxLat[polygonId], table->maxLon[polygonId]);
+            if(boxDistanceSqr && boxDistanceSqr < distanceSqr) {
+                distanceSqr = boxDistanceSqr;
+            }
+        }
+    } else if(table->memory) {
+        for(i = 0; i < table->count; i++) {
+            const uint64_t boxDistanceSqr = ZDBoxDistanceSqr(latFixedPoint, lonFixedPoint, table->minLat[i], table->minLon[i], table->maxLat[i], table->maxLon[i]);
+            if(boxDistanceSqr && boxDistanceSqr < distanceSqr) {
+                distanceSqr = boxDistanceSqr;
+            }
+        }
+    } else {
+        return 0;
+    }
+
+    const double reuse = sqrt((double)distanceSqr) - ZD_RESULT_CACHE_MARGIN;
+    if(reuse <= 0) {
+        return 0;
+    }
+    return (uint64_t)(reuse * reuse);
+}
+
+/*
+ * Look for an entry with the same coordinates, or one of the same grid cell whose reuse distance covers
+ * the point. On a hit, *numHits is set like the return value of ZDLookupHits and 1 is returned.
+ */
+static int ZDResultCacheFind(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, float *safezone, ZoneDetectHit *hits, size_t maxHits, size_t *numHits)
+{
+    const uint32_t cell = ZDGridCell(library, latFixedPoint, lonFixedPoint);
+    struct ZDResultShard *const shard = ZDResultShardOf(library->resultCache, cell);
+    struct ZDResultEntry *entry;
+    uint64_t distanceSqr = 0;
+
+    ZDMutexLock(&shard->mutex);
+    for(entry = *ZDResultBucket(shard, cell); entry; entry = entry->hashNext) {
+        if(entry->cell != cell) {
+            continue;
+        }
+
+        const int64_t diffLat = (int64_t)latFixedPoint - entry->lat;
+        const int64_t diffLon = (int64_t)lonFixedPoint - entry->lon;
+        distanceSqr = (uint64_t)(diffLat * diffLat) + (uint64_t)(diffLon * diffLon) * 4;
+        if(!distanceSqr || distanceSqr < entry->reuseSqr) {
+            break;
+        }
+    }
+
+    if(!entry) {
+        shard->misses++;
+        ZDMutexUnlock(&shard->mutex);
+        return 0;
+    }
+
+    shard->hits++;
+    ZDResultLruUnlink(shard, entry);
+    ZDResultLruPushFront(shard, entry);
+
+    *numHits = entry->numHits;
+    if(entry->numHits <= maxHits) {
+        memcpy(hits, entry->hits, entry->numHits * sizeof *hits);
+    }
+    if(safezone) {
+        /* Moving away from the entry shrinks the safezone by at most the distance moved, plus rounding */
+        const float reduction = distanceSqr ? sqrtf((float)distanceSqr) + ZD_RESULT_CACHE_MARGIN : 0;
+        *safezone = (sqrtf((float)entry->distanceSqr) - reduction) * 90 / (float)(1 << (library->precision - 1));
+    }
+    ZDMutexUnlock(&shard->mutex);
+
+    return 1;
+}
+
+static void ZDResultCacheInsert(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, uint64_t distanceSqr, const ZoneDetectHit *hits, size_t numHits)
+{
+    if(numHits > ZD_RESULT_CACHE_MAX_HITS) {
+        return;
+    }
+
+    /* Computed before locking, it walks the polygons of the cell */
+    const uint64_t reuseSqr = ZDResultReuseSqr(library, latFixedPoint, lonFixedPoint, distanceSqr);
+    const uint32_t cell = ZDGridCell(library, latFixedPoint, lonFixedPoint);
+    struct ZDResultShard *const shard = ZDResultShardOf(library->resultCache, cell);
+    struct ZDResultEntry *entry;
+
+    ZDMutexLock(&shard->mutex);
+
+    /* Another thread may have added it in the meantime */
+    for(entry = *ZDResultBucket(shard, cell); entry; entry = entry->hashNext) {
+        if(entry->lat == latFixedPoint && entry->lon == lonFixedPoint) {
+            ZDMutexUnlock(&shard->mutex);
+            return;
+        }
+    }
+
+    if(shard->numEntries < shard->maxEntries) {
+        entry = &shard->entries[shard->numEntries++];
+    } else {
+        entry = shard->lruTail;
+        struct ZDResultEntry **link = ZDResultBucket(shard, entry->cell);
+        while(*link != entry) {
+            link = &(*link)->hashNext;
+        }
+        *link = entry->hashNext;
+        ZDResultLruUnlink(shard, entry);
+        shard->evictions++;
+    }
+
+    entry->lat = latFixedPoint;
+    entry->lon = lonFixedPoint;
+    entry->cell = cell;
+    entry->numHits = (uint32_t)numHits;
+    entry->distanceSqr = distanceSqr;
+    entry->reuseSqr = reuseSqr;
+    memcpy(entry->hits, hits, numHits * sizeof *hits);
+
+    struct ZDResultEntry **const bucket = ZDResultBucket(shard, cell);
+    entry->hashNext = *bucket;
+    *bucket = entry;
+    ZDResultLruPushFront(shard, entry);
+
+    ZDMutexUnlock(&shard->mutex);
+}
+
+static void ZDFreeResultCache(struct ZDResultCache *cache)
+{
+    uint32_t i;
+    for(i = 0; i < cache->numShards; i++) {
+        struct ZDResultShard *const shard = &cache->shards[i];
+        if(shard->entries) {
+            ZDMutexDestroy(&shard->mutex);
+            free(shard->entries);
+        }
+        if(shard->buckets) free(shard->buckets);
+    }
+    free(cache->shards);
+    free(cache);
+}
+
+static int ZDCreateResultCache(ZoneDetect *library, const ZoneDetectOptions *options)
+{
+    const uint32_t maxEntries = options->resultCacheEntries ? options->resultCacheEntries : ZD_RESULT_CACHE_DEFAULT_ENTRIES;
+    uint32_t numShards = 1;
+    while(numShards < (options->resultCacheShards ? options->resultCacheShards : ZD_RESULT_CACHE_DEFAULT_SHARDS) && numShards < ZD_RESULT_CACHE_MAX_SHARDS) {
+        numShards *= 2;
+    }
+
+    struct ZDResultCache *const cache = calloc(1, sizeof *cache);
+    if(!cache) {
+        return -1;
+    }
+    cache->shards = calloc(numShards, sizeof *cache->shards);
+    if(!cache->shards) {
+        free(cache);
+        return -1;
+    }
+    cache->numShards = numShards;
+    cache->memory = sizeof *cache + numShards * sizeof *cache->shards;
+
+    uint32_t i;
+    for(i = 0; i < numShards; i++) {
+        struct ZDResultShard *const shard = &cache->shards[i];
+        shard->maxEntries = (maxEntries + numShards - 1) / numShards;
+        shard->numBuckets = 1;
+        while(shard->numBuckets < shard->maxEntries) {
+            shard->numBuckets *= 2;
+        }
+
+        shard->buckets = calloc(shard->numBuckets, sizeof *shard->buckets);
+        shard->entries = malloc((size_t)shard->maxEntries * sizeof *shard->entries);
+        if(!shard->buckets || !shard->entries || ZDMutexInit(&shard->mutex)) {
+            if(shard->entries) free(shard->entries);
+            shard->entries = NULL;
+            ZDFreeResultCache(cache);
+            return -1;
+        }
+        cache->memory += (size_t)shard->numBuckets * sizeof *shard->buckets + (size_t)shard->maxEntries * sizeof *shard->entries;
+    }
+
+    library->resultCache = cache;
+    return 0;
+}
+
+int ZDGetResultCacheStats(const ZoneDetect *library, ZoneDetectCacheStats *stats)
+{
+    const struct ZDResultCache *const cache = library->resultCache;
+    if(!cache) {
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->memory = cache->memory;
+
+    uint32_t i;
+    for(i = 0; i < cache->numShards; i++) {
+        struct ZDResultShard *const shard = &cache->shards[i];
+        ZDMutexLock(&shard->mutex);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->numEntries += shard->numEntries;
+        ZDMutexUnlock(&shard->mutex);
+    }
+
+    return 0;
+}
+
+static uint64_t ZDGridCountEntries(const ZoneDetect *library, uint32_t latCells, uint32_t lonCells)
+{
+    uint64_t numEntries = 0;
+    const struct ZDPolygonTable *const table = &library->table;
+    uint32_t i;
+    for(i = 0; i < table->count; i++) {
+        const uint64_t latSpan = ZDGridCoordinate(table->maxLat[i], latCells, library->precision) - ZDGridCoordinate(table->minLat[i], latCells, library->precision) + 1;
+        const uint64_t lonSpan = ZDGridCoordinate(table->maxLon[i], lonCells, library->precision) - ZDGridCoordinate(table->minLon[i], lonCells, library->precision) + 1;
+        numEntries += latSpan * lonSpan;
+    }
+    return numEntries;
+}
+
+static int ZDBuildGrid(ZoneDetect *library, const ZoneDetectOptions *options)
+{
+    uint32_t latCells = options->gridLatCells ? options->gridLatCells : ZD_GRID_DEFAULT_LAT_CELLS;
+    uint32_t lonCells = options->gridLonCells ? options->gridLonCells : ZD_GRID_DEFAULT_LON_CELLS;
+    uint64_t numEntries;
+
+    if(library->precision < 2 || library->precision > 32) {
+        return -1;
+    }
+
+    /* Cells smaller than one unit would be empty */
+    const uint32_t maxCells = UINT32_C(1) << (library->precision - 1);
+    if(latCells > maxCells) latCells = maxCells;
+    if(lonCells > maxCells) lonCells = maxCells;
+
+    /* Reduce the resolution until the index fits in the memory budget */
+    while(1) {
+        numEntries = ZDGridCountEntries(library, latCells, lonCells);
+        const uint64_t numCells = (uint64_t)latCells * lonCells;
+        const uint64_t memory = ((options->flags & ZD_OPEN_GRID_CLASSIFY ? 2 : 1) * numCells + 1 + numEntries) * sizeof(uint32_t);
+        if(numEntries < UINT32_MAX && (!options->gridMaxMemory || memory <= options->gridMaxMemory)) {
+            break;
+        }
+        if(latCells == 1 && lonCells == 1) {
+            return -1;
+        }
+        latCells = (latCells + 1) / 2;
+        lonCells = (lonCells + 1) / 2;
+    }
+
+    const size_t numCells = (size_t)latCells * lonCells;
+    library->grid.latCells = latCells;
+    library->grid.lonCells = lonCells;
+    library->grid.cellStart = calloc(numCells + 1, sizeof *library->grid.cellStart);
+    library->grid.cellPolygons = malloc((size_t)(numEntries ? numEntries : 1) * sizeof *library->grid.cellPolygons);
+    if(!library->grid.cellStart || !library->grid.cellPolygons) {
+        return -1;
+    }
+
+    /* Count the polygons per cell, then turn the counts into start indices */
+    const struct ZDPolygonTable *const table = &library->table;
+    uint32_t i, latCell, lonCell;
+    for(i = 0; i < table->count; i++) {
+        const uint32_t latEnd = ZDGridCoordinate(table->maxLat[i], latCells, library->precision);
+        const uint32_t lonEnd = ZDGridCoordinate(table->maxLon[i], lonCells, library->precision);
+        for(latCell = ZDGridCoordinate(table->minLat[i], latCells, library->precision); latCell <= latEnd; latCell++) {
+            for(lonCell = ZDGridCoordinate(table->minLon[i], lonCells, library->precision); lonCell <= lonEnd; lonCell++) {
+                library->grid.cellStart[(size_t)latCell * lonCells + lonCell + 1]++;
+            }
+        }
+    }
+
+    size_t cell;
+    for(cell = 0; cell < numCells; cell++) {
+        library->grid.cellStart[cell + 1] += library->grid.cellStart[cell];
+    }
+
+    /* Fill the cells in polygon id order, so lookups visit polygons in the same order as the bounding box section */
+    for(i = 0; i < table->count; i++) {
+        const uint32_t latEnd = ZDGridCoordinate(table->maxLat[i], latCells, library->precision);
+        const uint32_t lonEnd = ZDGridCoordinate(table->maxLon[i], lonCells, library->precision);
+        for(latCell = ZDGridCoordinate(table->minLat[i], latCells, library->precision); latCell <= latEnd; latCell++) {
+            for(lonCell = ZDGridCoordinate(table->minLon[i], lonCells, library->precision); lonCell <= lonEnd; lonCell++) {
+                library->grid.cellPolygons[library->grid.cellStart[(size_t)latCell * lonCells + lonCell]++] = i;
+            }
+        }
+    }
+
+    /* Filling advanced every start index to the start of the next cell */
+    for(cell = numCells; cell > 0; cell--) {
+        library->grid.cellStart[cell] = library->grid.cellStart[cell - 1];
+    }
+    library->grid.cellStart[0] = 0;
+
+    return 0;
+}
+
+static void ZDGridMarkBorder(const ZoneDetect *library, uint32_t *cellZone, int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2)
+{
+    const struct ZDGrid *const grid = &library->grid;
+    const int32_t minLat = (lat1 < lat2 ? lat1 : lat2) - ZD_GRID_BORDER_MARGIN;
+    const int32_t maxLat = (lat1 < lat2 ? lat2 : lat1) + ZD_GRID_BORDER_MARGIN;
+    const int32_t minLon = (lon1 < lon2 ? lon1 : lon2) - ZD_GRID_BORDER_MARGIN;
+    const int32_t maxLon = (lon1 < lon2 ? lon2 : lon1) + ZD_GRID_BORDER_MARGIN;
+
+    const uint32_t latEnd = ZDGridCoordinate(maxLat, grid->latCells, library->precision);
+    const uint32_t lonEnd = ZDGridCoordinate(maxLon, grid->lonCells, library->precision);
+    uint32_t latCell, lonCell;
+    for(latCell = ZDGridCoordinate(minLat, grid->latCells, library->precision); latCell <= latEnd; latCell++) {
+        for(lonCell = ZDGridCoordinate(minLon, grid->lonCells, library->precision); lonCell <= lonEnd; lonCell++) {
+            cellZone[(size_t)latCell * grid->lonCells + lonCell] = ZD_CELL_MIXED;
+        }
+    }
+}
+
+static size_t ZDLookupHitsFixedPoint(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, float safezoneLimit, float *safezone, ZoneDetectHit *hits, size_t maxHits);
+
+static int ZDClassifyGrid(ZoneDetect *library)
+{
+    struct ZDGrid *const grid = &library->grid;
+    const size_t numCells = (size_t)grid->latCells * grid->lonCells;
+    const uint32_t unvisited = ZD_CELL_EMPTY - 1;
+
+    /* Lookups must not use the classification while it is being built */
+    uint32_t *const cellZone = malloc(numCells * sizeof *cellZone);
+    uint32_t *const stack = malloc(numCells * sizeof *stack);
+    if(!cellZone || !stack) {
+        if(cellZone) free(cellZone);
+        if(stack) free(stack);
+        return -1;
+    }
+
+    size_t cell;
+    for(cell = 0; cell < numCells; cell++) {
+        cellZone[cell] = unvisited;
+    }
+
+    /* Every cell that an edge passes through is mixed */
+    uint32_t i;
+    for(i = 0; i < library->table.count; i++) {
+        struct Reader reader;
+        ZDReaderInit(&reader, library, library->table.polygonIndex[i]);
+
+        int32_t pointLat, pointLon, prevLat = 0, prevLon = 0;
+        uint8_t first = 1;
+        int result;
+        while((result = ZDReaderGetPoint(&reader, &pointLat, &pointLon)) > 0) {
+            ZDGridMarkBorder(library, cellZone, first ? pointLat : prevLat, first ? pointLon : prevLon, pointLat, pointLon);
+            prevLat = pointLat;
+            prevLon = pointLon;
+            first = 0;
+        }
+
+        if(result < 0) {
+            /* Do not classify anything if the polygons cannot be read */
+            free(stack);
+            free(cellZone);
+            return 0;
+        }
+    }
+
+    /*
+     * Cells that do not touch an edge and share a side form a region that no border crosses,
+     * so all points in it have the same result. One lookup per region is enough.
+     */
+    for(cell = 0; cell < numCells; cell++) {
+        if(cellZone[cell] != unvisited) {
+            continue;
+        }
+
+        const uint32_t latCell = (uint32_t)(cell / grid->lonCells);
+        const uint32_t lonCell = (uint32_t)(cell % grid->lonCells);
+        uint32_t zone = ZD_CELL_MIXED;
+
+        ZoneDetectHit hits[2];
+        const size_t numHits = ZDLookupHitsFixedPoint(library,
+                               ZDGridCellCenter(latCell, grid->latCells, library->precision),
+                               ZDGridCellCenter(lonCell, grid->lonCells, library->precision), 0, NULL, hits, 2);
+        if(numHits == 0) {
+            zone = ZD_CELL_EMPTY;
+        } else if(numHits == 1 && hits[0].lookupResult == ZD_LOOKUP_IN_ZONE) {
+            zone = hits[0].polygonId;
+        }
+
+        size_t stackSize = 0;
+        stack[stackSize++] = (uint32_t)cell;
+        cellZone[cell] = zone;
+        while(stackSize) {
+            const uint32_t current = stack[--stackSize];
+            const uint32_t currentLat = current / grid->lonCells;
+            const uint32_t currentLon = current % grid->lonCells;
+            uint32_t neighbours[4];
+            unsigned int numNeighbours = 0;
+
+            if(currentLat > 0) neighbours[numNeighbours++] = current - grid->lonCells;
+            if(currentLat + 1 < grid->latCells) neighbours[numNeighbours++] = current + grid->lonCells;
+            if(currentLon > 0) neighbours[numNeighbours++] = current - 1;
+            if(currentLon + 1 < grid->lonCells) neighbours[numNeighbours++] = current + 1;
+
+            unsigned int j;
+            for(j = 0; j < numNeighbours; j++) {
+                if(cellZone[neighbours[j]] == unvisited) {
+                    cellZone[neighbours[j]] = zone;
+                    stack[stackSize++] = neighbours[j];
+                }
+            }
+        }
+    }
+
+    free(stack);
+    grid->cellZone = cellZone;
+    return 0;
+}
+
+/* The metadata section is a sequence of records of numFields strings each, the metaId is their offset */
+static int ZDInternMetadata(ZoneDetect *library)
+{
+    struct ZDMetadataTable *const table = &library->metadata;
+    uint32_t index, count = 0;
+    size_t size = 0;
+    unsigned int i;
+
+    if(!library->numFields) {
+        return 0;
+    }
+
+    /* Version 3 strings are used in place */
+    if(library->version >= 3) {
+        const uint32_t recordSize = (uint32_t)library->numFields * 4;
+
+        table->metaIds = malloc(((size_t)library->metadataRecords + 1) * sizeof *table->metaIds);
+        table->fields = malloc(((size_t)library->metadataRecords * library->numFields + 1) * sizeof *table->fields);
+        if(!table->metaIds || !table->fields) {
+            return -1;
+        }
+
+        for(; table->count < library->metadataRecords; table->count++) {
+            ZoneDetectString *const fields = &table->fields[(size_t)table->count * library->numFields];
+            const uint32_t metaId = 4 + table->count * recordSize;
+            table->metaIds[table->count] = metaId;
+
+            for(i = 0; i < library->numFields; i++) {
+                uint32_t length;
+                fields[i].data = ZDLocateField(library, metaId, i, &length);
+                if(!fields[i].data) {
+                    return -1;
+                }
+                fields[i].length = length;
+            }
+        }
+
+        return 0;
+    }
+
+    /* The first pass counts the records and the characters */
+    for(index = library->metadataOffset; index < library->dataOffset; count++) {
+        for(i = 0; i < library->numFields; i++) {
+            uint32_t strOffset, strLength;
+            if(ZDLocateString(library, &index, &strOffset, &strLength)) {
+                return -1;
+            }
+            size += (size_t)strLength + 1;
+        }
+    }
+
+    table->metaIds = malloc(((size_t)count + 1) * sizeof *table->metaIds);
+    table->fields = malloc(((size_t)count * library->numFields + 1) * sizeof *table->fields);
+    table->strings = malloc(size + 1);
+    if(!table->metaIds || !table->fields || !table->strings) {
+        return -1;
+    }
+
+    char *str = table->strings;
+    for(index = library->metadataOffset; table->count < count; table->count++) {
+        ZoneDetectString *const fields = &table->fields[(size_t)table->count * library->numFields];
+        table->metaIds[table->count] = index - library->metadataOffset;
+
+        for(i = 0; i < library->numFields; i++) {
+            uint32_t strOffset, strLength;
+            if(ZDLocateString(library, &index, &strOffset, &strLength) || ZDCopyString(library, strOffset, strLength, str)) {
+                return -1;
+            }
+            fields[i].data = str;
+            fields[i].length = strLength;
+            str += strLength + 1;
+        }
+    }
+
+    return 0;
+}
+
+static int ZDCompareUInt32(const void *a, const void *b)
+{
+    const uint32_t valueA = *(const uint32_t *)a;
+    const uint32_t valueB = *(const uint32_t *)b;
+    return (valueA > valueB) - (valueA < valueB);
+}
+
+/*
+ * Coordinates are scaled to [-2^(precision-1), 2^(precision-1)], but zones that cross the antimeridian go a bit
+ * beyond 180 degrees. Twice that range is accepted, up to the ZD_COORDINATE_MAX the edge arithmetic needs.
+ */
+static int ZDInCoordinateRange(const ZoneDetect *library, int32_t value)
+{
+    const int32_t limit = (library->precision < 30) ? (INT32_C(1) << library->precision) : ZD_COORDINATE_MAX;
+    return value >= -limit && value <= limit;
+}
+
+/*
+ * Check every bounding box, polygon, back-reference, R-tree node and entry and metadata string that lookups decode.
+ * Lookups on a database that passes use the decoders without bounds checks.
+ */
+static int ZDValidateDatabase(ZoneDetect *library)
+{
+    uint32_t *metaIds = NULL, *polygonIndexes = NULL, *stackNeeded = NULL;
+    int32_t *boxes = NULL;
+    uint8_t *reached = NULL;
+    uint32_t numPolygons = 0, capacity = 0, i, j;
+    int result = -1;
+
+    /*
+     * Every entry must lie inside the bounding box section, have a box in the coordinate range and point into the
+     * metadata and data sections
+     */
+    uint32_t bboxIndex = library->bboxOffset;
+    struct ZDBBoxEntry entry = {0};
+    while(bboxIndex < library->bboxEnd) {
+        if(!ZDDecodeBBoxEntry(library, &bboxIndex, &entry) || entry.metadataIndex >= library->dataOffset - library->metadataOffset ||
+                (uint64_t)library->dataOffset + entry.polygonIndex >= (uint64_t)library->length) {
+            goto fail;
+        }
+        if(!ZDInCoordinateRange(library, entry.minLat) || !ZDInCoordinateRange(library, entry.minLon) ||
+                !ZDInCoordinateRange(library, entry.maxLat) || !ZDInCoordinateRange(library, entry.maxLon)) {
+            goto fail;
+        }
+
+        if(numPolygons == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            uint32_t *const newMetaIds = realloc(metaIds, capacity * sizeof *metaIds);
+            if(!newMetaIds) goto fail;
+            metaIds = newMetaIds;
+            uint32_t *const newPolygonIndexes = realloc(polygonIndexes, capacity * sizeof *polygonIndexes);
+            if(!newPolygonIndexes) goto fail;
+            polygonIndexes = newPolygonIndexes;
+            int32_t *const newBoxes = realloc(boxes, 4 * capacity * sizeof *boxes);
+            if(!newBoxes) goto fail;
+            boxes = newBoxes;
+        }
+        boxes[4 * numPolygons] = entry.minLat;
+        boxes[4 * numPolygons + 1] = entry.minLon;
+        boxes[4 * numPolygons + 2] = entry.maxLat;
+        boxes[4 * numPolygons + 3] = entry.maxLon;
+        metaIds[numPolygons] = entry.metadataIndex;
+        polygonIndexes[numPolygons] = library->dataOffset + entry.polygonIndex;
+        numPolygons++;
+    }
+
+    /* Decoding each polygon to the end also follows all its references */
+    for(i = 0; i < numPolygons; i++) {
+        struct Reader reader;
+        int32_t pointLat, pointLon;
+        int readResult;
+        ZDReaderInit(&reader, library, polygonIndexes[i]);
+        while((readResult = ZDReaderGetPoint(&reader, &pointLat, &pointLon)) > 0) {
+            if(!ZDInCoordinateRange(library, pointLat) || !ZDInCoordinateRange(library, pointLon)) {
+                goto fail;
+            }
+        }
+        if(readResult < 0) {
+            goto fail;
+        }
+    }
+
+    /*
+     * The R-tree entries must match the bounding box section. Every node and every polygon must be reached exactly
+     * once, each node box must contain the boxes below it and a search must fit in ZD_RTREE_MAX_STACK.
+     */
+    if(library->version >= 2) {
+        const uint32_t nodesOffset = library->rtreeOffset + ZD_RTREE_HEADER_SIZE;
+        const uint32_t entriesOffset = nodesOffset + library->rtreeNumNodes * ZD_RTREE_NODE_SIZE;
+        if(library->rtreeNumEntries != numPolygons) {
+            goto fail;
+        }
+        /* Nodes, then entries, then polygon ids */
+        reached = calloc((size_t)library->rtreeNumNodes + 2 * (size_t)numPolygons, 1);
+        stackNeeded = malloc(library->rtreeNumNodes * sizeof *stackNeeded);
+        if(!reached || !stackNeeded) {
+            goto fail;
+        }
+#if defined(_MSC_VER)
+        __try {
+#endif
+            for(i = 0; i < library->rtreeNumEntries; i++) {
+                const uint32_t entryOffset = entriesOffset + i * ZD_RTREE_ENTRY_SIZE;
+                const uint32_t polygonId = ZDReadUInt32(library, entryOffset + 16);
+                if(polygonId >= numPolygons || reached[library->rtreeNumNodes + numPolygons + polygonId] ||
+                        ZDReadUInt32(library, entryOffset + 20) != metaIds[polygonId] ||
+                        library->dataOffset + ZDReadUInt32(library, entryOffset + 24) != polygonIndexes[polygonId]) {
+                    goto fail;
+                }
+                for(j = 0; j < 4; j++) {
+                    if((int32_t)ZDReadUInt32(library, entryOffset + 4 * j) != boxes[4 * polygonId + j]) {
+                        goto fail;
+                    }
+                }
+                reached[library->rtreeNumNodes + numPolygons + polygonId] = 1;
+            }
+
+            /* Children come after their parent, so walking backwards sees every child before its parent */
+            i = library->rtreeNumNodes;
+            while(i--) {
+                const uint32_t nodeOffset = nodesOffset + i * ZD_RTREE_NODE_SIZE;
+                const uint32_t first = ZDReadUInt32(library, nodeOffset + 16);
+                const uint32_t count = ZDReadUInt32(library, nodeOffset + 20);
+                const uint32_t firstChild = first & ~ZD_RTREE_LEAF;
+                const int leaf = (first & ZD_RTREE_LEAF) != 0;
+                int32_t box[4];
+
+                if(leaf ? (uint64_t)firstChild + count > library->rtreeNumEntries
+                        : (firstChild <= i || (uint64_t)firstChild + count > library->rtreeNumNodes)) {
+                    goto fail;
+                }
+                for(j = 0; j < 4; j++) {
+                    box[j] = (int32_t)ZDReadUInt32(library, nodeOffset + 4 * j);
+                    if(!ZDInCoordinateRange(library, box[j])) {
+                        goto fail;
+                    }
+                }
+
+                /* The stack holds the remaining siblings of every node on the path */
+                stackNeeded[i] = leaf ? 0 : count;
+                for(j = 0; j < count; j++) {
+                    const uint32_t child = firstChild + j;
+                    const uint32_t childOffset = leaf ? entriesOffset + child * ZD_RTREE_ENTRY_SIZE : nodesOffset + child * ZD_RTREE_NODE_SIZE;
+                    uint8_t *const childReached = leaf ? &reached[library->rtreeNumNodes + child] : &reached[child];
+                    if(*childReached ||
+                            box[0] > (int32_t)ZDReadUInt32(library, childOffset) || box[1] > (int32_t)ZDReadUInt32(library, childOffset + 4) ||
+                            box[2] < (int32_t)ZDReadUInt32(library, childOffset + 8) || box[3] < (int32_t)ZDReadUInt32(library, childOffset + 12)) {
+                        goto fail;
+                    }
+                    *childReached = 1;
+                    if(!leaf && count - 1 - j + stackNeeded[child] > stackNeeded[i]) {
+                        stackNeeded[i] = count - 1 - j + stackNeeded[child];
+                    }
+                }
+            }
+#if defined(_MSC_VER)
+        } __except(GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR
+                   ? EXCEPTION_EXECUTE_HANDLER
+                   : EXCEPTION_CONTINUE_SEARCH) { /* file mapping SEH exception occurred */
+            zdError(ZD_E_DB_MAP_EXCEPTION, (int)GetLastError());
+            goto fail;
+        }
+#endif
+
+        /* Every node but the root and every entry needs exactly one parent, every polygon exactly one entry */
+        if(reached[0] || stackNeeded[0] > ZD_RTREE_MAX_STACK) {
+            goto fail;
+        }
+        for(i = 1; i < library->rtreeNumNodes + 2 * numPolygons; i++) {
+            if(!reached[i]) {
+                goto fail;
+            }
+        }
+    }
+
+    /* Every field of the records the polygons refer to must be readable */
+    if(numPolygons) {
+        qsort(metaIds, numPolygons, sizeof *metaIds, ZDCompareUInt32);
+    }
+    for(i = 0; i < numPolygons; i++) {
+        if(i && metaIds[i] == metaIds[i - 1]) {
+            continue;
+        }
+
+        uint32_t index = library->metadataOffset + metaIds[i];
+        for(j = 0; j < library->numFields; j++) {
+            uint32_t strOffset, strLength;
+            if(library->version >= 3) {
+                if(!ZDLocateField(library, metaIds[i], j, &strLength)) goto fail;
+            } else if(ZDLocateString(library, &index, &strOffset, &strLength) || (uint64_t)strOffset + strLength > (uint64_t)library->length) {
+                goto fail;
+            }
+        }
+    }
+
+    library->trusted = 1;
+    result = 0;
+
+fail:
+    if(metaIds) free(metaIds);
+    if(polygonIndexes) free(polygonIndexes);
+    if(boxes) free(boxes);
+    if(reached) free(reached);
+    if(stackNeeded) free(stackNeeded);
+    return result;
+}
+
+static int ZDBuildIndexes(ZoneDetect *library, const ZoneDetectOptions *options)
+{
+    if(options->flags & ZD_OPEN_INTERN_METADATA) {
+        if(ZDInternMetadata(library)) return -1;
+    }
+
+    /* Create the cache first, classifying the grid already benefits from it */
+    if(options->flags & ZD_OPEN_POLYGON_CACHE) {
+        if(ZDCreateCache(library, options)) return -1;
+    }
+
+    if(options->flags & (ZD_OPEN_DECODE_BBOX | ZD_OPEN_GRID_INDEX | ZD_OPEN_GRID_CLASSIFY | ZD_OPEN_SLAB_INDEX | ZD_OPEN_EXPANDED | ZD_OPEN_RESULT_CACHE)) {
+        if(ZDDecodePolygonTable(library)) return -1;
+    }
+
+    if(options->flags & (ZD_OPEN_GRID_INDEX | ZD_OPEN_GRID_CLASSIFY | ZD_OPEN_RESULT_CACHE)) {
+        if(ZDBuildGrid(library, options)) return -1;
+    }
+
+    if(options->flags & (ZD_OPEN_SLAB_INDEX | ZD_OPEN_EXPANDED)) {
+        const uint32_t slabMinVertices = options->slabMinVertices ? options->slabMinVertices : ZD_SLAB_DEFAULT_MIN_VERTICES;
+        const int expanded = (options->flags & ZD_OPEN_EXPANDED) != 0;
+        if(ZDDecodePolygons(library, expanded ? 0 : slabMinVertices, (options->flags & ZD_OPEN_SLAB_INDEX) ? slabMinVertices : UINT32_MAX)) return -1;
+    }
+
+    if(options->flags & ZD_OPEN_GRID_CLASSIFY) {
+        if(ZDClassifyGrid(library)) return -1;
+    }
+
+    /* Last, the lookups that build the other indexes must not be cached */
+    if(options->flags & ZD_OPEN_RESULT_CACHE) {
+        if(ZDCreateResultCache(library, options)) return -1;
+    }
+
+    return 0;
+}
+
+static uint8_t ZDDetectSimdLevel(void)
+{
+#if defined(ZD_SIMD_AVX2_DISPATCH)
+    if(__builtin_cpu_supports("avx2")) {
+        return ZD_SIMD_AVX2;
+    }
+#endif
+#if defined(ZD_SIMD_X86)
+    return ZD_SIMD_SSE2;
+#else
+    return ZD_SIMD_NONE;
+#endif
+}
+
+static int ZDApplyOptions(ZoneDetect *library, const ZoneDetectOptions *options)
+{
+    if(!options) {
+        return 0;
+    }
+
+    library->simdLevel = ZDDetectSimdLevel();
+
+    const clock_t start = clock();
+    const int result = ZDBuildIndexes(library, options);
+    library->indexBuildTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    return result;
+}
+
+void ZDInitOptions(ZoneDetectOptions *options)
+{
+    memset(options, 0, sizeof(*options));
+}
+
+void ZDGetIndexStats(const ZoneDetect *library, ZoneDetectIndexStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->buildTime = library->indexBuildTime;
+
+    if(library->table.memory) {
+        const size_t arraySize = ((size_t)library->table.paddedCount * sizeof(uint32_t) + ZD_CACHE_LINE_SIZE - 1) / ZD_CACHE_LINE_SIZE * ZD_CACHE_LINE_SIZE;
+        stats->tableMemory = 6 * arraySize + ZD_CACHE_LINE_SIZE;
+    }
+
+    if(library->grid.cellStart) {
+        const size_t numCells = (size_t)library->grid.latCells * library->grid.lonCells;
+        stats->gridMemory = (numCells + 1 + library->grid.cellStart[numCells]) * sizeof(uint32_t);
+        if(library->grid.cellZone) {
+            stats->gridMemory += numCells * sizeof(uint32_t);
+        }
+    }
+
+    uint32_t i;
+    stats->numDecodedPolygons = library->numDecodedPolygons;
+    stats->polygonMemory = library->numDecodedPolygons * sizeof(struct ZDDecodedPolygon);
+    for(i = 0; i < library->numDecodedPolygons; i++) {
+        const struct ZDDecodedPolygon *const polygon = &library->decodedPolygons[i];
+        stats->numDecodedPoints += polygon->numPoints;
+        stats->polygonMemory += 2 * (size_t)polygon->numPoints * sizeof(int32_t);
+        if(polygon->numSlabs) {
+            stats->polygonMemory += ((size_t)polygon->numSlabs + 1 + polygon->slabStart[polygon->numSlabs]) * sizeof(uint32_t);
+        }
+    }
+}
+
+void ZDCloseDatabase(ZoneDetect *library)
+{
+    if(library) {
+        if(library->grid.cellStart) {
+            free(library->grid.cellStart);
+        }
+        if(library->grid.cellPolygons) {
+            free(library->grid.cellPolygons);
+        }
+        if(library->grid.cellZone) {
+            free(library->grid.cellZone);
+        }
+        if(library->table.memory) {
+            free(library->table.memory);
+        }
+        if(library->cache) {
+            ZDFreeCache(library->cache);
+        }
+        if(library->resultCache) {
+            ZDFreeResultCache(library->resultCache);
+        }
+        if(library->metadata.metaIds) free(library->metadata.metaIds);
+        if(library->metadata.fields) free(library->metadata.fields);
+        if(library->metadata.strings) free(library->metadata.strings);
+        if(library->decodedPolygons) {
+            uint32_t i;
+            for(i = 0; i < library->numDecodedPolygons; i++) {
+                if(library->decodedPolygons[i].lat) free(library->decodedPolygons[i].lat);
+                if(library->decodedPolygons[i].slabStart) free(library->decodedPolygons[i].slabStart);
+                if(library->decodedPolygons[i].slabEdges) free(library->decodedPolygons[i].slabEdges);
+            }
+            free(library->decodedPolygons);
+        }
+        if(library->fieldNames) {
+            size_t i;
+            for(i = 0; i < (size_t)library->numFields; i++) {
+                if(library->fieldNames[i]) {
+                    free(library->fieldNames[i]);
+                }
+            }
+            free(library->fieldNames);
+        }
+        if(library->notice) {
+            free(library->notice);
+        }
+
+        if(library->closeType == 0) {
+#if defined(_MSC_VER) || defined(__MINGW32__)
+            if(library->mapping && !UnmapViewOfFile(library->mapping)) zdError(ZD_E_DB_MUNMAP_MSVIEW, (int)GetLastError());
+            if(library->fdMap && !CloseHandle(library->fdMap))         zdError(ZD_E_DB_MUNMAP, (int)GetLastError());
+            if(library->fd && !CloseHandle(library->fd))               zdError(ZD_E_DB_CLOSE, (int)GetLastError());
+#elif defined(__APPLE__) || defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)
+            if(library->mapping && munmap(library->mapping, (size_t)(library->length))) zdError(ZD_E_DB_MUNMAP, 0);
+            if(library->fd >= 0 && close(library->fd))                                  zdError(ZD_E_DB_CLOSE, 0);
+#endif
+        }
+
+        free(library);
+    }
+}
+
+ZoneDetect *ZDOpenDatabaseFromMemoryWithOptions(void* buffer, size_t length, const ZoneDetectOptions *options)
+{
+    ZoneDetect *const library = malloc(sizeof *library);
+
+    if(library) {
+        memset(library, 0, sizeof(*library));
+        library->closeType = 1;
+        library->length = (long int)length;
+
+        if(library->length <= 0) {
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__APPLE__) || defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)
+            zdError(ZD_E_DB_SEEK, errno);
+#else
+            zdError(ZD_E_DB_SEEK, 0);
+#endif
+            goto fail;
+        }
+
+        library->mapping = buffer;
+
+        /* Parse the header */
+        if(ZDParseHeader(library)) {
+            zdError(ZD_E_PARSE_HEADER, 0);
+            goto fail;
+        }
+
+        if(options && (options->flags & ZD_OPEN_VALIDATE) && ZDValidateDatabase(library)) {
+            zdError(ZD_E_VALIDATE, 0);
+            goto fail;
+        }
+
+        if(ZDApplyOptions(library, options)) {
+            zdError(ZD_E_BUILD_INDEX, 0);
+            goto fail;
+        }
+    }
+
+    return library;
+
+fail:
+    ZDCloseDatabase(library);
+    return NULL;
+}
+
+ZoneDetect *ZDOpenDatabaseWithOptions(const char *path, const ZoneDetectOptions *options)
+{
+    ZoneDetect *const library = malloc(sizeof *library);
+
+    if(library) {
+        memset(library, 0, sizeof(*library));
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+        library->fd = CreateFile(path, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (library->fd == INVALID_HANDLE_VALUE) {
+            zdError(ZD_E_DB_OPEN, (int)GetLastError());
+            goto fail;
+        }
+
+        const DWORD fsize = GetFileSize(library->fd, NULL);
+        if (fsize == INVALID_FILE_SIZE) {
+            zdError(ZD_E_DB_SEEK, (int)GetLastError());
+            goto fail;
+        }
+        library->length = (int32_t)fsize;
+
+        library->fdMap = CreateFileMappingA(library->fd, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!library->fdMap) {
+            zdError(ZD_E_DB_MMAP, (int)GetLastError());
+            goto fail;
+        }
+
+        library->mapping = MapViewOfFile(library->fdMap, FILE_MAP_READ, 0, 0, 0);
+        if (!library->mapping) {
+            zdError(ZD_E_DB_MMAP_MSVIEW, (int)GetLastError());
+            goto fail;
+        }
+#elif defined(__APPLE__) || defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)
+        library->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(library->fd < 0) {
+            zdError(ZD_E_DB_OPEN, errno);
+            goto fail;
+        }
+
+        library->length = lseek(library->fd, 0, SEEK_END);
+        if(library->length <= 0 || library->length > 50331648) {
+            zdError(ZD_E_DB_SEEK, errno);
+            goto fail;
+        }
+        lseek(library->fd, 0, SEEK_SET);
+
+        library->mapping = mmap(NULL, (size_t)library->length, PROT_READ, MAP_PRIVATE | MAP_FILE, library->fd, 0);
+        if(library->mapping == MAP_FAILED) {
+            zdError(ZD_E_DB_MMAP, errno);
+            goto fail;
+        }
+#endif
+
+        /* Parse the header */
+        if(ZDParseHeader(library)) {
+            zdError(ZD_E_PARSE_HEADER, 0);
+            goto fail;
+        }
+
+        if(options && (options->flags & ZD_OPEN_VALIDATE) && ZDValidateDatabase(library)) {
+            zdError(ZD_E_VALIDATE, 0);
+            goto fail;
+        }
+
+        if(ZDApplyOptions(library, options)) {
+            zdError(ZD_E_BUILD_INDEX, 0);
+            goto fail;
+        }
+    }
+
+    return library;
+
+fail:
+    ZDCloseDatabase(library);
+    return NULL;
+}
+
+ZoneDetect *ZDOpenDatabaseFromMemory(void* buffer, size_t length)
+{
+    return ZDOpenDatabaseFromMemoryWithOptions(buffer, length, NULL);
+}
+
+ZoneDetect *ZDOpenDatabaseExpanded(const char *path, uint32_t flags)
+{
+    ZoneDetectOptions options;
+    ZDInitOptions(&options);
+    options.flags = flags | ZD_OPEN_EXPANDED;
+
+    return ZDOpenDatabaseWithOptions(path, &options);
+}
+
+ZoneDetect *ZDOpenDatabase(const char *path)
+{
+    return ZDOpenDatabaseWithOptions(path, NULL);
+}
+
+static uint64_t ZDBoxArea(int32_t minLat, int32_t minLon, int32_t maxLat, int32_t maxLon)
+{
+    return (uint64_t)((int64_t)maxLat - minLat + 1) * (uint64_t)((int64_t)maxLon - minLon + 1);
+}
+
+/*
+ * Collect the R-tree entries whose bounding box contains the point, in polygon id order.
+ * Returns the number of entries found, only the first maxCandidates are stored.
+ */
+static size_t ZDRTreeSearch(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, struct ZDCandidate *candidates, size_t maxCandidates)
+{
+    const uint32_t nodesOffset = library->rtreeOffset + ZD_RTREE_HEADER_SIZE;
+    const uint32_t entriesOffset = nodesOffset + library->rtreeNumNodes * ZD_RTREE_NODE_SIZE;
+    size_t numCandidates = 0;
+
+    uint32_t stack[ZD_RTREE_MAX_STACK];
+    size_t stackSize = 0;
+    stack[stackSize++] = 0;
+
+#if defined(_MSC_VER)
+    __try {
+#endif
+        while(stackSize) {
+            const uint32_t node = stack[--stackSize];
+            const uint32_t nodeOffset = nodesOffset + node * ZD_RTREE_NODE_SIZE;
+
+            if(latFixedPoint < (int32_t)ZDReadUInt32(library, nodeOffset) ||
+                    lonFixedPoint < (int32_t)ZDReadUInt32(library, nodeOffset + 4) ||
+                    latFixedPoint > (int32_t)ZDReadUInt32(library, nodeOffset + 8) ||
+                    lonFixedPoint > (int32_t)ZDReadUInt32(library, nodeOffset + 12)) {
+                continue;
+            }
+
+            const uint32_t first = ZDReadUInt32(library, nodeOffset + 16);
+            const uint32_t count = ZDReadUInt32(library, nodeOffset + 20);
+            const uint32_t firstChild = first & ~ZD_RTREE_LEAF;
+
+            if(first & ZD_RTREE_LEAF) {
+                if((uint64_t)firstChild + count > library->rtreeNumEntries) {
+                    break;
+                }
+
+                uint32_t i;
+                for(i = firstChild; i < firstChild + count; i++) {
+                    const uint32_t entryOffset = entriesOffset + i * ZD_RTREE_ENTRY_SIZE;
+                    if(latFixedPoint >= (int32_t)ZDReadUInt32(library, entryOffset) &&
+                            lonFixedPoint >= (int32_t)ZDReadUInt32(library, entryOffset + 4) &&
+                            latFixedPoint <= (int32_t)ZDReadUInt32(library, entryOffset + 8) &&
+                            lonFixedPoint <= (int32_t)ZDReadUInt32(library, entryOffset + 12)) {
+                        if(numCandidates < maxCandidates) {
+                            candidates[numCandidates].polygonId = ZDReadUInt32(library, entryOffset + 16);
+                            candidates[numCandidates].metadataIndex = ZDReadUInt32(library, entryOffset + 20);
+                            candidates[numCandidates].polygonIndex = library->dataOffset + ZDReadUInt32(library, entryOffset + 24);
+                            candidates[numCandidates].boxArea = ZDBoxArea((int32_t)ZDReadUInt32(library, entryOffset), (int32_t)ZDReadUInt32(library, entryOffset + 4),
+                                                                          (int32_t)ZDReadUInt32(library, entryOffset + 8), (int32_t)ZDReadUInt32(library, entryOffset + 12));
+                        }
+                        numCandidates++;
+                    }
+                }
+            } else {
+                /* Children must come after their parent, this guarantees termination on corrupt files */
+                if(firstChild <= node || (uint64_t)firstChild + count > library->rtreeNumNodes || stackSize + count > ZD_RTREE_MAX_STACK) {
+                    break;
+                }
+
+                uint32_t i;
+                for(i = 0; i < count; i++) {
+                    stack[stackSize++] = firstChild + count - 1 - i;
+                }
+            }
+        }
+
+#if defined(_MSC_VER)
+    } __except(GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR
+               ? EXCEPTION_EXECUTE_HANDLER
+               : EXCEPTION_CONTINUE_SEARCH) { /* file mapping SEH exception occurred */
+        zdError(ZD_E_DB_MAP_EXCEPTION, (int)GetLastError());
+        return 0;
+    }
+#endif
+
+    /* Visit the polygons in the same order as the bounding box section */
+    const size_t numStored = numCandidates < maxCandidates ? numCandidates : maxCandidates;
+    size_t i;
+    for(i = 1; i < numStored; i++) {
+        const struct ZDCandidate candidate = candidates[i];
+        size_t j = i;
+        while(j > 0 && candidates[j - 1].polygonId > candidate.polygonId) {
+            candidates[j] = candidates[j - 1];
+            j--;
+        }
+        candidates[j] = candidate;
+    }
+
+    return numCandidates;
+}
+
+static int ZDHitListAdd(struct ZDHitList *list, uint32_t polygonId, uint32_t metaId, ZDLookupResult lookupResult)
+{
+    if(list->numHits >= list->capacity && list->fixed) {
+        /* Keep counting so the caller knows how much room is needed */
+        list->numHits++;
+        return 0;
+    }
+
+    if(list->numHits == list->capacity) {
+        /* The initial buffer may be on the stack, move to the heap when it is full */
+        const size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        ZoneDetectHit *const heap = realloc(list->heap, capacity * sizeof *heap);
+        if(!heap) {
+            return -1;
+        }
+        if(!list->heap && list->numHits) {
+            memcpy(heap, list->hits, list->numHits * sizeof *heap);
+        }
+        list->hits = list->heap = heap;
+        list->capacity = capacity;
+    }
+
+    list->hits[list->numHits].polygonId = polygonId;
+    list->hits[list->numHits].metaId = metaId;
+    list->hits[list->numHits].lookupResult = lookupResult;
+    list->numHits++;
+
+    return 0;
+}
+
+static int ZDLookupPolygon(const ZoneDetect *library, struct ZDHitList *list, uint32_t polygonId, uint32_t metadataIndex, uint32_t polygonIndex, int32_t latFixedPoint, int32_t lonFixedPoint, uint64_t *distanceSqrMin)
+{
+    const ZDLookupResult lookupResult = ZDPointInPolygon(library, polygonIndex, latFixedPoint, lonFixedPoint, distanceSqrMin);
+    if(lookupResult == ZD_LOOKUP_PARSE_ERROR) {
+        return -1;
+    } else if(lookupResult != ZD_LOOKUP_NOT_IN_ZONE) {
+        return ZDHitListAdd(list, polygonId, metadataIndex, lookupResult);
+    }
+
+    return 0;
+}
+
+/* Distances are only needed until one below distanceSqrStop was found, zero means always */
+static uint64_t *ZDDistanceNeeded(uint64_t *distanceSqrMin, uint64_t distanceSqrStop)
+{
+    return (distanceSqrMin && *distanceSqrMin >= distanceSqrStop) ? distanceSqrMin : NULL;
+}
+
+/* Called for each polygon whose bounding box contains the point, a nonzero return stops the search */
+typedef int (*ZDCandidateVisitor)(void *context, const struct ZDCandidate *candidate);
+
+static void ZDTableCandidate(const struct ZDPolygonTable *table, uint32_t polygonId, struct ZDCandidate *candidate)
+{
+    candidate->polygonId = polygonId;
+    candidate->metadataIndex = table->metadataIndex[polygonId];
+    candidate->polygonIndex = table->polygonIndex[polygonId];
+    candidate->boxArea = ZDBoxArea(table->minLat[polygonId], table->minLon[polygonId], table->maxLat[polygonId], table->maxLon[polygonId]);
+}
+
+/*
+ * Visit the polygons whose bounding box contains the point, through the grid, the decoded table or the R-tree
+ * when they were built and by scanning the bounding box section otherwise.
+ */
+static void ZDVisitCandidates(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, ZDCandidateVisitor visit, void *context)
+{
+    const struct ZDPolygonTable *const table = &library->table;
+    struct ZDCandidate candidate;
+
+    if(library->grid.cellStart) {
+        /* Only visit the polygons whose bounding box overlaps the cell of the point */
+        const uint32_t cell = ZDGridCell(library, latFixedPoint, lonFixedPoint);
+        uint32_t i;
+        for(i = library->grid.cellStart[cell]; i < library->grid.cellStart[cell + 1]; i++) {
+            const uint32_t polygonId = library->grid.cellPolygons[i];
+            if(latFixedPoint >= table->minLat[polygonId] && latFixedPoint <= table->maxLat[polygonId] &&
+                    lonFixedPoint >= table->minLon[polygonId] && lonFixedPoint <= table->maxLon[polygonId]) {
+                ZDTableCandidate(table, polygonId, &candidate);
+                if(visit(context, &candidate)) {
+                    return;
+                }
+            }
+        }
+    } else if(table->memory) {
+        /* Filter the decoded bounding boxes in blocks */
+        const uint32_t end = ZDPolygonTableEnd(table, latFixedPoint);
+        uint32_t filtered[256];
+        uint32_t start;
+
+        for(start = 0; start < end; start += 256) {
+            const uint32_t numFiltered = ZDPolygonTableFilter(table, latFixedPoint, lonFixedPoint, start, (end - start < 256) ? end : start + 256, filtered);
+            uint32_t i;
+            for(i = 0; i < numFiltered && filtered[i] < end; i++) {
+                ZDTableCandidate(table, filtered[i], &candidate);
+                if(visit(context, &candidate)) {
+                    return;
+                }
+            }
+        }
+    } else if(library->rtreeOffset) {
+        struct ZDCandidate candidateBuffer[32];
+        struct ZDCandidate *candidates = candidateBuffer;
+        size_t numCandidates = ZDRTreeSearch(library, latFixedPoint, lonFixedPoint, candidates, sizeof(candidateBuffer) / sizeof(candidateBuffer[0]));
+
+        if(numCandidates > sizeof(candidateBuffer) / sizeof(candidateBuffer[0])) {
+            candidates = malloc(numCandidates * sizeof *candidates);
+            if(candidates) {
+                numCandidates = ZDRTreeSearch(library, latFixedPoint, lonFixedPoint, candidates, numCandidates);
+            } else {
+                numCandidates = 0;
+            }
+        }
+
+        size_t i;
+        for(i = 0; i < numCandidates; i++) {
+            if(visit(context, &candidates[i])) {
+                break;
+            }
+        }
+
+        if(candidates != candidateBuffer && candidates) {
+            free(candidates);
+        }
+    } else {
+        uint32_t bboxIndex = library->bboxOffset;
+        struct ZDBBoxEntry entry = {0};
+        uint32_t polygonId;
+
+        for(polygonId = 0; ZDDecodeBBoxEntry(library, &bboxIndex, &entry); polygonId++) {
+            if(latFixedPoint < entry.minLat) {
+                /* The data is sorted along minLat */
+                break;
+            }
+            if(latFixedPoint <= entry.maxLat && lonFixedPoint >= entry.minLon && lonFixedPoint <= entry.maxLon) {
+                candidate.polygonId = polygonId;
+                candidate.metadataIndex = entry.metadataIndex;
+                candidate.polygonIndex = library->dataOffset + entry.polygonIndex;
+                candidate.boxArea = ZDBoxArea(entry.minLat, entry.minLon, entry.maxLat, entry.maxLon);
+                if(visit(context, &candidate)) {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+struct ZDCollectContext {
+    const ZoneDetect *library;
+    struct ZDHitList *list;
+    int32_t latFixedPoint, lonFixedPoint;
+    uint64_t *distanceSqrMin;
+    uint64_t distanceSqrStop;
+};
+
+static int ZDCollectVisit(void *context, const struct ZDCandidate *candidate)
+{
+    const struct ZDCollectContext *const collect = context;
+    return ZDLookupPolygon(collect->library, collect->list, candidate->polygonId, candidate->metadataIndex, candidate->polygonIndex,
+                           collect->latFixedPoint, collect->lonFixedPoint, ZDDistanceNeeded(collect->distanceSqrMin, collect->distanceSqrStop));
+}
+
+/*
+ * Append the polygons that contain the point, or on whose border it lies, to list. Like before, a parse error
+ * or failed allocation stops the search and keeps the hits found so far.
+ */
+static void ZDCollectHits(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, uint64_t *distanceSqrMin, uint64_t distanceSqrStop, struct ZDHitList *list)
+{
+    if(library->grid.cellStart) {
+        const uint32_t cell = ZDGridCell(library, latFixedPoint, lonFixedPoint);
+        /* With a stop distance the cell also decides the safezone if its sides are at least that far away */
+        const uint32_t cellZone = (library->grid.cellZone && ZDGridContains(library, latFixedPoint, lonFixedPoint) &&
+                                   (!distanceSqrMin || (distanceSqrStop && ZDGridCellDistanceSqr(library, latFixedPoint, lonFixedPoint) >= distanceSqrStop)))
+                                  ? library->grid.cellZone[cell] : ZD_CELL_MIXED;
+
+        if(cellZone == ZD_CELL_EMPTY) {
+            /* No zone contains the cell */
+            return;
+        } else if(cellZone != ZD_CELL_MIXED) {
+            /* The cell lies inside a single zone, there is no need to test any polygon */
+            ZDHitListAdd(list, cellZone, library->table.metadataIndex[cellZone], ZD_LOOKUP_IN_ZONE);
+            return;
+        }
+    }
+
+    struct ZDCollectContext context;
+    context.library = library;
+    context.list = list;
+    context.latFixedPoint = latFixedPoint;
+    context.lonFixedPoint = lonFixedPoint;
+    context.distanceSqrMin = distanceSqrMin;
+    context.distanceSqrStop = distanceSqrStop;
+    ZDVisitCandidates(library, latFixedPoint, lonFixedPoint, ZDCollectVisit, &context);
+}
+
+/* Position of a hit, sorted by zone by ZDMergeHits */
+struct ZDMergeEntry {
+    uint32_t metaId;
+    uint32_t index;
+};
+
+/* Lists up to this many hits are merged without sorting */
+#define ZD_MERGE_SORT_MIN 16
+
+static int ZDCompareMergeEntries(const void *a, const void *b)
+{
+    const struct ZDMergeEntry *const entryA = a;
+    const struct ZDMergeEntry *const entryB = b;
+    if(entryA->metaId != entryB->metaId) {
+        return (entryA->metaId > entryB->metaId) ? 1 : -1;
+    }
+    return (entryA->index > entryB->index) - (entryA->index < entryB->index);
+}
+
+/* Remove the hits that were merged into another one, returns the new number of hits */
+static size_t ZDCompactHits(ZoneDetectHit *hits, size_t numHits)
+{
+    size_t newNumHits = 0, i;
+    for(i = 0; i < numHits; i++) {
+        if(hits[i].lookupResult != ZD_LOOKUP_IGNORE) {
+            hits[newNumHits] = hits[i];
+            newNumHits++;
+        }
+    }
+
+    return newNumHits;
+}
+
+/*
+ * Merge the hits of the same zone into its first hit, returns the new number of hits. The hits are sorted by
+ * zone so many overlapping polygons do not take quadratic time, small lists use a simple nested loop.
+ */
+static size_t ZDMergeHits(ZoneDetectHit *hits, size_t numHits)
+{
+    struct ZDMergeEntry *entries = NULL;
+    size_t i;
+
+    if(numHits > ZD_MERGE_SORT_MIN && numHits <= UINT32_MAX) {
+        entries = malloc(numHits * sizeof *entries);
+    }
+
+    if(entries) {
+        for(i = 0; i < numHits; i++) {
+            entries[i].metaId = hits[i].metaId;
+            entries[i].index = (uint32_t)i;
+        }
+        qsort(entries, numHits, sizeof *entries, ZDCompareMergeEntries);
+
+        size_t start, end;
+        for(start = 0; start < numHits; start = end) {
+            int insideSum = 0;
+            ZDLookupResult overrideResult = ZD_LOOKUP_IGNORE;
+
+            /* Same as the nested loop below, visiting the hits of the zone in their original order */
+            for(end = start; end < numHits && entries[end].metaId == entries[start].metaId; end++) {
+                ZoneDetectHit *const hit = &hits[entries[end].index];
+                const ZDLookupResult tmpResult = hit->lookupResult;
+                hit->lookupResult = ZD_LOOKUP_IGNORE;
+
+                if(tmpResult == ZD_LOOKUP_IN_ZONE) {
+                    insideSum++;
+                } else if(tmpResult == ZD_LOOKUP_IN_EXCLUDED_ZONE) {
+                    insideSum--;
+                } else {
+                    overrideResult = tmpResult;
+                }
+            }
+
+            ZoneDetectHit *const first = &hits[entries[start].index];
+            if(overrideResult != ZD_LOOKUP_IGNORE) {
+                first->lookupResult = overrideResult;
+            } else if(insideSum) {
+                first->lookupResult = ZD_LOOKUP_IN_ZONE;
+            }
+        }
+
+        free(entries);
+        return ZDCompactHits(hits, numHits);
+    }
+
+    for(i = 0; i < numHits; i++) {
+        int insideSum = 0;
+        ZDLookupResult overrideResult = ZD_LOOKUP_IGNORE;
+        size_t j;
+        for(j = i; j < numHits; j++) {
+            if(hits[i].metaId == hits[j].metaId) {
+                ZDLookupResult tmpResult = hits[j].lookupResult;
+                hits[j].lookupResult = ZD_LOOKUP_IGNORE;
+
+                /* This is the same result. Is it an exclusion zone? */
+                if(tmpResult == ZD_LOOKUP_IN_ZONE) {
+                    insideSum++;
+                } else if(tmpResult == ZD_LOOKUP_IN_EXCLUDED_ZONE) {
+                    insideSum--;
+                } else {
+                    /* If on the bodrder then the final result is on the border */
+                    overrideResult = tmpResult;
+                }
+
+            }
+        }
+
+        if(overrideResult != ZD_LOOKUP_IGNORE) {
+            hits[i].lookupResult = overrideResult;
+        } else {
+            if(insideSum) {
+                hits[i].lookupResult = ZD_LOOKUP_IN_ZONE;
+            }
+        }
+    }
+
+    /* Remove zones to ignore */
+    return ZDCompactHits(hits, numHits);
+}
+
+/* Candidates stored by ZDCollectCandidates, numCandidates counts the ones that did not fit as well */
+struct ZDCandidateArray {
+    struct ZDCandidate *candidates;
+    size_t maxCandidates;
+    size_t numCandidates;
+};
+
+static int ZDCandidateArrayAdd(void *context, const struct ZDCandidate *candidate)
+{
+    struct ZDCandidateArray *const array = context;
+    if(array->numCandidates < array->maxCandidates) {
+        array->candidates[array->numCandidates] = *candidate;
+    }
+    array->numCandidates++;
+    return 0;
+}
+
+/*
+ * Store up to maxCandidates polygons whose bounding box contains the point, using the same index as
+ * ZDCollectHits. Returns the total number of candidates.
+ */
+static size_t ZDCollectCandidates(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, struct ZDCandidate *candidates, size_t maxCandidates)
+{
+    struct ZDCandidateArray array;
+    array.candidates = candidates;
+    array.maxCandidates = maxCandidates;
+    array.numCandidates = 0;
+    ZDVisitCandidates(library, latFixedPoint, lonFixedPoint, ZDCandidateArrayAdd, &array);
+    return array.numCandidates;
+}
+
+static int ZDCompareCandidateArea(const void *a, const void *b)
+{
+    const struct ZDCandidate *const candidateA = a;
+    const struct ZDCandidate *const candidateB = b;
+
+    if(candidateA->boxArea != candidateB->boxArea) {
+        return (candidateA->boxArea > candidateB->boxArea) ? 1 : -1;
+    }
+    return (candidateA->polygonId > candidateB->polygonId) - (candidateA->polygonId < candidateB->polygonId);
+}
+
+/* Marks candidates that were already tested as part of an earlier zone */
+#define ZD_CANDIDATE_DONE UINT32_MAX
+
+/*
+ * Test the polygons with the smallest bounding box first and stop at the first zone that contains the
+ * point. A zone is only accepted after its other candidates were tested too, these may be exclusion
+ * polygons or put the point on its border. The result of a zone is the one ZDMergeHits would give.
+ * Border results are returned only if no zone contains the point. Returns 1 if hit was written.
+ */
+static int ZDLookupFirstFixedPoint(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, ZoneDetectHit *hit)
+{
+    if(library->grid.cellZone && ZDGridContains(library, latFixedPoint, lonFixedPoint)) {
+        const uint32_t cellZone = library->grid.cellZone[ZDGridCell(library, latFixedPoint, lonFixedPoint)];
+        if(cellZone == ZD_CELL_EMPTY) {
+            return 0;
+        } else if(cellZone != ZD_CELL_MIXED) {
+            hit->lookupResult = ZD_LOOKUP_IN_ZONE;
+            hit->polygonId = cellZone;
+            hit->metaId = library->table.metadataIndex[cellZone];
+            return 1;
+        }
+    }
+
+    struct ZDCandidate candidateBuffer[64];
+    struct ZDCandidate *candidates = candidateBuffer;
+    size_t numCandidates = ZDCollectCandidates(library, latFixedPoint, lonFixedPoint, candidates, sizeof(candidateBuffer) / sizeof(candidateBuffer[0]));
+
+    if(numCandidates > sizeof(candidateBuffer) / sizeof(candidateBuffer[0])) {
+        candidates = malloc(numCandidates * sizeof *candidates);
+        if(!candidates) {
+            return 0;
+        }
+        numCandidates = ZDCollectCandidates(library, latFixedPoint, lonFixedPoint, candidates, numCandidates);
+    }
+
+    qsort(candidates, numCandidates, sizeof *candidates, ZDCompareCandidateArea);
+
+    ZoneDetectHit border;
+    int found = 0, haveBorder = 0;
+    size_t i, j;
+
+    for(i = 0; i < numCandidates && !found; i++) {
+        if(candidates[i].polygonId == ZD_CANDIDATE_DONE) {
+            continue;
+        }
+
+        const ZDLookupResult lookupResult = ZDPointInPolygon(library, candidates[i].polygonIndex, latFixedPoint, lonFixedPoint, NULL);
+        if(lookupResult == ZD_LOOKUP_PARSE_ERROR) {
+            break;
+        } else if(lookupResult == ZD_LOOKUP_NOT_IN_ZONE) {
+            continue;
+        }
+
+        /* Settle the zone, ZDMergeHits reports the first hit in polygon id order and the last border result */
+        const uint32_t metaId = candidates[i].metadataIndex;
+        uint32_t firstId = candidates[i].polygonId, overrideId = 0;
+        ZDLookupResult overrideResult = ZD_LOOKUP_IGNORE;
+        int insideSum = 0, parseError = 0;
+
+        for(j = i; j < numCandidates; j++) {
+            if(candidates[j].polygonId == ZD_CANDIDATE_DONE || candidates[j].metadataIndex != metaId) {
+                continue;
+            }
+
+            const uint32_t polygonId = candidates[j].polygonId;
+            const ZDLookupResult result = (j == i) ? lookupResult : ZDPointInPolygon(library, candidates[j].polygonIndex, latFixedPoint, lonFixedPoint, NULL);
+            candidates[j].polygonId = ZD_CANDIDATE_DONE;
+
+            if(result == ZD_LOOKUP_PARSE_ERROR) {
+                parseError = 1;
+                break;
+            } else if(result == ZD_LOOKUP_NOT_IN_ZONE) {
+                continue;
+            }
+
+            if(polygonId < firstId) {
+                firstId = polygonId;
+            }
+            if(result == ZD_LOOKUP_IN_ZONE) {
+                insideSum++;
+            } else if(result == ZD_LOOKUP_IN_EXCLUDED_ZONE) {
+                insideSum--;
+            } else if(overrideResult == ZD_LOOKUP_IGNORE || polygonId > overrideId) {
+                overrideResult = result;
+                overrideId = polygonId;
+            }
+        }
+
+        if(parseError) {
+            break;
+        }
+
+        if(overrideResult != ZD_LOOKUP_IGNORE) {
+            if(!haveBorder) {
+                border.lookupResult = overrideResult;
+                border.polygonId = firstId;
+                border.metaId = metaId;
+                haveBorder = 1;
+            }
+        } else if(insideSum) {
+            hit->lookupResult = ZD_LOOKUP_IN_ZONE;
+            hit->polygonId = firstId;
+            hit->metaId = metaId;
+            found = 1;
+        }
+    }
+
+    if(candidates != candidateBuffer) {
+        free(candidates);
+    }
+
+    if(!found && haveBorder) {
+        *hit = border;
+        found = 1;
+    }
+
+    return found;
+}
+
+/* Entry of the ZDLookupNearest queue, either an R-tree node or a polygon */
+struct ZDNearestItem {
+    uint64_t bound;
+    uint32_t node;
+    uint32_t polygonId;
+    uint32_t metadataIndex;
+    uint32_t polygonIndex;
+};
+
+#define ZD_NEAREST_POLYGON UINT32_MAX
+/* Largest number of grid cells visited by a bounded search, beyond that all bounding boxes are scanned */
+#define ZD_NEAREST_GRID_CELLS 64
+
+struct ZDNearestQueue {
+    struct ZDNearestItem *items;
+    size_t numItems;
+    size_t capacity;
+};
+
+/* Zone found by ZDLookupNearest, the results of its polygons are combined like in ZDMergeHits */
+struct ZDNearestZone {
+    uint32_t metaId;
+    /* Closest polygon and first polygon that contains the point or has it on its border */
+    uint32_t polygonId;
+    uint32_t hitPolygonId;
+    uint64_t distanceSqr;
+    int insideSum;
+    ZDLookupResult borderResult;
+};
+
+static int ZDNearestPush(struct ZDNearestQueue *queue, uint64_t bound, uint32_t node, uint32_t polygonId, uint32_t metadataIndex, uint32_t polygonIndex)
+{
+    if(queue->numItems == queue->capacity) {
+        const size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+        struct ZDNearestItem *const items = realloc(queue->items, capacity * sizeof *items);
+        if(!items) {
+            return -1;
+        }
+        queue->items = items;
+        queue->capacity = capacity;
+    }
+
+    size_t i = queue->numItems++;
+    while(i > 0 && queue->items[(i - 1) / 2].bound > bound) {
+        queue->items[i] = queue->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    queue->items[i].bound = bound;
+    queue->items[i].node = node;
+    queue->items[i].polygonId = polygonId;
+    queue->items[i].metadataIndex = metadataIndex;
+    queue->items[i].polygonIndex = polygonIndex;
+    return 0;
+}
+
+static struct ZDNearestItem ZDNearestPop(struct ZDNearestQueue *queue)
+{
+    const struct ZDNearestItem top = queue->items[0];
+    const struct ZDNearestItem last = queue->items[--queue->numItems];
+    size_t i = 0;
+
+    while(2 * i + 1 < queue->numItems) {
+        size_t child = 2 * i + 1;
+        if(child + 1 < queue->numItems && queue->items[child + 1].bound < queue->items[child].bound) {
+            child++;
+        }
+        if(queue->items[child].bound >= last.bound) {
+            break;
+        }
+        queue->items[i] = queue->items[child];
+        i = child;
+    }
+    queue->items[i] = last;
+
+    return top;
+}
+
+/* Push the children of an R-tree node, they must come after their parent like in ZDRTreeSearch */
+static int ZDNearestPushNode(const ZoneDetect *library, struct ZDNearestQueue *queue, uint32_t node, int32_t latFixedPoint, int32_t lonFixedPoint, uint64_t maxDistanceSqr)
+{
+    const uint32_t nodesOffset = library->rtreeOffset + ZD_RTREE_HEADER_SIZE;
+    const uint32_t entriesOffset = nodesOffset + library->rtreeNumNodes * ZD_RTREE_NODE_SIZE;
+    const uint32_t nodeOffset = nodesOffset + node * ZD_RTREE_NODE_SIZE;
+    const uint32_t first = ZDReadUInt32(library, nodeOffset + 16);
+    const uint32_t count = ZDReadUInt32(library, nodeOffset + 20);
+    const uint32_t firstChild = first & ~ZD_RTREE_LEAF;
+    uint32_t i;
+
+    if(first & ZD_RTREE_LEAF) {
+        if((uint64_t)firstChild + count > library->rtreeNumEntries) {
+            return 0;
+        }
+    } else if(firstChild <= node || (uint64_t)firstChild + count > library->rtreeNumNodes) {
+        return 0;
+    }
+
+    for(i = firstChild; i < firstChild + count; i++) {
+        const uint32_t offset = (first & ZD_RTREE_LEAF) ? entriesOffset + i * ZD_RTREE_ENTRY_SIZE : nodesOffset + i * ZD_RTREE_NODE_SIZE;
+        const uint64_t bound = ZDBoxDistanceSqr(latFixedPoint, lonFixedPoint, (int32_t)ZDReadUInt32(library, offset), (int32_t)ZDReadUInt32(library, offset + 4),
+                                                (int32_t)ZDReadUInt32(library, offset + 8), (int32_t)ZDReadUInt32(library, offset + 12));
+        if(bound > maxDistanceSqr) {
+            continue;
+        }
+
+        int error;
+        if(first & ZD_RTREE_LEAF) {
+            error = ZDNearestPush(queue, bound, ZD_NEAREST_POLYGON, ZDReadUInt32(library, offset + 16), ZDReadUInt32(library, offset + 20),
+                                  library->dataOffset + ZDReadUInt32(library, offset + 24));
+        } else {
+            error = ZDNearestPush(queue, bound, i, 0, 0, 0);
+        }
+        if(error) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Grid cell range of the box around the point that holds everything within maxDistanceSqr */
+static void ZDNearestGridRange(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, uint64_t maxDistanceSqr, uint32_t *latStart, uint32_t *latEnd, uint32_t *lonStart, uint32_t *lonEnd)
+{
+    /* Note: lon has half scale */
+    const int64_t latRadius = (int64_t)ceil(sqrt((double)maxDistanceSqr));
+    const int64_t lonRadius = (latRadius + 1) / 2;
+    const int64_t minLat = (int64_t)latFixedPoint - latRadius, maxLat = (int64_t)latFixedPoint + latRadius;
+    const int64_t minLon = (int64_t)lonFixedPoint - lonRadius, maxLon = (int64_t)lonFixedPoint + lonRadius;
+
+    *latStart = ZDGridCoordinate((minLat < INT32_MIN) ? INT32_MIN : (int32_t)minLat, library->grid.latCells, library->precision);
+    *latEnd = ZDGridCoordinate((maxLat > INT32_MAX) ? INT32_MAX : (int32_t)maxLat, library->grid.latCells, library->precision);
+    *lonStart = ZDGridCoordinate((minLon < INT32_MIN) ? INT32_MIN : (int32_t)minLon, library->grid.lonCells, library->precision);
+    *lonEnd = ZDGridCoordinate((maxLon > INT32_MAX) ? INT32_MAX : (int32_t)maxLon, library->grid.lonCells, library->precision);
+}
+
+/* Queue the polygons, or the R-tree root, that may lie within maxDistanceSqr */
+static int ZDNearestInit(const ZoneDetect *library, struct ZDNearestQueue *queue, int32_t latFixedPoint, int32_t lonFixedPoint, uint64_t maxDistanceSqr)
+{
+    const struct ZDPolygonTable *const table = &library->table;
+    uint32_t latStart = 0, latEnd = 0, lonStart = 0, lonEnd = 0;
+    int useGrid = 0;
+
+    /* The boxes are sorted along minLat, the ones starting north of this are too far away */
+    const int64_t maxLatBound = (int64_t)latFixedPoint + (int64_t)ceil(sqrt((double)maxDistanceSqr));
+
+    if(library->grid.cellStart && maxDistanceSqr != UINT64_MAX) {
+        ZDNearestGridRange(library, latFixedPoint, lonFixedPoint, maxDistanceSqr, &latStart, &latEnd, &lonStart, &lonEnd);
+        useGrid = (uint64_t)(latEnd - latStart + 1) * (lonEnd - lonStart + 1) <= ZD_NEAREST_GRID_CELLS;
+    }
+
+    if(useGrid) {
+        /* Only visit the cells around a small radius */
+        uint32_t latCell, lonCell, i;
+        for(latCell = latStart; latCell <= latEnd; latCell++) {
+            for(lonCell = lonStart; lonCell <= lonEnd; lonCell++) {
+                const uint32_t cell = latCell * library->grid.lonCells + lonCell;
+                for(i = library->grid.cellStart[cell]; i < library->grid.cellStart[cell + 1]; i++) {
+                    const uint32_t polygonId = library->grid.cellPolygons[i];
+
+                    /* A polygon is in every cell its box overlaps, only queue it from the first one in range */
+                    const uint32_t firstLat = ZDGridCoordinate(table->minLat[polygonId], library->grid.latCells, library->precision);
+                    const uint32_t firstLon = ZDGridCoordinate(table->minLon[polygonId], library->grid.lonCells, library->precision);
+                    if(((firstLat > latStart) ? firstLat : latStart) != latCell || ((firstLon > lonStart) ? firstLon : lonStart) != lonCell) {
+                        continue;
+                    }
+
+                    const uint64_t bound = ZDBoxDistanceSqr(latFixedPoint, lonFixedPoint, table->minLat[polygonId], table->minLon[polygonId], table->maxLat[polygonId], table->maxLon[polygonId]);
+                    if(bound <= maxDistanceSqr && ZDNearestPush(queue, bound, ZD_NEAREST_POLYGON, polygonId, table->metadataIndex[polygonId], table->polygonIndex[polygonId])) {
+                        return -1;
+                    }
+                }
+            }
+        }
+    } else if(table->memory) {
+        const uint32_t end = (table->sorted && maxLatBound < INT32_MAX) ? ZDPolygonTableEnd(table, (int32_t)maxLatBound) : table->count;
+        uint32_t i;
+        for(i = 0; i < end; i++) {
+            const uint64_t bound = ZDBoxDistanceSqr(latFixedPoint, lonFixedPoint, table->minLat[i], table->minLon[i], table->maxLat[i], table->maxLon[i]);
+            if(bound <= maxDistanceSqr && ZDNearestPush(queue, bound, ZD_NEAREST_POLYGON, i, table->metadataIndex[i], table->polygonIndex[i])) {
+                return -1;
+            }
+        }
+    } else if(library->rtreeOffset) {
+        return ZDNearestPush(queue, 0, 0, 0, 0, 0);
+    } else {
+        uint32_t bboxIndex = library->bboxOffset;
+        struct ZDBBoxEntry entry = {0};
+        uint32_t polygonId;
+
+        for(polygonId = 0; ZDDecodeBBoxEntry(library, &bboxIndex, &entry); polygonId++) {
+            if(entry.minLat > maxLatBound) {
+                /* The data is sorted along minLat */
+                break;
+            }
+
+            const uint64_t bound = ZDBoxDistanceSqr(latFixedPoint, lonFixedPoint, entry.minLat, entry.minLon, entry.maxLat, entry.maxLon);
+            if(bound <= maxDistanceSqr && ZDNearestPush(queue, bound, ZD_NEAREST_POLYGON, polygonId, entry.metadataIndex, library->dataOffset + entry.polygonIndex)) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static uint64_t ZDNearestZoneDistanceSqr(const struct ZDNearestZone *zone)
+{
+    return (zone->borderResult != ZD_LOOKUP_IGNORE || zone->insideSum) ? 0 : zone->distanceSqr;
+}
+
+static int ZDCompareNearestZones(const void *a, const void *b)
+{
+    const struct ZDNearestZone *const zoneA = a;
+    const struct ZDNearestZone *const zoneB = b;
+    const uint64_t distanceA = ZDNearestZoneDistanceSqr(zoneA);
+    const uint64_t distanceB = ZDNearestZoneDistanceSqr(zoneB);
+
+    if(distanceA != distanceB) {
+        return (distanceA > distanceB) ? 1 : -1;
+    }
+    return (zoneA->metaId > zoneB->metaId) - (zoneA->metaId < zoneB->metaId);
+}
+
+/* The k-th smallest zone distance, nothing further away can be part of the result */
+static uint64_t ZDNearestLimit(const struct ZDNearestZone *zones, size_t numZones, uint64_t *smallest, size_t k)
+{
+    size_t numSmallest = 0, i;
+
+    for(i = 0; i < numZones; i++) {
+        const uint64_t distanceSqr = ZDNearestZoneDistanceSqr(&zones[i]);
+        if(numSmallest == k && distanceSqr >= smallest[k - 1]) {
+            continue;
+        }
+
+        size_t j = (numSmallest < k) ? numSmallest++ : k - 1;
+        while(j > 0 && smallest[j - 1] > distanceSqr) {
+            smallest[j] = smallest[j - 1];
+            j--;
+        }
+        smallest[j] = distanceSqr;
+    }
+
+    return (numSmallest == k) ? smallest[k - 1] : UINT64_MAX;
+}
+
+/*
+ * Best-first search over the bounding boxes, ordered by their distance to the point. Polygons are only
+ * tested while their box could still hold one of the k closest zones, a k of SIZE_MAX keeps all zones
+ * within maxDistanceSqr. All boxes that contain the point are tested, so exclusion polygons and borders are
+ * combined like in ZDMergeHits. Writes up to maxHits hits and returns the number of zones found.
+ */
+static size_t ZDLookupNearestFixedPoint(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, size_t k, uint64_t maxDistanceSqr, ZoneDetectHit *hits, size_t maxHits, float *distances)
+{
+    struct ZDNearestQueue queue;
+    struct ZDNearestZone *zones = NULL;
+    uint64_t *smallest = NULL;
+    size_t numZones = 0, zonesCapacity = 0, numResults = 0, i;
+    uint64_t limit = maxDistanceSqr;
+
+    memset(&queue, 0, sizeof(queue));
+    if(!k) {
+        return 0;
+    }
+
+    if(k != SIZE_MAX) {
+        smallest = malloc(k * sizeof *smallest);
+        if(!smallest) {
+            goto done;
+        }
+    }
+    if(ZDNearestInit(library, &queue, latFixedPoint, lonFixedPoint, maxDistanceSqr)) {
+        goto done;
+    }
+
+    while(queue.numItems && queue.items[0].bound <= limit) {
+        const struct ZDNearestItem item = ZDNearestPop(&queue);
+
+        if(item.node != ZD_NEAREST_POLYGON) {
+            if(ZDNearestPushNode(library, &queue, item.node, latFixedPoint, lonFixedPoint, maxDistanceSqr)) {
+                goto done;
+            }
+            continue;
+        }
+
+        /*
+         * Edges further away than the limit cannot change the result, they are skipped. Until all boxes that
+         * contain the point are done, a hole may still move a zone counted as containing it out of the limit.
+         */
+        const uint64_t edgeLimit = item.bound ? limit : maxDistanceSqr;
+        uint64_t distanceSqr = (edgeLimit < UINT64_MAX) ? edgeLimit + 1 : UINT64_MAX;
+        ZDLookupResult lookupResult = ZDPointInPolygon(library, item.polygonIndex, latFixedPoint, lonFixedPoint, &distanceSqr);
+        if(lookupResult == ZD_LOOKUP_PARSE_ERROR) {
+            break;
+        } else if(item.bound) {
+            /* Like the other lookups, only a polygon whose box contains the point can contain it */
+            lookupResult = ZD_LOOKUP_NOT_IN_ZONE;
+        }
+
+        for(i = 0; i < numZones; i++) {
+            if(zones[i].metaId == item.metadataIndex) {
+                break;
+            }
+        }
+        if(i == numZones) {
+            if(numZones == zonesCapacity) {
+                zonesCapacity = zonesCapacity ? zonesCapacity * 2 : 16;
+                struct ZDNearestZone *const newZones = realloc(zones, zonesCapacity * sizeof *newZones);
+                if(!newZones) {
+                    goto done;
+                }
+                zones = newZones;
+            }
+            zones[i].metaId = item.metadataIndex;
+            zones[i].polygonId = item.polygonId;
+            zones[i].hitPolygonId = UINT32_MAX;
+            zones[i].distanceSqr = (uint64_t)-1;
+            zones[i].insideSum = 0;
+            zones[i].borderResult = ZD_LOOKUP_IGNORE;
+            numZones++;
+        }
+
+        struct ZDNearestZone *const zone = &zones[i];
+        if(lookupResult != ZD_LOOKUP_NOT_IN_ZONE && item.polygonId < zone->hitPolygonId) {
+            zone->hitPolygonId = item.polygonId;
+        }
+        if(lookupResult == ZD_LOOKUP_IN_ZONE) {
+            zone->insideSum++;
+        } else if(lookupResult == ZD_LOOKUP_IN_EXCLUDED_ZONE) {
+            zone->insideSum--;
+        } else if(lookupResult != ZD_LOOKUP_NOT_IN_ZONE) {
+            zone->borderResult = lookupResult;
+        }
+        if(distanceSqr < zone->distanceSqr) {
+            zone->distanceSqr = distanceSqr;
+            zone->polygonId = item.polygonId;
+        }
+
+        if(smallest) {
+            limit = ZDNearestLimit(zones, numZones, smallest, k);
+            if(limit > maxDistanceSqr) {
+                limit = maxDistanceSqr;
+            }
+        }
+    }
+
+    if(numZones) {
+        qsort(zones, numZones, sizeof *zones, ZDCompareNearestZones);
+    }
+    for(i = 0; i < numZones && numResults < k; i++) {
+        const uint64_t distanceSqr = ZDNearestZoneDistanceSqr(&zones[i]);
+        if(distanceSqr > maxDistanceSqr) {
+            break;
+        }
+        if(numResults >= maxHits) {
+            /* Keep counting so the caller knows how much room is needed */
+            numResults++;
+            continue;
+        }
+
+        hits[numResults].polygonId = zones[i].hitPolygonId;
+        hits[numResults].metaId = zones[i].metaId;
+        if(zones[i].borderResult != ZD_LOOKUP_IGNORE) {
+            hits[numResults].lookupResult = zones[i].borderResult;
+        } else if(zones[i].insideSum) {
+            hits[numResults].lookupResult = ZD_LOOKUP_IN_ZONE;
+        } else {
+            hits[numResults].lookupResult = ZD_LOOKUP_NOT_IN_ZONE;
+            hits[numResults].polygonId = zones[i].polygonId;
+        }
+        if(distances) {
+            distances[numResults] = sqrtf((float)distanceSqr) * 90 / (float)(1 << (library->precision - 1));
+        }
+        numResults++;
+    }
+
+done:
+    if(queue.items) free(queue.items);
+    if(zones) free(zones);
+    if(smallest) free(smallest);
+    return numResults;
+}
+
+static const ZoneDetectString *ZDFindMetadata(const ZoneDetect *library, uint32_t metaId)
+{
+    const struct ZDMetadataTable *const table = &library->metadata;
+    uint32_t low = 0, high = table->count;
+
+    while(low < high) {
+        const uint32_t middle = low + (high - low) / 2;
+        if(table->metaIds[middle] == metaId) {
+            return &table->fields[(size_t)middle * library->numFields];
+        } else if(table->metaIds[middle] < metaId) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return NULL;
+}
+
+static char *ZDDuplicateString(const ZoneDetectString *string)
+{
+    char *const str = malloc(string->length + 1);
+    if(str) {
+        memcpy(str, string->data, string->length + 1);
+    }
+    return str;
+}
+
+/* Squared safezone limit in the units of distanceSqrMin, zero if there is none */
+static uint64_t ZDSafezoneLimitSqr(const ZoneDetect *library, float safezoneLimit)
+{
+    const double limitFixedPoint = (double)safezoneLimit * (double)(1 << (library->precision - 1)) / 90;
+    if(!(limitFixedPoint > 0)) {
+        return 0;
+    } else if(limitFixedPoint >= 4e9) {
+        return UINT64_MAX;
+    }
+    return (uint64_t)ceil(limitFixedPoint * limitFixedPoint);
+}
+
+/*
+ * Collect and merge the hits of the point in list. Returns their number, or for a fixed list that was too
+ * small the number of unmerged hits that are needed.
+ */
+static size_t ZDLookupListFixedPoint(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, float safezoneLimit, float *safezone, struct ZDHitList *list)
+{
+    /* Borders at the limit or further away do not matter, start the search there */
+    const uint64_t distanceSqrLimit = ZDSafezoneLimitSqr(library, safezoneLimit);
+    uint64_t distanceSqrMin = distanceSqrLimit ? distanceSqrLimit : (uint64_t)-1;
+
+    /* Limited lookups do not compute the full safezone, they are not cached */
+    const int useCache = library->resultCache && !distanceSqrLimit;
+    size_t numHits;
+    if(useCache && ZDResultCacheFind(library, latFixedPoint, lonFixedPoint, safezone, list->hits, list->capacity, &numHits)) {
+        return numHits;
+    }
+
+    ZDCollectHits(library, latFixedPoint, lonFixedPoint, (safezone || useCache) ? &distanceSqrMin : NULL, distanceSqrLimit, list);
+
+    if(safezone && distanceSqrLimit) {
+        *safezone = (distanceSqrMin >= distanceSqrLimit) ? safezoneLimit : 0;
+    } else if(safezone) {
+        *safezone = sqrtf((float)distanceSqrMin) * 90 / (float)(1 << (library->precision - 1));
+    }
+
+    if(list->numHits > list->capacity) {
+        return list->numHits;
+    }
+
+    numHits = ZDMergeHits(list->hits, list->numHits);
+    if(useCache) {
+        ZDResultCacheInsert(library, latFixedPoint, lonFixedPoint, distanceSqrMin, list->hits, numHits);
+    }
+    return numHits;
+}
+
+static size_t ZDLookupHitsFixedPoint(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, float safezoneLimit, float *safezone, ZoneDetectHit *hits, size_t maxHits)
+{
+    struct ZDHitList list;
+
+    list.hits = hits;
+    list.heap = NULL;
+    list.numHits = 0;
+    list.capacity = maxHits;
+    list.fixed = 1;
+
+    return ZDLookupListFixedPoint(library, latFixedPoint, lonFixedPoint, safezoneLimit, safezone, &list);
+}
+
+size_t ZDLookupHits(const ZoneDetect *library, float lat, float lon, float *safezone, ZoneDetectHit *hits, size_t maxHits)
+{
+    const int32_t latFixedPoint = ZDFloatToFixedPoint(lat, 90, library->precision);
+    const int32_t lonFixedPoint = ZDFloatToFixedPoint(lon, 180, library->precision);
+
+    return ZDLookupHitsFixedPoint(library, latFixedPoint, lonFixedPoint, 0, safezone, hits, maxHits);
+}
+
+size_t ZDLookupHitsWithSafezoneLimit(const ZoneDetect *library, float lat, float lon, float safezoneLimit, float *safezone, ZoneDetectHit *hits, size_t maxHits)
+{
+    const int32_t latFixedPoint = ZDFloatToFixedPoint(lat, 90, library->precision);
+    const int32_t lonFixedPoint = ZDFloatToFixedPoint(lon, 180, library->precision);
+
+    return ZDLookupHitsFixedPoint(library, latFixedPoint, lonFixedPoint, safezoneLimit, safezone, hits, maxHits);
+}
+
+int ZDLookupFirst(const ZoneDetect *library, float lat, float lon, ZoneDetectHit *hit)
+{
+    const int32_t latFixedPoint = ZDFloatToFixedPoint(lat, 90, library->precision);
+    const int32_t lonFixedPoint = ZDFloatToFixedPoint(lon, 180, library->precision);
+
+    return ZDLookupFirstFixedPoint(library, latFixedPoint, lonFixedPoint, hit);
+}
+
+/* Squared distance in the units of distanceSqrMin, returns -1 if it is negative */
+static int ZDMaxDistanceSqr(const ZoneDetect *library, float maxDistance, uint64_t *maxDistanceSqr)
+{
+    /* Same units as the safezone */
+    const double maxDistanceFixedPoint = (double)maxDistance * (double)(1 << (library->precision - 1)) / 90;
+    *maxDistanceSqr = UINT64_MAX;
+    if(maxDistanceFixedPoint < 0) {
+        return -1;
+    } else if(maxDistanceFixedPoint < 4e9) {
+        *maxDistanceSqr = (uint64_t)(maxDistanceFixedPoint * maxDistanceFixedPoint);
+    }
+    return 0;
+}
+
+size_t ZDLookupNearest(const ZoneDetect *library, float lat, float lon, size_t k, float maxDistance, ZoneDetectHit *hits, float *distances)
+{
+    const int32_t latFixedPoint = ZDFloatToFixedPoint(lat, 90, library->precision);
+    const int32_t lonFixedPoint = ZDFloatToFixedPoint(lon, 180, library->precision);
+
+    uint64_t maxDistanceSqr;
+    if(ZDMaxDistanceSqr(library, maxDistance, &maxDistanceSqr)) {
+        return 0;
+    }
+
+    return ZDLookupNearestFixedPoint(library, latFixedPoint, lonFixedPoint, k, maxDistanceSqr, hits, k, distances);
+}
+
+size_t ZDLookupRadius(const ZoneDetect *library, float lat, float lon, float radius, ZoneDetectHit *hits, size_t maxHits, float *distances)
+{
+    const int32_t latFixedPoint = ZDFloatToFixedPoint(lat, 90, library->precision);
+    const int32_t lonFixedPoint = ZDFloatToFixedPoint(lon, 180, library->precision);
+
+    uint64_t maxDistanceSqr;
+    if(ZDMaxDistanceSqr(library, radius, &maxDistanceSqr)) {
+        return 0;
+    }
+
+    return ZDLookupNearestFixedPoint(library, latFixedPoint, lonFixedPoint, SIZE_MAX, maxDistanceSqr, hits, maxHits, distances);
+}
+
+/* Copies of the metadata fields of metaId, NULL if out of memory or on a parse error */
+static char **ZDDuplicateFields(const ZoneDetect *library, uint32_t metaId)
+{
+    uint32_t tmpIndex = library->metadataOffset + metaId;
+    const ZoneDetectString *const fields = ZDFindMetadata(library, metaId);
+    char **const data = malloc(library->numFields * sizeof *data);
+    size_t j;
+
+    if(!data) {
+        return NULL;
+    }
+
+    for(j = 0; j < library->numFields; j++) {
+        data[j] = fields ? ZDDuplicateString(&fields[j]) : ZDParseField(library, metaId, (unsigned int)j, &tmpIndex);
+        if(!data[j]) {
+            while(j--) {
+                free(data[j]);
+            }
+            free(data);
+            return NULL;
+        }
+    }
+
+    return data;
+}
+
+static ZoneDetectResult *ZDLookupFixedPoint(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, float safezoneLimit, float *safezone)
+{
+    ZoneDetectHit hitBuffer[16];
+    struct ZDHitList list;
+    size_t i;
+
+    /* The hits start on the stack and move to the heap if there are many, the lookup is done only once */
+    list.hits = hitBuffer;
+    list.heap = NULL;
+    list.numHits = 0;
+    list.capacity = sizeof(hitBuffer) / sizeof(hitBuffer[0]);
+    list.fixed = 0;
+
+    const size_t numResults = ZDLookupListFixedPoint(library, latFixedPoint, lonFixedPoint, safezoneLimit, safezone, &list);
+    const ZoneDetectHit *const hits = list.hits;
+
+    ZoneDetectResult *const results = malloc(sizeof *results * (numResults + 1));
+    if(!results) {
+        if(list.heap) free(list.heap);
+        return NULL;
+    }
+
+    for(i = 0; i < numResults; i++) {
+        results[i].polygonId = hits[i].polygonId;
+        results[i].metaId = hits[i].metaId;
+        results[i].numFields = library->numFields;
+        results[i].fieldNames = library->fieldNames;
+        results[i].lookupResult = hits[i].lookupResult;
+    }
+    if(list.heap) free(list.heap);
+
+    /* Lookup metadata */
+    for(i = 0; i < numResults; i++) {
+        results[i].data = ZDDuplicateFields(library, results[i].metaId);
+        if(!results[i].data) {
+            /* free all allocated memory */
+            results[i].lookupResult = ZD_LOOKUP_END;
+            ZDFreeResults(results);
+            return NULL;
+        }
+    }
+
+    /* Write end marker */
+    results[numResults].lookupResult = ZD_LOOKUP_END;
+    results[numResults].numFields = 0;
+    results[numResults].fieldNames = NULL;
+    results[numResults].data = NULL;
+
+    return results;
+}
+
+ZoneDetectResult *ZDLookup(const ZoneDetect *library, float lat, float lon, float *safezone)
+{
+    const int32_t latFixedPoint = ZDFloatToFixedPoint(lat, 90, library->precision);
+    const int32_t lonFixedPoint = ZDFloatToFixedPoint(lon, 180, library->precision);
+
+    return ZDLookupFixedPoint(library, latFixedPoint, lonFixedPoint, 0, safezone);
+}
+
+ZoneDetectResult *ZDLookupWithSafezoneLimit(const ZoneDetect *library, float lat, float lon, float safezoneLimit, float *safezone)
+{
+    const int32_t latFixedPoint = ZDFloatToFixedPoint(lat, 90, library->precision);
+    const int32_t lonFixedPoint = ZDFloatToFixedPoint(lon, 180, library->precision);
+
+    return ZDLookupFixedPoint(library, latFixedPoint, lonFixedPoint, safezoneLimit, safezone);
+}
+
+static uint32_t ZDMortonCoordinate(int32_t value, unsigned int precision)
+{
+    /* Map to 16 unsigned bits */
+    uint32_t coordinate = (uint32_t)((int64_t)value + ((int64_t)1 << (precision - 1)));
+    if(precision > 16) {
+        coordinate >>= precision - 16;
+    }
+    if(coordinate > 0xFFFF) {
+        coordinate = 0xFFFF;
+    }
+
+    /* Spread the bits so they can be interleaved */
+    coordinate = (coordinate | (coordinate << 8)) & 0x00FF00FFu;
+    coordinate = (coordinate | (coordinate << 4)) & 0x0F0F0F0Fu;
+    coordinate = (coordinate | (coordinate << 2)) & 0x33333333u;
+    coordinate = (coordinate | (coordinate << 1)) & 0x55555555u;
+    return coordinate;
+}
+
+static int ZDCompareBatchPoints(const void *a, const void *b)
+{
+    const struct ZDBatchPoint *const pointA = a;
+    const struct ZDBatchPoint *const pointB = b;
+    if(pointA->key != pointB->key) {
+        return (pointA->key > pointB->key) ? 1 : -1;
+    }
+    return (pointA->index > pointB->index) - (pointA->index < pointB->index);
+}
+
+/* Merge the hits in list and store the first one in result */
+static void ZDBatchSetResult(struct ZDHitList *list, ZoneDetectBatchResult *result)
+{
+    const size_t numHits = ZDMergeHits(list->hits, list->numHits);
+
+    result->numResults = (uint32_t)numHits;
+    if(numHits) {
+        result->lookupResult = list->hits[0].lookupResult;
+        result->polygonId = list->hits[0].polygonId;
+        result->metaId = list->hits[0].metaId;
+    } else {
+        result->lookupResult = ZD_LOOKUP_END;
+        result->polygonId = 0;
+        result->metaId = 0;
+    }
+}
+
+static void ZDLookupBatchPoint(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint, uint32_t flags, struct ZDHitList *list, ZoneDetectBatchResult *result)
+{
+    if(flags & ZD_BATCH_FIRST_MATCH) {
+        ZoneDetectHit hit;
+        if(ZDLookupFirstFixedPoint(library, latFixedPoint, lonFixedPoint, &hit)) {
+            result->lookupResult = hit.lookupResult;
+            result->polygonId = hit.polygonId;
+            result->metaId = hit.metaId;
+            result->numResults = 1;
+        } else {
+            result->lookupResult = ZD_LOOKUP_END;
+            result->polygonId = 0;
+            result->metaId = 0;
+            result->numResults = 0;
+        }
+        return;
+    }
+
+    list->numHits = 0;
+    ZDCollectHits(library, latFixedPoint, lonFixedPoint, NULL, 0, list);
+    ZDBatchSetResult(list, result);
+}
+
+static int ZDCompareBatchTests(const void *a, const void *b)
+{
+    const struct ZDBatchTest *const testA = a;
+    const struct ZDBatchTest *const testB = b;
+    if(testA->polygonIndex != testB->polygonIndex) {
+        return (testA->polygonIndex > testB->polygonIndex) ? 1 : -1;
+    }
+    return (testA->candidate > testB->candidate) - (testA->candidate < testB->candidate);
+}
+
+/* The zone ZDCollectHits takes from the grid cell of the point without testing polygons, or ZD_CELL_MIXED */
+static uint32_t ZDBatchCellZone(const ZoneDetect *library, int32_t latFixedPoint, int32_t lonFixedPoint)
+{
+    if(library->grid.cellStart && library->grid.cellZone && ZDGridContains(library, latFixedPoint, lonFixedPoint)) {
+        return library->grid.cellZone[ZDGridCell(library, latFixedPoint, lonFixedPoint)];
+    }
+    return ZD_CELL_MIXED;
+}
+
+/* Move point k of the group to the next vertex, this is one iteration of the loop in ZDPointInPolygon */
+static void ZDBatchGroupStep(struct ZDBatchGroup *group, uint32_t k, int32_t pointLat, int32_t pointLon, int32_t prevLat, int32_t prevLon, int first)
+{
+    const int32_t latFixedPoint = group->lat[k], lonFixedPoint = group->lon[k];
+
+    if(group->done[k]) {
+        return;
+    }
+
+    if(pointLat == latFixedPoint && pointLon == lonFixedPoint) {
+        group->result[k] = ZD_LOOKUP_ON_BORDER_VERTEX;
+        group->done[k] = -1;
+        return;
+    }
+
+    const int quadrant = ZDQuadrant(pointLat, pointLon, latFixedPoint, lonFixedPoint);
+
+    if(!first) {
+        int winding = group->winding[k];
+        const ZDLookupResult edgeResult = ZDWindingEdge(latFixedPoint, lonFixedPoint, prevLat, prevLon, group->quadrant[k], pointLat, pointLon, quadrant, &winding, NULL);
+        group->winding[k] = winding;
+        if(edgeResult != ZD_LOOKUP_IGNORE) {
+            group->result[k] = edgeResult;
+            group->done[k] = -1;
+            return;
+        }
+    }
+
+    group->quadrant[k] = quadrant;
+}
+
+/*
+ * Move all points of the group to the next vertex. Like the vector winding kernels, points for which the
+ * edge is not a plain move to the next quadrant, or that are done, are handed to the scalar code.
+ */
+static void ZDBatchGroupVertex(const ZoneDetect *library, struct ZDBatchGroup *group, uint32_t numPoints, int32_t pointLat, int32_t pointLon, int32_t prevLat, int32_t prevLon, int first)
+{
+    uint32_t k = 0;
+
+#if defined(ZD_SIMD_X86)
+    if(!first && library->simdLevel != ZD_SIMD_NONE) {
+        const __m128i vertexLat = _mm_set1_epi32(pointLat), vertexLon = _mm_set1_epi32(pointLon);
+        const __m128i edgeLat = _mm_set1_epi32(prevLat), edgeLon = _mm_set1_epi32(prevLon);
+        const __m128i one = _mm_set1_epi32(1), two = _mm_set1_epi32(2), three = _mm_set1_epi32(3);
+
+        for(; k + 4 <= numPoints; k += 4) {
+            const __m128i lat = _mm_loadu_si128((const __m128i *)(const void *)(group->lat + k));
+            const __m128i lon = _mm_loadu_si128((const __m128i *)(const void *)(group->lon + k));
+            const __m128i prevQuadrant = _mm_loadu_si128((const __m128i *)(const void *)(group->quadrant + k));
+            const __m128i done = _mm_loadu_si128((const __m128i *)(const void *)(group->done + k));
+
+            const __m128i quadrant = ZDQuadrantSSE2(vertexLat, vertexLon, lat, lon);
+            const __m128i delta = _mm_and_si128(_mm_sub_epi32(quadrant, prevQuadrant), three);
+            const __m128i outside = _mm_or_si128(ZDOutsideSSE2(vertexLat, edgeLat, lat), ZDOutsideSSE2(vertexLon, edgeLon, lon));
+            const __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi32(delta, two), _mm_xor_si128(outside, _mm_set1_epi32(-1))), done);
+
+            __m128i winding = _mm_loadu_si128((const __m128i *)(const void *)(group->winding + k));
+            winding = _mm_add_epi32(winding, _mm_andnot_si128(special, _mm_and_si128(_mm_cmpeq_epi32(delta, one), one)));
+            winding = _mm_sub_epi32(winding, _mm_andnot_si128(special, _mm_and_si128(_mm_cmpeq_epi32(delta, three), one)));
+            _mm_storeu_si128((__m128i *)(void *)(group->winding + k), winding);
+            _mm_storeu_si128((__m128i *)(void *)(group->quadrant + k), _mm_or_si128(_mm_andnot_si128(special, quadrant), _mm_and_si128(special, prevQuadrant)));
+
+            const int mask = _mm_movemask_ps(_mm_castsi128_ps(special));
+            if(mask) {
+                unsigned int lane;
+                for(lane = 0; lane < 4; lane++) {
+                    if(mask & (1 << lane)) {
+                        ZDBatchGroupStep(group, k + lane, pointLat, pointLon, prevLat, prevLon, first);
+                    }
+                }
+            }
+        }
+    }
+#else
+    (void)library;
+#endif
+
+    for(; k < numPoints; k++) {
+        ZDBatchGroupStep(group, k, pointLat, pointLon, prevLat, prevLon, first);
+    }
+}
+
+/* Test all points of the group against one polygon, which is decoded only once */
+static void ZDBatchTestPolygon(const ZoneDetect *library, uint32_t polygonIndex, struct ZDBatchGroup *group, uint32_t numPoints)
+{
+    int32_t pointLat, pointLon, prevLat = 0, prevLon = 0;
+    uint32_t k;
+    int first = 1;
+
+    if(library->numDecodedPolygons) {
+        const struct ZDDecodedPolygon *const polygon = ZDFindDecodedPolygon(library, polygonIndex);
+        if(polygon) {
+            for(k = 0; k < numPoints; k++) {
+                group->result[k] = ZDPointInDecodedPolygon(library, polygon, group->lat[k], group->lon[k], NULL);
+            }
+            return;
+        }
+    }
+
+    if(library->cache) {
+        struct ZDCacheEntry *const entry = ZDCacheAcquire(library, polygonIndex);
+        if(entry) {
+            for(k = 0; k < numPoints; k++) {
+                group->result[k] = ZDPointInDecodedPolygon(library, &entry->polygon, group->lat[k], group->lon[k], NULL);
+            }
+            ZDCacheRelease(library, entry);
+            return;
+        }
+        /* Fall through, the reader reports the parse error */
+    }
+
+    for(k = 0; k < numPoints; k++) {
+        group->quadrant[k] = 0;
+        group->winding[k] = 0;
+        group->done[k] = 0;
+    }
+
+    struct Reader reader;
+    ZDReaderInit(&reader, library, polygonIndex);
+
+    while(1) {
+        const int result = ZDReaderGetPoint(&reader, &pointLat, &pointLon);
+        if(result < 0) {
+            for(k = 0; k < numPoints; k++) {
+                if(!group->done[k]) {
+                    group->result[k] = ZD_LOOKUP_PARSE_ERROR;
+                }
+            }
+            return;
+        } else if(result == 0) {
+            break;
+        }
+
+        ZDBatchGroupVertex(library, group, numPoints, pointLat, pointLon, prevLat, prevLon, first);
+
+        prevLat = pointLat;
+        prevLon = pointLon;
+        first = 0;
+    }
+
+    for(k = 0; k < numPoints; k++) {
+        if(!group->done[k]) {
+            group->result[k] = ZDWindingToResult(group->winding[k], NULL);
+        }
+    }
+}
+
+/*
+ * Look up a block of points by testing every candidate polygon against all points of the block that need
+ * it, instead of the other way round. The hits of each point are then added in the order of ZDCollectHits,
+ * so the results are identical. Returns -1 if memory ran out, nothing is written then.
+ */
+static int ZDLookupBatchPolygonMajor(const ZoneDetect *library, const struct ZDBatchPoint *points, size_t numPoints, ZoneDetectBatchResult *results, struct ZDHitList *list)
+{
+    size_t maxCandidates = numPoints * 4, numCandidates = 0, maxGroup = 0;
+    struct ZDCandidate *candidates = malloc(maxCandidates * sizeof *candidates);
+    size_t *pointStart = malloc((numPoints + 1) * sizeof *pointStart);
+    struct ZDBatchTest *tests = NULL;
+    ZDLookupResult *lookupResults = NULL;
+    int32_t *groupMemory = NULL;
+    size_t i, j;
+
+    if(!candidates || !pointStart) {
+        goto fail;
+    }
+
+    for(i = 0; i < numPoints; i++) {
+        pointStart[i] = numCandidates;
+        if(ZDBatchCellZone(library, points[i].latFixedPoint, points[i].lonFixedPoint) != ZD_CELL_MIXED) {
+            continue;
+        }
+
+        const size_t numFound = ZDCollectCandidates(library, points[i].latFixedPoint, points[i].lonFixedPoint, candidates + numCandidates, maxCandidates - numCandidates);
+        if(numCandidates + numFound > maxCandidates) {
+            maxCandidates = (numCandidates + numFound) * 2;
+            struct ZDCandidate *const newCandidates = realloc(candidates, maxCandidates * sizeof *candidates);
+            if(!newCandidates) {
+                goto fail;
+            }
+            candidates = newCandidates;
+            ZDCollectCandidates(library, points[i].latFixedPoint, points[i].lonFixedPoint, candidates + numCandidates, numFound);
+        }
+        numCandidates += numFound;
+    }
+    pointStart[numPoints] = numCandidates;
+
+    if(numCandidates) {
+        tests = malloc(numCandidates * sizeof *tests);
+        lookupResults = malloc(numCandidates * sizeof *lookupResults);
+        if(!tests || !lookupResults) {
+            goto fail;
+        }
+
+        for(i = 0; i < numPoints; i++) {
+            for(j = pointStart[i]; j < pointStart[i + 1]; j++) {
+                tests[j].polygonIndex = candidates[j].polygonIndex;
+                tests[j].candidate = (uint32_t)j;
+                tests[j].point = (uint32_t)i;
+            }
+        }
+        qsort(tests, numCandidates, sizeof *tests, ZDCompareBatchTests);
+
+        for(i = 0; i < numCandidates; i = j) {
+            for(j = i + 1; j < numCandidates && tests[j].polygonIndex == tests[i].polygonIndex; j++);
+            if(j - i > maxGroup) {
+                maxGroup = j - i;
+            }
+        }
+
+        groupMemory = malloc(maxGroup * (5 * sizeof(int32_t) + sizeof(ZDLookupResult)));
+        if(!groupMemory) {
+            goto fail;
+        }
+
+        struct ZDBatchGroup group;
+        group.lat = groupMemory;
+        group.lon = group.lat + maxGroup;
+        group.quadrant = group.lon + maxGroup;
+        group.winding = group.quadrant + maxGroup;
+        group.done = group.winding + maxGroup;
+        group.result = (ZDLookupResult *)(void *)(group.done + maxGroup);
+
+        for(i = 0; i < numCandidates; i = j) {
+            for(j = i; j < numCandidates && tests[j].polygonIndex == tests[i].polygonIndex; j++) {
+                group.lat[j - i] = points[tests[j].point].latFixedPoint;
+                group.lon[j - i] = points[tests[j].point].lonFixedPoint;
+            }
+
+            ZDBatchTestPolygon(library, tests[i].polygonIndex, &group, (uint32_t)(j - i));
+
+            size_t k;
+            for(k = i; k < j; k++) {
+                lookupResults[tests[k].candidate] = group.result[k - i];
+            }
+        }
+    }
+
+    for(i = 0; i < numPoints; i++) {
+        const uint32_t cellZone = ZDBatchCellZone(library, points[i].latFixedPoint, points[i].lonFixedPoint);
+
+        list->numHits = 0;
+        if(cellZone == ZD_CELL_EMPTY) {
+            /* No zone contains the cell */
+        } else if(cellZone != ZD_CELL_MIXED) {
+            ZDHitListAdd(list, cellZone, library->table.metadataIndex[cellZone], ZD_LOOKUP_IN_ZONE);
+        } else {
+            /* Like ZDLookupPolygon, a parse error or failed allocation stops the point */
+            for(j = pointStart[i]; j < pointStart[i + 1]; j++) {
+                if(lookupResults[j] == ZD_LOOKUP_PARSE_ERROR) {
+                    break;
+                } else if(lookupResults[j] != ZD_LOOKUP_NOT_IN_ZONE && ZDHitListAdd(list, candidates[j].polygonId, candidates[j].metadataIndex, lookupResults[j])) {
+                    break;
+                }
+            }
+        }
+        ZDBatchSetResult(list, &results[points[i].index]);
+    }
+
+    free(groupMemory);
+    free(lookupResults);
+    free(tests);
+    free(pointStart);
+    free(candidates);
+    return 0;
+
+fail:
+    if(groupMemory) free(groupMemory);
+    if(lookupResults) free(lookupResults);
+    if(tests) free(tests);
+    if(pointStart) free(pointStart);
+    if(candidates) free(candidates);
+    return -1;
+}
+
+static void ZDLookupBatchSequential(const ZoneDetect *library, const float *lat, const float *lon, size_t numPoints, ZoneDetectBatchResult *results, uint32_t flags)
+{
+    ZoneDetectHit hitBuffer[16];
+    struct ZDHitList list;
+    struct ZDBatchPoint *points = NULL;
+    size_t start;
+
+    list.hits = hitBuffer;
+    list.heap = NULL;
+    list.numHits = 0;
+    list.capacity = sizeof(hitBuffer) / sizeof(hitBuffer[0]);
+    list.fixed = 0;
+
+    const int polygonMajor = (flags & ZD_BATCH_POLYGON_MAJOR) && !(flags & ZD_BATCH_FIRST_MATCH);
+    if((!(flags & ZD_BATCH_KEEP_ORDER) || polygonMajor) && numPoints > 1) {
+        /* Without memory for sorting the points are simply visited in order */
+        points = malloc((numPoints < ZD_BATCH_CHUNK ? numPoints : ZD_BATCH_CHUNK) * sizeof *points);
+    }
+
+    for(start = 0; start < numPoints; start += ZD_BATCH_CHUNK) {
+        const size_t chunkSize = (numPoints - start < ZD_BATCH_CHUNK) ? numPoints - start : ZD_BATCH_CHUNK;
+        size_t i;
+
+        if(!points) {
+            for(i = start; i < start + chunkSize; i++) {
+                const int32_t latFixedPoint = ZDFloatToFixedPoint(lat[i], 90, library->precision);
+                const int32_t lonFixedPoint = ZDFloatToFixedPoint(lon[i], 180, library->precision);
+                ZDLookupBatchPoint(library, latFixedPoint, lonFixedPoint, flags, &list, &results[i]);
+            }
+            continue;
+        }
+
+        /* Visit the points along a Morton curve, nearby points then use the same polygons */
+        for(i = 0; i < chunkSize; i++) {
+            struct ZDBatchPoint *const point = &points[i];
+            point->latFixedPoint = ZDFloatToFixedPoint(lat[start + i], 90, library->precision);
+            point->lonFixedPoint = ZDFloatToFixedPoint(lon[start + i], 180, library->precision);
+            point->key = ZDMortonCoordinate(point->latFixedPoint, library->precision) |
+                         (ZDMortonCoordinate(point->lonFixedPoint, library->precision) << 1);
+            point->index = (uint32_t)i;
+        }
+
+        if(!(flags & ZD_BATCH_KEEP_ORDER)) {
+            qsort(points, chunkSize, sizeof *points, ZDCompareBatchPoints);
+        }
+
+        size_t blockStart;
+        for(blockStart = 0; blockStart < chunkSize; blockStart += ZD_BATCH_POLYGON_POINTS) {
+            const size_t blockEnd = (chunkSize - blockStart < ZD_BATCH_POLYGON_POINTS) ? chunkSize : blockStart + ZD_BATCH_POLYGON_POINTS;
+            if(polygonMajor && !ZDLookupBatchPolygonMajor(library, &points[blockStart], blockEnd - blockStart, &results[start], &list)) {
+                continue;
+            }
+
+            for(i = blockStart; i < blockEnd; i++) {
+                ZDLookupBatchPoint(library, points[i].latFixedPoint, points[i].lonFixedPoint, flags, &list, &results[start + points[i].index]);
+            }
+        }
+    }
+
+    if(points) free(points);
+    if(list.heap) free(list.heap);
+}
+
+static int ZDBatchDequePop(struct ZDBatchDeque *deque, struct ZDBatchUnit *unit, int steal)
+{
+    int found = 0;
+
+    ZDMutexLock(&deque->mutex);
+    if(deque->head < deque->tail) {
+        *unit = steal ? deque->units[deque->head++] : deque->units[--deque->tail];
+        found = 1;
+    }
+    ZDMutexUnlock(&deque->mutex);
+
+    return found;
+}
+
+/* Sort the next chunk and queue its units on the deque of the worker, returns 0 if all chunks were taken */
+static int ZDBatchClaimChunk(struct ZDBatchJob *job, uint32_t worker)
+{
+    ZDMutexLock(&job->mutex);
+    const uint32_t chunk = job->nextChunk++;
+    ZDMutexUnlock(&job->mutex);
+
+    if((uint64_t)chunk * job->chunkSize >= job->numPoints) {
+        return 0;
+    }
+
+    const uint32_t start = chunk * job->chunkSize;
+    const uint32_t end = (job->numPoints - start < job->chunkSize) ? job->numPoints : start + job->chunkSize;
+    const unsigned int precision = job->library->precision;
+    uint32_t i;
+
+    for(i = start; i < end; i++) {
+        struct ZDBatchPoint *const point = &job->points[i];
+        point->latFixedPoint = ZDFloatToFixedPoint(job->lat[job->base + i], 90, precision);
+        point->lonFixedPoint = ZDFloatToFixedPoint(job->lon[job->base + i], 180, precision);
+        point->key = ZDMortonCoordinate(point->latFixedPoint, precision) | (ZDMortonCoordinate(point->lonFixedPoint, precision) << 1);
+        point->index = i;
+    }
+
+    if(job->sort) {
+        qsort(&job->points[start], end - start, sizeof *job->points, ZDCompareBatchPoints);
+    }
+
+    /* Queue in reverse so the owner walks the chunk along the curve */
+    struct ZDBatchDeque *const deque = &job->deques[worker];
+    ZDMutexLock(&deque->mutex);
+    deque->head = deque->tail = 0;
+    for(i = end; i > start;) {
+        const uint32_t unitStart = (i - start > ZD_BATCH_UNIT) ? i - ZD_BATCH_UNIT : start;
+        deque->units[deque->tail].start = unitStart;
+        deque->units[deque->tail].end = i;
+        deque->tail++;
+        i = unitStart;
+    }
+    ZDMutexUnlock(&deque->mutex);
+
+    return 1;
+}
+
+static void ZDBatchWorker(void *argument)
+{
+    struct ZDBatchJob *const job = argument;
+    ZoneDetectHit hitBuffer[16];
+    struct ZDHitList list;
+
+    ZDMutexLock(&job->mutex);
+    const uint32_t worker = job->nextWorker++;
+    ZDMutexUnlock(&job->mutex);
+
+    if(worker >= job->numWorkers) {
+        /* The pool started more workers than requested */
+        return;
+    }
+
+    list.hits = hitBuffer;
+    list.heap = NULL;
+    list.numHits = 0;
+    list.capacity = sizeof(hitBuffer) / sizeof(hitBuffer[0]);
+    list.fixed = 0;
+
+    while(1) {
+        struct ZDBatchUnit unit;
+
+        if(!ZDBatchDequePop(&job->deques[worker], &unit, 0)) {
+            if(ZDBatchClaimChunk(job, worker)) {
+                continue;
+            }
+
+            /* No more chunks, help the other workers */
+            uint32_t victim;
+            int found = 0;
+            for(victim = 1; victim < job->numWorkers && !found; victim++) {
+                found = ZDBatchDequePop(&job->deques[(worker + victim) % job->numWorkers], &unit, 1);
+            }
+            if(!found) {
+                break;
+            }
+        }
+
+        if((job->flags & ZD_BATCH_POLYGON_MAJOR) && !(job->flags & ZD_BATCH_FIRST_MATCH) &&
+                !ZDLookupBatchPolygonMajor(job->library, &job->points[unit.start], unit.end - unit.start, &job->results[job->base], &list)) {
+            continue;
+        }
+
+        uint32_t i;
+        for(i = unit.start; i < unit.end; i++) {
+            const struct ZDBatchPoint *const point = &job->points[i];
+            ZDLookupBatchPoint(job->library, point->latFixedPoint, point->lonFixedPoint, job->flags, &list, &job->results[job->base + point->index]);
+        }
+    }
+
+    if(list.heap) free(list.heap);
+}
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+static DWORD WINAPI ZDBatchThreadMain(LPVOID argument)
+{
+    ZDBatchWorker(argument);
+    return 0;
+}
+#elif defined(ZD_THREADS)
+static void *ZDBatchThreadMain(void *argument)
+{
+    ZDBatchWorker(argument);
+    return NULL;
+}
+#endif
+
+static uint32_t ZDNumProcessors(void)
+{
+#if defined(_MSC_VER) || defined(__MINGW32__)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors ? (uint32_t)info.dwNumberOfProcessors : 1;
+#elif defined(ZD_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+    const long numProcessors = sysconf(_SC_NPROCESSORS_ONLN);
+    return (numProcessors > 0) ? (uint32_t)numProcessors : 1;
+#else
+    return 1;
+#endif
+}
+
+static void ZDRunBatchWorkers(struct ZDBatchJob *job, const ZoneDetectBatchOptions *options)
+{
+    if(options->runWorkers) {
+        options->runWorkers(options->poolContext, ZDBatchWorker, job, job->numWorkers);
+        return;
+    }
+
+#if defined(ZD_THREADS)
+    ZDThread threads[ZD_BATCH_MAX_THREADS];
+    uint32_t numThreads, i;
+
+    /* If a thread cannot be started, the remaining workers take over its chunks */
+    for(numThreads = 0; numThreads + 1 < job->numWorkers; numThreads++) {
+#if defined(_MSC_VER) || defined(__MINGW32__)
+        threads[numThreads] = CreateThread(NULL, 0, ZDBatchThreadMain, job, 0, NULL);
+        if(!threads[numThreads]) break;
+#else
+        if(pthread_create(&threads[numThreads], NULL, ZDBatchThreadMain, job)) break;
+#endif
+    }
+
+    ZDBatchWorker(job);
+
+    for(i = 0; i < numThreads; i++) {
+#if defined(_MSC_VER) || defined(__MINGW32__)
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+#else
+    ZDBatchWorker(job);
+#endif
+}
+
+void ZDInitBatchOptions(ZoneDetectBatchOptions *options)
+{
+    memset(options, 0, sizeof(*options));
+}
+
+void ZDLookupBatchWithOptions(const ZoneDetect *library, const float *lat, const float *lon, size_t numPoints, ZoneDetectBatchResult *results, const ZoneDetectBatchOptions *options)
+{
+    uint32_t numWorkers = options->numThreads ? options->numThreads : ZDNumProcessors();
+    if(numWorkers > ZD_BATCH_MAX_THREADS) {
+        numWorkers = ZD_BATCH_MAX_THREADS;
+    }
+
+    /* Small batches get smaller chunks so every worker has one */
+    uint32_t chunkSize = ZD_BATCH_THREAD_CHUNK;
+    if(numPoints / numWorkers < chunkSize) {
+        chunkSize = (uint32_t)(numPoints / numWorkers) + 1;
+        if(chunkSize < ZD_BATCH_UNIT) {
+            chunkSize = ZD_BATCH_UNIT;
+        }
+    }
+    if((numPoints + chunkSize - 1) / chunkSize < numWorkers) {
+        numWorkers = (uint32_t)((numPoints + chunkSize - 1) / chunkSize);
+    }
+
+    if(numWorkers <= 1) {
+        ZDLookupBatchSequential(library, lat, lon, numPoints, results, options->flags);
+        return;
+    }
+
+    struct ZDBatchJob job;
+    const uint32_t roundSize = numWorkers * chunkSize;
+    const uint32_t unitsPerChunk = (chunkSize + ZD_BATCH_UNIT - 1) / ZD_BATCH_UNIT;
+    uint32_t numDeques = 0;
+
+    memset(&job, 0, sizeof(job));
+    job.library = library;
+    job.lat = lat;
+    job.lon = lon;
+    job.results = results;
+    job.sort = !(options->flags & ZD_BATCH_KEEP_ORDER);
+    job.flags = options->flags;
+    job.chunkSize = chunkSize;
+    job.numWorkers = numWorkers;
+
+    job.points = malloc((size_t)roundSize * sizeof *job.points);
+    job.deques = calloc(numWorkers, sizeof *job.deques);
+    if(!job.points || !job.deques || ZDMutexInit(&job.mutex)) {
+        goto fail;
+    }
+    for(numDeques = 0; numDeques < numWorkers; numDeques++) {
+        job.deques[numDeques].units = malloc(unitsPerChunk * sizeof *job.deques[numDeques].units);
+        if(!job.deques[numDeques].units || ZDMutexInit(&job.deques[numDeques].mutex)) {
+            if(job.deques[numDeques].units) free(job.deques[numDeques].units);
+            ZDMutexDestroy(&job.mutex);
+            goto fail;
+        }
+    }
+
+    for(job.base = 0; job.base < numPoints; job.base += roundSize) {
+        job.numPoints = (numPoints - job.base < roundSize) ? (uint32_t)(numPoints - job.base) : roundSize;
+        job.nextChunk = 0;
+        job.nextWorker = 0;
+        ZDRunBatchWorkers(&job, options);
+    }
+
+    ZDMutexDestroy(&job.mutex);
+    while(numDeques > 0) {
+        numDeques--;
+        ZDMutexDestroy(&job.deques[numDeques].mutex);
+        free(job.deques[numDeques].units);
+    }
+    free(job.deques);
+    free(job.points);
+    return;
+
+fail:
+    while(numDeques > 0) {
+        numDeques--;
+        ZDMutexDestroy(&job.deques[numDeques].mutex);
+        free(job.deques[numDeques].units);
+    }
+    if(job.deques) free(job.deques);
+    if(job.points) free(job.points);
+
+    ZDLookupBatchSequential(library, lat, lon, numPoints, results, options->flags);
+}
+
+void ZDLookupBatch(const ZoneDetect *library, const float *lat, const float *lon, size_t numPoints, ZoneDetectBatchResult *results, uint32_t flags)
+{
+    ZoneDetectBatchOptions options;
+    ZDInitBatchOptions(&options);
+    options.flags = flags;
+    options.numThreads = 1;
+
+    ZDLookupBatchWithOptions(library, lat, lon, numPoints, results, &options);
+}
+
+/* Per entity state in separate arrays, the common case only reads the position and reuse distance */
+struct ZoneDetectTrackerOpaque {
+    const ZoneDetect *library;
+    uint32_t numEntities;
+
+    int32_t *lat;
+    int32_t *lon;
+    uint64_t *reuseSqr;
+    /* Grid cell the reuse distance is valid in, only used if the library has a grid */
+    uint32_t *cell;
+    uint32_t *zone;
+
+    ZoneDetectHit *hits;
+    size_t maxHits;
+
+    uint64_t updates;
+    uint64_t lookups;
+    uint64_t events;
+};
+
+void ZDTrackerFree(ZoneDetectTracker *tracker)
+{
+    if(tracker) {
+        if(tracker->lat) free(tracker->lat);
+        if(tracker->lon) free(tracker->lon);
+        if(tracker->reuseSqr) free(tracker->reuseSqr);
+        if(tracker->cell) free(tracker->cell);
+        if(tracker->zone) free(tracker->zone);
+        if(tracker->hits) free(tracker->hits);
+        free(tracker);
+    }
+}
+
+ZoneDetectTracker *ZDTrackerCreate(const ZoneDetect *library, uint32_t numEntities)
+{
+    ZoneDetectTracker *const tracker = calloc(1, sizeof *tracker);
+    if(!tracker) {
+        return NULL;
+    }
+
+    tracker->library = library;
+    tracker->numEntities = numEntities;
+    tracker->lat = malloc((size_t)numEntities * sizeof *tracker->lat);
+    tracker->lon = malloc((size_t)numEntities * sizeof *tracker->lon);
+    tracker->reuseSqr = malloc((size_t)numEntities * sizeof *tracker->reuseSqr);
+    tracker->cell = malloc((size_t)numEntities * sizeof *tracker->cell);
+    tracker->zone = malloc((size_t)numEntities * sizeof *tracker->zone);
+    tracker->maxHits = 16;
+    tracker->hits = malloc(tracker->maxHits * sizeof *tracker->hits);
+    if((numEntities && (!tracker->lat || !tracker->lon || !tracker->reuseSqr || !tracker->cell || !tracker->zone)) || !tracker->hits) {
+        ZDTrackerFree(tracker);
+        return NULL;
+    }
+
+    /* A reuse distance of 0 forces a lookup on the first update */
+    uint32_t i;
+    for(i = 0; i < numEntities; i++) {
+        tracker->lat[i] = 0;
+        tracker->lon[i] = 0;
+        tracker->reuseSqr[i] = 0;
+        tracker->cell[i] = 0;
+        tracker->zone[i] = ZD_TRACKER_NO_ZONE;
+    }
+
+    return tracker;
+}
+
+/*
+ * The zone an entity is in after a lookup. It stays in its current zone as long as it is inside or on the
+ * border of it, otherwise it moves to the first zone containing the point, or on whose border it is.
+ */
+static uint32_t ZDTrackerZone(const ZoneDetectHit *hits, size_t numHits, uint32_t current)
+{
+    size_t i;
+    for(i = 0; i < numHits; i++) {
+        if(hits[i].metaId == current && hits[i].lookupResult >= ZD_LOOKUP_IN_ZONE) {
+            return current;
+        }
+    }
+    for(i = 0; i < numHits; i++) {
+        if(hits[i].lookupResult == ZD_LOOKUP_IN_ZONE) {
+            return hits[i].metaId;
+        }
+    }
+    for(i = 0; i < numHits; i++) {
+        if(hits[i].lookupResult == ZD_LOOKUP_ON_BORDER_VERTEX || hits[i].lookupResult == ZD_LOOKUP_ON_BORDER_SEGMENT) {
+            return hits[i].metaId;
+        }
+    }
+    return ZD_TRACKER_NO_ZONE;
+}
+
+static int ZDTrackerLookup(ZoneDetectTracker *tracker, uint32_t entity, int32_t latFixedPoint, int32_t lonFixedPoint)
+{
+    const ZoneDetect *const library = tracker->library;
+    float safezone = 0;
+
+    size_t numHits = ZDLookupHitsFixedPoint(library, latFixedPoint, lonFixedPoint, 0, &safezone, tracker->hits, tracker->maxHits);
+    if(numHits > tracker->maxHits) {
+        ZoneDetectHit *const hits = realloc(tracker->hits, numHits * sizeof *hits);
+        if(!hits) {
+            return -1;
+        }
+        tracker->hits = hits;
+        tracker->maxHits = numHits;
+        numHits = ZDLookupHitsFixedPoint(library, latFixedPoint, lonFixedPoint, 0, &safezone, tracker->hits, tracker->maxHits);
+    }
+    tracker->lookups++;
+
+    const double distance = (double)safezone * (double)(1 << (library->precision - 1)) / 90;
+    tracker->lat[entity] = latFixedPoint;
+    tracker->lon[entity] = lonFixedPoint;
+    tracker->reuseSqr[entity] = ZDResultReuseSqr(library, latFixedPoint, lonFixedPoint, (distance < 4e9) ? (uint64_t)(distance * distance) : UINT64_MAX);
+    tracker->cell[entity] = library->grid.cellStart ? ZDGridCell(library, latFixedPoint, lonFixedPoint) : 0;
+    tracker->zone[entity] = ZDTrackerZone(tracker->hits, numHits, tracker->zone[entity]);
+    return 0;
+}
+
+size_t ZDTrackerUpdate(ZoneDetectTracker *tracker, const uint32_t *entities, const float *lat, const float *lon, size_t numUpdates, ZoneDetectTrackerEvent *events, size_t maxEvents, size_t *numEvents)
+{
+    const ZoneDetect *const library = tracker->library;
+    size_t i;
+
+    *numEvents = 0;
+    for(i = 0; i < numUpdates; i++) {
+        const uint32_t entity = entities[i];
+        if(entity >= tracker->numEntities) {
+            continue;
+        }
+
+        /* An update causes at most an exit and an enter event */
+        if(maxEvents - *numEvents < 2) {
+            break;
+        }
+
+        const int32_t latFixedPoint = ZDFloatToFixedPoint(lat[i], 90, library->precision);
+        const int32_t lonFixedPoint = ZDFloatToFixedPoint(lon[i], 180, library->precision);
+        tracker->updates++;
+
+        /* Still inside the safe circle of the last lookup */
+        const int64_t diffLat = (int64_t)latFixedPoint - tracker->lat[entity];
+        const int64_t diffLon = (int64_t)lonFixedPoint - tracker->lon[entity];
+        const uint64_t distanceSqr = (uint64_t)(diffLat * diffLat) + (uint64_t)(diffLon * diffLon) * 4;
+        if(distanceSqr < tracker->reuseSqr[entity] &&
+                (!library->grid.cellStart || ZDGridCell(library, latFixedPoint, lonFixedPoint) == tracker->cell[entity])) {
+            continue;
+        }
+
+        const uint32_t previous = tracker->zone[entity];
+        if(ZDTrackerLookup(tracker, entity, latFixedPoint, lonFixedPoint)) {
+            break;
+        }
+
+        const uint32_t current = tracker->zone[entity];
+        if(current != previous) {
+            if(previous != ZD_TRACKER_NO_ZONE) {
+                events[*numEvents].entity = entity;
+                events[*numEvents].metaId = previous;
+                events[*numEvents].type = ZD_TRACKER_EXIT;
+                (*numEvents)++;
+            }
+            if(current != ZD_TRACKER_NO_ZONE) {
+                events[*numEvents].entity = entity;
+                events[*numEvents].metaId = current;
+                events[*numEvents].type = ZD_TRACKER_ENTER;
+                (*numEvents)++;
+            }
+        }
+    }
+
+    tracker->events += *numEvents;
+    return i;
+}
+
+uint32_t ZDTrackerGetZone(const ZoneDetectTracker *tracker, uint32_t entity)
+{
+    if(entity >= tracker->numEntities) {
+        return ZD_TRACKER_NO_ZONE;
+    }
+    return tracker->zone[entity];
+}
+
+void ZDTrackerGetStats(const ZoneDetectTracker *tracker, ZoneDetectTrackerStats *stats)
+{
+    stats->updates = tracker->updates;
+    stats->lookups = tracker->lookups;
+    stats->events = tracker->events;
+}
+
+/* Children per R-tree node written by ZDBuilderFinish, like the database builder */
+#define ZD_BUILDER_FANOUT 16
+
+/* Growable byte buffer of the builder */
+struct ZDBuilderBuffer {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+};
+
+struct ZDBuilderPolygon {
+    int32_t minLat, minLon, maxLat, maxLon;
+    uint32_t metadata;
+    /* Keeps polygons with the same minLat in the order they were added */
+    uint32_t sequence;
+    /* Encoded vertices in the vertices buffer of the builder */
+    size_t dataStart, dataLength;
+    /* Offset in the data section, set by ZDBuilderFinish */
+    uint32_t fileIndex;
+};
+
+/* Box of a polygon or R-tree node */
+struct ZDBuilderNode {
+    int32_t minLat, minLon, maxLat, maxLon;
+    uint32_t first, count;
+};
+
+struct ZDBuilderSortKey {
+    int64_t key;
+    uint32_t index;
+};
+
+struct ZoneDetectBuilderOpaque {
+    uint8_t tableType;
+    uint8_t precision;
+    uint8_t numFields;
+    char **fieldNames;
+    char *notice;
+
+    struct ZDBuilderPolygon *polygons;
+    size_t numPolygons, polygonsCapacity;
+    struct ZDBuilderBuffer vertices;
+
+    /* One offset in the string pool per field of every record */
+    uint32_t *records;
+    size_t numRecords, recordsCapacity;
+    struct ZDBuilderBuffer strings;
+    /* Open addressing table of string pool offsets, UINT32_MAX marks an empty slot */
+    uint32_t *stringTable;
+    size_t stringTableSize, numStrings;
+};
+
+static int ZDBufferReserve(struct ZDBuilderBuffer *buffer, size_t extra)
+{
+    if(buffer->length + extra > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        while(capacity < buffer->length + extra) {
+            capacity *= 2;
+        }
+        uint8_t *const data = realloc(buffer->data, capacity);
+        if(!data) {
+            return -1;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    return 0;
+}
+
+static int ZDBufferAppend(struct ZDBuilderBuffer *buffer, const void *data, size_t length)
+{
+    if(ZDBufferReserve(buffer, length)) {
+        return -1;
+    }
+    if(length) {
+        memcpy(buffer->data + buffer->length, data, length);
+    }
+    buffer->length += length;
+    return 0;
+}
+
+static int ZDBufferPutVariableLength(struct ZDBuilderBuffer *buffer, uint64_t value)
+{
+    if(ZDBufferReserve(buffer, 10)) {
+        return -1;
+    }
+    do {
+        uint8_t byteOut = value & 0x7F;
+        if(value >= 128) {
+            byteOut |= 128;
+        }
+        buffer->data[buffer->length++] = byteOut;
+        value >>= 7;
+    } while(value);
+    return 0;
+}
+
+static uint64_t ZDEncodeSigned(int64_t value)
+{
+    return (value < 0) ? (uint64_t)(-value) * 2 + 1 : (uint64_t)value * 2;
+}
+
+static int ZDBufferPutSigned(struct ZDBuilderBuffer *buffer, int64_t value)
+{
+    return ZDBufferPutVariableLength(buffer, ZDEncodeSigned(value));
+}
+
+static int ZDBufferPutUInt32(struct ZDBuilderBuffer *buffer, uint32_t value)
+{
+    const uint8_t bytes[4] = {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24)};
+    return ZDBufferAppend(buffer, bytes, sizeof(bytes));
+}
+
+/* Header string, as parsed by ZDParseString */
+static int ZDBufferPutString(struct ZDBuilderBuffer *buffer, const char *str)
+{
+    const size_t length = strlen(str);
+    size_t i;
+    if(ZDBufferPutVariableLength(buffer, length) || ZDBufferReserve(buffer, length)) {
+        return -1;
+    }
+    for(i = 0; i < length; i++) {
+        buffer->data[buffer->length++] = (uint8_t)str[i] ^ UINT8_C(0x80);
+    }
+    return 0;
+}
+
+/* Inverse of ZDUnshuffle */
+static uint64_t ZDShuffle(uint32_t value)
+{
+    uint64_t w = value;
+    w = (w | (w << 16)) & 0x0000FFFF0000FFFFllu;
+    w = (w | (w << 8))  & 0x00FF00FF00FF00FFllu;
+    w = (w | (w << 4))  & 0x0F0F0F0F0F0F0F0Fllu;
+    w = (w | (w << 2))  & 0x3333333333333333llu;
+    w = (w | (w << 1))  & 0x5555555555555555llu;
+    return w;
+}
+
+/* Inverse of ZDDecodePoint, zero is reserved for markers */
+static uint64_t ZDEncodePoint(int64_t lat, int64_t lon)
+{
+    return ZDShuffle((uint32_t)ZDEncodeSigned(lat)) | (ZDShuffle((uint32_t)ZDEncodeSigned(lon)) << 1);
+}
+
+static char *ZDBuilderDuplicate(const char *str)
+{
+    const size_t length = strlen(str);
+    char *const copy = malloc(length + 1);
+    if(copy) {
+        memcpy(copy, str, length + 1);
+    }
+    return copy;
+}
+
+void ZDBuilderFree(ZoneDetectBuilder *builder)
+{
+    if(builder) {
+        if(builder->fieldNames) {
+            size_t i;
+            for(i = 0; i < builder->numFields; i++) {
+                if(builder->fieldNames[i]) free(builder->fieldNames[i]);
+            }
+            free(builder->fieldNames);
+        }
+        if(builder->notice) free(builder->notice);
+        if(builder->polygons) free(builder->polygons);
+        if(builder->vertices.data) free(builder->vertices.data);
+        if(builder->records) free(builder->records);
+        if(builder->strings.data) free(builder->strings.data);
+        if(builder->stringTable) free(builder->stringTable);
+        free(builder);
+    }
+}
+
+ZoneDetectBuilder *ZDBuilderCreate(uint8_t tableType, unsigned int precision, const char *const *fieldNames, uint8_t numFields, const char *notice)
+{
+    size_t i;
+
+    /* The lookups need coordinates of at most 30 bits */
+    if(precision < 2 || precision > 30) {
+        return NULL;
+    }
+
+    ZoneDetectBuilder *const builder = calloc(1, sizeof *builder);
+    if(!builder) {
+        return NULL;
+    }
+
+    builder->tableType = tableType;
+    builder->precision = (uint8_t)precision;
+    builder->numFields = numFields;
+
+    /* Header strings are limited to 255 bytes */
+    builder->fieldNames = calloc(numFields ? numFields : 1, sizeof *builder->fieldNames);
+    if(!builder->fieldNames) {
+        goto fail;
+    }
+    for(i = 0; i < numFields; i++) {
+        if(strlen(fieldNames[i]) >= 256 || !(builder->fieldNames[i] = ZDBuilderDuplicate(fieldNames[i]))) {
+            goto fail;
+        }
+    }
+    if(!notice) {
+        notice = "";
+    }
+    if(strlen(notice) >= 256 || !(builder->notice = ZDBuilderDuplicate(notice))) {
+        goto fail;
+    }
+
+    builder->stringTableSize = 64;
+    builder->stringTable = malloc(builder->stringTableSize * sizeof *builder->stringTable);
+    if(!builder->stringTable) {
+        goto fail;
+    }
+    for(i = 0; i < builder->stringTableSize; i++) {
+        builder->stringTable[i] = UINT32_MAX;
+    }
+
+    return builder;
+
+fail:
+    ZDBuilderFree(builder);
+    return NULL;
+}
+
+static uint32_t ZDBuilderHashString(const char *str)
+{
+    /* FNV-1a */
+    uint32_t hash = UINT32_C(2166136261);
+    while(*str) {
+        hash ^= (uint8_t)*str++;
+        hash *= UINT32_C(16777619);
+    }
+    return hash;
+}
+
+/* Offset of the string in the pool, each distinct string is stored once. Returns UINT32_MAX on failure. */
+static uint32_t ZDBuilderInternString(ZoneDetectBuilder *builder, const char *str)
+{
+    size_t slot, i;
+
+    if(2 * (builder->numStrings + 1) > builder->stringTableSize) {
+        const size_t tableSize = builder->stringTableSize * 2;
+        uint32_t *const table = malloc(tableSize * sizeof *table);
+        if(!table) {
+            return UINT32_MAX;
+        }
+        for(i = 0; i < tableSize; i++) {
+            table[i] = UINT32_MAX;
+        }
+        for(i = 0; i < builder->stringTableSize; i++) {
+            const uint32_t offset = builder->stringTable[i];
+            if(offset != UINT32_MAX) {
+                for(slot = ZDBuilderHashString((const char *)builder->strings.data + offset) & (tableSize - 1); table[slot] != UINT32_MAX; slot = (slot + 1) & (tableSize - 1));
+                table[slot] = offset;
+            }
+        }
+        free(builder->stringTable);
+        builder->stringTable = table;
+        builder->stringTableSize = tableSize;
+    }
+
+    for(slot = ZDBuilderHashString(str) & (builder->stringTableSize - 1); builder->stringTable[slot] != UINT32_MAX; slot = (slot + 1) & (builder->stringTableSize - 1)) {
+        if(!strcmp((const char *)builder->strings.data + builder->stringTable[slot], str)) {
+            return builder->stringTable[slot];
+        }
+    }
+
+    const size_t offset = builder->strings.length;
+    if(offset + strlen(str) + 1 >= UINT32_MAX || ZDBufferAppend(&builder->strings, str, strlen(str) + 1)) {
+        return UINT32_MAX;
+    }
+
+    builder->stringTable[slot] = (uint32_t)offset;
+    builder->numStrings++;
+    return (uint32_t)offset;
+}
+
+int ZDBuilderAddMetadata(ZoneDetectBuilder *builder, const char *const *fields, uint32_t *metaId)
+{
+    size_t i;
+
+    /* The metaId is the offset of the record in the metadata section */
+    const uint64_t recordOffset = 4 + (uint64_t)builder->numRecords * builder->numFields * 4;
+    if(recordOffset + (uint64_t)builder->numFields * 4 > UINT32_MAX || builder->numRecords >= INT32_MAX) {
+        return -1;
+    }
+
+    if(builder->numFields && (builder->numRecords + 1) * builder->numFields > builder->recordsCapacity) {
+        const size_t capacity = builder->recordsCapacity ? builder->recordsCapacity * 2 : (size_t)builder->numFields * 64;
+        uint32_t *const records = realloc(builder->records, capacity * sizeof *records);
+        if(!records) {
+            return -1;
+        }
+        builder->records = records;
+        builder->recordsCapacity = capacity;
+    }
+
+    for(i = 0; i < builder->numFields; i++) {
+        const uint32_t offset = ZDBuilderInternString(builder, fields[i] ? fields[i] : "");
+        if(offset == UINT32_MAX) {
+            return -1;
+        }
+        builder->records[builder->numRecords * builder->numFields + i] = offset;
+    }
+
+    if(metaId) {
+        *metaId = (uint32_t)recordOffset;
+    }
+    return (int)builder->numRecords++;
+}
+
+/* Moving in the same direction twice, the vertex in between can be left out */
+static int ZDSameDirection(int64_t diffLat, int64_t diffLon, int64_t prevDiffLat, int64_t prevDiffLon)
+{
+    if(!prevDiffLat && !prevDiffLon) {
+        return 0;
+    }
+    return diffLat * prevDiffLon == diffLon * prevDiffLat && diffLat * prevDiffLat + diffLon * prevDiffLon > 0;
+}
+
+/*
+ * Encode a ring as version 1 and up store it: the first point, then the difference to each next point and an
+ * end marker. Runs of points in the same direction are merged into one step. Unlike the database builder, this
+ * does not refer to the encoded vertices of other polygons, which only makes the data smaller.
+ */
+static int ZDBuilderEncodeRing(struct ZDBuilderBuffer *output, const int32_t *points, size_t numPoints, size_t start)
+{
+    int64_t accDiffLat = 0, accDiffLon = 0, prevDiffLat = 0, prevDiffLon = 0;
+    int64_t prevLat = points[2 * start], prevLon = points[2 * start + 1];
+    size_t i;
+
+    if(ZDBufferPutVariableLength(output, ZDEncodePoint(prevLat, prevLon))) {
+        return -1;
+    }
+
+    for(i = 1; i < numPoints; i++) {
+        const size_t index = (start + i) % numPoints;
+        const int64_t diffLat = points[2 * index] - prevLat;
+        const int64_t diffLon = points[2 * index + 1] - prevLon;
+
+        if(!ZDSameDirection(diffLat, diffLon, prevDiffLat, prevDiffLon) && (accDiffLat || accDiffLon)) {
+            if(ZDBufferPutVariableLength(output, ZDEncodePoint(accDiffLat, accDiffLon))) {
+                return -1;
+            }
+            accDiffLat = 0;
+            accDiffLon = 0;
+        }
+
+        accDiffLat += diffLat;
+        accDiffLon += diffLon;
+        prevDiffLat = diffLat;
+        prevDiffLon = diffLon;
+        prevLat = points[2 * index];
+        prevLon = points[2 * index + 1];
+    }
+
+    if(accDiffLat || accDiffLon) {
+        if(ZDBufferPutVariableLength(output, ZDEncodePoint(accDiffLat, accDiffLon))) {
+            return -1;
+        }
+    }
+
+    /* End marker */
+    const uint8_t marker[2] = {0, 0};
+    return ZDBufferAppend(output, marker, sizeof(marker));
+}
+
+/* Convert to fixed-point lat, lon pairs, truncated like the database builder does */
+static int ZDBuilderConvertPoints(unsigned int precision, const double *lat, const double *lon, size_t numPoints, int32_t *points)
+{
+    const double scale = (double)(1 << (precision - 1));
+    size_t i;
+
+    for(i = 0; i < numPoints; i++) {
+        if(!(lat[i] >= -90 && lat[i] <= 90 && lon[i] >= -180 && lon[i] <= 180)) {
+            return -1;
+        }
+        points[2 * i] = (int32_t)(lat[i] / 90 * scale);
+        points[2 * i + 1] = (int32_t)(lon[i] / 180 * scale);
+    }
+
+    return 0;
+}
+
+/* Add a ring of fixed-point lat, lon pairs */
+static int ZDBuilderAddFixedPoint(ZoneDetectBuilder *builder, uint32_t metadata, const int32_t *points, size_t numPoints)
+{
+    size_t numUnique = 0, i;
+
+    if(metadata >= builder->numRecords || builder->numPolygons >= UINT32_MAX) {
+        return -1;
+    }
+
+    int32_t *const unique = malloc((numPoints ? numPoints : 1) * 2 * sizeof *unique);
+    if(!unique) {
+        return -1;
+    }
+
+    struct ZDBuilderPolygon polygon;
+    polygon.minLat = polygon.minLon = INT32_MAX;
+    polygon.maxLat = polygon.maxLon = INT32_MIN;
+
+    for(i = 0; i < numPoints; i++) {
+        const int32_t pointLat = points[2 * i];
+        const int32_t pointLon = points[2 * i + 1];
+
+        if(pointLat < polygon.minLat) polygon.minLat = pointLat;
+        if(pointLon < polygon.minLon) polygon.minLon = pointLon;
+        if(pointLat > polygon.maxLat) polygon.maxLat = pointLat;
+        if(pointLon > polygon.maxLon) polygon.maxLon = pointLon;
+
+        /* Don't encode duplicate points */
+        if(numUnique && unique[2 * numUnique - 2] == pointLat && unique[2 * numUnique - 1] == pointLon) {
+            continue;
+        }
+        unique[2 * numUnique] = pointLat;
+        unique[2 * numUnique + 1] = pointLon;
+        numUnique++;
+    }
+
+    /* The ring is closed implicitly */
+    while(numUnique > 1 && unique[2 * numUnique - 2] == unique[0] && unique[2 * numUnique - 1] == unique[1]) {
+        numUnique--;
+    }
+    if(numUnique < 3) {
+        goto fail;
+    }
+
+    /* A first point at 0,0 would encode as a marker, start the ring elsewhere */
+    size_t start = 0;
+    while(!unique[2 * start] && !unique[2 * start + 1]) {
+        start++;
+    }
+
+    if(builder->numPolygons == builder->polygonsCapacity) {
+        const size_t capacity = builder->polygonsCapacity ? builder->polygonsCapacity * 2 : 64;
+        struct ZDBuilderPolygon *const polygons = realloc(builder->polygons, capacity * sizeof *polygons);
+        if(!polygons) {
+            goto fail;
+        }
+        builder->polygons = polygons;
+        builder->polygonsCapacity = capacity;
+    }
+
+    polygon.metadata = metadata;
+    polygon.sequence = (uint32_t)builder->numPolygons;
+    polygon.dataStart = builder->vertices.length;
+    polygon.fileIndex = 0;
+    if(ZDBuilderEncodeRing(&builder->vertices, unique, numUnique, start)) {
+        builder->vertices.length = polygon.dataStart;
+        goto fail;
+    }
+    polygon.dataLength = builder->vertices.length - polygon.dataStart;
+
+    builder->polygons[builder->numPolygons++] = polygon;
+
+    free(unique);
+    return 0;
+
+fail:
+    free(unique);
+    return -1;
+}
+
+int ZDBuilderAddPolygon(ZoneDetectBuilder *builder, uint32_t metadata, const double *lat, const double *lon, size_t numPoints)
+{
+    int32_t *const points = malloc((numPoints ? numPoints : 1) * 2 * sizeof *points);
+    if(!points) {
+        return -1;
+    }
+
+    const int result = ZDBuilderConvertPoints(builder->precision, lat, lon, numPoints, points) ? -1 : ZDBuilderAddFixedPoint(builder, metadata, points, numPoints);
+    free(points);
+    return result;
+}
+
+static int ZDCompareBuilderPolygons(const void *a, const void *b)
+{
+    const struct ZDBuilderPolygon *const polygonA = a;
+    const struct ZDBuilderPolygon *const polygonB = b;
+    if(polygonA->minLat != polygonB->minLat) {
+        return (polygonA->minLat > polygonB->minLat) ? 1 : -1;
+    }
+    return (polygonA->sequence > polygonB->sequence) - (polygonA->sequence < polygonB->sequence);
+}
+
+static int ZDCompareBuilderKeys(const void *a, const void *b)
+{
+    const struct ZDBuilderSortKey *const keyA = a;
+    const struct ZDBuilderSortKey *const keyB = b;
+    if(keyA->key != keyB->key) {
+        return (keyA->key > keyB->key) ? 1 : -1;
+    }
+    return (keyA->index > keyB->index) - (keyA->index < keyB->index);
+}
+
+/* Sort-Tile-Recursive packing: order the boxes such that every ZD_BUILDER_FANOUT consecutive boxes are close together */
+static int ZDBuilderPackOrder(const struct ZDBuilderNode *boxes, uint32_t numBoxes, uint32_t *order)
+{
+    struct ZDBuilderSortKey *const keys = malloc((numBoxes ? numBoxes : 1) * sizeof *keys);
+    uint32_t i, start;
+    if(!keys) {
+        return -1;
+    }
+
+    for(i = 0; i < numBoxes; i++) {
+        keys[i].key = (int64_t)boxes[i].minLon + boxes[i].maxLon;
+        keys[i].index = i;
+    }
+    qsort(keys, numBoxes, sizeof *keys, ZDCompareBuilderKeys);
+
+    const uint32_t numNodes = (numBoxes + ZD_BUILDER_FANOUT - 1) / ZD_BUILDER_FANOUT;
+    const uint32_t numSlices = (uint32_t)ceil(sqrt((double)numNodes));
+    const uint64_t sliceSize = (uint64_t)(numSlices ? numSlices : 1) * ZD_BUILDER_FANOUT;
+
+    for(start = 0; start < numBoxes; start = (uint32_t)((start + sliceSize < numBoxes) ? start + sliceSize : numBoxes)) {
+        const uint32_t end = (start + sliceSize < numBoxes) ? (uint32_t)(start + sliceSize) : numBoxes;
+        for(i = start; i < end; i++) {
+            keys[i].key = (int64_t)boxes[keys[i].index].minLat + boxes[keys[i].index].maxLat;
+        }
+        qsort(&keys[start], end - start, sizeof *keys, ZDCompareBuilderKeys);
+    }
+
+    for(i = 0; i < numBoxes; i++) {
+        order[i] = keys[i].index;
+    }
+    free(keys);
+    return 0;
+}
+
+/* Group every ZD_BUILDER_FANOUT consecutive boxes into a node, there is always at least one node */
+static uint32_t ZDBuilderGroupNodes(const struct ZDBuilderNode *boxes, uint32_t numBoxes, uint32_t flags, struct ZDBuilderNode *nodes)
+{
+    uint32_t numNodes = 0, i, j;
+
+    for(i = 0; i < numBoxes || !numNodes; i += ZD_BUILDER_FANOUT) {
+        struct ZDBuilderNode *const node = &nodes[numNodes++];
+        node->minLat = node->minLon = INT32_MAX;
+        node->maxLat = node->maxLon = INT32_MIN;
+        node->first = i | flags;
+        node->count = (numBoxes - i < ZD_BUILDER_FANOUT) ? numBoxes - i : ZD_BUILDER_FANOUT;
+        for(j = i; j < i + node->count; j++) {
+            if(boxes[j].minLat < node->minLat) node->minLat = boxes[j].minLat;
+            if(boxes[j].minLon < node->minLon) node->minLon = boxes[j].minLon;
+            if(boxes[j].maxLat > node->maxLat) node->maxLat = boxes[j].maxLat;
+            if(boxes[j].maxLon > node->maxLon) node->maxLon = boxes[j].maxLon;
+        }
+        /* The root of a database without polygons gets an empty box in the coordinate range */
+        if(!node->count) {
+            node->minLat = node->minLon = node->maxLat = node->maxLon = 0;
+        }
+    }
+
+    return numNodes;
+}
+
+static int ZDBufferPutNode(struct ZDBuilderBuffer *output, const struct ZDBuilderNode *node)
+{
+    return ZDBufferPutUInt32(output, (uint32_t)node->minLat) || ZDBufferPutUInt32(output, (uint32_t)node->minLon) ||
+           ZDBufferPutUInt32(output, (uint32_t)node->maxLat) || ZDBufferPutUInt32(output, (uint32_t)node->maxLon);
+}
+
+/* Packed R-tree section of version 2 and up, the root comes first and children always after their parent */
+static int ZDBuilderEncodeRTree(const ZoneDetectBuilder *builder, const uint32_t *metadataIndex, struct ZDBuilderBuffer *output)
+{
+    const uint32_t numBoxes = (uint32_t)builder->numPolygons;
+    struct ZDBuilderNode *boxes = NULL, *nodes = NULL, *sorted = NULL;
+    uint32_t *order = NULL, *levelStart = NULL, *entryOrder = NULL;
+    uint32_t numLevels = 0, numNodes = 0, i, level;
+    int result = -1;
+
+    /* Every level has at most half the nodes of the level below, with one node for the root */
+    const size_t maxNodes = 2 * ((size_t)numBoxes / ZD_BUILDER_FANOUT + 1) + 64;
+    const size_t maxEntries = numBoxes ? numBoxes : 1;
+    boxes = calloc(maxEntries, sizeof *boxes);
+    sorted = malloc((maxEntries > maxNodes ? maxEntries : maxNodes) * sizeof *sorted);
+    nodes = malloc(maxNodes * sizeof *nodes);
+    order = malloc((maxEntries > maxNodes ? maxEntries : maxNodes) * sizeof *order);
+    entryOrder = malloc(maxEntries * sizeof *entryOrder);
+    levelStart = malloc(34 * sizeof *levelStart);
+    if(!boxes || !sorted || !nodes || !order || !entryOrder || !levelStart) {
+        goto fail;
+    }
+
+    for(i = 0; i < numBoxes; i++) {
+        boxes[i].minLat = builder->polygons[i].minLat;
+        boxes[i].minLon = builder->polygons[i].minLon;
+        boxes[i].maxLat = builder->polygons[i].maxLat;
+        boxes[i].maxLon = builder->polygons[i].maxLon;
+    }
+
+    if(ZDBuilderPackOrder(boxes, numBoxes, entryOrder)) {
+        goto fail;
+    }
+    for(i = 0; i < numBoxes; i++) {
+        sorted[i] = boxes[entryOrder[i]];
+    }
+
+    /* Build the levels bottom up in nodes, before grouping a level it is reordered so siblings are close */
+    levelStart[0] = 0;
+    numNodes = ZDBuilderGroupNodes(sorted, numBoxes, ZD_RTREE_LEAF, nodes);
+    numLevels = 1;
+    while(numNodes - levelStart[numLevels - 1] > 1) {
+        const uint32_t start = levelStart[numLevels - 1];
+        const uint32_t count = numNodes - start;
+
+        if(ZDBuilderPackOrder(&nodes[start], count, order)) {
+            goto fail;
+        }
+        for(i = 0; i < count; i++) {
+            sorted[i] = nodes[start + order[i]];
+        }
+        memcpy(&nodes[start], sorted, count * sizeof *nodes);
+
+        levelStart[numLevels++] = numNodes;
+        numNodes += ZDBuilderGroupNodes(&nodes[start], count, 0, &nodes[numNodes]);
+    }
+    levelStart[numLevels] = numNodes;
+
+    if(ZDBufferPutUInt32(output, numNodes) || ZDBufferPutUInt32(output, numBoxes)) {
+        goto fail;
+    }
+
+    /* Store the root level first, the first child of a node is then an index into the next level */
+    uint32_t written = 0;
+    for(level = numLevels; level-- > 0;) {
+        const uint32_t count = levelStart[level + 1] - levelStart[level];
+        const uint32_t childStart = written + count;
+        for(i = levelStart[level]; i < levelStart[level + 1]; i++) {
+            const struct ZDBuilderNode *const node = &nodes[i];
+            if(ZDBufferPutNode(output, node) ||
+                    ZDBufferPutUInt32(output, (node->first & ZD_RTREE_LEAF) ? node->first : node->first + childStart) ||
+                    ZDBufferPutUInt32(output, node->count)) {
+                goto fail;
+            }
+        }
+        written = childStart;
+    }
+
+    for(i = 0; i < numBoxes; i++) {
+        const uint32_t index = entryOrder[i];
+        if(ZDBufferPutNode(output, &boxes[index]) || ZDBufferPutUInt32(output, index) ||
+                ZDBufferPutUInt32(output, metadataIndex[builder->polygons[index].metadata]) || ZDBufferPutUInt32(output, builder->polygons[index].fileIndex)) {
+            goto fail;
+        }
+    }
+
+    result = 0;
+
+fail:
+    if(boxes) free(boxes);
+    if(sorted) free(sorted);
+    if(nodes) free(nodes);
+    if(order) free(order);
+    if(entryOrder) free(entryOrder);
+    if(levelStart) free(levelStart);
+    return result;
+}
+
+void *ZDBuilderFinish(ZoneDetectBuilder *builder, size_t *length)
+{
+    struct ZDBuilderBuffer header, bbox, metadata, data, rtree, output;
+    uint32_t *metadataIndex = NULL;
+    size_t i, j;
+
+    memset(&header, 0, sizeof(header));
+    memset(&bbox, 0, sizeof(bbox));
+    memset(&metadata, 0, sizeof(metadata));
+    memset(&data, 0, sizeof(data));
+    memset(&rtree, 0, sizeof(rtree));
+    memset(&output, 0, sizeof(output));
+
+    /* Sort according to bounding box */
+    if(builder->numPolygons) {
+        qsort(builder->polygons, builder->numPolygons, sizeof *builder->polygons, ZDCompareBuilderPolygons);
+    }
+
+    /* Encode data section and store pointers */
+    for(i = 0; i < builder->numPolygons; i++) {
+        struct ZDBuilderPolygon *const polygon = &builder->polygons[i];
+        polygon->fileIndex = (uint32_t)data.length;
+        if(ZDBufferAppend(&data, builder->vertices.data + polygon->dataStart, polygon->dataLength) || data.length >= UINT32_MAX) {
+            goto fail;
+        }
+    }
+
+    /* Version 3 metadata: a record count, one offset per field for every record and the zero terminated strings */
+    const uint64_t tableSize = 4 + (uint64_t)builder->numRecords * builder->numFields * 4;
+    metadataIndex = malloc((builder->numRecords ? builder->numRecords : 1) * sizeof *metadataIndex);
+    if(!metadataIndex || tableSize + builder->strings.length >= UINT32_MAX || ZDBufferPutUInt32(&metadata, (uint32_t)builder->numRecords)) {
+        goto fail;
+    }
+    for(i = 0; i < builder->numRecords; i++) {
+        metadataIndex[i] = (uint32_t)metadata.length;
+        for(j = 0; j < builder->numFields; j++) {
+            if(ZDBufferPutUInt32(&metadata, (uint32_t)tableSize + builder->records[i * builder->numFields + j])) {
+                goto fail;
+            }
+        }
+    }
+    if(ZDBufferAppend(&metadata, builder->strings.data, builder->strings.length)) {
+        goto fail;
+    }
+
+    /* Encode bounding boxes */
+    int64_t prevFileIndex = 0, prevMetaIndex = 0;
+    for(i = 0; i < builder->numPolygons; i++) {
+        const struct ZDBuilderPolygon *const polygon = &builder->polygons[i];
+        if(ZDBufferPutSigned(&bbox, polygon->minLat) || ZDBufferPutSigned(&bbox, polygon->minLon) ||
+                ZDBufferPutSigned(&bbox, polygon->maxLat) || ZDBufferPutSigned(&bbox, polygon->maxLon) ||
+                ZDBufferPutSigned(&bbox, (int64_t)metadataIndex[polygon->metadata] - prevMetaIndex) ||
+                ZDBufferPutVariableLength(&bbox, (uint64_t)((int64_t)polygon->fileIndex - prevFileIndex))) {
+            goto fail;
+        }
+        prevMetaIndex = metadataIndex[polygon->metadata];
+        prevFileIndex = polygon->fileIndex;
+    }
+
+    if(ZDBuilderEncodeRTree(builder, metadataIndex, &rtree)) {
+        goto fail;
+    }
+
+    /* Encode header */
+    const uint8_t magic[7] = {'P', 'L', 'B', builder->tableType, 3, builder->precision, builder->numFields};
+    if(ZDBufferAppend(&header, magic, sizeof(magic))) {
+        goto fail;
+    }
+    for(i = 0; i < builder->numFields; i++) {
+        if(ZDBufferPutString(&header, builder->fieldNames[i])) {
+            goto fail;
+        }
+    }
+    if(ZDBufferPutString(&header, builder->notice) ||
+            ZDBufferPutVariableLength(&header, bbox.length) || ZDBufferPutVariableLength(&header, metadata.length) ||
+            ZDBufferPutVariableLength(&header, data.length) || ZDBufferPutVariableLength(&header, rtree.length)) {
+        goto fail;
+    }
+
+    /* The metadata section and the R-tree start at a 4 byte aligned offset */
+    const uint8_t padding[4] = {0, 0, 0, 0};
+    const size_t bboxEnd = header.length + bbox.length;
+    const size_t dataEnd = bboxEnd + (4 - bboxEnd % 4) % 4 + metadata.length + data.length;
+    if(ZDBufferAppend(&output, header.data, header.length) || ZDBufferAppend(&output, bbox.data, bbox.length) ||
+            ZDBufferAppend(&output, padding, (4 - bboxEnd % 4) % 4) || ZDBufferAppend(&output, metadata.data, metadata.length) ||
+            ZDBufferAppend(&output, data.data, data.length) || ZDBufferAppend(&output, padding, (4 - dataEnd % 4) % 4) ||
+            ZDBufferAppend(&output, rtree.data, rtree.length) || output.length >= INT32_MAX) {
+        goto fail;
+    }
+
+    free(header.data);
+    free(bbox.data);
+    free(metadata.data);
+    free(data.data);
+    free(rtree.data);
+    free(metadataIndex);
+
+    *length = output.length;
+    return output.data;
+
+fail:
+    if(header.data) free(header.data);
+    if(bbox.data) free(bbox.data);
+    if(metadata.data) free(metadata.data);
+    if(data.data) free(data.data);
+    if(rtree.data) free(rtree.data);
+    if(output.data) free(output.data);
+    if(metadataIndex) free(metadataIndex);
+    return NULL;
+}
+
+/*
+ * Minimum number of reader slots, there are at least two per processor. Readers that find no free slot
+ * use a shared counter instead, which delays freeing replaced databases while it is not zero.
+ */
+#define ZD_OVERLAY_READER_SLOTS 64
+
+/* Pending changes that never cause a compaction, above this the limit is the square root of the base size */
+#define ZD_OVERLAY_MIN_DELTA 64
+
+struct ZDOverlaySlot {
+    /* Epoch the reader entered in, 0 if the slot is free */
+    volatile uint64_t epoch;
+    /* Keep slots of different readers on different cache lines */
+    uint8_t padding[56];
+};
+
+/* Immutable database searched by overlay readers */
+struct ZDOverlayImage {
+    ZoneDetect *library;
+    /* Built by the overlay, NULL for the base it was created with */
+    void *buffer;
+    /* Overlay polygonId of every polygon in the image, NULL if they are the same */
+    uint32_t *ids;
+    uint32_t numPolygons;
+};
+
+struct ZDOverlaySnapshot {
+    struct ZDOverlayImage *base;
+    /* Polygons added since the last compaction, NULL if there are none */
+    struct ZDOverlayImage *delta;
+    /* Sorted polygonIds in the base image of removed polygons */
+    uint32_t *removed;
+    size_t numRemoved;
+};
+
+/* Replaced snapshot and images, readers that entered up to epoch may still use them */
+struct ZDOverlayGarbage {
+    uint64_t epoch;
+    struct ZDOverlaySnapshot *snapshot;
+    struct ZDOverlayImage *delta, *base;
+    struct ZDOverlayGarbage *next;
+};
+
+/* Polygon added since the last compaction */
+struct ZDOverlayPolygon {
+    uint32_t id;
+    size_t numPoints;
+    int32_t *points;
+    char **fields;
+};
+
+struct ZoneDetectOverlayOpaque {
+    struct ZDOverlaySnapshot *volatile snapshot;
+    volatile uint64_t epoch;
+    /* The epoch of the slot after the last one counts the readers that did not get a slot */
+    struct ZDOverlaySlot *slots;
+    uint32_t numSlots;
+
+    uint8_t tableType;
+    uint8_t precision;
+    uint8_t numFields;
+    /* Shared by all images, results point to these */
+    char **fieldNames;
+    char *notice;
+    ZoneDetectOptions options;
+
+    /* Only one compaction builds a new base at a time */
+    ZDMutex compactLock;
+
+    /* Everything below belongs to the writers and is protected by lock */
+    ZDMutex lock;
+    struct ZDOverlayPolygon *polygons;
+    size_t numPolygons, polygonsCapacity;
+    uint32_t nextId;
+    struct ZDOverlayGarbage *garbage;
+    /* While a compaction builds a new base: the polygonIds removed since it started */
+    uint8_t compacting;
+    uint32_t *compactRemoved;
+    size_t numCompactRemoved, compactRemovedCapacity;
+};
+
+/* Count the polygons of a database and optionally list their metaId and data offset */
+static uint32_t ZDListPolygons(const ZoneDetect *library, uint32_t *metaIds, uint32_t *polygonIndexes)
+{
+    uint32_t polygonId;
+
+    if(library->table.memory) {
+        if(metaIds) {
+            memcpy(metaIds, library->table.metadataIndex, library->table.count * sizeof *metaIds);
+            memcpy(polygonIndexes, library->table.polygonIndex, library->table.count * sizeof *polygonIndexes);
+        }
+        return library->table.count;
+    }
+
+    uint32_t bboxIndex = library->bboxOffset;
+    struct ZDBBoxEntry entry = {0};
+
+    for(polygonId = 0; ZDDecodeBBoxEntry(library, &bboxIndex, &entry); polygonId++) {
+        if(metaIds) {
+            metaIds[polygonId] = entry.metadataIndex;
+            polygonIndexes[polygonId] = library->dataOffset + entry.polygonIndex;
+        }
+    }
+
+    return polygonId;
+}
+
+static void ZDOverlayFreeImage(struct ZDOverlayImage *image)
+{
+    if(image) {
+        if(image->buffer) {
+            ZDCloseDatabase(image->library);
+            free(image->buffer);
+        }
+        if(image->ids) free(image->ids);
+        free(image);
+    }
+}
+
+static void ZDOverlayFreeSnapshot(struct ZDOverlaySnapshot *snapshot)
+{
+    if(snapshot) {
+        if(snapshot->removed) free(snapshot->removed);
+        free(snapshot);
+    }
+}
+
+static void ZDOverlayFreePolygon(struct ZDOverlayPolygon *polygon, uint8_t numFields)
+{
+    if(polygon->fields) {
+        size_t i;
+        for(i = 0; i < numFields; i++) {
+            if(polygon->fields[i]) free(polygon->fields[i]);
+        }
+        free(polygon->fields);
+    }
+    if(polygon->points) free(polygon->points);
+}
+
+/* Returns the slot of the reader, or NULL if it was counted as a reader without one. Never waits. */
+static struct ZDOverlaySlot *ZDOverlayEnter(const ZoneDetectOverlay *overlay)
+{
+    /* Threads have different stacks, start looking for a free slot at one that depends on it */
+    uint32_t index = (uint32_t)(((uintptr_t)&index >> 12) * 2654435761u);
+    uint32_t i;
+
+    for(i = 0; i < overlay->numSlots; i++, index++) {
+        struct ZDOverlaySlot *const slot = &overlay->slots[index % overlay->numSlots];
+        if(!ZDAtomicLoad(&slot->epoch) && ZDAtomicCompareExchange(&slot->epoch, 0, ZDAtomicLoad(&overlay->epoch))) {
+            return slot;
+        }
+    }
+
+    ZDAtomicIncrement(&overlay->slots[overlay->numSlots].epoch);
+    return NULL;
+}
+
+static void ZDOverlayExit(const ZoneDetectOverlay *overlay, struct ZDOverlaySlot *slot)
+{
+    if(slot) {
+        ZDAtomicStore(&slot->epoch, 0);
+    } else {
+        ZDAtomicDecrement(&overlay->slots[overlay->numSlots].epoch);
+    }
+}
+
+/* Free the garbage that no reader can still be using */
+static void ZDOverlayReclaim(ZoneDetectOverlay *overlay)
+{
+    uint64_t oldestEpoch = UINT64_MAX;
+    size_t i;
+
+    /* Readers without a slot may use anything that was replaced before they leave */
+    if(ZDAtomicLoad(&overlay->slots[overlay->numSlots].epoch)) {
+        return;
+    }
+
+    for(i = 0; i < overlay->numSlots; i++) {
+        const uint64_t epoch = ZDAtomicLoad(&overlay->slots[i].epoch);
+        if(epoch && epoch < oldestEpoch) {
+            oldestEpoch = epoch;
+        }
+    }
+
+    struct ZDOverlayGarbage **garbagePtr = &overlay->garbage;
+    while(*garbagePtr) {
+        struct ZDOverlayGarbage *const garbage = *garbagePtr;
+        if(garbage->epoch < oldestEpoch) {
+            *garbagePtr = garbage->next;
+            ZDOverlayFreeSnapshot(garbage->snapshot);
+            ZDOverlayFreeImage(garbage->delta);
+            ZDOverlayFreeImage(garbage->base);
+            free(garbage);
+        } else {
+            garbagePtr = &garbage->next;
+        }
+    }
+}
+
+/*
+ * Make snapshot visible to new readers. The old snapshot and the images it no longer shares are freed once
+ * the readers that entered before the switch have left. On failure nothing changes.
+ */
+static int ZDOverlayPublish(ZoneDetectOverlay *overlay, struct ZDOverlaySnapshot *snapshot, struct ZDOverlayImage *oldDelta, struct ZDOverlayImage *oldBase)
+{
+    struct ZDOverlayGarbage *const garbage = malloc(sizeof *garbage);
+    if(!garbage) {
+        return -1;
+    }
+
+    garbage->snapshot = ZDAtomicExchangePointer((void *volatile *)&overlay->snapshot, snapshot);
+    garbage->delta = oldDelta;
+    garbage->base = oldBase;
+
+    /* Readers that enter in a later epoch see the new snapshot */
+    garbage->epoch = ZDAtomicIncrement(&overlay->epoch);
+    garbage->next = overlay->garbage;
+    overlay->garbage = garbage;
+
+    ZDOverlayReclaim(overlay);
+    return 0;
+}
+
+/* Copy of the current snapshot that shares its images, to be changed and published */
+static struct ZDOverlaySnapshot *ZDOverlayCopySnapshot(const struct ZDOverlaySnapshot *current, size_t extraRemoved)
+{
+    struct ZDOverlaySnapshot *const snapshot = malloc(sizeof *snapshot);
+    if(!snapshot) {
+        return NULL;
+    }
+
+    *snapshot = *current;
+    snapshot->removed = NULL;
+    if(current->numRemoved + extraRemoved) {
+        snapshot->removed = malloc((current->numRemoved + extraRemoved) * sizeof *snapshot->removed);
+        if(!snapshot->removed) {
+            free(snapshot);
+            return NULL;
+        }
+        if(current->numRemoved) {
+            memcpy(snapshot->removed, current->removed, current->numRemoved * sizeof *snapshot->removed);
+        }
+    }
+
+    return snapshot;
+}
+
+/* Open addressing table of builder records by their fields, UINT32_MAX marks an empty slot */
+struct ZDOverlayZones {
+    uint32_t *records;
+    size_t size;
+};
+
+static uint32_t ZDOverlayHashRecord(const ZoneDetectBuilder *builder, const uint32_t *offsets)
+{
+    /* FNV-1a over the string pool offsets, equal fields have equal offsets */
+    uint32_t hash = UINT32_C(2166136261);
+    size_t i;
+    for(i = 0; i < builder->numFields; i++) {
+        hash ^= offsets[i];
+        hash *= UINT32_C(16777619);
+    }
+    return hash;
+}
+
+/*
+ * Builder record for fields, returns -1 on failure. With shared, the record of an earlier zone with the same
+ * fields is returned instead of a new one. Base zones are never shared with each other.
+ */
+static int ZDOverlayAddZone(ZoneDetectBuilder *builder, struct ZDOverlayZones *zones, const char *const *fields, int shared)
+{
+    const int record = ZDBuilderAddMetadata(builder, fields, NULL);
+    if(record < 0) {
+        return -1;
+    }
+
+    const uint32_t *const offsets = &builder->records[(size_t)record * builder->numFields];
+    size_t slot;
+    for(slot = ZDOverlayHashRecord(builder, offsets) & (zones->size - 1); zones->records[slot] != UINT32_MAX; slot = (slot + 1) & (zones->size - 1)) {
+        if(!memcmp(&builder->records[(size_t)zones->records[slot] * builder->numFields], offsets, builder->numFields * sizeof *offsets)) {
+            if(!shared) {
+                return record;
+            }
+            /* The strings were already in the pool, only the record is dropped */
+            builder->numRecords--;
+            return (int)zones->records[slot];
+        }
+    }
+
+    zones->records[slot] = (uint32_t)record;
+    return record;
+}
+
+/* Builder record holding a copy of the fields of metaId */
+static int ZDOverlayAddMetadata(ZoneDetectBuilder *builder, struct ZDOverlayZones *zones, const ZoneDetect *library, uint32_t metaId, int shared)
+{
+    char **const fields = ZDDuplicateFields(library, metaId);
+    size_t i;
+    if(!fields) {
+        return -1;
+    }
+
+    const int record = ZDOverlayAddZone(builder, zones, (const char *const *)fields, shared);
+    for(i = 0; i < library->numFields; i++) {
+        free(fields[i]);
+    }
+    free(fields);
+    return record;
+}
+
+/*
+ * Add the polygons of image that were not removed to builder, ids receives their overlay polygonIds. Zones of
+ * the base are added with shared unset, polygons added later join a zone with the same fields.
+ */
+static int ZDOverlayAddImage(ZoneDetectBuilder *builder, struct ZDOverlayZones *zones, const struct ZDOverlayImage *image, const uint32_t *removed, size_t numRemoved, int shared, uint32_t *ids)
+{
+    const ZoneDetect *const library = image->library;
+    uint32_t *metaIds = NULL, *polygonIndexes = NULL, *uniqueMetaIds = NULL, *records = NULL;
+    uint32_t numUnique = 0, i;
+    int result = -1;
+
+    const size_t count = image->numPolygons ? image->numPolygons : 1;
+    metaIds = malloc(count * sizeof *metaIds);
+    polygonIndexes = malloc(count * sizeof *polygonIndexes);
+    uniqueMetaIds = malloc(count * sizeof *uniqueMetaIds);
+    records = malloc(count * sizeof *records);
+    if(!metaIds || !polygonIndexes || !uniqueMetaIds || !records || ZDListPolygons(library, metaIds, polygonIndexes) != image->numPolygons) {
+        goto fail;
+    }
+
+    /* Every zone of the image becomes one record, in the order of their metaId */
+    if(image->numPolygons) {
+        memcpy(uniqueMetaIds, metaIds, image->numPolygons * sizeof *uniqueMetaIds);
+        qsort(uniqueMetaIds, image->numPolygons, sizeof *uniqueMetaIds, ZDCompareUInt32);
+    }
+    for(i = 0; i < image->numPolygons; i++) {
+        if(!numUnique || uniqueMetaIds[numUnique - 1] != uniqueMetaIds[i]) {
+            uniqueMetaIds[numUnique++] = uniqueMetaIds[i];
+        }
+    }
+    for(i = 0; i < numUnique; i++) {
+        const int record = ZDOverlayAddMetadata(builder, zones, library, uniqueMetaIds[i], shared);
+        if(record < 0) {
+            goto fail;
+        }
+        records[i] = (uint32_t)record;
+    }
+
+    for(i = 0; i < image->numPolygons; i++) {
+        if(numRemoved && bsearch(&i, removed, numRemoved, sizeof *removed, ZDCompareUInt32)) {
+            continue;
+        }
+
+        size_t length;
+        int32_t *const list = ZDPolygonToListInternal(library, polygonIndexes[i], &length);
+        if(!list) {
+            goto fail;
+        }
+
+        const uint32_t *const unique = bsearch(&metaIds[i], uniqueMetaIds, numUnique, sizeof *uniqueMetaIds, ZDCompareUInt32);
+        const size_t sequence = builder->numPolygons;
+        const int added = ZDBuilderAddFixedPoint(builder, records[unique - uniqueMetaIds], list, length / 2);
+        free(list);
+
+        /* Degenerate rings have no inside and are dropped */
+        if(!added) {
+            ids[sequence] = image->ids ? image->ids[i] : i;
+        }
+    }
+
+    result = 0;
+
+fail:
+    if(metaIds) free(metaIds);
+    if(polygonIndexes) free(polygonIndexes);
+    if(uniqueMetaIds) free(uniqueMetaIds);
+    if(records) free(records);
+    return result;
+}
+
+/*
+ * Build an image of polygons, and of the polygons of snapshot if it is not NULL. Only the fields of overlay
+ * that never change are used, so this does not need the lock. Sets *imagePtr to NULL if there are no
+ * polygons to add.
+ */
+static int ZDOverlayBuildImage(const ZoneDetectOverlay *overlay, const struct ZDOverlaySnapshot *snapshot, const struct ZDOverlayPolygon *polygons, size_t numPolygons, struct ZDOverlayImage **imagePtr)
+{
+    ZoneDetectBuilder *builder = NULL;
+    struct ZDOverlayImage *image = NULL;
+    struct ZDOverlayZones zones = {NULL, 0};
+    uint32_t *ids = NULL;
+    size_t i;
+
+    *imagePtr = NULL;
+    if(!snapshot && !numPolygons) {
+        return 0;
+    }
+
+    /* There is at most one record per polygon, the table is kept at most half full */
+    const size_t numSnapshotPolygons = snapshot ? snapshot->base->numPolygons + (snapshot->delta ? snapshot->delta->numPolygons : 0) : 0;
+    for(zones.size = 16; zones.size < 2 * (numSnapshotPolygons + numPolygons); zones.size *= 2);
+    zones.records = malloc(zones.size * sizeof *zones.records);
+    builder = ZDBuilderCreate(overlay->tableType, overlay->precision, (const char *const *)overlay->fieldNames, overlay->numFields, overlay->notice);
+    image = calloc(1, sizeof *image);
+    ids = malloc((numSnapshotPolygons + numPolygons + 1) * sizeof *ids);
+    if(!zones.records || !builder || !image || !ids) {
+        goto fail;
+    }
+    for(i = 0; i < zones.size; i++) {
+        zones.records[i] = UINT32_MAX;
+    }
+
+    if(snapshot) {
+        if(ZDOverlayAddImage(builder, &zones, snapshot->base, snapshot->removed, snapshot->numRemoved, 0, ids)) {
+            goto fail;
+        }
+        if(snapshot->delta && ZDOverlayAddImage(builder, &zones, snapshot->delta, NULL, 0, 1, ids)) {
+            goto fail;
+        }
+    }
+
+    for(i = 0; i < numPolygons; i++) {
+        const struct ZDOverlayPolygon *const polygon = &polygons[i];
+        const size_t sequence = builder->numPolygons;
+        const int record = ZDOverlayAddZone(builder, &zones, (const char *const *)polygon->fields, 1);
+        if(record < 0 || ZDBuilderAddFixedPoint(builder, (uint32_t)record, polygon->points, polygon->numPoints)) {
+            goto fail;
+        }
+        ids[sequence] = polygon->id;
+    }
+
+    size_t length;
+    image->buffer = ZDBuilderFinish(builder, &length);
+    if(!image->buffer) {
+        goto fail;
+    }
+
+    /* The builder sorted its polygons, which gives their polygonId */
+    image->numPolygons = (uint32_t)builder->numPolygons;
+    image->ids = malloc((builder->numPolygons ? builder->numPolygons : 1) * sizeof *image->ids);
+    if(!image->ids) {
+        goto fail;
+    }
+    for(i = 0; i < builder->numPolygons; i++) {
+        image->ids[i] = ids[builder->polygons[i].sequence];
+    }
+
+    image->library = ZDOpenDatabaseFromMemoryWithOptions(image->buffer, length, &overlay->options);
+    if(!image->library) {
+        goto fail;
+    }
+
+    ZDBuilderFree(builder);
+    free(zones.records);
+    free(ids);
+    *imagePtr = image;
+    return 0;
+
+fail:
+    if(image) {
+        if(image->buffer) free(image->buffer);
+        if(image->ids) free(image->ids);
+        free(image);
+    }
+    if(zones.records) free(zones.records);
+    if(ids) free(ids);
+    ZDBuilderFree(builder);
+    return -1;
+}
+
+/*
+ * Whether the next change should compact, called with the lock held. A change rebuilds the delta in time
+ * linear in the number of pending changes, a compaction takes time linear in the size of the base. Capping
+ * the pending changes at the square root of the base size gives O(sqrt(n)) amortized time per change.
+ */
+static int ZDOverlayDeltaFull(const ZoneDetectOverlay *overlay)
+{
+    const struct ZDOverlaySnapshot *const snapshot = overlay->snapshot;
+    size_t limit = (size_t)sqrt((double)snapshot->base->numPolygons);
+    if(limit < ZD_OVERLAY_MIN_DELTA) {
+        limit = ZD_OVERLAY_MIN_DELTA;
+    }
+
+    return overlay->numPolygons + snapshot->numRemoved > limit;
+}
+
+static int ZDOverlayCompactInternal(ZoneDetectOverlay *overlay, int onlyIfFull);
+
+void ZDOverlayFree(ZoneDetectOverlay *overlay)
+{
+    if(overlay) {
+        size_t i;
+
+        if(overlay->snapshot) {
+            ZDOverlayFreeImage(overlay->snapshot->base);
+            ZDOverlayFreeImage(overlay->snapshot->delta);
+            ZDOverlayFreeSnapshot(overlay->snapshot);
+        }
+        while(overlay->garbage) {
+            struct ZDOverlayGarbage *const garbage = overlay->garbage;
+            overlay->garbage = garbage->next;
+            ZDOverlayFreeSnapshot(garbage->snapshot);
+            ZDOverlayFreeImage(garbage->delta);
+            ZDOverlayFreeImage(garbage->base);
+            free(garbage);
+        }
+
+        if(overlay->polygons) {
+            for(i = 0; i < overlay->numPolygons; i++) {
+                ZDOverlayFreePolygon(&overlay->polygons[i], overlay->numFields);
+            }
+            free(overlay->polygons);
+        }
+        if(overlay->fieldNames) {
+            for(i = 0; i < overlay->numFields; i++) {
+                if(overlay->fieldNames[i]) free(overlay->fieldNames[i]);
+            }
+            free(overlay->fieldNames);
+        }
+        if(overlay->notice) free(overlay->notice);
+        if(overlay->compactRemoved) free(overlay->compactRemoved);
+        if(overlay->slots) {
+            ZDMutexDestroy(&overlay->compactLock);
+            ZDMutexDestroy(&overlay->lock);
+            free(overlay->slots);
+        }
+        free(overlay);
+    }
+}
+
+ZoneDetectOverlay *ZDOverlayCreate(ZoneDetect *base, const ZoneDetectOptions *options)
+{
+    size_t i;
+
+    /* Images are made by the builder, which needs the same precision */
+    if(base->precision < 2 || base->precision > 30) {
+        return NULL;
+    }
+
+    ZoneDetectOverlay *const overlay = calloc(1, sizeof *overlay);
+    if(!overlay) {
+        return NULL;
+    }
+
+    overlay->tableType = base->tableType;
+    overlay->precision = base->precision;
+    overlay->numFields = base->numFields;
+    if(options) {
+        overlay->options = *options;
+    } else {
+        ZDInitOptions(&overlay->options);
+    }
+
+    overlay->fieldNames = calloc(base->numFields ? base->numFields : 1, sizeof *overlay->fieldNames);
+    if(!overlay->fieldNames) {
+        goto fail;
+    }
+    for(i = 0; i < base->numFields; i++) {
+        if(!(overlay->fieldNames[i] = ZDBuilderDuplicate(base->fieldNames[i]))) {
+            goto fail;
+        }
+    }
+    if(!(overlay->notice = ZDBuilderDuplicate(base->notice ? base->notice : ""))) {
+        goto fail;
+    }
+
+    overlay->numSlots = ZDNumProcessors() * 2;
+    if(overlay->numSlots < ZD_OVERLAY_READER_SLOTS) {
+        overlay->numSlots = ZD_OVERLAY_READER_SLOTS;
+    }
+    overlay->slots = calloc((size_t)overlay->numSlots + 1, sizeof *overlay->slots);
+    if(!overlay->slots) {
+        goto fail;
+    }
+    if(ZDMutexInit(&overlay->lock)) {
+        free(overlay->slots);
+        overlay->slots = NULL;
+        goto fail;
+    }
+    if(ZDMutexInit(&overlay->compactLock)) {
+        ZDMutexDestroy(&overlay->lock);
+        free(overlay->slots);
+        overlay->slots = NULL;
+        goto fail;
+    }
+
+    struct ZDOverlayImage *const image = calloc(1, sizeof *image);
+    overlay->snapshot = calloc(1, sizeof *overlay->snapshot);
+    if(!image || !overlay->snapshot) {
+        if(image) free(image);
+        goto fail;
+    }
+    image->library = base;
+    image->numPolygons = ZDListPolygons(base, NULL, NULL);
+    overlay->snapshot->base = image;
+
+    overlay->nextId = image->numPolygons;
+    overlay->epoch = 1;
+    return overlay;
+
+fail:
+    ZDOverlayFree(overlay);
+    return NULL;
 }
 
-ZoneDetect *ZDOpenDatabaseFromMemory(void* buffer, size_t length)
+int ZDOverlayAddPolygon(ZoneDetectOverlay *overlay, const char *const *fields, const double *lat, const double *lon, size_t numPoints, uint32_t *polygonId)
 {
-    ZoneDetect *const library = malloc(sizeof *library);
+    struct ZDOverlayPolygon polygon;
+    struct ZDOverlayImage *delta = NULL;
+    size_t i;
 
-    if(library) {
-        memset(library, 0, sizeof(*library));
-        library->closeType = 1;
-        library->length = (long int)length;
+    memset(&polygon, 0, sizeof(polygon));
 
-        if(library->length <= 0) {
-#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__APPLE__) || defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)
-            zdError(ZD_E_DB_SEEK, errno);
-#else
-            zdError(ZD_E_DB_SEEK, 0);
-#endif
+    ZDMutexLock(&overlay->lock);
+
+    if(overlay->nextId == UINT32_MAX) {
+        goto fail;
+    }
+    polygon.id = overlay->nextId;
+    polygon.numPoints = numPoints;
+    polygon.points = malloc((numPoints ? numPoints : 1) * 2 * sizeof *polygon.points);
+    polygon.fields = calloc(overlay->numFields ? overlay->numFields : 1, sizeof *polygon.fields);
+    if(!polygon.points || !polygon.fields || ZDBuilderConvertPoints(overlay->precision, lat, lon, numPoints, polygon.points)) {
+        goto fail;
+    }
+    for(i = 0; i < overlay->numFields; i++) {
+        if(!(polygon.fields[i] = ZDBuilderDuplicate(fields[i] ? fields[i] : ""))) {
             goto fail;
         }
+    }
 
-        library->mapping = buffer;
-
-        /* Parse the header */
-        if(ZDParseHeader(library)) {
-            zdError(ZD_E_PARSE_HEADER, 0);
+    if(overlay->numPolygons == overlay->polygonsCapacity) {
+        const size_t capacity = overlay->polygonsCapacity ? overlay->polygonsCapacity * 2 : 16;
+        struct ZDOverlayPolygon *const polygons = realloc(overlay->polygons, capacity * sizeof *polygons);
+        if(!polygons) {
             goto fail;
         }
+        overlay->polygons = polygons;
+        overlay->polygonsCapacity = capacity;
     }
 
-    return library;
+    /* The delta is rebuilt with the new polygon, which also checks that it is valid */
+    overlay->polygons[overlay->numPolygons++] = polygon;
+    if(ZDOverlayBuildImage(overlay, NULL, overlay->polygons, overlay->numPolygons, &delta)) {
+        overlay->numPolygons--;
+        goto fail;
+    }
+
+    const struct ZDOverlaySnapshot *const current = overlay->snapshot;
+    struct ZDOverlaySnapshot *const snapshot = ZDOverlayCopySnapshot(current, 0);
+    if(!snapshot) {
+        overlay->numPolygons--;
+        goto fail;
+    }
+    snapshot->delta = delta;
+    if(ZDOverlayPublish(overlay, snapshot, current->delta, NULL)) {
+        ZDOverlayFreeSnapshot(snapshot);
+        overlay->numPolygons--;
+        goto fail;
+    }
+
+    overlay->nextId++;
+    const int compact = !overlay->compacting && ZDOverlayDeltaFull(overlay);
+    ZDMutexUnlock(&overlay->lock);
+
+    if(polygonId) {
+        *polygonId = polygon.id;
+    }
+
+    /* The polygon was added even if merging the full delta into the base fails */
+    if(compact) {
+        ZDOverlayCompactInternal(overlay, 1);
+    }
+    return 0;
 
 fail:
-    ZDCloseDatabase(library);
-    return NULL;
+    ZDMutexUnlock(&overlay->lock);
+    ZDOverlayFreeImage(delta);
+    ZDOverlayFreePolygon(&polygon, overlay->numFields);
+    return -1;
 }
 
-ZoneDetect *ZDOpenDatabase(const char *path)
+int ZDOverlayRemovePolygon(ZoneDetectOverlay *overlay, uint32_t polygonId)
 {
-    ZoneDetect *const library = malloc(sizeof *library);
+    const struct ZDOverlaySnapshot *current;
+    struct ZDOverlaySnapshot *snapshot = NULL;
+    struct ZDOverlayImage *delta = NULL;
+    size_t i;
 
-    if(library) {
-        memset(library, 0, sizeof(*library));
+    ZDMutexLock(&overlay->lock);
+    current = overlay->snapshot;
 
-#if defined(_MSC_VER) || defined(__MINGW32__)
-        library->fd = CreateFile(path, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-        if (library->fd == INVALID_HANDLE_VALUE) {
-            zdError(ZD_E_DB_OPEN, (int)GetLastError());
+    /* A running compaction hides the polygon in the base it builds */
+    if(overlay->compacting && overlay->numCompactRemoved == overlay->compactRemovedCapacity) {
+        const size_t capacity = overlay->compactRemovedCapacity ? overlay->compactRemovedCapacity * 2 : 16;
+        uint32_t *const compactRemoved = realloc(overlay->compactRemoved, capacity * sizeof *compactRemoved);
+        if(!compactRemoved) {
             goto fail;
         }
+        overlay->compactRemoved = compactRemoved;
+        overlay->compactRemovedCapacity = capacity;
+    }
 
-        const DWORD fsize = GetFileSize(library->fd, NULL);
-        if (fsize == INVALID_FILE_SIZE) {
-            zdError(ZD_E_DB_SEEK, (int)GetLastError());
-            goto fail;
-        }
-        library->length = (int32_t)fsize;
+    /* Polygons added since the last compaction are removed from the delta */
+    for(i = 0; i < overlay->numPolygons && overlay->polygons[i].id != polygonId; i++);
+    if(i < overlay->numPolygons) {
+        struct ZDOverlayPolygon polygon = overlay->polygons[i];
+        memmove(&overlay->polygons[i], &overlay->polygons[i + 1], (overlay->numPolygons - i - 1) * sizeof *overlay->polygons);
+        overlay->numPolygons--;
 
-        library->fdMap = CreateFileMappingA(library->fd, NULL, PAGE_READONLY, 0, 0, NULL);
-        if (!library->fdMap) {
-            zdError(ZD_E_DB_MMAP, (int)GetLastError());
-            goto fail;
+        if(ZDOverlayBuildImage(overlay, NULL, overlay->polygons, overlay->numPolygons, &delta) || !(snapshot = ZDOverlayCopySnapshot(current, 0))) {
+            goto restore;
+        }
+        snapshot->delta = delta;
+        if(ZDOverlayPublish(overlay, snapshot, current->delta, NULL)) {
+            goto restore;
         }
 
-        library->mapping = MapViewOfFile(library->fdMap, FILE_MAP_READ, 0, 0, 0);
-        if (!library->mapping) {
-            zdError(ZD_E_DB_MMAP_MSVIEW, (int)GetLastError());
+        ZDOverlayFreePolygon(&polygon, overlay->numFields);
+        goto done;
+
+restore:
+        memmove(&overlay->polygons[i + 1], &overlay->polygons[i], (overlay->numPolygons - i) * sizeof *overlay->polygons);
+        overlay->polygons[i] = polygon;
+        overlay->numPolygons++;
+        goto fail;
+    }
+
+    /* Polygons of the base are hidden until the next compaction */
+    const struct ZDOverlayImage *const base = current->base;
+    uint32_t baseId;
+    if(base->ids) {
+        for(baseId = 0; baseId < base->numPolygons && base->ids[baseId] != polygonId; baseId++);
+    } else {
+        baseId = polygonId;
+    }
+    if(baseId >= base->numPolygons || (current->numRemoved && bsearch(&baseId, current->removed, current->numRemoved, sizeof *current->removed, ZDCompareUInt32))) {
+        goto fail;
+    }
+
+    snapshot = ZDOverlayCopySnapshot(current, 1);
+    if(!snapshot) {
+        goto fail;
+    }
+    for(i = snapshot->numRemoved; i > 0 && snapshot->removed[i - 1] > baseId; i--) {
+        snapshot->removed[i] = snapshot->removed[i - 1];
+    }
+    snapshot->removed[i] = baseId;
+    snapshot->numRemoved++;
+
+    if(ZDOverlayPublish(overlay, snapshot, NULL, NULL)) {
+        goto fail;
+    }
+
+done:
+    if(overlay->compacting) {
+        overlay->compactRemoved[overlay->numCompactRemoved++] = polygonId;
+    }
+    const int compact = !overlay->compacting && ZDOverlayDeltaFull(overlay);
+    ZDMutexUnlock(&overlay->lock);
+
+    /* The polygon was removed even if merging the pending changes into the base fails */
+    if(compact) {
+        ZDOverlayCompactInternal(overlay, 1);
+    }
+    return 0;
+
+fail:
+    ZDMutexUnlock(&overlay->lock);
+    ZDOverlayFreeImage(delta);
+    ZDOverlayFreeSnapshot(snapshot);
+    return -1;
+}
+
+/* Build a new base of all current polygons, with onlyIfFull nothing is done unless the delta is still full */
+static int ZDOverlayCompactInternal(ZoneDetectOverlay *overlay, int onlyIfFull)
+{
+    struct ZDOverlayImage *base = NULL, *delta = NULL;
+    struct ZDOverlaySnapshot *snapshot = NULL;
+    size_t numCompacted, i;
+    int result = -1;
+
+    ZDMutexLock(&overlay->compactLock);
+
+    /* The new base is built from the current snapshot while changes go on, entering as a reader keeps it alive */
+    ZDMutexLock(&overlay->lock);
+    if(onlyIfFull && !ZDOverlayDeltaFull(overlay)) {
+        ZDMutexUnlock(&overlay->lock);
+        ZDMutexUnlock(&overlay->compactLock);
+        return 0;
+    }
+    struct ZDOverlaySlot *const slot = ZDOverlayEnter(overlay);
+    const struct ZDOverlaySnapshot *const start = overlay->snapshot;
+    const uint32_t startId = overlay->nextId;
+    overlay->compacting = 1;
+    overlay->numCompactRemoved = 0;
+    ZDMutexUnlock(&overlay->lock);
+
+    const int built = ZDOverlayBuildImage(overlay, start, NULL, 0, &base);
+    ZDOverlayExit(overlay, slot);
+
+    ZDMutexLock(&overlay->lock);
+    overlay->compacting = 0;
+    const struct ZDOverlaySnapshot *const current = overlay->snapshot;
+    snapshot = calloc(1, sizeof *snapshot);
+    if(built || !snapshot) {
+        goto fail;
+    }
+    snapshot->base = base;
+
+    /* Polygons removed during the build are hidden in the new base */
+    if(overlay->numCompactRemoved) {
+        qsort(overlay->compactRemoved, overlay->numCompactRemoved, sizeof *overlay->compactRemoved, ZDCompareUInt32);
+        snapshot->removed = malloc(overlay->numCompactRemoved * sizeof *snapshot->removed);
+        if(!snapshot->removed) {
             goto fail;
         }
-#elif defined(__APPLE__) || defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)
-        library->fd = open(path, O_RDONLY | O_CLOEXEC);
-        if(library->fd < 0) {
-            zdError(ZD_E_DB_OPEN, errno);
-            goto fail;
+        for(i = 0; i < base->numPolygons; i++) {
+            if(bsearch(&base->ids[i], overlay->compactRemoved, overlay->numCompactRemoved, sizeof *overlay->compactRemoved, ZDCompareUInt32)) {
+                snapshot->removed[snapshot->numRemoved++] = (uint32_t)i;
+            }
         }
+    }
 
-        library->length = lseek(library->fd, 0, SEEK_END);
-        if(library->length <= 0 || library->length > 50331648) {
-            zdError(ZD_E_DB_SEEK, errno);
-            goto fail;
-        }
-        lseek(library->fd, 0, SEEK_SET);
+    /* Pending polygons are ordered by id, the ones added during the build stay in the delta */
+    for(numCompacted = 0; numCompacted < overlay->numPolygons && overlay->polygons[numCompacted].id < startId; numCompacted++);
+    if(overlay->numPolygons > numCompacted && ZDOverlayBuildImage(overlay, NULL, overlay->polygons + numCompacted, overlay->numPolygons - numCompacted, &delta)) {
+        goto fail;
+    }
+    snapshot->delta = delta;
 
-        library->mapping = mmap(NULL, (size_t)library->length, PROT_READ, MAP_PRIVATE | MAP_FILE, library->fd, 0);
-        if(library->mapping == MAP_FAILED) {
-            zdError(ZD_E_DB_MMAP, errno);
-            goto fail;
-        }
-#endif
+    if(ZDOverlayPublish(overlay, snapshot, current->delta, current->base)) {
+        goto fail;
+    }
+    base = delta = NULL;
+    snapshot = NULL;
 
-        /* Parse the header */
-        if(ZDParseHeader(library)) {
-            zdError(ZD_E_PARSE_HEADER, 0);
-            goto fail;
+    if(numCompacted) {
+        for(i = 0; i < numCompacted; i++) {
+            ZDOverlayFreePolygon(&overlay->polygons[i], overlay->numFields);
         }
+        overlay->numPolygons -= numCompacted;
+        memmove(overlay->polygons, overlay->polygons + numCompacted, overlay->numPolygons * sizeof *overlay->polygons);
     }
-
-    return library;
+    result = 0;
 
 fail:
-    ZDCloseDatabase(library);
-    return NULL;
+    overlay->numCompactRemoved = 0;
+    ZDMutexUnlock(&overlay->lock);
+    ZDMutexUnlock(&overlay->compactLock);
+    ZDOverlayFreeImage(base);
+    ZDOverlayFreeImage(delta);
+    ZDOverlayFreeSnapshot(snapshot);
+    return result;
 }
 
-ZoneDetectResult *ZDLookup(const ZoneDetect *library, float lat, float lon, float *safezone)
+int ZDOverlayCompact(ZoneDetectOverlay *overlay)
 {
-    const int32_t latFixedPoint = ZDFloatToFixedPoint(lat, 90, library->precision);
-    const int32_t lonFixedPoint = ZDFloatToFixedPoint(lon, 180, library->precision);
-    size_t numResults = 0;
-    uint64_t distanceSqrMin = (uint64_t)-1;
+    return ZDOverlayCompactInternal(overlay, 0);
+}
 
-    /* Iterate over all polygons */
-    uint32_t bboxIndex = library->bboxOffset;
-    uint32_t metadataIndex = 0;
-    uint32_t polygonIndex = 0;
+size_t ZDOverlayGetPendingChanges(ZoneDetectOverlay *overlay)
+{
+    ZDMutexLock(&overlay->lock);
+    const size_t changes = overlay->numPolygons + overlay->snapshot->numRemoved;
+    ZDMutexUnlock(&overlay->lock);
+    return changes;
+}
 
-    ZoneDetectResult *results = malloc(sizeof *results);
-    if(!results) {
-        return NULL;
-    }
+/* Hits of one image with removed polygons left out, polygonIds are translated to the overlay */
+static void ZDOverlayCollectHits(const struct ZDOverlaySnapshot *snapshot, const struct ZDOverlayImage *image, int32_t latFixedPoint, int32_t lonFixedPoint, uint64_t *distanceSqrMin, struct ZDHitList *list)
+{
+    size_t numHits = 0, i;
 
-    uint32_t polygonId = 0;
+    ZDCollectHits(image->library, latFixedPoint, lonFixedPoint, distanceSqrMin, 0, list);
 
-    while(bboxIndex < library->metadataOffset) {
-        int32_t minLat, minLon, maxLat, maxLon, metadataIndexDelta;
-        uint64_t polygonIndexDelta;
-        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &minLat)) break;
-        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &minLon)) break;
-        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &maxLat)) break;
-        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &maxLon)) break;
-        if(!ZDDecodeVariableLengthSigned(library, &bboxIndex, &metadataIndexDelta)) break;
-        if(!ZDDecodeVariableLengthUnsigned(library, &bboxIndex, &polygonIndexDelta)) break;
-
-        metadataIndex += (uint32_t)metadataIndexDelta;
-        polygonIndex += (uint32_t)polygonIndexDelta;
-
-        if(latFixedPoint >= minLat) {
-            if(latFixedPoint <= maxLat &&
-                    lonFixedPoint >= minLon &&
-                    lonFixedPoint <= maxLon) {
-
-                const ZDLookupResult lookupResult = ZDPointInPolygon(library, library->dataOffset + polygonIndex, latFixedPoint, lonFixedPoint, (safezone) ? &distanceSqrMin : NULL);
-                if(lookupResult == ZD_LOOKUP_PARSE_ERROR) {
-                    break;
-                } else if(lookupResult != ZD_LOOKUP_NOT_IN_ZONE) {
-                    ZoneDetectResult *const newResults = realloc(results, sizeof *newResults * (numResults + 2));
-
-                    if(newResults) {
-                        results = newResults;
-                        results[numResults].polygonId = polygonId;
-                        results[numResults].metaId = metadataIndex;
-                        results[numResults].numFields = library->numFields;
-                        results[numResults].fieldNames = library->fieldNames;
-                        results[numResults].lookupResult = lookupResult;
-
-                        numResults++;
-                    } else {
-                        break;
-                    }
-                }
-            }
-        } else {
-            /* The data is sorted along minLat */
-            break;
+    for(i = 0; i < list->numHits; i++) {
+        if(image == snapshot->base && snapshot->numRemoved &&
+                bsearch(&list->hits[i].polygonId, snapshot->removed, snapshot->numRemoved, sizeof *snapshot->removed, ZDCompareUInt32)) {
+            continue;
         }
+        list->hits[numHits++] = list->hits[i];
+    }
+    list->numHits = numHits;
 
-        polygonId++;
+    if(image->ids) {
+        for(i = 0; i < numHits; i++) {
+            list->hits[i].polygonId = image->ids[list->hits[i].polygonId];
+        }
     }
+}
 
-    /* Clean up results */
+/* 1 if metaIdA of libraryA and metaIdB of libraryB have the same fields, 0 if not, -1 on failure */
+static int ZDOverlaySameZone(const ZoneDetect *libraryA, uint32_t metaIdA, const ZoneDetect *libraryB, uint32_t metaIdB)
+{
+    char **const fieldsA = ZDDuplicateFields(libraryA, metaIdA);
+    char **const fieldsB = ZDDuplicateFields(libraryB, metaIdB);
+    int result = -1;
     size_t i;
-    for(i = 0; i < numResults; i++) {
-        int insideSum = 0;
-        ZDLookupResult overrideResult = ZD_LOOKUP_IGNORE;
-        size_t j;
-        for(j = i; j < numResults; j++) {
-            if(results[i].metaId == results[j].metaId) {
-                ZDLookupResult tmpResult = results[j].lookupResult;
-                results[j].lookupResult = ZD_LOOKUP_IGNORE;
-
-                /* This is the same result. Is it an exclusion zone? */
-                if(tmpResult == ZD_LOOKUP_IN_ZONE) {
-                    insideSum++;
-                } else if(tmpResult == ZD_LOOKUP_IN_EXCLUDED_ZONE) {
-                    insideSum--;
-                } else {
-                    /* If on the bodrder then the final result is on the border */
-                    overrideResult = tmpResult;
-                }
 
+    if(fieldsA && fieldsB) {
+        result = 1;
+        for(i = 0; i < libraryA->numFields; i++) {
+            if(strcmp(fieldsA[i], fieldsB[i])) {
+                result = 0;
+                break;
             }
         }
+    }
 
-        if(overrideResult != ZD_LOOKUP_IGNORE) {
-            results[i].lookupResult = overrideResult;
+    for(i = 0; i < libraryA->numFields; i++) {
+        if(fieldsA) free(fieldsA[i]);
+        if(fieldsB) free(fieldsB[i]);
+    }
+    if(fieldsA) free(fieldsA);
+    if(fieldsB) free(fieldsB);
+    return result;
+}
+
+/*
+ * Move the delta hits of zones that also have a base hit to the base list, so each zone is merged once like
+ * after a compaction. Zones are the same when their fields are.
+ */
+static int ZDOverlayMoveSharedZones(const struct ZDOverlayImage *base, struct ZDHitList *baseList, const struct ZDOverlayImage *delta, struct ZDHitList *deltaList)
+{
+    const size_t numBaseHits = baseList->numHits;
+    size_t i, j;
+
+    for(i = 0; i < deltaList->numHits; i++) {
+        ZoneDetectHit *const hit = &deltaList->hits[i];
+        uint32_t metaId = UINT32_MAX;
+
+        /* A moved hit keeps the metaId of its base zone for the other hits of the zone */
+        for(j = 0; j < i && deltaList->hits[j].metaId != hit->metaId; j++);
+        if(j < i) {
+            if(deltaList->hits[j].lookupResult != ZD_LOOKUP_IGNORE) {
+                continue;
+            }
+            metaId = deltaList->hits[j].polygonId;
         } else {
-            if(insideSum) {
-                results[i].lookupResult = ZD_LOOKUP_IN_ZONE;
+            for(j = 0; j < numBaseHits && metaId == UINT32_MAX; j++) {
+                const int same = ZDOverlaySameZone(delta->library, hit->metaId, base->library, baseList->hits[j].metaId);
+                if(same < 0) {
+                    return -1;
+                }
+                if(same) {
+                    metaId = baseList->hits[j].metaId;
+                }
+            }
+            if(metaId == UINT32_MAX) {
+                continue;
             }
         }
-    }
 
-    /* Remove zones to ignore */
-    size_t newNumResults = 0;
-    for(i = 0; i < numResults; i++) {
-        if(results[i].lookupResult != ZD_LOOKUP_IGNORE) {
-            results[newNumResults] = results[i];
-            newNumResults++;
+        if(ZDHitListAdd(baseList, hit->polygonId, metaId, hit->lookupResult)) {
+            return -1;
         }
+        hit->lookupResult = ZD_LOOKUP_IGNORE;
+        hit->polygonId = metaId;
     }
-    numResults = newNumResults;
 
-    /* Lookup metadata */
-    for(i = 0; i < numResults; i++) {
-        uint32_t tmpIndex = library->metadataOffset + results[i].metaId;
-        results[i].data = malloc(library->numFields * sizeof *results[i].data);
-        if(results[i].data) {
-            size_t j;
-            for(j = 0; j < library->numFields; j++) {
-                results[i].data[j] = ZDParseString(library, &tmpIndex);
-                if (!results[i].data[j]) {
-                    /* free all allocated memory */
-                    size_t m;
-                    for(m = 0; m < j; m++) {
-                        if(results[i].data[m]) {
-                            free(results[i].data[m]);
-                        }
-                    }
-                    size_t k;
-                    for(k = 0; k < i; k++) {
-                        size_t l;
-                        for(l = 0; l < (size_t)results[k].numFields; l++) {
-                            if(results[k].data[l]) {
-                                free(results[k].data[l]);
-                            }
-                        }
-                        if (results[k].data) {
-                            free(results[k].data);
-                        }
-                    }
-                    free(results);
-                    return NULL;
-                }
-            }
+    deltaList->numHits = ZDCompactHits(deltaList->hits, deltaList->numHits);
+    return 0;
+}
+
+ZoneDetectResult *ZDOverlayLookup(const ZoneDetectOverlay *overlay, float lat, float lon, float *safezone)
+{
+    const int32_t latFixedPoint = ZDFloatToFixedPoint(lat, 90, overlay->precision);
+    const int32_t lonFixedPoint = ZDFloatToFixedPoint(lon, 180, overlay->precision);
+    ZoneDetectHit hitBuffer[2][16];
+    struct ZDHitList lists[2];
+    size_t numHits[2] = {0, 0};
+    uint64_t distanceSqrMin = UINT64_MAX;
+    ZoneDetectResult *results = NULL;
+    size_t i, j, numResults = 0;
+
+    struct ZDOverlaySlot *const slot = ZDOverlayEnter(overlay);
+    const struct ZDOverlaySnapshot *const snapshot = ZDAtomicLoadPointer((void *volatile *)&overlay->snapshot);
+    const struct ZDOverlayImage *const images[2] = {snapshot->base, snapshot->delta};
+
+    for(i = 0; i < 2; i++) {
+        lists[i].hits = hitBuffer[i];
+        lists[i].heap = NULL;
+        lists[i].numHits = 0;
+        lists[i].capacity = sizeof(hitBuffer[i]) / sizeof(hitBuffer[i][0]);
+        lists[i].fixed = 0;
+        if(images[i]) {
+            ZDOverlayCollectHits(snapshot, images[i], latFixedPoint, lonFixedPoint, safezone ? &distanceSqrMin : NULL, &lists[i]);
         }
-        else {
-            /* free all allocated memory */
-            size_t k;
-            for(k = 0; k < i; k++) {
-                size_t l;
-                for(l = 0; l < (size_t)results[k].numFields; l++) {
-                    if(results[k].data[l]) {
-                        free(results[k].data[l]);
-                    }
-                }
-                if (results[k].data) {
-                    free(results[k].data);
-                }
+    }
+
+    /* A zone with polygons in both images gives one result */
+    if(lists[0].numHits && lists[1].numHits && ZDOverlayMoveSharedZones(images[0], &lists[0], images[1], &lists[1])) {
+        goto done;
+    }
+    for(i = 0; i < 2; i++) {
+        numHits[i] = ZDMergeHits(lists[i].hits, lists[i].numHits);
+    }
+
+    results = malloc(sizeof *results * (numHits[0] + numHits[1] + 1));
+    if(!results) {
+        goto done;
+    }
+
+    /* The images may be freed after this reader leaves, the fields are copied now */
+    for(i = 0; i < 2; i++) {
+        for(j = 0; j < numHits[i]; j++) {
+            ZoneDetectResult *const result = &results[numResults];
+            result->lookupResult = lists[i].hits[j].lookupResult;
+            result->polygonId = lists[i].hits[j].polygonId;
+            result->metaId = lists[i].hits[j].metaId;
+            result->numFields = overlay->numFields;
+            result->fieldNames = overlay->fieldNames;
+            result->data = ZDDuplicateFields(images[i]->library, lists[i].hits[j].metaId);
+            if(!result->data) {
+                result->lookupResult = ZD_LOOKUP_END;
+                ZDFreeResults(results);
+                results = NULL;
+                goto done;
             }
-            free(results);
-            return NULL;
+            numResults++;
         }
     }
 
@@ -1081,9 +7365,14 @@ ZoneDetectResult *ZDLookup(const ZoneDetect *library, float lat, float lon, floa
     results[numResults].data = NULL;
 
     if(safezone) {
-        *safezone = sqrtf((float)distanceSqrMin) * 90 / (float)(1 << (library->precision - 1));
+        *safezone = sqrtf((float)distanceSqrMin) * 90 / (float)(1 << (overlay->precision - 1));
     }
 
+done:
+    ZDOverlayExit(overlay, slot);
+    for(i = 0; i < 2; i++) {
+        if(lists[i].heap) free(lists[i].heap);
+    }
     return results;
 }
 
@@ -1110,6 +7399,84 @@ void ZDFreeResults(ZoneDetectResult *results)
     free(results);
 }
 
+int ZDGetMetadata(const ZoneDetect *library, uint32_t metaId, ZoneDetectString *fields, char *buffer, size_t bufferSize)
+{
+    const ZoneDetectString *const interned = ZDFindMetadata(library, metaId);
+    uint32_t index = library->metadataOffset + metaId;
+    size_t used = 0;
+    unsigned int i;
+
+    /* Version 3 strings are used in place and need no buffer */
+    if(library->version >= 3) {
+        for(i = 0; i < library->numFields; i++) {
+            uint32_t length;
+            fields[i].data = ZDLocateField(library, metaId, i, &length);
+            if(!fields[i].data) {
+                return -1;
+            }
+            fields[i].length = length;
+        }
+        return 0;
+    }
+
+    for(i = 0; i < library->numFields; i++) {
+        uint32_t strOffset = 0, strLength;
+        if(interned) {
+            strLength = (uint32_t)interned[i].length;
+        } else if(ZDLocateString(library, &index, &strOffset, &strLength)) {
+            return -1;
+        }
+
+        fields[i].length = strLength;
+        fields[i].data = NULL;
+        if(used + strLength + 1 <= bufferSize) {
+            if(interned) {
+                memcpy(buffer + used, interned[i].data, (size_t)strLength + 1);
+            } else if(ZDCopyString(library, strOffset, strLength, buffer + used)) {
+                return -1;
+            }
+            fields[i].data = buffer + used;
+        }
+        used += strLength + 1;
+    }
+
+    return (int)used;
+}
+
+uint32_t ZDGetNumZones(const ZoneDetect *library)
+{
+    return library->metadata.count;
+}
+
+int ZDGetZoneIndex(const ZoneDetect *library, uint32_t metaId)
+{
+    const ZoneDetectString *const fields = ZDFindMetadata(library, metaId);
+    if(!fields || !library->numFields) {
+        return -1;
+    }
+
+    return (int)((size_t)(fields - library->metadata.fields) / library->numFields);
+}
+
+const ZoneDetectString *ZDGetZoneFields(const ZoneDetect *library, uint32_t zoneIndex)
+{
+    if(zoneIndex >= library->metadata.count) {
+        return NULL;
+    }
+
+    return &library->metadata.fields[(size_t)zoneIndex * library->numFields];
+}
+
+uint8_t ZDGetNumFields(const ZoneDetect *library)
+{
+    return library->numFields;
+}
+
+const char *ZDGetFieldName(const ZoneDetect *library, uint8_t field)
+{
+    return (field < library->numFields) ? library->fieldNames[field] : NULL;
+}
+
 const char *ZDGetNotice(const ZoneDetect *library)
 {
     return library->notice;
@@ -1173,6 +7540,10 @@ const char *ZDGetErrorString(int errZD)
             return ZD_E_COULD_NOT("close database file");
         case ZD_E_PARSE_HEADER    :
             return ZD_E_COULD_NOT("parse database header");
+        case ZD_E_BUILD_INDEX     :
+            return ZD_E_COULD_NOT("build lookup index");
+        case ZD_E_VALIDATE        :
+            return ZD_E_COULD_NOT("validate database");
     }
 }
 
@@ -60,9 +60,126 @@ typedef struct {
     char **data;
 } ZoneDetectResult;
 
+typedef struct {
+    ZDLookupResult lookupResult;
+    uint32_t polygonId;
+    uint32_t metaId;
+} ZoneDetectHit;
+
+/* Not zero terminated view of a metadata field */
+typedef struct {
+    const char *data;
+    size_t length;
+} ZoneDetectString;
+
 struct ZoneDetectOpaque;
 typedef struct ZoneDetectOpaque ZoneDetect;
 
+/* Flags for ZoneDetectOptions.flags */
+#define ZD_OPEN_GRID_INDEX    (1u << 0) /* Build a lat/lon grid of candidate polygons when opening */
+#define ZD_OPEN_GRID_CLASSIFY (1u << 1) /* Also find grid cells inside a single zone, implies ZD_OPEN_GRID_INDEX */
+#define ZD_OPEN_DECODE_BBOX   (1u << 2) /* Decode the bounding boxes when opening and filter them with SIMD */
+#define ZD_OPEN_SLAB_INDEX    (1u << 3) /* Decode large polygons when opening and bucket their edges by latitude */
+#define ZD_OPEN_POLYGON_CACHE (1u << 4) /* Keep recently used polygons decoded in a thread-safe LRU cache */
+#define ZD_OPEN_EXPANDED      (1u << 5) /* Decode all polygons when opening */
+#define ZD_OPEN_INTERN_METADATA (1u << 6) /* Decode all metadata records once when opening */
+#define ZD_OPEN_RESULT_CACHE  (1u << 7) /* Cache lookup results in a sharded thread-safe LRU cache, implies ZD_OPEN_GRID_INDEX */
+#define ZD_OPEN_VALIDATE      (1u << 8) /* Check the whole database when opening, which fails if it is corrupt, and skip bounds checks in lookups */
+
+typedef struct {
+    uint32_t flags;
+
+    /* Grid index resolution, 0 selects the default of 180x360 (one degree) cells */
+    uint32_t gridLatCells;
+    uint32_t gridLonCells;
+    /* Upper bound for the grid index memory in bytes, 0 is unlimited. The resolution is halved until it fits. */
+    size_t gridMaxMemory;
+
+    /* Minimum number of vertices for ZD_OPEN_SLAB_INDEX, 0 selects the default of 1024 */
+    uint32_t slabMinVertices;
+
+    /* Memory budget of ZD_OPEN_POLYGON_CACHE in bytes, 0 selects the default of 8 MiB */
+    size_t cacheMaxMemory;
+
+    /* Number of entries of ZD_OPEN_RESULT_CACHE, 0 selects the default of 65536 */
+    uint32_t resultCacheEntries;
+    /* Number of separately locked shards, rounded up to a power of two. 0 selects the default of 16. */
+    uint32_t resultCacheShards;
+} ZoneDetectOptions;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t memory;
+    uint32_t numEntries;
+} ZoneDetectCacheStats;
+
+/* Flags for ZDLookupBatch */
+#define ZD_BATCH_KEEP_ORDER (1u << 0) /* Visit the points in input order instead of along a Morton curve */
+#define ZD_BATCH_FIRST_MATCH (1u << 1) /* Return the ZDLookupFirst() result, numResults is then 0 or 1 */
+#define ZD_BATCH_POLYGON_MAJOR (1u << 2) /* Test nearby points together, reading each polygon once for all of them. Ignored with ZD_BATCH_FIRST_MATCH */
+
+typedef struct {
+    /* First result ZDLookup would return, ZD_LOOKUP_END if there is none */
+    ZDLookupResult lookupResult;
+    uint32_t polygonId;
+    uint32_t metaId;
+    /* Number of results ZDLookup would return */
+    uint32_t numResults;
+} ZoneDetectBatchResult;
+
+typedef struct {
+    uint32_t flags;
+    /* Number of worker threads, 0 selects one per processor */
+    uint32_t numThreads;
+
+    /*
+     * Optional external thread pool. It must call worker(argument) numWorkers times, possibly in parallel,
+     * and return once all calls have returned. Workers never wait for each other.
+     */
+    void (*runWorkers)(void *poolContext, void (*worker)(void *argument), void *argument, uint32_t numWorkers);
+    void *poolContext;
+} ZoneDetectBatchOptions;
+
+struct ZoneDetectTrackerOpaque;
+typedef struct ZoneDetectTrackerOpaque ZoneDetectTracker;
+
+struct ZoneDetectBuilderOpaque;
+typedef struct ZoneDetectBuilderOpaque ZoneDetectBuilder;
+
+struct ZoneDetectOverlayOpaque;
+typedef struct ZoneDetectOverlayOpaque ZoneDetectOverlay;
+
+/* Values of ZoneDetectTrackerEvent.type */
+#define ZD_TRACKER_ENTER 1
+#define ZD_TRACKER_EXIT  2
+/* Returned by ZDTrackerGetZone for entities that are not in any zone */
+#define ZD_TRACKER_NO_ZONE UINT32_MAX
+
+typedef struct {
+    uint32_t entity;
+    uint32_t metaId;
+    uint32_t type;
+} ZoneDetectTrackerEvent;
+
+typedef struct {
+    uint64_t updates;
+    uint64_t lookups;
+    uint64_t events;
+} ZoneDetectTrackerStats;
+
+typedef struct {
+    /* CPU time in seconds spent building the indexes when opening */
+    double buildTime;
+
+    size_t tableMemory;
+    size_t gridMemory;
+    size_t polygonMemory;
+    uint32_t numDecodedPolygons;
+    uint64_t numDecodedPoints;
+} ZoneDetectIndexStats;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -71,11 +188,145 @@ ZD_EXPORT ZoneDetect *ZDOpenDatabase(const char *path);
 ZD_EXPORT ZoneDetect *ZDOpenDatabaseFromMemory(void* buffer, size_t length);
 ZD_EXPORT void        ZDCloseDatabase(ZoneDetect *library);
 
+ZD_EXPORT void        ZDInitOptions(ZoneDetectOptions *options);
+ZD_EXPORT ZoneDetect *ZDOpenDatabaseWithOptions(const char *path, const ZoneDetectOptions *options);
+ZD_EXPORT ZoneDetect *ZDOpenDatabaseFromMemoryWithOptions(void* buffer, size_t length, const ZoneDetectOptions *options);
+ZD_EXPORT ZoneDetect *ZDOpenDatabaseExpanded(const char *path, uint32_t flags);
+ZD_EXPORT int         ZDGetCacheStats(const ZoneDetect *library, ZoneDetectCacheStats *stats);
+
+/*
+ * ZD_OPEN_RESULT_CACHE is used by ZDLookup and ZDLookupHits. Points with the same fixed point coordinates as
+ * a cached one, or in the same grid cell and inside its safezone, get its results without a lookup. The
+ * safezone reported for the latter is the cached one minus the distance to it, so it can be smaller than
+ * the one a lookup would find. A miss always computes the safezone, also when the caller passes NULL, since
+ * the entry needs it. Such lookups are slower than without the cache, they compute distances to the edges
+ * and cannot use the vector winding kernels. Returns -1 if the cache is not enabled.
+ */
+ZD_EXPORT int         ZDGetResultCacheStats(const ZoneDetect *library, ZoneDetectCacheStats *stats);
+ZD_EXPORT void        ZDGetIndexStats(const ZoneDetect *library, ZoneDetectIndexStats *stats);
+
 ZD_EXPORT ZoneDetectResult *ZDLookup(const ZoneDetect *library, float lat, float lon, float *safezone);
 ZD_EXPORT void              ZDFreeResults(ZoneDetectResult *results);
 
+/*
+ * Like ZDLookup, for callers that only need to know whether the safezone is at least safezoneLimit.
+ * *safezone is set to safezoneLimit if it is, and to 0 otherwise. Borders further away than the limit
+ * are not searched and distances are no longer computed once a closer one was found.
+ */
+ZD_EXPORT ZoneDetectResult *ZDLookupWithSafezoneLimit(const ZoneDetect *library, float lat, float lon, float safezoneLimit, float *safezone);
+
+/*
+ * Lookup without allocating: writes up to maxHits results to hits and returns the number of results. If
+ * this is more than maxHits, the results were not written and the call should be repeated with at least
+ * the returned number of entries.
+ */
+ZD_EXPORT size_t            ZDLookupHits(const ZoneDetect *library, float lat, float lon, float *safezone, ZoneDetectHit *hits, size_t maxHits);
+ZD_EXPORT size_t            ZDLookupHitsWithSafezoneLimit(const ZoneDetect *library, float lat, float lon, float safezoneLimit, float *safezone, ZoneDetectHit *hits, size_t maxHits);
+
+/*
+ * Stop at the first zone that contains the point, for tables whose zones do not overlap such as the timezone
+ * table. Exclusion polygons are taken into account. If no zone contains the point, a zone on whose border it
+ * lies is returned. Returns 1 if hit was written, 0 if the point is in no zone. If zones overlap, which of
+ * them is returned is unspecified.
+ */
+ZD_EXPORT int               ZDLookupFirst(const ZoneDetect *library, float lat, float lon, ZoneDetectHit *hit);
+
+/*
+ * Find the k zones closest to the point, also when it lies in none of them. Writes up to k hits ordered by
+ * distance and returns their number. Zones containing the point come first with a distance of 0, the
+ * others have ZD_LOOKUP_NOT_IN_ZONE and the polygon closest to the point. Distances are in the units of the
+ * safezone, zones further away than maxDistance are left out. distances may be NULL.
+ */
+ZD_EXPORT size_t            ZDLookupNearest(const ZoneDetect *library, float lat, float lon, size_t k, float maxDistance, ZoneDetectHit *hits, float *distances);
+
+/*
+ * Find all zones within radius of the point, for example the uncertainty of a GPS fix, in the units of the
+ * safezone. Hits and distances are written like ZDLookupNearest(), up to maxHits of them. Returns the number
+ * of zones found, if this is larger than maxHits the call needs to be repeated with more room.
+ */
+ZD_EXPORT size_t            ZDLookupRadius(const ZoneDetect *library, float lat, float lon, float radius, ZoneDetectHit *hits, size_t maxHits, float *distances);
+
+/*
+ * Decode the ZDGetNumFields() metadata fields of metaId into buffer and point fields into it. Returns the
+ * buffer size needed, fields that did not fit have a NULL data pointer. Returns -1 on a parse error.
+ * Version 3 databases store plain strings, the fields then point into the database and this returns 0.
+ */
+ZD_EXPORT int               ZDGetMetadata(const ZoneDetect *library, uint32_t metaId, ZoneDetectString *fields, char *buffer, size_t bufferSize);
+
+/*
+ * With ZD_OPEN_INTERN_METADATA every metadata record gets a dense zone index. Its ZDGetNumFields() zero
+ * terminated fields stay valid until the database is closed. ZDGetZoneIndex() returns -1 for unknown ids.
+ */
+ZD_EXPORT uint32_t                ZDGetNumZones(const ZoneDetect *library);
+ZD_EXPORT int                     ZDGetZoneIndex(const ZoneDetect *library, uint32_t metaId);
+ZD_EXPORT const ZoneDetectString *ZDGetZoneFields(const ZoneDetect *library, uint32_t zoneIndex);
+
+/*
+ * Look up numPoints points and write one result per point to results. ZDLookupBatch() runs on the calling
+ * thread, ZDLookupBatchWithOptions() spreads the points over worker threads. ZDInitBatchOptions() clears
+ * options, which selects one worker per processor.
+ */
+ZD_EXPORT void              ZDLookupBatch(const ZoneDetect *library, const float *lat, const float *lon, size_t numPoints, ZoneDetectBatchResult *results, uint32_t flags);
+ZD_EXPORT void              ZDInitBatchOptions(ZoneDetectBatchOptions *options);
+ZD_EXPORT void              ZDLookupBatchWithOptions(const ZoneDetect *library, const float *lat, const float *lon, size_t numPoints, ZoneDetectBatchResult *results, const ZoneDetectBatchOptions *options);
+
+/*
+ * Tracks the zone of numEntities moving entities, numbered from 0. An update only does a lookup when the
+ * entity left the safezone of its last one, which needs a grid index or decoded table to be used. Each
+ * entity is in at most one zone: it stays in its zone while inside or on the border of it, and otherwise
+ * takes the first zone ZDLookup returns. Changes are written to events as an exit of the old zone followed
+ * by an enter of the new one. Updates for unknown entities are skipped. Returns the number of updates
+ * processed, which is less than numUpdates when the events no longer fit or memory ran out. A tracker must
+ * not be updated from several threads at once.
+ */
+ZD_EXPORT ZoneDetectTracker *ZDTrackerCreate(const ZoneDetect *library, uint32_t numEntities);
+ZD_EXPORT void               ZDTrackerFree(ZoneDetectTracker *tracker);
+ZD_EXPORT size_t             ZDTrackerUpdate(ZoneDetectTracker *tracker, const uint32_t *entities, const float *lat, const float *lon, size_t numUpdates, ZoneDetectTrackerEvent *events, size_t maxEvents, size_t *numEvents);
+ZD_EXPORT uint32_t           ZDTrackerGetZone(const ZoneDetectTracker *tracker, uint32_t entity);
+ZD_EXPORT void               ZDTrackerGetStats(const ZoneDetectTracker *tracker, ZoneDetectTrackerStats *stats);
+
+/*
+ * Build a version 3 database in memory, for zones that are not read from shapefiles. Field names and the
+ * notice are at most 255 bytes. ZDBuilderAddMetadata() adds a record of numFields strings, NULL fields are
+ * empty, and returns its number for ZDBuilderAddPolygon(), or -1. The metaId lookups will report is written
+ * to metaId if it is not NULL. A polygon is a ring of at least three distinct points, it does not have to
+ * be closed. Like in shapefiles, outer rings are clockwise and holes counterclockwise. ZDBuilderFinish()
+ * returns a buffer for ZDOpenDatabaseFromMemory(), which must be freed after the database is closed. The
+ * builder is freed with ZDBuilderFree(), also after ZDBuilderFinish().
+ */
+ZD_EXPORT ZoneDetectBuilder *ZDBuilderCreate(uint8_t tableType, unsigned int precision, const char *const *fieldNames, uint8_t numFields, const char *notice);
+ZD_EXPORT int                ZDBuilderAddMetadata(ZoneDetectBuilder *builder, const char *const *fields, uint32_t *metaId);
+ZD_EXPORT int                ZDBuilderAddPolygon(ZoneDetectBuilder *builder, uint32_t metadata, const double *lat, const double *lon, size_t numPoints);
+ZD_EXPORT void              *ZDBuilderFinish(ZoneDetectBuilder *builder, size_t *length);
+ZD_EXPORT void               ZDBuilderFree(ZoneDetectBuilder *builder);
+
+/*
+ * Mutable layer over an immutable base database. Added polygons go to a small delta database and removed base
+ * polygons are hidden, ZDOverlayCompact() builds a new base of all current polygons. Changes made while it
+ * runs are not blocked and are kept. A change rebuilds the delta in time linear in the number of pending
+ * changes. Once these exceed the square root of the number of base polygons, and at least 64, the change
+ * compacts before it returns unless a compaction is already running, so a change takes O(sqrt(n)) amortized
+ * time for n polygons. Calling ZDOverlayCompact() from a background thread keeps most of that off writers.
+ * Lookups never wait for changes, replaced databases are freed once the lookups that may use them have
+ * finished. With more concurrent lookups than reader slots, of which there are two per processor and at least
+ * 64, that can be delayed until they are all done. Changes are serialized. Results carry a polygonId that
+ * stays the same across compactions: base polygons keep their polygonId, added ones get new ids from
+ * ZDOverlayAddPolygon(). Added polygons with the same fields as a base zone are part of that zone, which gives
+ * one result like after a compaction. The metaId of a result is not stable. New databases are opened with
+ * options, NULL selects the defaults. The base must stay open until ZDOverlayFree().
+ */
+ZD_EXPORT ZoneDetectOverlay *ZDOverlayCreate(ZoneDetect *base, const ZoneDetectOptions *options);
+ZD_EXPORT void               ZDOverlayFree(ZoneDetectOverlay *overlay);
+ZD_EXPORT int                ZDOverlayAddPolygon(ZoneDetectOverlay *overlay, const char *const *fields, const double *lat, const double *lon, size_t numPoints, uint32_t *polygonId);
+ZD_EXPORT int                ZDOverlayRemovePolygon(ZoneDetectOverlay *overlay, uint32_t polygonId);
+ZD_EXPORT int                ZDOverlayCompact(ZoneDetectOverlay *overlay);
+ZD_EXPORT size_t             ZDOverlayGetPendingChanges(ZoneDetectOverlay *overlay);
+ZD_EXPORT ZoneDetectResult  *ZDOverlayLookup(const ZoneDetectOverlay *overlay, float lat, float lon, float *safezone);
+
 ZD_EXPORT const char *ZDGetNotice(const ZoneDetect *library);
 ZD_EXPORT uint8_t     ZDGetTableType(const ZoneDetect *library);
+ZD_EXPORT uint8_t     ZDGetNumFields(const ZoneDetect *library);
+ZD_EXPORT const char *ZDGetFieldName(const ZoneDetect *library, uint8_t field);
 ZD_EXPORT const char *ZDLookupResultToString(ZDLookupResult result);
 
 ZD_EXPORT int         ZDSetErrorHandler(void (*handler)(int, int));
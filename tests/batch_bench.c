@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2018, Bertold Van den Bergh (vandenbergh@bertold.org)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Scaling benchmark of ZDLookupBatchWithOptions. Usage: batch_bench [database] [points] [openFlags] [maxThreads]
+ * Runs the same batch with 1, 2, 4, ... up to maxThreads workers (default: one per processor), once for
+ * points spread over the globe and once for points over Europe, and checks every result against the
+ * sequential ZDLookupBatch, which is checked against ZDLookup. Without a database, or with "-", a generated
+ * one is used with 20000 points and up to 4 workers, which is how make check runs it.
+ */
+
+#include "../library/zonedetect.c"
+
+static double Now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static uint64_t rngState = 88172645463325252ULL;
+
+static float Random(float min, float max)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return min + (max - min) * (float)(rngState >> 40) / (float)(UINT64_C(1) << 24);
+}
+
+static uint32_t Random32(uint32_t range)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return (uint32_t)((rngState >> 32) % range);
+}
+
+/* A star shaped ring around the center, clockwise for an outer ring */
+static void AddRing(ZoneDetectBuilder *builder, uint32_t record, float centerLat, float centerLon, float radius, int clockwise)
+{
+    double lat[64], lon[64];
+    const size_t numPoints = 3 + Random32(60);
+    size_t i;
+
+    for(i = 0; i < numPoints; i++) {
+        const double angle = 2 * M_PI * (double)i / (double)numPoints * (clockwise ? -1 : 1);
+        const double r = radius * Random(0.5f, 1);
+        lat[i] = centerLat + r * sin(angle);
+        lon[i] = centerLon + r * cos(angle);
+    }
+    ZDBuilderAddPolygon(builder, record, lat, lon, numPoints);
+}
+
+/* Overlapping zones with holes over the globe, and smaller ones over Europe */
+static void *BuildDatabase(size_t *length)
+{
+    static const char *const fieldNames[] = {"Name"};
+    ZoneDetectBuilder *const builder = ZDBuilderCreate('T', 21, fieldNames, 1, "batch_bench");
+    uint32_t zone;
+
+    for(zone = 0; zone < 400; zone++) {
+        char name[16];
+        const char *fields[1] = {name};
+        snprintf(name, sizeof(name), "Zone%u", zone);
+        const int record = ZDBuilderAddMetadata(builder, fields, NULL);
+
+        const int europe = zone % 2;
+        const float radius = europe ? Random(0.5f, 4) : Random(1, 20);
+        const float centerLat = europe ? Random(36, 60) : Random(-90 + radius, 90 - radius);
+        const float centerLon = europe ? Random(-10, 30) : Random(-180 + radius, 180 - radius);
+        AddRing(builder, (uint32_t)record, centerLat, centerLon, radius, 1);
+        if(zone % 4 == 0) {
+            AddRing(builder, (uint32_t)record, centerLat, centerLon, radius / 4, 0);
+        }
+    }
+
+    void *const buffer = ZDBuilderFinish(builder, length);
+    ZDBuilderFree(builder);
+    return buffer;
+}
+
+/* The first result and number of results of ZDLookup, which ZDLookupBatch must return */
+static int CheckReference(const ZoneDetect *library, const float *lat, const float *lon, size_t numPoints, const ZoneDetectBatchResult *reference)
+{
+    size_t i, numDiffs = 0;
+
+    for(i = 0; i < numPoints; i++) {
+        ZoneDetectResult *const results = ZDLookup(library, lat[i], lon[i], NULL);
+        uint32_t numResults = 0;
+        while(results && results[numResults].lookupResult != ZD_LOOKUP_END) {
+            numResults++;
+        }
+
+        if(!results || reference[i].numResults != numResults || reference[i].lookupResult != results[0].lookupResult ||
+                (numResults && (reference[i].polygonId != results[0].polygonId || reference[i].metaId != results[0].metaId))) {
+            numDiffs++;
+        }
+        ZDFreeResults(results);
+    }
+
+    if(numDiffs) {
+        printf("  ZDLookupBatch differs from ZDLookup for %zu points\n", numDiffs);
+    }
+    return numDiffs ? 1 : 0;
+}
+
+static int Run(const ZoneDetect *library, const char *name, size_t numPoints, uint32_t maxThreads, float minLat, float maxLat, float minLon, float maxLon)
+{
+    float *lat = malloc(numPoints * sizeof(float));
+    float *lon = malloc(numPoints * sizeof(float));
+    ZoneDetectBatchResult *reference = malloc(numPoints * sizeof(ZoneDetectBatchResult));
+    ZoneDetectBatchResult *results = malloc(numPoints * sizeof(ZoneDetectBatchResult));
+    int failed = 0;
+    size_t i;
+
+    if(!lat || !lon || !reference || !results) {
+        failed = 1;
+        goto done;
+    }
+
+    for(i = 0; i < numPoints; i++) {
+        lat[i] = Random(minLat, maxLat);
+        lon[i] = Random(minLon, maxLon);
+    }
+
+    double start = Now();
+    ZDLookupBatch(library, lat, lon, numPoints, reference, 0);
+    const double sequential = Now() - start;
+    printf("%s, %zu points\n", name, numPoints);
+    printf("  sequential  %8.3f us/point\n", sequential / (double)numPoints * 1e6);
+    failed = CheckReference(library, lat, lon, numPoints, reference);
+
+    uint32_t numThreads;
+    double single = 0;
+    for(numThreads = 1;; numThreads *= 2) {
+        if(numThreads > maxThreads) {
+            numThreads = maxThreads;
+        }
+
+        ZoneDetectBatchOptions options;
+        ZDInitBatchOptions(&options);
+        options.numThreads = numThreads;
+
+        memset(results, 0xab, numPoints * sizeof(ZoneDetectBatchResult));
+        start = Now();
+        ZDLookupBatchWithOptions(library, lat, lon, numPoints, results, &options);
+        const double elapsed = Now() - start;
+        if(numThreads == 1) {
+            single = elapsed;
+        }
+
+        const int match = !memcmp(results, reference, numPoints * sizeof(ZoneDetectBatchResult));
+        printf("  %3u threads %8.3f us/point, speedup %5.2f%s\n", numThreads, elapsed / (double)numPoints * 1e6, single / elapsed, match ? "" : ", RESULTS DIFFER");
+        if(!match) {
+            failed = 1;
+        }
+        if(numThreads == maxThreads) {
+            break;
+        }
+    }
+
+    /* The other visiting orders must give the same results */
+    static const uint32_t batchFlags[] = {ZD_BATCH_KEEP_ORDER, ZD_BATCH_POLYGON_MAJOR, ZD_BATCH_POLYGON_MAJOR | ZD_BATCH_KEEP_ORDER};
+    static const char *const batchNames[] = {"keep order", "polygon major", "polygon major, keep order"};
+    for(i = 0; i < sizeof(batchFlags) / sizeof(batchFlags[0]); i++) {
+        ZoneDetectBatchOptions options;
+        ZDInitBatchOptions(&options);
+        options.flags = batchFlags[i];
+        options.numThreads = maxThreads;
+
+        memset(results, 0xab, numPoints * sizeof(ZoneDetectBatchResult));
+        start = Now();
+        ZDLookupBatchWithOptions(library, lat, lon, numPoints, results, &options);
+        const double elapsed = Now() - start;
+
+        const int match = !memcmp(results, reference, numPoints * sizeof(ZoneDetectBatchResult));
+        printf("  %-25s %8.3f us/point%s\n", batchNames[i], elapsed / (double)numPoints * 1e6, match ? "" : ", RESULTS DIFFER");
+        if(!match) {
+            failed = 1;
+        }
+    }
+
+done:
+    free(lat);
+    free(lon);
+    free(reference);
+    free(results);
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    const int generated = argc < 2 || !strcmp(argv[1], "-");
+    const size_t numPoints = (argc > 2) ? (size_t)strtoul(argv[2], NULL, 10) : generated ? 20000 : 1000000;
+    ZoneDetectOptions options;
+    ZDInitOptions(&options);
+    options.flags = (argc > 3) ? (uint32_t)strtoul(argv[3], NULL, 0) : ZD_OPEN_GRID_INDEX | ZD_OPEN_DECODE_BBOX;
+    uint32_t maxThreads = (argc > 4) ? (uint32_t)strtoul(argv[4], NULL, 10) : generated ? 4 : 0;
+    if(!maxThreads) {
+        maxThreads = ZDNumProcessors();
+    }
+
+    ZoneDetect *library;
+    void *buffer = NULL;
+    if(generated) {
+        size_t length;
+        buffer = BuildDatabase(&length);
+        library = buffer ? ZDOpenDatabaseFromMemoryWithOptions(buffer, length, &options) : NULL;
+    } else {
+        library = ZDOpenDatabaseWithOptions(argv[1], &options);
+    }
+    if(!library) {
+        fprintf(stderr, "Could not open %s\n", generated ? "the generated database" : argv[1]);
+        return 1;
+    }
+
+    printf("%u processors, open flags 0x%x\n", ZDNumProcessors(), options.flags);
+    int failed = Run(library, "Globe", numPoints, maxThreads, -90, 90, -180, 180);
+    failed |= Run(library, "Europe", numPoints, maxThreads, 36, 60, -10, 30);
+
+    ZDCloseDatabase(library);
+    if(buffer) {
+        free(buffer);
+    }
+    return failed;
+}
@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2018, Bertold Van den Bergh (vandenbergh@bertold.org)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Round trip test of the builder. Zones with several rings, holes, islands in holes, overlaps and the
+ * antimeridian are built at high precision, with metadata records that share strings. The database is opened
+ * with and without ZD_OPEN_VALIDATE. Lookups must find the zones a plain point in polygon test finds, and the
+ * metadata must be the input.
+ */
+
+#include "../library/zonedetect.c"
+
+#define MAX_RINGS 4
+#define MAX_POINTS 256
+/* Points closer to an edge than this, in degrees, are not checked */
+#define EDGE_MARGIN 1e-3
+
+struct Ring {
+    /* Outer rings are clockwise, holes counterclockwise */
+    int hole;
+    size_t numPoints;
+    double lat[MAX_POINTS], lon[MAX_POINTS];
+};
+
+struct Zone {
+    const char *fields[3];
+    size_t numRings;
+    struct Ring rings[MAX_RINGS];
+    uint32_t metaId;
+};
+
+static const char *const fieldNames[] = {"TimezoneId", "CountryAlpha2", "Comment"};
+static char longComment[400];
+
+static struct Zone zones[] = {
+    {{"Europe/Amsterdam", "NL", ""}, 0, {{0}}, 0},
+    {{"Europe/Brussels", "BE", NULL}, 0, {{0}}, 0},
+    /* The same strings as the first zone, in a record of its own */
+    {{"Europe/Amsterdam", "NL", ""}, 0, {{0}}, 0},
+    {{"Europe/Z\xc3\xbcrich", "CH", "Overlaps the first zone"}, 0, {{0}}, 0},
+    {{"Pacific/Auckland", "NZ", longComment}, 0, {{0}}, 0},
+    {{"Pacific/Fiji", "FJ", "Antimeridian"}, 0, {{0}}, 0},
+    {{"Antarctica/Troll", "", "NL"}, 0, {{0}}, 0},
+    {{"America/Denver", "US", "Concave"}, 0, {{0}}, 0},
+};
+
+#define NUM_ZONES (sizeof(zones) / sizeof(zones[0]))
+
+static uint32_t rngState = 1;
+
+static uint32_t Random(uint32_t range)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState % range;
+}
+
+static double RandomDouble(double min, double max)
+{
+    return min + (max - min) * Random(1000000) / 1000000.0;
+}
+
+static struct Ring *AddRing(struct Zone *zone, int hole)
+{
+    struct Ring *const ring = &zone->rings[zone->numRings++];
+    ring->hole = hole;
+    ring->numPoints = 0;
+    return ring;
+}
+
+static void AddPoint(struct Ring *ring, double lat, double lon)
+{
+    ring->lat[ring->numPoints] = lat;
+    ring->lon[ring->numPoints] = lon;
+    ring->numPoints++;
+}
+
+/* A rectangle with an extra point halfway up its first side, which the builder may leave out */
+static void AddRectangle(struct Zone *zone, double minLat, double minLon, double maxLat, double maxLon, int hole)
+{
+    struct Ring *const ring = AddRing(zone, hole);
+    AddPoint(ring, minLat, minLon);
+    AddPoint(ring, (minLat + maxLat) / 2, minLon);
+    if(hole) {
+        AddPoint(ring, maxLat, minLon);
+        AddPoint(ring, maxLat, maxLon);
+        AddPoint(ring, minLat, maxLon);
+        /* Reverse all but the first point */
+        size_t i;
+        for(i = 1; i < 3; i++) {
+            const double lat = ring->lat[i], lon = ring->lon[i];
+            ring->lat[i] = ring->lat[5 - i];
+            ring->lon[i] = ring->lon[5 - i];
+            ring->lat[5 - i] = lat;
+            ring->lon[5 - i] = lon;
+        }
+    } else {
+        AddPoint(ring, maxLat, minLon);
+        AddPoint(ring, maxLat, maxLon);
+        AddPoint(ring, minLat, maxLon);
+    }
+}
+
+static void DefineZones(void)
+{
+    size_t i;
+
+    memset(longComment, 'x', sizeof(longComment) - 1);
+
+    AddRectangle(&zones[0], 10, 10, 20, 20, 0);
+
+    /* A hole with an island in it */
+    AddRectangle(&zones[1], 30, 30, 50, 50, 0);
+    AddRectangle(&zones[1], 35, 35, 45, 45, 1);
+    AddRectangle(&zones[1], 38, 38, 42, 42, 0);
+
+    /* Two separate rings */
+    AddRectangle(&zones[2], 10, -20, 15, -10, 0);
+    AddRectangle(&zones[2], 60, -30, 70, -20, 0);
+
+    AddRectangle(&zones[3], 15, 15, 25, 25, 0);
+
+    /* Many points around a circle with a hole in the middle */
+    struct Ring *const circle = AddRing(&zones[4], 0);
+    for(i = 0; i < 200; i++) {
+        const double angle = -2 * M_PI * (double)i / 200;
+        AddPoint(circle, -40 + 8 * sin(angle), 100 + 8 * cos(angle));
+    }
+    AddRectangle(&zones[4], -42, 98, -38, 102, 1);
+
+    /* Both sides of the antimeridian */
+    AddRectangle(&zones[5], -10, 170, 10, 180, 0);
+    AddRectangle(&zones[5], -10, -180, 10, -170, 0);
+
+    AddRectangle(&zones[6], 80, -180, 90, 180, 0);
+
+    /* An L shape */
+    struct Ring *const shape = AddRing(&zones[7], 0);
+    AddPoint(shape, -30, -120);
+    AddPoint(shape, -10, -120);
+    AddPoint(shape, -10, -115);
+    AddPoint(shape, -25, -115);
+    AddPoint(shape, -25, -100);
+    AddPoint(shape, -30, -100);
+}
+
+static int InRing(const struct Ring *ring, double lat, double lon)
+{
+    int inside = 0;
+    size_t i, j;
+
+    for(i = 0, j = ring->numPoints - 1; i < ring->numPoints; j = i++) {
+        if((ring->lat[i] > lat) != (ring->lat[j] > lat) &&
+                lon < ring->lon[j] + (ring->lon[i] - ring->lon[j]) * (lat - ring->lat[j]) / (ring->lat[i] - ring->lat[j])) {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
+static int NearEdge(const struct Ring *ring, double lat, double lon)
+{
+    size_t i, j;
+
+    for(i = 0, j = ring->numPoints - 1; i < ring->numPoints; j = i++) {
+        const double dLat = ring->lat[i] - ring->lat[j], dLon = ring->lon[i] - ring->lon[j];
+        double t = ((lat - ring->lat[j]) * dLat + (lon - ring->lon[j]) * dLon) / (dLat * dLat + dLon * dLon);
+        t = (t < 0) ? 0 : (t > 1) ? 1 : t;
+        const double distLat = lat - (ring->lat[j] + t * dLat), distLon = lon - (ring->lon[j] + t * dLon);
+        if(distLat * distLat + distLon * distLon < EDGE_MARGIN * EDGE_MARGIN) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Zones that contain the point like ZDMergeHits combines rings, -1 if it is too close to an edge */
+static int ExpectedZones(double lat, double lon, int *inZone)
+{
+    size_t z, r;
+
+    for(z = 0; z < NUM_ZONES; z++) {
+        int insideSum = 0;
+        for(r = 0; r < zones[z].numRings; r++) {
+            const struct Ring *const ring = &zones[z].rings[r];
+            if(NearEdge(ring, lat, lon)) {
+                return -1;
+            }
+            if(InRing(ring, lat, lon)) {
+                insideSum += ring->hole ? -1 : 1;
+            }
+        }
+        inZone[z] = insideSum != 0;
+    }
+    return 0;
+}
+
+static int SameField(const ZoneDetectString *field, const char *expected)
+{
+    if(!expected) {
+        expected = "";
+    }
+    return field->data && field->length == strlen(expected) && !memcmp(field->data, expected, field->length);
+}
+
+static unsigned long CheckMetadata(const ZoneDetect *library)
+{
+    unsigned long numFailures = 0;
+    size_t z, f;
+
+    if(library->version != 3 || ZDGetNumFields(library) != 3 || strcmp(ZDGetNotice(library), "builder_roundtrip") || ZDGetTableType(library) != 'T') {
+        numFailures++;
+    }
+    for(f = 0; f < 3; f++) {
+        if(strcmp(ZDGetFieldName(library, (uint8_t)f), fieldNames[f])) {
+            numFailures++;
+        }
+    }
+
+    for(z = 0; z < NUM_ZONES; z++) {
+        ZoneDetectString fields[3];
+        if(ZDGetMetadata(library, zones[z].metaId, fields, NULL, 0)) {
+            numFailures++;
+            continue;
+        }
+        for(f = 0; f < 3; f++) {
+            if(!SameField(&fields[f], zones[z].fields[f])) {
+                printf("Field %u of zone %u differs\n", (unsigned int)f, (unsigned int)z);
+                numFailures++;
+            }
+        }
+    }
+
+    return numFailures;
+}
+
+static unsigned long CheckPoint(const ZoneDetect *library, float lat, float lon, unsigned long *numChecked)
+{
+    int inZone[NUM_ZONES], found[NUM_ZONES] = {0};
+    ZoneDetectHit hits[16];
+    unsigned long numFailures = 0;
+    size_t i, z;
+
+    if(ExpectedZones(lat, lon, inZone)) {
+        return 0;
+    }
+    (*numChecked)++;
+
+    const size_t numHits = ZDLookupHits(library, lat, lon, NULL, hits, 16);
+    for(i = 0; i < numHits && i < 16; i++) {
+        for(z = 0; z < NUM_ZONES && zones[z].metaId != hits[i].metaId; z++);
+        if(z == NUM_ZONES || hits[i].lookupResult != ZD_LOOKUP_IN_ZONE || found[z]) {
+            numFailures++;
+        } else {
+            found[z] = 1;
+        }
+    }
+    for(z = 0; z < NUM_ZONES; z++) {
+        if(found[z] != inZone[z]) {
+            numFailures++;
+        }
+    }
+
+    /* The results of ZDLookup carry copies of the fields */
+    ZoneDetectResult *const results = ZDLookup(library, lat, lon, NULL);
+    for(i = 0; results && results[i].lookupResult != ZD_LOOKUP_END; i++) {
+        for(z = 0; z < NUM_ZONES && zones[z].metaId != results[i].metaId; z++);
+        if(z == NUM_ZONES || results[i].numFields != 3) {
+            numFailures++;
+            continue;
+        }
+        size_t f;
+        for(f = 0; f < 3; f++) {
+            if(strcmp(results[i].data[f], zones[z].fields[f] ? zones[z].fields[f] : "")) {
+                numFailures++;
+            }
+        }
+    }
+    if(!results || i != numHits) {
+        numFailures++;
+    }
+    ZDFreeResults(results);
+
+    if(numFailures && numFailures < 4) {
+        printf("Lookup of %f %f differs\n", lat, lon);
+    }
+    return numFailures;
+}
+
+/* A database without polygons must also validate, and find nothing */
+static unsigned long CheckEmpty(void)
+{
+    ZoneDetectBuilder *const builder = ZDBuilderCreate('T', 30, fieldNames, 3, "builder_roundtrip");
+    unsigned long numFailures = 0;
+    ZoneDetectHit hits[4];
+    size_t length;
+
+    void *const buffer = ZDBuilderFinish(builder, &length);
+    ZDBuilderFree(builder);
+
+    ZoneDetectOptions options;
+    ZDInitOptions(&options);
+    options.flags = ZD_OPEN_VALIDATE | ZD_OPEN_GRID_CLASSIFY;
+    ZoneDetect *const library = buffer ? ZDOpenDatabaseFromMemoryWithOptions(buffer, length, &options) : NULL;
+    if(!library) {
+        printf("The empty database does not open\n");
+        numFailures++;
+    } else {
+        ZoneDetectResult *const results = ZDLookup(library, 10, 10, NULL);
+        if(!results || results[0].lookupResult != ZD_LOOKUP_END || ZDLookupHits(library, 0, 0, NULL, hits, 4)) {
+            numFailures++;
+        }
+        ZDFreeResults(results);
+        ZDCloseDatabase(library);
+    }
+
+    if(buffer) {
+        free(buffer);
+    }
+    return numFailures;
+}
+
+int main(void)
+{
+    static const unsigned int precisions[] = {28, 30};
+    static const uint32_t flags[] = {0, ZD_OPEN_VALIDATE, ZD_OPEN_VALIDATE | ZD_OPEN_GRID_CLASSIFY | ZD_OPEN_INTERN_METADATA};
+    unsigned long numFailures = 0, numChecked = 0;
+    size_t p, f, z, r;
+
+    DefineZones();
+
+    for(p = 0; p < sizeof(precisions) / sizeof(precisions[0]); p++) {
+        ZoneDetectBuilder *const builder = ZDBuilderCreate('T', precisions[p], fieldNames, 3, "builder_roundtrip");
+        for(z = 0; z < NUM_ZONES; z++) {
+            const int record = ZDBuilderAddMetadata(builder, zones[z].fields, &zones[z].metaId);
+            for(r = 0; r < zones[z].numRings; r++) {
+                const struct Ring *const ring = &zones[z].rings[r];
+                if(record < 0 || ZDBuilderAddPolygon(builder, (uint32_t)record, ring->lat, ring->lon, ring->numPoints)) {
+                    printf("Zone %u was not accepted\n", (unsigned int)z);
+                    return 1;
+                }
+            }
+        }
+
+        size_t length;
+        void *const buffer = ZDBuilderFinish(builder, &length);
+        ZDBuilderFree(builder);
+        if(!buffer) {
+            return 1;
+        }
+
+        for(f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+            ZoneDetectOptions options;
+            ZDInitOptions(&options);
+            options.flags = flags[f];
+            ZoneDetect *const library = ZDOpenDatabaseFromMemoryWithOptions(buffer, length, &options);
+            if(!library) {
+                printf("The database at precision %u does not open with flags %u\n", precisions[p], flags[f]);
+                return 1;
+            }
+
+            numFailures += CheckMetadata(library);
+
+            /* A grid over the globe, and random points around the zones */
+            double lat, lon;
+            for(lat = -89.95; lat < 90; lat += 1.3) {
+                for(lon = -179.95; lon < 180; lon += 1.3) {
+                    numFailures += CheckPoint(library, (float)lat, (float)lon, &numChecked);
+                }
+            }
+            for(z = 0; z < NUM_ZONES; z++) {
+                for(r = 0; r < 500; r++) {
+                    const struct Ring *const ring = &zones[z].rings[Random((uint32_t)zones[z].numRings)];
+                    const size_t i = Random((uint32_t)ring->numPoints);
+                    lat = ring->lat[i] + RandomDouble(-3, 3);
+                    lon = ring->lon[i] + RandomDouble(-3, 3);
+                    if(fabs(lat) < 90 && fabs(lon) < 180) {
+                        numFailures += CheckPoint(library, (float)lat, (float)lon, &numChecked);
+                    }
+                }
+            }
+
+            ZDCloseDatabase(library);
+        }
+
+        free(buffer);
+    }
+
+    numFailures += CheckEmpty();
+
+    printf("%lu points checked, %lu failures\n", numChecked, numFailures);
+
+    return numFailures ? 1 : 0;
+}
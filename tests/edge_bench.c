@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2018, Bertold Van den Bergh (vandenbergh@bertold.org)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Per-edge cost of the edge loop over every decoded polygon of a database. Usage: edge_bench database [points]
+ * The float based edge code that was used before the exact integer arithmetic is kept below for comparison.
+ */
+
+#include "../library/zonedetect.c"
+
+/* ZDWindingEdge with y = ax + b in float, as it was before the exact integer arithmetic */
+static ZDLookupResult LegacyWindingEdge(int32_t latFixedPoint, int32_t lonFixedPoint, int32_t prevLat, int32_t prevLon, int prevQuadrant, int32_t pointLat, int32_t pointLon, int quadrant, int *winding, uint64_t *distanceSqrMin)
+{
+    int windingNeedCompare = 0, lineIsStraight = 0;
+    float a = 0, b = 0;
+
+    /* Calculate winding number */
+    if(quadrant == prevQuadrant) {
+        /* Do nothing */
+    } else if(quadrant == (prevQuadrant + 1) % 4) {
+        (*winding) ++;
+    } else if((quadrant + 1) % 4 == prevQuadrant) {
+        (*winding) --;
+    } else {
+        windingNeedCompare = 1;
+    }
+
+    /* Avoid horizontal and vertical lines */
+    if((pointLon == prevLon || pointLat == prevLat)) {
+        lineIsStraight = 1;
+    }
+
+    /* Calculate the parameters of y=ax+b if needed */
+    if(!lineIsStraight && (distanceSqrMin || windingNeedCompare)) {
+        a = ((float)pointLat - (float)prevLat) / ((float)pointLon - (float)prevLon);
+        b = (float)pointLat - a * (float)pointLon;
+    }
+
+    int onStraight = ZDPointInBox(pointLat, latFixedPoint, prevLat, pointLon, lonFixedPoint, prevLon);
+    if(lineIsStraight && (onStraight || windingNeedCompare)) {
+        if(distanceSqrMin) *distanceSqrMin = 0;
+        return ZD_LOOKUP_ON_BORDER_SEGMENT;
+    }
+
+    /* Jumped two quadrants. */
+    if(windingNeedCompare) {
+        /* Check if the target is on the border */
+        const int32_t intersectLon = (int32_t)(((float)latFixedPoint - b) / a);
+        if(intersectLon >= lonFixedPoint-1 && intersectLon <= lonFixedPoint+1) {
+            if(distanceSqrMin) *distanceSqrMin = 0;
+            return ZD_LOOKUP_ON_BORDER_SEGMENT;
+        }
+
+        /* Ok, it's not. In which direction did we go round the target? */
+        const int sign = (intersectLon < lonFixedPoint) ? 2 : -2;
+        if(quadrant == 2 || quadrant == 3) {
+            *winding += sign;
+        } else {
+            *winding -= sign;
+        }
+    }
+
+    /* Calculate closest point on line (if needed) */
+    if(distanceSqrMin) {
+        float closestLon, closestLat;
+        if(!lineIsStraight) {
+            closestLon = ((float)lonFixedPoint + a * (float)latFixedPoint - a * b) / (a * a + 1);
+            closestLat = (a * ((float)lonFixedPoint + a * (float)latFixedPoint) + b) / (a * a + 1);
+        } else {
+            if(pointLon == prevLon) {
+                closestLon = (float)pointLon;
+                closestLat = (float)latFixedPoint;
+            } else {
+                closestLon = (float)lonFixedPoint;
+                closestLat = (float)pointLat;
+            }
+        }
+
+        const int closestInBox = ZDPointInBox(pointLon, (int32_t)closestLon, prevLon, pointLat, (int32_t)closestLat, prevLat);
+
+        int64_t diffLat, diffLon;
+        if(closestInBox) {
+            /* Calculate squared distance to segment. */
+            diffLat = (int64_t)(closestLat - (float)latFixedPoint);
+            diffLon = (int64_t)(closestLon - (float)lonFixedPoint);
+        } else {
+            /*
+             * Calculate squared distance to vertices
+             * It is enough to check the current point since the polygon is closed.
+             */
+            diffLat = (int64_t)(pointLat - latFixedPoint);
+            diffLon = (int64_t)(pointLon - lonFixedPoint);
+        }
+
+        /* Note: lon has half scale */
+        uint64_t distanceSqr = (uint64_t)(diffLat * diffLat) + (uint64_t)(diffLon * diffLon) * 4;
+        if(distanceSqr < *distanceSqrMin) *distanceSqrMin = distanceSqr;
+    }
+
+    return ZD_LOOKUP_IGNORE;
+}
+
+static ZDLookupResult LegacyWindingEdges(const struct ZDDecodedPolygon *polygon, int32_t latFixedPoint, int32_t lonFixedPoint, int *winding, uint64_t *distanceSqrMin)
+{
+    const int32_t *const lat = polygon->lat;
+    const int32_t *const lon = polygon->lon;
+    uint32_t i;
+
+    int prevQuadrant = ZDQuadrant(lat[0], lon[0], latFixedPoint, lonFixedPoint);
+    for(i = 1; i < polygon->numPoints; i++) {
+        if(lat[i] == latFixedPoint && lon[i] == lonFixedPoint) {
+            if(distanceSqrMin) *distanceSqrMin = 0;
+            return ZD_LOOKUP_ON_BORDER_VERTEX;
+        }
+
+        const int quadrant = ZDQuadrant(lat[i], lon[i], latFixedPoint, lonFixedPoint);
+        const ZDLookupResult edgeResult = LegacyWindingEdge(latFixedPoint, lonFixedPoint, lat[i - 1], lon[i - 1], prevQuadrant, lat[i], lon[i], quadrant, winding, distanceSqrMin);
+        if(edgeResult != ZD_LOOKUP_IGNORE) {
+            return edgeResult;
+        }
+        prevQuadrant = quadrant;
+    }
+
+    return ZD_LOOKUP_IGNORE;
+}
+
+static double Now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static uint32_t rngState = 1;
+
+static int32_t RandomCoordinate(unsigned int precision)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return (int32_t)(rngState >> (32 - precision)) - (INT32_C(1) << (precision - 1));
+}
+
+static volatile long sink;
+
+/* Best of 5 runs in ns per edge */
+static double Measure(const ZoneDetect *library, size_t numPoints, int legacy, int withSafezone)
+{
+    double best = 0;
+    int run;
+
+    for(run = 0; run < 5; run++) {
+        uint64_t numEdges = 0;
+        long check = 0;
+        size_t n;
+        uint32_t i;
+
+        rngState = 1;
+        const double start = Now();
+        for(n = 0; n < numPoints; n++) {
+            const int32_t lat = RandomCoordinate(library->precision);
+            const int32_t lon = RandomCoordinate(library->precision);
+            for(i = 0; i < library->numDecodedPolygons; i++) {
+                const struct ZDDecodedPolygon *const polygon = &library->decodedPolygons[i];
+                uint64_t distanceSqr = UINT64_MAX;
+                int winding = 0;
+                const ZDLookupResult result = legacy ? LegacyWindingEdges(polygon, lat, lon, &winding, withSafezone ? &distanceSqr : NULL)
+                                              : ZDWindingEdges(polygon, lat, lon, 1, polygon->numPoints, &winding, withSafezone ? &distanceSqr : NULL);
+                check += result + winding + (long)(distanceSqr & 7);
+                numEdges += polygon->numPoints - 1;
+            }
+        }
+        const double elapsed = (Now() - start) * 1e9 / (double)numEdges;
+        sink = check;
+
+        if(run == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2) {
+        fprintf(stderr, "Usage: %s database [points]\n", argv[0]);
+        return 1;
+    }
+
+    const size_t numPoints = (argc > 2) ? (size_t)strtoul(argv[2], NULL, 10) : 20;
+    ZoneDetectOptions options;
+    ZDInitOptions(&options);
+    options.flags = ZD_OPEN_EXPANDED;
+
+    ZoneDetect *const library = ZDOpenDatabaseWithOptions(argv[1], &options);
+    if(!library) {
+        fprintf(stderr, "Could not open %s\n", argv[1]);
+        return 1;
+    }
+
+    printf("%u polygons, %zu points, ns per edge (best of 5)\n", library->numDecodedPolygons, numPoints);
+    printf("                float   integer\n");
+    printf("  winding only  %5.2f   %5.2f\n", Measure(library, numPoints, 1, 0), Measure(library, numPoints, 0, 0));
+    printf("  with safezone %5.2f   %5.2f\n", Measure(library, numPoints, 1, 1), Measure(library, numPoints, 0, 1));
+
+    ZDCloseDatabase(library);
+    return 0;
+}
@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2018, Bertold Van den Bergh (vandenbergh@bertold.org)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Concurrency test of the overlay. Reader threads look up points while one thread adds and removes polygons
+ * and another compacts in a loop. Readers check that no zone is reported twice. The final state must give
+ * the same lookups as a database built from the remaining polygons, before and after compacting. make check
+ * builds this test with the thread sanitizer.
+ */
+
+#include "../library/zonedetect.c"
+
+#define NUM_READERS 80
+#define NUM_SQUARES 400
+#define NUM_POINTS 4000
+
+static uint32_t rngState = 1;
+
+static uint32_t Random(uint32_t range)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState % range;
+}
+
+/*
+ * Square k of the grid, or the square shifted by half its size that overlaps it and its neighbours, or a
+ * hole in it. Base zone Z<n> has the squares 2n and 2n + 1, added polygons may belong to such a zone.
+ */
+enum Shape { SQUARE, SHIFTED, HOLE };
+
+static void MakeShape(int k, enum Shape shape, double *lat, double *lon)
+{
+    const double offset = (shape == SHIFTED) ? 0.5 : (shape == HOLE) ? 0.25 : 0;
+    const double size = (shape == HOLE) ? 0.5 : 1;
+    const double minLat = -60 + (k / 40) * 3 + offset, minLon = -170 + (k % 40) * 8 + offset;
+
+    /* Outer rings are clockwise, holes counterclockwise */
+    lat[0] = minLat;
+    lon[0] = minLon;
+    lat[2] = minLat + size;
+    lon[2] = minLon + size;
+    if(shape == HOLE) {
+        lat[1] = minLat;
+        lon[1] = minLon + size;
+        lat[3] = minLat + size;
+        lon[3] = minLon;
+    } else {
+        lat[1] = minLat + size;
+        lon[1] = minLon;
+        lat[3] = minLat;
+        lon[3] = minLon + size;
+    }
+}
+
+static void ZoneName(int k, int newZone, char *name, size_t size)
+{
+    snprintf(name, size, newZone ? "N%d" : "Z%d", k / 2);
+}
+
+/* Polygon added by the writer */
+struct Added {
+    int live;
+    enum Shape shape;
+    int newZone;
+    uint32_t id;
+};
+
+static const char *const fieldNames[] = {"Name", "Group"};
+
+static ZoneDetectOverlay *overlay;
+static struct Added added[NUM_SQUARES];
+static int baseRemoved[NUM_SQUARES];
+static float points[NUM_POINTS][2];
+static volatile int stop;
+static volatile unsigned long numDuplicates;
+
+static void *Reader(void *argument)
+{
+    unsigned long n = (unsigned long)(uintptr_t)argument, numLookups = 0;
+
+    while(!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        float safezone;
+        ZoneDetectResult *const results = ZDOverlayLookup(overlay, points[n % NUM_POINTS][0], points[n % NUM_POINTS][1], &safezone);
+        size_t i, j;
+
+        for(i = 0; results && results[i].lookupResult != ZD_LOOKUP_END; i++) {
+            for(j = 0; j < i; j++) {
+                if(!strcmp(results[i].data[0], results[j].data[0])) {
+                    __atomic_add_fetch(&numDuplicates, 1, __ATOMIC_RELAXED);
+                }
+            }
+        }
+        ZDFreeResults(results);
+        n += 7;
+        numLookups++;
+
+        /* Leave time for the writers, the machine may have fewer processors than there are readers */
+        const struct timespec pause = {0, 3000000};
+        nanosleep(&pause, NULL);
+    }
+
+    return (void *)(uintptr_t)numLookups;
+}
+
+static void *Compactor(void *argument)
+{
+    unsigned long numCompactions = 0;
+    (void)argument;
+
+    while(!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        if(ZDOverlayCompact(overlay)) {
+            fprintf(stderr, "Compaction failed\n");
+        }
+        numCompactions++;
+    }
+
+    return (void *)(uintptr_t)numCompactions;
+}
+
+static int AddShape(int k, struct Added *entry)
+{
+    char name[16];
+    const char *fields[2] = {name, "Test"};
+    double lat[4], lon[4];
+
+    ZoneName(k, entry->newZone, name, sizeof(name));
+    MakeShape(k, entry->shape, lat, lon);
+    return ZDOverlayAddPolygon(overlay, fields, lat, lon, 4, &entry->id);
+}
+
+/* Add or remove a random polygon, returns 1 if that did not go as expected */
+static int RandomChange(uint32_t numBasePolygons)
+{
+    const int k = (int)Random(NUM_SQUARES);
+    /* Base polygons stay removed, do that rarely to keep most of them */
+    const uint32_t operation = Random(16);
+    int failed = 0;
+
+    if(operation < 8 && !added[k].live) {
+        added[k].shape = (enum Shape)Random(3);
+        added[k].newZone = added[k].shape == SHIFTED && Random(2);
+        if(AddShape(k, &added[k])) {
+            failed = 1;
+        } else {
+            added[k].live = 1;
+        }
+    } else if(operation < 15 && added[k].live) {
+        if(ZDOverlayRemovePolygon(overlay, added[k].id)) {
+            failed = 1;
+        } else {
+            added[k].live = 0;
+        }
+    } else if(operation == 15) {
+        /* Removing a base polygon twice fails */
+        const uint32_t polygonId = Random(numBasePolygons);
+        if(ZDOverlayRemovePolygon(overlay, polygonId) != (baseRemoved[polygonId] ? -1 : 0)) {
+            failed = 1;
+        }
+        baseRemoved[polygonId] = 1;
+    }
+
+    return failed;
+}
+
+static void *BuildBase(size_t *length)
+{
+    ZoneDetectBuilder *const builder = ZDBuilderCreate('T', 21, fieldNames, 2, "overlay_stress");
+    int k;
+
+    for(k = 0; k < NUM_SQUARES; k += 2) {
+        char name[16];
+        const char *fields[2] = {name, "Test"};
+        double lat[4], lon[4];
+
+        ZoneName(k, 0, name, sizeof(name));
+        const int record = ZDBuilderAddMetadata(builder, fields, NULL);
+        MakeShape(k, SQUARE, lat, lon);
+        ZDBuilderAddPolygon(builder, (uint32_t)record, lat, lon, 4);
+        MakeShape(k + 1, SQUARE, lat, lon);
+        ZDBuilderAddPolygon(builder, (uint32_t)record, lat, lon, 4);
+    }
+
+    void *const buffer = ZDBuilderFinish(builder, length);
+    ZDBuilderFree(builder);
+    return buffer;
+}
+
+/* Record of the zone called name, added to builder the first time */
+static uint32_t ReferenceRecord(ZoneDetectBuilder *builder, char names[][16], size_t *numNames, const char *name)
+{
+    const char *fields[2] = {name, "Test"};
+    size_t i;
+
+    for(i = 0; i < *numNames && strcmp(names[i], name); i++);
+    if(i == *numNames) {
+        ZDBuilderAddMetadata(builder, fields, NULL);
+        strcpy(names[(*numNames)++], name);
+    }
+    return (uint32_t)i;
+}
+
+/* The base polygons that were not removed and the added polygons, one record per zone */
+static void *BuildReference(const ZoneDetect *base, size_t *length)
+{
+    ZoneDetectBuilder *const builder = ZDBuilderCreate('T', 21, fieldNames, 2, "overlay_stress");
+    static char names[2 * NUM_SQUARES][16];
+    size_t numNames = 0;
+    uint32_t metaIds[NUM_SQUARES], polygonIndexes[NUM_SQUARES], i;
+    int k;
+
+    const uint32_t numBasePolygons = ZDListPolygons(base, metaIds, polygonIndexes);
+    for(i = 0; i < numBasePolygons; i++) {
+        if(!baseRemoved[i]) {
+            char **const fields = ZDDuplicateFields(base, metaIds[i]);
+            size_t numPoints;
+            int32_t *const list = ZDPolygonToListInternal(base, polygonIndexes[i], &numPoints);
+            ZDBuilderAddFixedPoint(builder, ReferenceRecord(builder, names, &numNames, fields[0]), list, numPoints / 2);
+            free(list);
+            free(fields[0]);
+            free(fields[1]);
+            free(fields);
+        }
+    }
+
+    for(k = 0; k < NUM_SQUARES; k++) {
+        if(added[k].live) {
+            char name[16];
+            double lat[4], lon[4];
+            ZoneName(k, added[k].newZone, name, sizeof(name));
+            MakeShape(k, added[k].shape, lat, lon);
+            ZDBuilderAddPolygon(builder, ReferenceRecord(builder, names, &numNames, name), lat, lon, 4);
+        }
+    }
+
+    void *const buffer = ZDBuilderFinish(builder, length);
+    ZDBuilderFree(builder);
+    return buffer;
+}
+
+static int CompareStrings(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Result and fields of every zone of results in a fixed order, frees results */
+static void Describe(ZoneDetectResult *results, char *description, size_t size)
+{
+    char *items[16];
+    size_t numItems = 0, used = 0, i;
+
+    for(i = 0; results && results[i].lookupResult != ZD_LOOKUP_END && numItems < 16; i++) {
+        items[numItems] = malloc(64);
+        snprintf(items[numItems++], 64, "%d|%s|%s", (int)results[i].lookupResult, results[i].data[0], results[i].data[1]);
+    }
+    qsort(items, numItems, sizeof(items[0]), CompareStrings);
+
+    description[0] = '\0';
+    for(i = 0; i < numItems; i++) {
+        used += (size_t)snprintf(description + used, size - used, "%s;", items[i]);
+        free(items[i]);
+    }
+    ZDFreeResults(results);
+}
+
+static unsigned long CompareLookups(const ZoneDetect *reference)
+{
+    unsigned long numDiffs = 0;
+    size_t i;
+
+    for(i = 0; i < NUM_POINTS; i++) {
+        char description[1024], referenceDescription[1024];
+        Describe(ZDOverlayLookup(overlay, points[i][0], points[i][1], NULL), description, sizeof(description));
+        Describe(ZDLookup(reference, points[i][0], points[i][1], NULL), referenceDescription, sizeof(referenceDescription));
+        if(strcmp(description, referenceDescription)) {
+            if(numDiffs++ < 3) {
+                printf("Lookup of %f %f differs:\n  %s\n  %s\n", points[i][0], points[i][1], description, referenceDescription);
+            }
+        }
+    }
+
+    return numDiffs;
+}
+
+int main(int argc, char *argv[])
+{
+    const unsigned long numChanges = (argc > 1) ? strtoul(argv[1], NULL, 10) : 2000;
+    pthread_t threads[NUM_READERS + 1];
+    unsigned long numLookups = 0, numCompactions, numFailures = 0, numDiffs, n;
+    size_t length, referenceLength, i;
+    void *result;
+
+    void *const buffer = BuildBase(&length);
+    ZoneDetect *const base = ZDOpenDatabaseFromMemory(buffer, length);
+    if(!base) {
+        return 1;
+    }
+    const uint32_t numBasePolygons = ZDListPolygons(base, NULL, NULL);
+    overlay = ZDOverlayCreate(base, NULL);
+    if(!overlay) {
+        return 1;
+    }
+
+    /* Points in the squares, where the shapes overlap, and anywhere */
+    for(i = 0; i < NUM_POINTS; i++) {
+        const int k = (int)Random(NUM_SQUARES);
+        const double position = (i % 4 == 3) ? 0 : 0.1 + 0.2 * (double)Random(8);
+        points[i][0] = (float)((i % 8 == 7) ? (double)Random(180) - 90 : -60 + (k / 40) * 3 + position);
+        points[i][1] = (float)((i % 8 == 7) ? (double)Random(360) - 180 : -170 + (k % 40) * 8 + position + 0.1 * (double)Random(2));
+    }
+
+    for(i = 0; i < NUM_READERS; i++) {
+        pthread_create(&threads[i], NULL, Reader, (void *)(uintptr_t)i);
+    }
+    pthread_create(&threads[NUM_READERS], NULL, Compactor, NULL);
+
+    for(n = 0; n < numChanges; n++) {
+        numFailures += RandomChange(numBasePolygons);
+    }
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for(i = 0; i < NUM_READERS; i++) {
+        pthread_join(threads[i], &result);
+        numLookups += (unsigned long)(uintptr_t)result;
+    }
+    pthread_join(threads[NUM_READERS], &result);
+    numCompactions = (unsigned long)(uintptr_t)result;
+
+    /* Leave changes in the delta, fewer than make a change compact */
+    for(n = 0; n < ZD_OVERLAY_MIN_DELTA / 2; n++) {
+        numFailures += RandomChange(numBasePolygons);
+    }
+
+    void *const referenceBuffer = BuildReference(base, &referenceLength);
+    ZoneDetect *const reference = ZDOpenDatabaseFromMemory(referenceBuffer, referenceLength);
+    if(!reference) {
+        return 1;
+    }
+    numDiffs = CompareLookups(reference);
+    if(ZDOverlayCompact(overlay)) {
+        numFailures++;
+    }
+    numDiffs += CompareLookups(reference);
+
+    printf("%lu lookups, %lu compactions, %lu failed changes, %lu duplicate zones, %lu lookups differ\n",
+           numLookups, numCompactions, numFailures, numDuplicates, numDiffs);
+
+    ZDCloseDatabase(reference);
+    free(referenceBuffer);
+    ZDOverlayFree(overlay);
+    ZDCloseDatabase(base);
+    free(buffer);
+
+    return (numFailures || numDuplicates || numDiffs) ? 1 : 0;
+}
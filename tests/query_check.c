@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2018, Bertold Van den Bergh (vandenbergh@bertold.org)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Assertion tests of the queries on a small database with known distances. Coordinates are multiples of
+ * 1/64 of the range, which are exact in fixed point, so distances are exact too. make check builds this test
+ * with the sanitizers.
+ */
+
+#include "../library/zonedetect.c"
+
+/* Units of the test coordinates in degrees */
+#define LAT (90.0 / 64)
+#define LON (180.0 / 64)
+
+static unsigned long numFailures;
+
+static void Check(int condition, const char *description)
+{
+    if(!condition) {
+        printf("Failed: %s\n", description);
+        numFailures++;
+    }
+}
+
+/* Clockwise rectangle, or counterclockwise for a hole */
+static void AddRectangle(ZoneDetectBuilder *builder, uint32_t record, double minLat, double minLon, double maxLat, double maxLon, int hole)
+{
+    const double lat[4] = {minLat, maxLat, maxLat, minLat};
+    const double lon[4] = {minLon, minLon, maxLon, maxLon};
+    const double holeLat[4] = {minLat, minLat, maxLat, maxLat};
+    const double holeLon[4] = {minLon, maxLon, maxLon, minLon};
+    ZDBuilderAddPolygon(builder, record, hole ? holeLat : lat, hole ? holeLon : lon, 4);
+}
+
+/*
+ * Seen from the origin, East is 1 LON away and North 4 LAT. Home contains (32 LAT, 4 LON), Ring has a hole
+ * around (-28 LAT, 12 LON) whose edge is 2 LAT away.
+ */
+enum { EAST, NORTH, HOME, RING, NUM_ZONES };
+static uint32_t metaIds[NUM_ZONES];
+
+static void *BuildDatabase(size_t *length)
+{
+    static const char *const fieldNames[] = {"Name"};
+    static const char *const names[NUM_ZONES] = {"East", "North", "Home", "Ring"};
+    ZoneDetectBuilder *const builder = ZDBuilderCreate('T', 21, fieldNames, 1, "query_check");
+    uint32_t records[NUM_ZONES];
+    size_t i;
+
+    for(i = 0; i < NUM_ZONES; i++) {
+        records[i] = (uint32_t)ZDBuilderAddMetadata(builder, &names[i], &metaIds[i]);
+    }
+    AddRectangle(builder, records[EAST], -1 * LAT, 1 * LON, 1 * LAT, 2 * LON, 0);
+    AddRectangle(builder, records[NORTH], 4 * LAT, -1 * LON, 5 * LAT, 1 * LON, 0);
+    AddRectangle(builder, records[HOME], 30 * LAT, 3 * LON, 34 * LAT, 5 * LON, 0);
+    AddRectangle(builder, records[RING], -34 * LAT, 8 * LON, -22 * LAT, 16 * LON, 0);
+    AddRectangle(builder, records[RING], -30 * LAT, 10 * LON, -26 * LAT, 14 * LON, 1);
+
+    void *const buffer = ZDBuilderFinish(builder, length);
+    ZDBuilderFree(builder);
+    return buffer;
+}
+
+static void CheckNearest(const ZoneDetect *library)
+{
+    ZoneDetectHit hits[NUM_ZONES + 1];
+    float distances[NUM_ZONES + 1];
+    size_t numHits;
+
+    /* Nothing in range leaves an empty zone list, which must not be sorted */
+    numHits = ZDLookupNearest(library, -80, -170, 4, 1, hits, distances);
+    Check(numHits == 0, "nearest with no zone in range");
+    Check(ZDLookupNearest(library, 0, 0, 0, 1000, hits, distances) == 0, "nearest with k = 0");
+    Check(ZDLookupNearest(library, 0, 0, 4, -1, hits, distances) == 0, "nearest with a negative maximum distance");
+
+    /* Distances in degrees, a LON is as far as a LAT of the same number of degrees */
+    numHits = ZDLookupNearest(library, 0, 0, 2, 1000, hits, distances);
+    Check(numHits == 2 && hits[0].metaId == metaIds[EAST] && hits[1].metaId == metaIds[NORTH], "the two nearest zones in order");
+    Check(numHits == 2 && hits[0].lookupResult == ZD_LOOKUP_NOT_IN_ZONE && distances[0] == (float)LON && distances[1] == (float)(4 * LAT),
+          "nearest distances of zones that do not contain the point");
+
+    /* A maximum distance equal to that of a zone keeps it */
+    Check(ZDLookupNearest(library, 0, 0, 4, (float)LON, hits, NULL) == 1, "nearest with the distance of the closest zone as maximum");
+
+    /* The zone containing the point comes first with distance 0, k larger than the number of zones finds all */
+    numHits = ZDLookupNearest(library, (float)(32 * LAT), (float)(4 * LON), NUM_ZONES + 1, 1000, hits, distances);
+    Check(numHits == NUM_ZONES && hits[0].metaId == metaIds[HOME] && hits[0].lookupResult == ZD_LOOKUP_IN_ZONE && distances[0] == 0,
+          "nearest from inside a zone");
+
+    /* In the hole the zone is outside, at the distance of the edge of the hole */
+    numHits = ZDLookupNearest(library, (float)(-28 * LAT), (float)(12 * LON), 1, 1000, hits, distances);
+    Check(numHits == 1 && hits[0].metaId == metaIds[RING] && hits[0].lookupResult == ZD_LOOKUP_NOT_IN_ZONE && distances[0] == (float)(2 * LAT),
+          "nearest from inside a hole");
+}
+
+static void CheckRadius(const ZoneDetect *library)
+{
+    ZoneDetectHit hits[NUM_ZONES];
+    float distances[NUM_ZONES];
+    size_t numHits;
+
+    /* The radius is inclusive, a zone exactly at it is found and one a float step further is not */
+    numHits = ZDLookupRadius(library, 0, 0, (float)LON, hits, NUM_ZONES, distances);
+    Check(numHits == 1 && hits[0].metaId == metaIds[EAST] && distances[0] == (float)LON, "radius equal to the distance of a zone");
+    Check(ZDLookupRadius(library, 0, 0, nextafterf((float)LON, 0), hits, NUM_ZONES, distances) == 0, "radius just below the distance of a zone");
+    numHits = ZDLookupRadius(library, (float)(-28 * LAT), (float)(12 * LON), (float)(2 * LAT), hits, NUM_ZONES, distances);
+    Check(numHits == 1 && hits[0].metaId == metaIds[RING] && hits[0].lookupResult == ZD_LOOKUP_NOT_IN_ZONE && distances[0] == (float)(2 * LAT),
+          "radius equal to the distance of the edge of a hole");
+    Check(ZDLookupRadius(library, (float)(-28 * LAT), (float)(12 * LON), nextafterf((float)(2 * LAT), 0), hits, NUM_ZONES, distances) == 0,
+          "radius just below the distance of the edge of a hole");
+
+    /* A radius of 0 only finds the zone containing the point, a negative one nothing */
+    Check(ZDLookupRadius(library, 0, 0, 0, hits, NUM_ZONES, distances) == 0, "radius 0 outside all zones");
+    numHits = ZDLookupRadius(library, (float)(32 * LAT), (float)(4 * LON), 0, hits, NUM_ZONES, distances);
+    Check(numHits == 1 && hits[0].metaId == metaIds[HOME] && hits[0].lookupResult == ZD_LOOKUP_IN_ZONE && distances[0] == 0,
+          "radius 0 inside a zone");
+    Check(ZDLookupRadius(library, (float)(32 * LAT), (float)(4 * LON), -1, hits, NUM_ZONES, distances) == 0, "negative radius");
+
+    /* Without room for all hits the count is still returned, with the closest ones written */
+    numHits = ZDLookupRadius(library, 0, 0, (float)(4 * LAT), hits, 1, distances);
+    Check(numHits == 2 && hits[0].metaId == metaIds[EAST], "radius with fewer hits than zones found");
+    Check(ZDLookupRadius(library, 0, 0, (float)(4 * LAT), NULL, 0, NULL) == 2, "radius without room for hits");
+
+    numHits = ZDLookupRadius(library, 0, 0, 1e30f, hits, NUM_ZONES, distances);
+    Check(numHits == NUM_ZONES && hits[0].metaId == metaIds[EAST] && hits[1].metaId == metaIds[NORTH], "huge radius finds all zones");
+}
+
+static int SameEvent(const ZoneDetectTrackerEvent *event, uint32_t entity, int zone, uint32_t type)
+{
+    return event->entity == entity && event->metaId == metaIds[zone] && event->type == type;
+}
+
+static void CheckTracker(const ZoneDetect *library)
+{
+    ZoneDetectTracker *const tracker = ZDTrackerCreate(library, 3);
+    ZoneDetectTrackerEvent events[8];
+    ZoneDetectTrackerStats stats;
+    size_t numEvents, i;
+
+    if(!tracker) {
+        Check(0, "tracker creation");
+        return;
+    }
+
+    /* Entity 0 enters Home and 1 enters East, 2 is in no zone and the unknown entity 7 is skipped */
+    {
+        const uint32_t entities[] = {0, 1, 7, 2};
+        const float lat[] = {(float)(31.3 * LAT), 0, 0, (float)(-50 * LAT)};
+        const float lon[] = {(float)(3.7 * LON), (float)(1.5 * LON), 0, (float)(-40 * LON)};
+        Check(ZDTrackerUpdate(tracker, entities, lat, lon, 4, events, 8, &numEvents) == 4, "tracker processes all updates");
+        Check(numEvents == 2 && SameEvent(&events[0], 0, HOME, ZD_TRACKER_ENTER) && SameEvent(&events[1], 1, EAST, ZD_TRACKER_ENTER),
+              "tracker enter events");
+        Check(ZDTrackerGetZone(tracker, 2) == ZD_TRACKER_NO_ZONE && ZDTrackerGetZone(tracker, 7) == ZD_TRACKER_NO_ZONE,
+              "tracker entities without a zone");
+    }
+
+    /* Small moves inside Home give no events, with a decoded table they stay in the safezone */
+    for(i = 1; i <= 4; i++) {
+        const uint32_t entity = 0;
+        const float lat = (float)(31.3 * LAT + 0.001 * (double)i), lon = (float)(3.7 * LON);
+        Check(ZDTrackerUpdate(tracker, &entity, &lat, &lon, 1, events, 8, &numEvents) == 1 && numEvents == 0, "tracker move inside a zone");
+    }
+    ZDTrackerGetStats(tracker, &stats);
+    Check(stats.updates == 7 && (library->table.memory ? stats.lookups < stats.updates : stats.lookups == stats.updates),
+          "tracker lookups skipped in the safezone");
+
+    /* Moving from Home to East is an exit and an enter, which leaves no room for the exit of entity 1 */
+    {
+        const uint32_t entities[] = {0, 1};
+        const float lat[] = {0, (float)(-50 * LAT)};
+        const float lon[] = {(float)(1.5 * LON), (float)(-40 * LON)};
+        Check(ZDTrackerUpdate(tracker, entities, lat, lon, 2, events, 1, &numEvents) == 0 && numEvents == 0,
+              "tracker stops when an update may not fit");
+        Check(ZDTrackerUpdate(tracker, entities, lat, lon, 2, events, 3, &numEvents) == 1 && numEvents == 2 &&
+              SameEvent(&events[0], 0, HOME, ZD_TRACKER_EXIT) && SameEvent(&events[1], 0, EAST, ZD_TRACKER_ENTER),
+              "tracker exit and enter events");
+        Check(ZDTrackerUpdate(tracker, entities + 1, lat + 1, lon + 1, 1, events, 3, &numEvents) == 1 && numEvents == 1 &&
+              SameEvent(&events[0], 1, EAST, ZD_TRACKER_EXIT), "tracker continues with the remaining updates");
+        Check(ZDTrackerGetZone(tracker, 0) == metaIds[EAST] && ZDTrackerGetZone(tracker, 1) == ZD_TRACKER_NO_ZONE, "tracker zones after moves");
+    }
+
+    /* The hole of Ring is not part of it */
+    {
+        const uint32_t entities[] = {2, 2};
+        const float lat[] = {(float)(-28 * LAT), (float)(-24 * LAT)};
+        const float lon[] = {(float)(12 * LON), (float)(12 * LON)};
+        Check(ZDTrackerUpdate(tracker, entities, lat, lon, 1, events, 8, &numEvents) == 1 && numEvents == 0, "tracker inside a hole");
+        Check(ZDTrackerUpdate(tracker, entities + 1, lat + 1, lon + 1, 1, events, 8, &numEvents) == 1 && numEvents == 1 &&
+              SameEvent(&events[0], 2, RING, ZD_TRACKER_ENTER), "tracker enters a zone with a hole");
+    }
+
+    ZDTrackerGetStats(tracker, &stats);
+    Check(stats.updates == 11 && stats.events == 6, "tracker statistics");
+
+    ZDTrackerFree(tracker);
+}
+
+int main(void)
+{
+    static const uint32_t flags[] = {0, ZD_OPEN_VALIDATE | ZD_OPEN_GRID_CLASSIFY, ZD_OPEN_DECODE_BBOX, ZD_OPEN_EXPANDED};
+    size_t length, i;
+
+    void *const buffer = BuildDatabase(&length);
+    if(!buffer) {
+        return 1;
+    }
+
+    for(i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        ZoneDetectOptions options;
+        ZDInitOptions(&options);
+        options.flags = flags[i];
+        ZoneDetect *const library = ZDOpenDatabaseFromMemoryWithOptions(buffer, length, &options);
+        if(!library) {
+            printf("The database does not open with flags %u\n", flags[i]);
+            return 1;
+        }
+
+        CheckNearest(library);
+        CheckRadius(library);
+        CheckTracker(library);
+
+        ZDCloseDatabase(library);
+    }
+
+    free(buffer);
+
+    printf("%lu failures\n", numFailures);
+    return numFailures ? 1 : 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2018, Bertold Van den Bergh (vandenbergh@bertold.org)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Corruption test of ZD_OPEN_VALIDATE. Random bytes of a database from the builder are changed and the result
+ * is opened with validation. When only the R-tree section was changed, a database that still opens must give
+ * the same lookups as the original. Any other database that opens must be safe to use, which the sanitizers
+ * check: make check builds this test with them.
+ */
+
+#include "../library/zonedetect.c"
+
+static uint32_t rngState = 1;
+
+static uint32_t Random(uint32_t range)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState % range;
+}
+
+static double RandomDouble(double min, double max)
+{
+    return min + (max - min) * Random(1000000) / 1000000.0;
+}
+
+/* A star shaped ring around the center, clockwise for an outer ring */
+static void AddRing(ZoneDetectBuilder *builder, uint32_t record, double centerLat, double centerLon, double radius, int clockwise)
+{
+    double lat[64], lon[64];
+    const size_t numPoints = 3 + Random(60);
+    size_t i;
+
+    for(i = 0; i < numPoints; i++) {
+        const double angle = 2 * M_PI * (double)i / (double)numPoints * (clockwise ? -1 : 1);
+        const double r = radius * RandomDouble(0.5, 1);
+        lat[i] = centerLat + r * sin(angle);
+        lon[i] = centerLon + r * cos(angle);
+    }
+    ZDBuilderAddPolygon(builder, record, lat, lon, numPoints);
+}
+
+static void *BuildDatabase(unsigned int precision, size_t *length)
+{
+    static const char *const fieldNames[] = {"Name", "Group"};
+    static const char *const groups[] = {"A", "B", "C"};
+    ZoneDetectBuilder *const builder = ZDBuilderCreate('T', precision, fieldNames, 2, "validate_fuzz");
+    uint32_t zone;
+
+    for(zone = 0; zone < 60; zone++) {
+        char name[16];
+        const char *fields[2];
+        snprintf(name, sizeof(name), "Zone%u", zone);
+        fields[0] = name;
+        fields[1] = groups[zone % 3];
+        const int record = ZDBuilderAddMetadata(builder, fields, NULL);
+
+        /* Cover the whole coordinate range, including the antimeridian and the poles */
+        const double radius = RandomDouble(0.5, 20);
+        const double centerLat = RandomDouble(-90 + radius, 90 - radius);
+        const double centerLon = (zone % 10 == 0) ? ((zone % 20) ? 180 - radius : -180 + radius) : RandomDouble(-180 + radius, 180 - radius);
+        AddRing(builder, (uint32_t)record, centerLat, centerLon, radius, 1);
+        if(zone % 4 == 0) {
+            AddRing(builder, (uint32_t)record, centerLat, centerLon, radius / 4, 0);
+        }
+    }
+
+    void *const buffer = ZDBuilderFinish(builder, length);
+    ZDBuilderFree(builder);
+    return buffer;
+}
+
+struct Lookup {
+    size_t numHits, numNearest, numRadius;
+    float safezone;
+    ZoneDetectHit hits[8], nearest[4], radius[8];
+    float nearestDistances[4], radiusDistances[8];
+};
+
+static void DoLookup(const ZoneDetect *library, float lat, float lon, struct Lookup *lookup)
+{
+    memset(lookup, 0, sizeof(*lookup));
+    lookup->numHits = ZDLookupHits(library, lat, lon, &lookup->safezone, lookup->hits, 8);
+    lookup->numNearest = ZDLookupNearest(library, lat, lon, 4, 10, lookup->nearest, lookup->nearestDistances);
+    lookup->numRadius = ZDLookupRadius(library, lat, lon, 5, lookup->radius, 8, lookup->radiusDistances);
+    ZDFreeResults(ZDLookup(library, lat, lon, NULL));
+}
+
+static int SameLookup(const struct Lookup *a, const struct Lookup *b)
+{
+    return a->numHits == b->numHits && a->numNearest == b->numNearest && a->numRadius == b->numRadius && a->safezone == b->safezone &&
+           !memcmp(a->hits, b->hits, sizeof(a->hits)) && !memcmp(a->nearest, b->nearest, sizeof(a->nearest)) &&
+           !memcmp(a->radius, b->radius, sizeof(a->radius)) && !memcmp(a->nearestDistances, b->nearestDistances, sizeof(a->nearestDistances)) &&
+           !memcmp(a->radiusDistances, b->radiusDistances, sizeof(a->radiusDistances));
+}
+
+/* Look up points with library and count the ones that differ from reference, which may be NULL */
+static unsigned long Lookups(const ZoneDetect *library, const ZoneDetect *reference)
+{
+    unsigned long numDiffs = 0;
+    int i;
+
+    for(i = 0; i < 100; i++) {
+        /* Include a corner and points outside the globe, far away ones are clamped */
+        const float lat = (i == 0) ? 90 : (i == 1) ? -1000 : (i == 2) ? NAN : (float)RandomDouble(-95, 95);
+        const float lon = (i == 0) ? 180 : (i == 1) ? 1e30f : (i == 2) ? 0 : (float)RandomDouble(-185, 185);
+        struct Lookup lookup, referenceLookup;
+
+        DoLookup(library, lat, lon, &lookup);
+        if(reference) {
+            DoLookup(reference, lat, lon, &referenceLookup);
+            if(!SameLookup(&lookup, &referenceLookup)) {
+                numDiffs++;
+            }
+        }
+    }
+
+    return numDiffs;
+}
+
+int main(int argc, char *argv[])
+{
+    const unsigned long numIterations = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1500;
+    static const unsigned int precisions[] = {16, 24, 30};
+    /* Every index is built from the validated data */
+    static const uint32_t flags[] = {0, ZD_OPEN_GRID_INDEX | ZD_OPEN_GRID_CLASSIFY, ZD_OPEN_DECODE_BBOX, ZD_OPEN_SLAB_INDEX, ZD_OPEN_EXPANDED};
+    unsigned long numOpened = 0, numTreeOpened = 0, numDiffs = 0, n;
+    size_t p;
+
+    for(p = 0; p < sizeof(precisions) / sizeof(precisions[0]); p++) {
+        size_t length;
+        uint8_t *const original = BuildDatabase(precisions[p], &length);
+        uint8_t *const buffer = malloc(length);
+        if(!original || !buffer) {
+            return 1;
+        }
+
+        ZoneDetectOptions options;
+        ZDInitOptions(&options);
+        options.flags = ZD_OPEN_VALIDATE;
+        ZoneDetect *const reference = ZDOpenDatabaseFromMemoryWithOptions(original, length, &options);
+        if(!reference || !reference->rtreeOffset) {
+            fprintf(stderr, "The database at precision %u does not validate\n", precisions[p]);
+            return 1;
+        }
+        const uint32_t rtreeOffset = reference->rtreeOffset;
+
+        for(n = 0; n < numIterations; n++) {
+            const int treeOnly = (n % 3 == 0);
+            uint32_t i;
+
+            memcpy(buffer, original, length);
+            if(treeOnly) {
+                /* Flip a low bit, half of the time in the nodes, whose boxes may grow without failing validation */
+                const uint32_t position = Random(2) ? rtreeOffset + ZD_RTREE_HEADER_SIZE + Random(reference->rtreeNumNodes * ZD_RTREE_NODE_SIZE)
+                                          : rtreeOffset + Random((uint32_t)length - rtreeOffset);
+                buffer[position] ^= (uint8_t)(1u << Random(3));
+            } else {
+                const uint32_t numChanges = 1 + Random(4);
+                for(i = 0; i < numChanges; i++) {
+                    const uint32_t position = Random((uint32_t)length);
+                    buffer[position] = Random(2) ? (uint8_t)Random(256) : (uint8_t)(buffer[position] ^ (1u << Random(8)));
+                }
+            }
+
+            options.flags = ZD_OPEN_VALIDATE | flags[n % (sizeof(flags) / sizeof(flags[0]))];
+            ZoneDetect *const library = ZDOpenDatabaseFromMemoryWithOptions(buffer, length, &options);
+            if(!library) {
+                continue;
+            }
+
+            numOpened++;
+            if(treeOnly) {
+                numTreeOpened++;
+            }
+            numDiffs += Lookups(library, treeOnly ? reference : NULL);
+            ZDCloseDatabase(library);
+        }
+
+        ZDCloseDatabase(reference);
+        free(buffer);
+        free(original);
+    }
+
+    printf("%lu corrupt databases opened, %lu with a changed R-tree, %lu lookups differ\n", numOpened, numTreeOpened, numDiffs);
+
+    return numDiffs ? 1 : 0;
+}
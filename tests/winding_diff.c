@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2018, Bertold Van den Bergh (vandenbergh@bertold.org)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR DISTRIBUTOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Differential test of the vector winding kernels against the scalar edge code. Random polygons are
+ * evaluated at random points, on and next to their vertices and on and next to their segments, at every
+ * SIMD level the CPU supports. Results and winding numbers must be identical.
+ */
+
+#include "../library/zonedetect.c"
+
+static uint32_t rngState = 1;
+
+static uint32_t Random(uint32_t range)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState % range;
+}
+
+static int32_t RandomCoordinate(int32_t range)
+{
+    return (int32_t)Random(2 * (uint32_t)range + 1) - range;
+}
+
+static int32_t GreatestCommonDivisor(int32_t a, int32_t b)
+{
+    if(a < 0) a = -a;
+    if(b < 0) b = -b;
+    while(b) {
+        const int32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* The scalar path of ZDPointInPolygon, one ZDWindingEdge call per edge */
+static ZDLookupResult ReferenceEdges(const struct ZDDecodedPolygon *polygon, int32_t latFixedPoint, int32_t lonFixedPoint, int *winding)
+{
+    const int32_t *const lat = polygon->lat;
+    const int32_t *const lon = polygon->lon;
+    uint32_t i;
+
+    int prevQuadrant = ZDQuadrant(lat[0], lon[0], latFixedPoint, lonFixedPoint);
+    for(i = 1; i < polygon->numPoints; i++) {
+        if(lat[i] == latFixedPoint && lon[i] == lonFixedPoint) {
+            return ZD_LOOKUP_ON_BORDER_VERTEX;
+        }
+
+        const int quadrant = ZDQuadrant(lat[i], lon[i], latFixedPoint, lonFixedPoint);
+        const ZDLookupResult result = ZDWindingEdge(latFixedPoint, lonFixedPoint, lat[i - 1], lon[i - 1], prevQuadrant, lat[i], lon[i], quadrant, winding, NULL);
+        if(result != ZD_LOOKUP_IGNORE) {
+            return result;
+        }
+        prevQuadrant = quadrant;
+    }
+
+    return ZD_LOOKUP_IGNORE;
+}
+
+static const char *const levelNames[] = {"scalar", "SSE2", "AVX2"};
+
+static unsigned long numChecks, numFailures;
+static unsigned long numResults[ZD_LOOKUP_ON_BORDER_SEGMENT + 1];
+
+static void Check(ZoneDetect *library, uint8_t maxLevel, const struct ZDDecodedPolygon *polygon, int32_t lat, int32_t lon)
+{
+    int referenceWinding = 0;
+    const ZDLookupResult reference = ReferenceEdges(polygon, lat, lon, &referenceWinding);
+    const ZDLookupResult referenceFinal = (reference != ZD_LOOKUP_IGNORE) ? reference : ZDWindingToResult(referenceWinding, NULL);
+    uint8_t level;
+
+    numResults[referenceFinal]++;
+
+    for(level = ZD_SIMD_NONE; level <= maxLevel; level++) {
+        int winding = 0;
+        library->simdLevel = level;
+        const ZDLookupResult result = ZDWindingKernel(library, polygon, lat, lon, &winding);
+        const ZDLookupResult final = (polygon->lat[0] == lat && polygon->lon[0] == lon) ? ZD_LOOKUP_ON_BORDER_VERTEX : referenceFinal;
+
+        numChecks++;
+        if(result != reference || (result == ZD_LOOKUP_IGNORE && winding != referenceWinding)
+                || ZDPointInDecodedPolygon(library, polygon, lat, lon, NULL) != final) {
+            if(numFailures++ < 10) {
+                fprintf(stderr, "%s: %u points, point (%d, %d): result %d winding %d, scalar %d winding %d\n",
+                        levelNames[level], polygon->numPoints, lat, lon, result, winding, reference, referenceWinding);
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const unsigned long numPolygons = (argc > 1) ? strtoul(argv[1], NULL, 10) : 20000;
+    /* Small ranges give many collinear, horizontal and vertical edges, large ones test the overflow margins */
+    static const int32_t ranges[] = {2, 8, 1000, 1 << 20, (1 << 30) - 1};
+    ZoneDetect library;
+    unsigned long n;
+
+    memset(&library, 0, sizeof(library));
+    const uint8_t maxLevel = ZDDetectSimdLevel();
+
+    for(n = 0; n < numPolygons; n++) {
+        const int32_t range = ranges[n % (sizeof(ranges) / sizeof(ranges[0]))];
+        /* Cover every remainder of the 4 and 8 edge groups */
+        const uint32_t numVertices = 3 + Random((n % 8 == 0) ? 200 : 40);
+        struct ZDDecodedPolygon polygon;
+        uint32_t i;
+
+        memset(&polygon, 0, sizeof(polygon));
+        polygon.numPoints = numVertices + 1;
+        polygon.lat = malloc(2 * sizeof(int32_t) * polygon.numPoints);
+        if(!polygon.lat) {
+            return 1;
+        }
+        polygon.lon = polygon.lat + polygon.numPoints;
+
+        for(i = 0; i < numVertices; i++) {
+            if(i && Random(4) == 0) {
+                /* Axis parallel edge */
+                polygon.lat[i] = Random(2) ? polygon.lat[i - 1] : RandomCoordinate(range);
+                polygon.lon[i] = (polygon.lat[i] == polygon.lat[i - 1]) ? RandomCoordinate(range) : polygon.lon[i - 1];
+            } else {
+                polygon.lat[i] = RandomCoordinate(range);
+                polygon.lon[i] = RandomCoordinate(range);
+            }
+        }
+        polygon.lat[numVertices] = polygon.lat[0];
+        polygon.lon[numVertices] = polygon.lon[0];
+
+        for(i = 0; i < 16; i++) {
+            const uint32_t vertex = Random(numVertices);
+            const int32_t dLat = (int32_t)Random(3) - 1, dLon = (int32_t)Random(3) - 1;
+
+            /* Random point */
+            Check(&library, maxLevel, &polygon, RandomCoordinate(range), RandomCoordinate(range));
+
+            /* On and next to a vertex */
+            Check(&library, maxLevel, &polygon, polygon.lat[vertex], polygon.lon[vertex]);
+            Check(&library, maxLevel, &polygon, polygon.lat[vertex] + dLat, polygon.lon[vertex] + dLon);
+
+            /* On and next to a lattice point of a segment */
+            const int32_t edgeLat = polygon.lat[vertex + 1] - polygon.lat[vertex];
+            const int32_t edgeLon = polygon.lon[vertex + 1] - polygon.lon[vertex];
+            const int32_t steps = GreatestCommonDivisor(edgeLat, edgeLon);
+            if(steps) {
+                const int32_t step = (int32_t)Random((uint32_t)steps + 1);
+                const int32_t lat = polygon.lat[vertex] + edgeLat / steps * step;
+                const int32_t lon = polygon.lon[vertex] + edgeLon / steps * step;
+                Check(&library, maxLevel, &polygon, lat, lon);
+                Check(&library, maxLevel, &polygon, lat + dLat, lon + dLon);
+            }
+        }
+
+        free(polygon.lat);
+    }
+
+    printf("%lu checks up to %s, %lu failures (not in zone %lu, in zone %lu, in excluded zone %lu, vertex %lu, segment %lu)\n",
+           numChecks, levelNames[maxLevel], numFailures,
+           numResults[ZD_LOOKUP_NOT_IN_ZONE], numResults[ZD_LOOKUP_IN_ZONE], numResults[ZD_LOOKUP_IN_EXCLUDED_ZONE],
+           numResults[ZD_LOOKUP_ON_BORDER_VERTEX], numResults[ZD_LOOKUP_ON_BORDER_SEGMENT]);
+
+    return numFailures ? 1 : 0;
+}